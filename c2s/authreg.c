@@ -19,6 +19,7 @@
  */
 
 #include "c2s.h"
+#include <util/crypt_blowfish.h>
 #include <stringprep.h>
 #ifdef _WIN32
   #include <windows.h>
@@ -36,20 +37,14 @@ typedef struct _authreg_error_st {
     char        *uri;
 } *authreg_error_t;
 
-/** get a handle for the named module */
-authreg_t authreg_init(c2s_t c2s, const char *name) {
+/** load the named module into a fresh handle, 0 if it's good to go */
+static int _authreg_load(authreg_t ar, const char *name) {
+    c2s_t c2s = ar->c2s;
     char mod_fullpath[PATH_MAX];
     const char *modules_path;
     ar_module_init_fn init_fn = NULL;
-    authreg_t ar;
     void *handle;
 
-    /* return if already loaded */
-    ar = xhash_get(c2s->ar_modules, name);
-    if (ar) {
-        return ar->initialized ? ar : NULL;
-    }
-
     /* load authreg module */
     modules_path = config_get_one(c2s->config, "authreg.path", 0);
     if (modules_path != NULL)
@@ -88,26 +83,17 @@ authreg_t authreg_init(c2s_t c2s, const char *name) {
         if (handle != NULL)
             FreeLibrary((HMODULE) handle);
 #endif
-        return NULL;
-    }
-
-    /* make a new one */
-    ar = (authreg_t) pmalloco(xhash_pool(c2s->ar_modules), sizeof(struct authreg_st));
-    if(!ar) {
-        log_write(c2s->log, LOG_ERR, "cannot allocate memory for new authreg, aborting");
-        exit(1);
+        return 1;
     }
 
-    ar->c2s = c2s;
-
-    xhash_put(c2s->ar_modules, name, ar);
+    ar->name = name;
 
     /* call the initialiser */
     if((init_fn)(ar) != 0)
     {
         log_write(c2s->log, LOG_ERR, "failed to initialize auth module '%s'", name);
         authreg_free(ar);
-        return NULL;
+        return 1;
     }
 
     /* we need user_exists(), at the very least */
@@ -115,13 +101,40 @@ authreg_t authreg_init(c2s_t c2s, const char *name) {
     {
         log_write(c2s->log, LOG_ERR, "auth module '%s' has no check for user existence", name);
         authreg_free(ar);
-        return NULL;
+        return 1;
     }
     
     /* its good */
     ar->initialized = TRUE;
     log_write(c2s->log, LOG_NOTICE, "initialized auth module '%s'", name);
 
+    return 0;
+}
+
+/** get a handle for the named module */
+authreg_t authreg_init(c2s_t c2s, const char *name) {
+    authreg_t ar;
+
+    /* return if already loaded */
+    ar = xhash_get(c2s->ar_modules, name);
+    if (ar) {
+        return ar->initialized ? ar : NULL;
+    }
+
+    /* make a new one */
+    ar = (authreg_t) pmalloco(xhash_pool(c2s->ar_modules), sizeof(struct authreg_st));
+    if(!ar) {
+        log_write(c2s->log, LOG_ERR, "cannot allocate memory for new authreg, aborting");
+        exit(1);
+    }
+
+    ar->c2s = c2s;
+
+    xhash_put(c2s->ar_modules, name, ar);
+
+    if(_authreg_load(ar, name) != 0)
+        return NULL;
+
     return ar;
 }
 
@@ -132,6 +145,851 @@ void authreg_free(authreg_t ar) {
     }
 }
 
+/*
+ * Credential cache. Backends like ldap or pipe do a search and a bind
+ * for every plaintext check, so the outcome of a check is kept for a
+ * while, against a bcrypt hash of the password that was tried. Failures
+ * are kept too, for less time, so the same wrong password (or a storm of
+ * reconnects while the backend is down) doesn't go back to it either.
+ */
+
+/** cached outcomes for one user */
+typedef struct _ar_cache_entry_st *_ar_cache_entry_t;
+struct _ar_cache_entry_st {
+    char                *key;               /**< realm length, realm, username */
+    char                *username;
+    char                *realm;
+
+    char                ok[AR_CACHE_HASH_LEN];  /**< password that worked */
+    time_t              ok_until;
+    char                bad[AR_CACHE_HASH_LEN]; /**< password that didn't */
+    time_t              bad_until;
+
+    _ar_cache_entry_t   prev, next;         /**< lru list, most recently used first */
+};
+
+struct ar_cache_st {
+    xht                 entries;
+    _ar_cache_entry_t   head, tail;
+    int                 count;
+
+    int                 max;                /**< most users to keep */
+    int                 ttl;                /**< seconds a good password is trusted */
+    int                 negative_ttl;       /**< seconds a bad one is refused without asking */
+    int                 cost;               /**< bcrypt cost */
+
+    char                secret[41];         /**< salts come from this */
+    unsigned long       salts;
+
+    unsigned long       gen;                /**< bumped by flushes, outcomes from before aren't kept */
+
+    unsigned long       hits, negative_hits, misses, evictions;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t     lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+# define _ar_cache_lock(c)      pthread_mutex_lock(&(c)->lock)
+# define _ar_cache_unlock(c)    pthread_mutex_unlock(&(c)->lock)
+#else
+# define _ar_cache_lock(c)
+# define _ar_cache_unlock(c)
+#endif
+
+void authreg_cache_init(c2s_t c2s) {
+    ar_cache_t cache;
+    unsigned char rnd[32];
+    char buf[128];
+    int fd, n = 0;
+
+    /* opt-in */
+    if(config_get(c2s->config, "authreg.cache") == NULL)
+        return;
+
+    cache = (ar_cache_t) calloc(1, sizeof(struct ar_cache_st));
+
+    cache->entries = xhash_new(1021);
+    cache->max = j_atoi(config_get_one(c2s->config, "authreg.cache.max", 0), 10000);
+    cache->ttl = j_atoi(config_get_one(c2s->config, "authreg.cache.ttl", 0), 300);
+    cache->negative_ttl = j_atoi(config_get_one(c2s->config, "authreg.cache.negative-ttl", 0), 30);
+    cache->cost = j_atoi(config_get_one(c2s->config, "authreg.cache.cost", 0), 6);
+    if(cache->cost < 4 || cache->cost > 31) {
+        log_write(c2s->log, LOG_ERR, "authreg cache bcrypt cost has to be between 4 and 31, using 6");
+        cache->cost = 6;
+    }
+
+    /* whatever the hashes are salted with must not be guessable */
+    if((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+        n = read(fd, rnd, sizeof(rnd));
+        close(fd);
+    }
+    if(n == sizeof(rnd))
+        hex_from_raw(rnd, sizeof(rnd), buf);
+    else {
+        log_write(c2s->log, LOG_WARNING, "couldn't read /dev/urandom, authreg cache salts will be weaker");
+        snprintf(buf, sizeof(buf), "%ld:%d:%p:%ld", (long) time(NULL), (int) getpid(), (void *) cache, (long) clock());
+    }
+    shahash_r(buf, cache->secret);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+
+    c2s->ar_cache = cache;
+
+    log_write(c2s->log, LOG_NOTICE, "caching credentials for up to %d users (ttl %d, negative ttl %d)", cache->max, cache->ttl, cache->negative_ttl);
+}
+
+static void _ar_cache_unlink(ar_cache_t cache, _ar_cache_entry_t e) {
+    if(e->prev != NULL) e->prev->next = e->next; else cache->head = e->next;
+    if(e->next != NULL) e->next->prev = e->prev; else cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void _ar_cache_link(ar_cache_t cache, _ar_cache_entry_t e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head != NULL) cache->head->prev = e; else cache->tail = e;
+    cache->head = e;
+}
+
+static void _ar_cache_drop(ar_cache_t cache, _ar_cache_entry_t e) {
+    _ar_cache_unlink(cache, e);
+    xhash_zap(cache->entries, e->key);
+    cache->count--;
+
+    free(e->key);
+    free(e->username);
+    free(e->realm);
+    free(e);
+}
+
+void authreg_cache_flush(c2s_t c2s, const char *username, const char *realm) {
+    ar_cache_t cache = c2s->ar_cache;
+    _ar_cache_entry_t e, next;
+    int n = 0;
+
+    if(cache == NULL)
+        return;
+
+    _ar_cache_lock(cache);
+
+    for(e = cache->head; e != NULL; e = next) {
+        next = e->next;
+
+        if(username != NULL && strcmp(e->username, username) != 0)
+            continue;
+        if(realm != NULL && strcmp(e->realm, realm) != 0)
+            continue;
+
+        _ar_cache_drop(cache, e);
+        n++;
+    }
+
+    cache->gen++;
+
+    _ar_cache_unlock(cache);
+
+    if(username == NULL)
+        log_write(c2s->log, LOG_NOTICE, "flushed authreg cache, %d users dropped", n);
+    else
+        log_debug(ZONE, "flushed %d authreg cache entries for %s@%s", n, username, realm != NULL ? realm : "*");
+}
+
+void authreg_cache_stats(c2s_t c2s) {
+    ar_cache_t cache = c2s->ar_cache;
+
+    if(cache == NULL)
+        return;
+
+    _ar_cache_lock(cache);
+    log_write(c2s->log, LOG_INFO, "authreg cache: %d users, %lu hits, %lu negative hits, %lu misses, %lu evictions",
+        cache->count, cache->hits, cache->negative_hits, cache->misses, cache->evictions);
+    _ar_cache_unlock(cache);
+}
+
+void authreg_cache_free(c2s_t c2s) {
+    ar_cache_t cache = c2s->ar_cache;
+
+    if(cache == NULL)
+        return;
+
+    while(cache->head != NULL)
+        _ar_cache_drop(cache, cache->head);
+
+    xhash_free(cache->entries);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&cache->lock);
+#endif
+
+    free(cache);
+    c2s->ar_cache = NULL;
+}
+
+/**
+ * bcrypt only looks at the first 72 bytes, so what it gets is a keyed
+ * digest of the password instead, the same length whatever the password
+ */
+static void _ar_cache_digest(ar_cache_t cache, const char *password, char digest[41]) {
+    unsigned char pad[64], inner[20], outer[20];
+    sha1_state_t sha;
+    int i;
+
+    /* hmac-sha1, the secret is shorter than a block */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, cache->secret, strlen(cache->secret));
+    for(i = 0; i < 64; i++) pad[i] ^= 0x36;
+
+    sha1_init(&sha);
+    sha1_append(&sha, pad, 64);
+    sha1_append(&sha, (const unsigned char *) password, strlen(password));
+    sha1_finish(&sha, inner);
+
+    for(i = 0; i < 64; i++) pad[i] ^= 0x36 ^ 0x5c;
+
+    sha1_init(&sha);
+    sha1_append(&sha, pad, 64);
+    sha1_append(&sha, inner, 20);
+    sha1_finish(&sha, outer);
+
+    hex_from_raw(outer, 20, digest);
+}
+
+/** true if the password is the one hashed */
+static int _ar_cache_match(ar_cache_t cache, const char *password, const char *hash) {
+    char out[AR_CACHE_HASH_LEN], digest[41];
+    int i, diff = 0;
+
+    if(hash[0] == '\0')
+        return 0;
+
+    _ar_cache_digest(cache, password, digest);
+    if(crypt_rn(digest, hash, out, sizeof(out)) == NULL)
+        return 0;
+
+    for(i = 0; hash[i] != '\0' && out[i] != '\0'; i++)
+        diff |= hash[i] ^ out[i];
+
+    return diff == 0 && hash[i] == out[i];
+}
+
+/** hash a password with a fresh salt, 0 if it worked */
+static int _ar_cache_hash(ar_cache_t cache, const char *key, const char *password, char hash[AR_CACHE_HASH_LEN]) {
+    char buf[1024], setting[AR_CACHE_HASH_LEN], digest[41];
+    unsigned char salt[20];
+    unsigned long n;
+
+    _ar_cache_lock(cache);
+    n = cache->salts++;
+    _ar_cache_unlock(cache);
+
+    snprintf(buf, sizeof(buf), "%s:%lu:%s", cache->secret, n, key);
+    shahash_raw(buf, salt);
+
+    _ar_cache_digest(cache, password, digest);
+
+    if(crypt_gensalt_rn("$2y$", cache->cost, (const char *) salt, 16, setting, sizeof(setting)) == NULL ||
+       crypt_rn(digest, setting, hash, AR_CACHE_HASH_LEN) == NULL)
+        return 1;
+
+    return 0;
+}
+
+int authreg_check_password(authreg_t ar, sess_t sess, const char *username, const char *realm, const char *password) {
+    ar_cache_t cache = ar->c2s->ar_cache;
+    _ar_cache_entry_t e;
+    char key[1280], ok[AR_CACHE_HASH_LEN], bad[AR_CACHE_HASH_LEN], hash[AR_CACHE_HASH_LEN];
+    unsigned long gen;
+    time_t now;
+    int ret;
+
+    if(cache == NULL)
+        return (ar->check_password)(ar, sess, (char *) username, (char *) realm, (char *) password);
+
+    snprintf(key, sizeof(key), "%d:%s%s", (int) strlen(realm), realm, username);
+    now = time(NULL);
+
+    /* copy out what we know, the hashing is slow and done unlocked */
+    ok[0] = bad[0] = '\0';
+
+    _ar_cache_lock(cache);
+    gen = cache->gen;
+    if((e = (_ar_cache_entry_t) xhash_get(cache->entries, key)) != NULL) {
+        if(e->ok_until > now) strcpy(ok, e->ok);
+        if(e->bad_until > now) strcpy(bad, e->bad);
+    }
+    _ar_cache_unlock(cache);
+
+    if(_ar_cache_match(cache, password, ok)) {
+        log_debug(ZONE, "authreg cache hit for %s@%s", username, realm);
+        _ar_cache_lock(cache);
+        cache->hits++;
+        _ar_cache_unlock(cache);
+        return 0;
+    }
+
+    if(_ar_cache_match(cache, password, bad)) {
+        log_debug(ZONE, "authreg cache negative hit for %s@%s", username, realm);
+        _ar_cache_lock(cache);
+        cache->negative_hits++;
+        _ar_cache_unlock(cache);
+        return 1;
+    }
+
+    ret = (ar->check_password)(ar, sess, (char *) username, (char *) realm, (char *) password);
+
+    if(_ar_cache_hash(cache, key, password, hash) != 0)
+        return ret;
+
+    _ar_cache_lock(cache);
+
+    cache->misses++;
+
+    /* flushed while we were asking, it may not be true any more */
+    if(cache->gen != gen) {
+        _ar_cache_unlock(cache);
+        return ret;
+    }
+
+    if((e = (_ar_cache_entry_t) xhash_get(cache->entries, key)) == NULL) {
+        e = (_ar_cache_entry_t) calloc(1, sizeof(struct _ar_cache_entry_st));
+        e->key = strdup(key);
+        e->username = strdup(username);
+        e->realm = strdup(realm);
+        xhash_put(cache->entries, e->key, (void *) e);
+        cache->count++;
+    } else
+        _ar_cache_unlink(cache, e);
+
+    _ar_cache_link(cache, e);
+
+    if(ret == 0) {
+        strcpy(e->ok, hash);
+        e->ok_until = now + cache->ttl;
+
+        /* whatever was wrong before isn't now */
+        e->bad[0] = '\0';
+        e->bad_until = 0;
+    } else {
+        strcpy(e->bad, hash);
+        e->bad_until = now + cache->negative_ttl;
+    }
+
+    while(cache->count > cache->max && cache->tail != NULL && cache->tail != e) {
+        _ar_cache_drop(cache, cache->tail);
+        cache->evictions++;
+    }
+
+    _ar_cache_unlock(cache);
+
+    return ret;
+}
+
+/*
+ * Requests go to the authreg threads, each of which has its own instance
+ * of every module (they're not thread safe, and they each keep a single
+ * connection to their backend), and come back on the queue of the loop
+ * serving the session. Without threads they run where they're made.
+ */
+
+#ifdef HAVE_PTHREAD
+/** an authreg thread, and its modules */
+typedef struct _authreg_thread_st {
+    ar_async_t  aa;
+    pthread_t   thread;
+
+    /** module name -> our instance */
+    xht         ars;
+
+    /** request being run */
+    ar_req_t    req;
+} *_authreg_thread_t;
+
+/** the threads, requests go in under the lock */
+struct ar_async_st {
+    int                         nthreads;
+    struct _authreg_thread_st   *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    ar_req_t        head, tail;
+    int             stop;
+};
+
+static pthread_key_t _authreg_thread_key;
+static pthread_once_t _authreg_thread_once = PTHREAD_ONCE_INIT;
+
+static void _authreg_thread_key_init(void) {
+    pthread_key_create(&_authreg_thread_key, NULL);
+}
+
+static _authreg_thread_t _authreg_thread_self(void) {
+    pthread_once(&_authreg_thread_once, _authreg_thread_key_init);
+
+    return (_authreg_thread_t) pthread_getspecific(_authreg_thread_key);
+}
+#endif
+
+ar_req_t authreg_req_new(sess_t sess, ar_op_t op, ar_req_fn cb, void *arg) {
+    ar_req_t req;
+
+    req = (ar_req_t) calloc(1, sizeof(struct ar_req_st));
+    req->op = op;
+    req->sess = sess;
+    req->realm = sess->host->realm;
+    req->cb = cb;
+    req->arg = arg;
+
+    return req;
+}
+
+void authreg_req_free(ar_req_t req) {
+    if(req->nad != NULL) nad_free(req->nad);
+
+    free(req);
+}
+
+/** what a call that never happened returns */
+static void _authreg_req_fail(ar_req_t req) {
+    req->ret = (req->op == ar_op_USER_EXISTS || req->op == ar_op_CREATE_CHALLENGE) ? 0 : 1;
+}
+
+/** make the call */
+static void _authreg_req_exec(authreg_t ar, ar_req_t req) {
+    sess_t sess = req->sess;
+
+    switch(req->op) {
+        case ar_op_USER_EXISTS:
+            req->ret = (ar->user_exists)(ar, sess, req->username, req->realm);
+            return;
+
+        case ar_op_GET_PASSWORD:
+            if(ar->get_password == NULL) break;
+            req->ret = (ar->get_password)(ar, sess, req->username, req->realm, req->password);
+            return;
+
+        case ar_op_CHECK_PASSWORD:
+            if(ar->check_password == NULL) break;
+            req->ret = authreg_check_password(ar, sess, req->username, req->realm, req->password);
+            return;
+
+        case ar_op_SET_PASSWORD:
+            if(ar->set_password == NULL) break;
+            req->ret = (ar->set_password)(ar, sess, req->username, req->realm, req->password);
+            /* sasl checks may have been cached under another realm */
+            if(req->ret == 0)
+                authreg_cache_flush(ar->c2s, req->username, NULL);
+            return;
+
+        case ar_op_CREATE_USER:
+            if(ar->create_user == NULL) break;
+            req->ret = (ar->create_user)(ar, sess, req->username, req->realm);
+            return;
+
+        case ar_op_DELETE_USER:
+            if(ar->delete_user == NULL) break;
+            req->ret = (ar->delete_user)(ar, sess, req->username, req->realm);
+            if(req->ret == 0)
+                authreg_cache_flush(ar->c2s, req->username, NULL);
+            return;
+
+        case ar_op_CREATE_CHALLENGE:
+            if(ar->create_challenge == NULL) break;
+            req->ret = (ar->create_challenge)(ar, sess, req->username, req->realm, req->challenge, sizeof(req->challenge));
+            return;
+
+        case ar_op_CHECK_RESPONSE:
+            if(ar->check_response == NULL) break;
+            req->ret = (ar->check_response)(ar, sess, req->username, req->realm, req->challenge, req->response);
+            return;
+
+        case ar_op_CALL:
+            (req->call)(ar, req);
+            return;
+    }
+
+    _authreg_req_fail(req);
+}
+
+/** back in the session's loop */
+static void _authreg_req_back(ar_req_t req) {
+    sess_t sess = req->sess;
+
+    sess->ar_pending--;
+    sess->worker->ar_pending--;
+
+    /* nobody left to answer */
+    if(sess->closed) {
+        authreg_req_free(req);
+        return;
+    }
+
+    (req->cb)(req);
+}
+
+#ifdef HAVE_PTHREAD
+static void _authreg_wake(int fd) {
+    char c = 0;
+
+    while(write(fd, &c, 1) < 0 && errno == EINTR);
+}
+
+/** requests for our sessions are back */
+static int _authreg_async_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    char buf[64];
+
+    switch(a) {
+        case action_READ:
+            while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+            authreg_async_run((c2s_worker_t) arg);
+
+            return 1;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+static void *_authreg_thread_run(void *arg) {
+    _authreg_thread_t t = (_authreg_thread_t) arg;
+    ar_async_t aa = t->aa;
+    ar_req_t req;
+    authreg_t ar;
+
+    pthread_once(&_authreg_thread_once, _authreg_thread_key_init);
+    pthread_setspecific(_authreg_thread_key, (void *) t);
+
+    while(1) {
+        pthread_mutex_lock(&aa->lock);
+        while(!aa->stop && aa->head == NULL)
+            pthread_cond_wait(&aa->cond, &aa->lock);
+
+        if(aa->stop) {
+            pthread_mutex_unlock(&aa->lock);
+            break;
+        }
+
+        req = aa->head;
+        aa->head = req->next;
+        if(aa->head == NULL)
+            aa->tail = NULL;
+        pthread_mutex_unlock(&aa->lock);
+
+        /* our own instance of the module the session's host uses */
+        t->req = req;
+        if((ar = (authreg_t) xhash_get(t->ars, req->sess->host->ar->name)) != NULL)
+            _authreg_req_exec(ar, req);
+        else
+            _authreg_req_fail(req);
+        t->req = NULL;
+
+        authreg_async_done(req);
+    }
+
+    return NULL;
+}
+
+static void _authreg_thread_free(_authreg_thread_t t) {
+    authreg_t ar;
+    void *val;
+
+    if(t->ars == NULL)
+        return;
+
+    if(xhash_iter_first(t->ars))
+        do {
+            xhash_iter_get(t->ars, NULL, NULL, &val);
+            ar = (authreg_t) val;
+            authreg_free(ar);
+        } while(xhash_iter_next(t->ars));
+
+    xhash_free(t->ars);
+    t->ars = NULL;
+}
+#endif
+
+int authreg_async_start(c2s_t c2s, int threads) {
+#ifdef HAVE_PTHREAD
+    ar_async_t aa;
+    _authreg_thread_t t;
+    c2s_worker_t w;
+    authreg_t ar, tar;
+    sigset_t all, old;
+    void *val;
+    int i, err;
+
+    /* answers come back on the queue of the session's loop */
+    for(i = 0; i <= c2s->io_workers; i++) {
+        w = &c2s->workers[i];
+
+        if(pipe(w->ar_wake) != 0) {
+            log_write(c2s->log, LOG_ERR, "failed to create authreg pipe for worker %d: %s", i, strerror(errno));
+            return 1;
+        }
+
+        w->ar_done = mpscq_new();
+        w->ar_wake_fd = mio_register(w->mio, w->ar_wake[0], _authreg_async_mio_callback, (void *) w);
+        mio_read(w->mio, w->ar_wake_fd);
+    }
+
+    if(threads <= 0)
+        return 0;
+
+    aa = (ar_async_t) calloc(1, sizeof(struct ar_async_st));
+
+    pthread_mutex_init(&aa->lock, NULL);
+    pthread_cond_init(&aa->cond, NULL);
+
+    aa->threads = (struct _authreg_thread_st *) calloc(threads, sizeof(struct _authreg_thread_st));
+
+    c2s->ar_async = aa;
+
+    /* signals are for the main loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for(err = 0, i = 0; i < threads && err == 0; i++) {
+        t = &aa->threads[i];
+        t->aa = aa;
+        t->ars = xhash_new(11);
+
+        /* everything the hosts use, each module connects to its backend again */
+        if(xhash_iter_first(c2s->ar_modules))
+            do {
+                xhash_iter_get(c2s->ar_modules, NULL, NULL, &val);
+                ar = (authreg_t) val;
+                if(!ar->initialized)
+                    continue;
+
+                tar = (authreg_t) pmalloco(xhash_pool(t->ars), sizeof(struct authreg_st));
+                tar->c2s = c2s;
+
+                if(_authreg_load(tar, ar->name) != 0) {
+                    log_write(c2s->log, LOG_ERR, "failed to initialise '%s' authreg module for thread %d", ar->name, i);
+                    err = 1;
+                    xhash_iter_done(c2s->ar_modules);
+                    break;
+                }
+
+                xhash_put(t->ars, ar->name, (void *) tar);
+            } while(xhash_iter_next(c2s->ar_modules));
+
+        if(err == 0 && (err = pthread_create(&t->thread, NULL, _authreg_thread_run, (void *) t)) != 0)
+            log_write(c2s->log, LOG_ERR, "failed to start authreg thread %d: %s", i, strerror(err));
+
+        if(err != 0) {
+            _authreg_thread_free(t);
+            break;
+        }
+
+        aa->nthreads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(err != 0) {
+        authreg_async_stop(c2s);
+        return 1;
+    }
+
+    log_write(c2s->log, LOG_NOTICE, "started %d authreg threads", aa->nthreads);
+#else
+    if(threads > 0)
+        log_write(c2s->log, LOG_WARNING, "no thread support, authreg calls will run in the main loop");
+#endif
+
+    return 0;
+}
+
+void authreg_async_stop(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    ar_async_t aa = c2s->ar_async;
+    ar_req_t req;
+    int i;
+
+    if(aa == NULL)
+        return;
+
+    pthread_mutex_lock(&aa->lock);
+    aa->stop = 1;
+    pthread_cond_broadcast(&aa->cond);
+    pthread_mutex_unlock(&aa->lock);
+
+    for(i = 0; i < aa->nthreads; i++) {
+        pthread_join(aa->threads[i].thread, NULL);
+        _authreg_thread_free(&aa->threads[i]);
+    }
+
+    /* the loops have waited for theirs, so nobody is left for these */
+    while((req = aa->head) != NULL) {
+        aa->head = req->next;
+        authreg_req_free(req);
+    }
+
+    c2s->ar_async = NULL;
+
+    pthread_cond_destroy(&aa->cond);
+    pthread_mutex_destroy(&aa->lock);
+    free(aa->threads);
+    free(aa);
+#endif
+}
+
+void authreg_async_free(c2s_worker_t w) {
+#ifdef HAVE_PTHREAD
+    ar_req_t req;
+
+    if(w->ar_done == NULL)
+        return;
+
+    mio_close(w->mio, w->ar_wake_fd);
+    close(w->ar_wake[1]);
+
+    while((req = (ar_req_t) mpscq_pull(w->ar_done)) != NULL)
+        authreg_req_free(req);
+    mpscq_free(w->ar_done);
+    w->ar_done = NULL;
+#endif
+}
+
+void authreg_async(ar_req_t req) {
+    sess_t sess = req->sess;
+    authreg_t ar = sess->host->ar;
+#ifdef HAVE_PTHREAD
+    ar_async_t aa = sess->c2s->ar_async;
+#endif
+    int ret;
+
+    sess->ar_pending++;
+    sess->worker->ar_pending++;
+
+    /* modules that can wait on their backend by themselves */
+    if(req->op != ar_op_CALL && ar->submit != NULL) {
+        c2s_ar_lock(sess->c2s);
+        ret = (ar->submit)(ar, req);
+        c2s_ar_unlock(sess->c2s);
+
+        if(ret == 0)
+            return;
+    }
+
+#ifdef HAVE_PTHREAD
+    if(aa != NULL) {
+        pthread_mutex_lock(&aa->lock);
+        req->next = NULL;
+        if(aa->tail != NULL)
+            aa->tail->next = req;
+        else
+            aa->head = req;
+        aa->tail = req;
+        pthread_cond_signal(&aa->cond);
+        pthread_mutex_unlock(&aa->lock);
+
+        return;
+    }
+#endif
+
+    /* calls take the lock themselves, if they need it */
+    if(req->op == ar_op_CALL)
+        _authreg_req_exec(ar, req);
+    else {
+        c2s_ar_lock(sess->c2s);
+        _authreg_req_exec(ar, req);
+        c2s_ar_unlock(sess->c2s);
+    }
+
+    _authreg_req_back(req);
+}
+
+void authreg_async_done(ar_req_t req) {
+#ifdef HAVE_PTHREAD
+    c2s_worker_t w = req->sess->worker;
+
+    if(w->ar_done != NULL) {
+        if(mpscq_push(w->ar_done, (void *) req))
+            _authreg_wake(w->ar_wake[1]);
+        return;
+    }
+#endif
+
+    _authreg_req_back(req);
+}
+
+void authreg_async_run(c2s_worker_t w) {
+#ifdef HAVE_PTHREAD
+    ar_req_t req;
+
+    if(w->ar_done == NULL)
+        return;
+
+    mpscq_woken(w->ar_done);
+    while((req = (ar_req_t) mpscq_pull(w->ar_done)) != NULL)
+        _authreg_req_back(req);
+#endif
+}
+
+void authreg_async_wait(c2s_worker_t w) {
+    while(w->ar_pending > 0) {
+        mio_run(w->mio, 100);
+        authreg_async_run(w);
+    }
+}
+
+ar_req_t authreg_current(void) {
+#ifdef HAVE_PTHREAD
+    _authreg_thread_t t = _authreg_thread_self();
+
+    if(t != NULL)
+        return t->req;
+#endif
+
+    return NULL;
+}
+
+authreg_t authreg_local(authreg_t ar) {
+#ifdef HAVE_PTHREAD
+    _authreg_thread_t t = _authreg_thread_self();
+    authreg_t tar;
+
+    if(t != NULL && (tar = (authreg_t) xhash_get(t->ars, ar->name)) != NULL)
+        return tar;
+#endif
+
+    return ar;
+}
+
+/** gsasl steps, their callbacks ask for the module themselves */
+static void _authreg_sasl_run(authreg_t ar, ar_req_t req) {
+    sx_sasl_step_run((sx_sasl_step_t) req->arg);
+}
+
+static void _authreg_sasl_done(ar_req_t req) {
+    sx_sasl_step_done((sx_sasl_step_t) req->arg);
+
+    authreg_req_free(req);
+}
+
+int authreg_sasl_step(sess_t sess, sx_sasl_step_t step) {
+    ar_req_t req;
+
+    /* no point without somewhere else to run it */
+    if(sess->c2s->ar_async == NULL)
+        return sx_sasl_ret_FAIL;
+
+    req = authreg_req_new(sess, ar_op_CALL, _authreg_sasl_done, (void *) step);
+    req->call = _authreg_sasl_run;
+
+    authreg_async(req);
+
+    return sx_sasl_ret_OK;
+}
+
 /** auth logger */
 inline static void _authreg_auth_log(c2s_t c2s, sess_t sess, const char *method, const char *username, const char *resource, int success) {
     log_write(c2s->log, LOG_NOTICE, "[%d] %s authentication %s: %s@%s/%s %s:%d %s",
@@ -141,11 +999,110 @@ inline static void _authreg_auth_log(c2s_t c2s, sess_t sess, const char *method,
     );
 }
 
+/** traditional mechanisms this session may use */
+static int _authreg_mechs(c2s_t c2s, sess_t sess) {
+    int ar_mechs = c2s->ar_mechanisms;
+
+    if (sess->s->ssf > 0)
+        ar_mechs = ar_mechs | c2s->ar_ssl_mechanisms;
+
+    return ar_mechs;
+}
+
+/** bounce the packet a request was answering, and finish with the request */
+static void _authreg_req_error(ar_req_t req, int err) {
+    sx_nad_write(req->sess->s, stanza_tofrom(stanza_error(req->nad, 0, err), 0));
+    req->nad = NULL;
+
+    authreg_req_free(req);
+}
+
+/** empty result for an iq */
+static nad_t _authreg_result_new(nad_t nad) {
+    nad_t result;
+    int ns, attr;
+
+    result = nad_new();
+
+    ns = nad_add_namespace(result, uri_CLIENT, NULL);
+
+    nad_append_elem(result, ns, "iq", 0);
+    nad_set_attr(result, 0, -1, "type", "result", 6);
+
+    /* extract the id */
+    attr = nad_find_attr(nad, 0, -1, "id", NULL);
+    if(attr >= 0)
+        nad_set_attr(result, 0, -1, "id", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+
+    return result;
+}
+
+/** auth get, after the user check and the challenge */
+static void _authreg_auth_get_done(ar_req_t req) {
+    sess_t sess = req->sess;
+    authreg_t ar = sess->host->ar;
+    int ns, ar_mechs;
+    nad_t nad;
+
+    ar_mechs = _authreg_mechs(sess->c2s, sess);
+
+    /* do we have the user? */
+    if(req->op == ar_op_USER_EXISTS) {
+        if(req->ret == 0) {
+            _authreg_req_error(req, stanza_err_OLD_UNAUTH);
+            return;
+        }
+
+        /* cram-md5 needs a challenge to offer */
+        if(ar_mechs & AR_MECH_TRAD_CRAMMD5 && ar->create_challenge != NULL) {
+            req->op = ar_op_CREATE_CHALLENGE;
+            authreg_async(req);
+            return;
+        }
+    }
+
+    else if(req->ret == 0) { /* operation failed */
+        _authreg_req_error(req, stanza_err_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /* build a result packet */
+    nad = _authreg_result_new(req->nad);
+
+    ns = nad_add_namespace(nad, uri_AUTH, NULL);
+    nad_append_elem(nad, ns, "query", 1);
+    
+    nad_append_elem(nad, ns, "username", 2);
+    nad_append_cdata(nad, req->username, strlen(req->username), 3);
+
+    nad_append_elem(nad, ns, "resource", 2);
+
+    /* fill out the packet with available auth mechanisms */
+    if(ar_mechs & AR_MECH_TRAD_PLAIN && (ar->get_password != NULL || ar->check_password != NULL))
+        nad_append_elem(nad, ns, "password", 2);
+
+    if(ar_mechs & AR_MECH_TRAD_DIGEST && ar->get_password != NULL)
+        nad_append_elem(nad, ns, "digest", 2);
+
+    if (req->op == ar_op_CREATE_CHALLENGE && req->ret == 1) { /* operation succeeded */
+        memcpy(sess->auth_challenge, req->challenge, sizeof(sess->auth_challenge));
+        nad_append_elem(nad, ns, "crammd5", 2);
+        nad_append_attr(nad, -1, "challenge", sess->auth_challenge);
+    }
+    /* otherwise the auth method is unsupported for user */
+
+    authreg_req_free(req);
+
+    /* give it back to the client */
+    sx_nad_write(sess->s, nad);
+}
+
 /** auth get handler */
 static void _authreg_auth_get(c2s_t c2s, sess_t sess, nad_t nad) {
-    int ns, elem, attr, err;
-    char username[1024], id[128];
+    int ns, elem;
+    char username[1024];
     int ar_mechs;
+    ar_req_t req;
 
     /* can't auth if they're active */
     if(sess->active) {
@@ -153,99 +1110,243 @@ static void _authreg_auth_get(c2s_t c2s, sess_t sess, nad_t nad) {
         return;
     }
 
-    /* sort out the username */
+    /* sort out the username */
+    ns = nad_find_scoped_namespace(nad, uri_AUTH, NULL);
+    elem = nad_find_elem(nad, 1, ns, "username", 1);
+    if(elem < 0)
+    {
+        log_debug(ZONE, "auth get with no username, bouncing it");
+
+        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_BAD_REQUEST), 0));
+
+        return;
+    }
+
+    snprintf(username, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
+    if(stringprep_xmpp_nodeprep(username, 1024) != 0) {
+        log_debug(ZONE, "auth get username failed nodeprep, bouncing it");
+        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_JID_MALFORMED), 0));
+        return;
+    }
+
+    ar_mechs = _authreg_mechs(c2s, sess);
+        
+    /* no point going on if we have no mechanisms */
+    if(!(ar_mechs & (AR_MECH_TRAD_PLAIN | AR_MECH_TRAD_DIGEST | AR_MECH_TRAD_CRAMMD5))) {
+        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_FORBIDDEN), 0));
+        return;
+    }
+    
+    /* do we have the user? */
+    req = authreg_req_new(sess, ar_op_USER_EXISTS, _authreg_auth_get_done, NULL);
+    strcpy(req->username, username);
+    req->nad = nad;
+
+    authreg_async(req);
+}
+
+/** where an auth set has got to, mechanisms are tried in this order */
+enum {
+    _auth_set_EXISTS,
+    _auth_set_CRAMMD5,
+    _auth_set_DIGEST,
+    _auth_set_COMPARE,
+    _auth_set_CHECK
+};
+
+/** auth set, all the checks are done */
+static void _authreg_auth_set_finish(ar_req_t req, int authd) {
+    sess_t sess = req->sess;
+    c2s_t c2s = sess->c2s;
+
+    /* they might have got in some other way while we were checking */
+    if(sess->active || sess->result != NULL) {
+        _authreg_req_error(req, stanza_err_NOT_ALLOWED);
+        return;
+    }
+
+    /* now, are they authenticated? */
+    if(authd)
+    {
+        /* create new bound jid holder */
+        if(sess->resources == NULL) {
+            sess->resources = (bres_t) calloc(1, sizeof(struct bres_st));
+        }
+
+        /* our local id */
+        sprintf(sess->resources->c2s_id, "%d", sess->s->tag);
+
+        /* the full user jid for this session */
+        sess->resources->jid = jid_new(sess->s->req_to, -1);
+        jid_reset_components(sess->resources->jid, req->username, sess->resources->jid->domain, req->resource);
+
+        log_write(sess->c2s->log, LOG_NOTICE, "[%d] requesting session: jid=%s", sess->s->tag, jid_full(sess->resources->jid));
+
+        /* build a result packet, we'll send this back to the client after we have a session for them */
+        sess->result = _authreg_result_new(req->nad);
+
+        /* finished with the request and the nad */
+        authreg_req_free(req);
+
+        /* start a session with the sm */
+        sm_start(sess, sess->resources);
+
+        return;
+    }
+
+    _authreg_auth_log(c2s, sess, "traditional", req->username, req->resource, FALSE);
+
+    /* auth failed, so error */
+    _authreg_req_error(req, stanza_err_OLD_UNAUTH);
+}
+
+/** auth set, on to the next mechanism the client gave us something for */
+static void _authreg_auth_set_next(ar_req_t req) {
+    sess_t sess = req->sess;
+    authreg_t ar = sess->host->ar;
+    nad_t nad = req->nad;
+    int ns, elem, ar_mechs;
+
+    ar_mechs = _authreg_mechs(sess->c2s, sess);
     ns = nad_find_scoped_namespace(nad, uri_AUTH, NULL);
-    elem = nad_find_elem(nad, 1, ns, "username", 1);
-    if(elem < 0)
-    {
-        log_debug(ZONE, "auth get with no username, bouncing it");
 
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_BAD_REQUEST), 0));
+    while(++req->state <= _auth_set_CHECK) {
+        switch(req->state) {
+            /* handle CRAM-MD5 response */
+            case _auth_set_CRAMMD5:
+                if(!(ar_mechs & AR_MECH_TRAD_CRAMMD5) || ar->check_response == NULL ||
+                   (elem = nad_find_elem(nad, 1, ns, "crammd5", 1)) < 0)
+                    continue;
+
+                req->op = ar_op_CHECK_RESPONSE;
+                memcpy(req->challenge, sess->auth_challenge, sizeof(req->challenge));
+                snprintf(req->response, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
+                break;
+
+            /* digest auth */
+            case _auth_set_DIGEST:
+                if(!(ar_mechs & AR_MECH_TRAD_DIGEST) || ar->get_password == NULL ||
+                   nad_find_elem(nad, 1, ns, "digest", 1) < 0)
+                    continue;
+
+                req->op = ar_op_GET_PASSWORD;
+                break;
+
+            /* plaintext auth (compare) */
+            case _auth_set_COMPARE:
+                if(!(ar_mechs & AR_MECH_TRAD_PLAIN) || ar->get_password == NULL ||
+                   nad_find_elem(nad, 1, ns, "password", 1) < 0)
+                    continue;
+
+                req->op = ar_op_GET_PASSWORD;
+                break;
+
+            /* plaintext auth (check) */
+            case _auth_set_CHECK:
+                if(!(ar_mechs & AR_MECH_TRAD_PLAIN) || ar->check_password == NULL ||
+                   (elem = nad_find_elem(nad, 1, ns, "password", 1)) < 0)
+                    continue;
+
+                req->op = ar_op_CHECK_PASSWORD;
+                snprintf(req->password, 257, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
+                break;
+        }
 
+        authreg_async(req);
         return;
     }
 
-    snprintf(username, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
-    if(stringprep_xmpp_nodeprep(username, 1024) != 0) {
-        log_debug(ZONE, "auth get username failed nodeprep, bouncing it");
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_JID_MALFORMED), 0));
-        return;
-    }
+    _authreg_auth_set_finish(req, 0);
+}
 
-    ar_mechs = c2s->ar_mechanisms;
-    if (sess->s->ssf>0) 
-        ar_mechs = ar_mechs | c2s->ar_ssl_mechanisms;
-        
-    /* no point going on if we have no mechanisms */
-    if(!(ar_mechs & (AR_MECH_TRAD_PLAIN | AR_MECH_TRAD_DIGEST | AR_MECH_TRAD_CRAMMD5))) {
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_FORBIDDEN), 0));
-        return;
-    }
-    
-    /* do we have the user? */
-    if((sess->host->ar->user_exists)(sess->host->ar, sess, username, sess->host->realm) == 0) {
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_OLD_UNAUTH), 0));
-        return;
-    }
+/** auth set, a check has come back */
+static void _authreg_auth_set_done(ar_req_t req) {
+    sess_t sess = req->sess;
+    c2s_t c2s = sess->c2s;
+    nad_t nad = req->nad;
+    int ns, elem;
+    char hash[280];
 
-    /* extract the id */
-    attr = nad_find_attr(nad, 0, -1, "id", NULL);
-    if(attr >= 0)
-        snprintf(id, 128, "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+    ns = nad_find_scoped_namespace(nad, uri_AUTH, NULL);
 
-    nad_free(nad);
+    switch(req->state) {
+        /* do we have the user? */
+        case _auth_set_EXISTS:
+            if(req->ret == 0) {
+                _authreg_req_error(req, stanza_err_OLD_UNAUTH);
+                return;
+            }
+            break;
 
-    /* build a result packet */
-    nad = nad_new();
+        case _auth_set_CRAMMD5:
+            if(req->ret == 0)
+            {
+                log_debug(ZONE, "crammd5 auth (check) succeded");
+                _authreg_auth_log(c2s, sess, "traditional.cram-md5", req->username, req->resource, TRUE);
+                _authreg_auth_set_finish(req, 1);
+                return;
+            }
 
-    ns = nad_add_namespace(nad, uri_CLIENT, NULL);
+            _authreg_auth_log(c2s, sess, "traditional.cram-md5", req->username, req->resource, FALSE);
+            break;
 
-    nad_append_elem(nad, ns, "iq", 0);
-    nad_append_attr(nad, -1, "type", "result");
+        case _auth_set_DIGEST:
+            if(req->ret != 0)
+                break;
 
-    if(attr >= 0)
-        nad_append_attr(nad, -1, "id", id);
+            elem = nad_find_elem(nad, 1, ns, "digest", 1);
 
-    ns = nad_add_namespace(nad, uri_AUTH, NULL);
-    nad_append_elem(nad, ns, "query", 1);
-    
-    nad_append_elem(nad, ns, "username", 2);
-    nad_append_cdata(nad, username, strlen(username), 3);
+            snprintf(hash, 280, "%s%s", sess->s->id, req->password);
+            shahash_r(hash, hash);
 
-    nad_append_elem(nad, ns, "resource", 2);
+            if(strlen(hash) == NAD_CDATA_L(nad, elem) && strncmp(hash, NAD_CDATA(nad, elem), NAD_CDATA_L(nad, elem)) == 0)
+            {
+                log_debug(ZONE, "digest auth succeeded");
+                _authreg_auth_log(c2s, sess, "traditional.digest", req->username, req->resource, TRUE);
+                _authreg_auth_set_finish(req, 1);
+                return;
+            }
 
-    /* fill out the packet with available auth mechanisms */
-    if(ar_mechs & AR_MECH_TRAD_PLAIN && (sess->host->ar->get_password != NULL || sess->host->ar->check_password != NULL))
-        nad_append_elem(nad, ns, "password", 2);
+            _authreg_auth_log(c2s, sess, "traditional.digest", req->username, req->resource, FALSE);
+            break;
 
-    if(ar_mechs & AR_MECH_TRAD_DIGEST && sess->host->ar->get_password != NULL)
-        nad_append_elem(nad, ns, "digest", 2);
+        case _auth_set_COMPARE:
+            elem = nad_find_elem(nad, 1, ns, "password", 1);
 
-    if (ar_mechs & AR_MECH_TRAD_CRAMMD5 && sess->host->ar->create_challenge != NULL) {
-        err = (sess->host->ar->create_challenge)(sess->host->ar, sess, (char *) username, sess->host->realm,
-                (char *) sess->auth_challenge, sizeof(sess->auth_challenge));
-        if (0 == err) { /* operation failed */
-            sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_INTERNAL_SERVER_ERROR), 0));
-            return;
-        }
-        else if (1 == err) { /* operation succeeded */
-            nad_append_elem(nad, ns, "crammd5", 2);
-            nad_append_attr(nad, -1, "challenge", sess->auth_challenge);
-        }
-        else ; /* auth method unsupported for user */
-    }
+            if(req->ret == 0 &&
+                    strlen(req->password) == NAD_CDATA_L(nad, elem) && strncmp(req->password, NAD_CDATA(nad, elem), NAD_CDATA_L(nad, elem)) == 0)
+            {
+                log_debug(ZONE, "plaintext auth (compare) succeeded");
+                _authreg_auth_log(c2s, sess, "traditional.plain(compare)", req->username, req->resource, TRUE);
+                _authreg_auth_set_finish(req, 1);
+                return;
+            }
 
-    /* give it back to the client */
-    sx_nad_write(sess->s, nad);
+            _authreg_auth_log(c2s, sess, "traditional.plain(compare)", req->username, req->resource, FALSE);
+            break;
+
+        case _auth_set_CHECK:
+            if(req->ret == 0)
+            {
+                log_debug(ZONE, "plaintext auth (check) succeded");
+                _authreg_auth_log(c2s, sess, "traditional.plain", req->username, req->resource, TRUE);
+                _authreg_auth_set_finish(req, 1);
+                return;
+            }
+
+            _authreg_auth_log(c2s, sess, "traditional.plain", req->username, req->resource, FALSE);
+            break;
+    }
 
-    return;
+    _authreg_auth_set_next(req);
 }
 
 /** auth set handler */
 static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
-    int ns, elem, attr, authd = 0;
-    char username[1024], resource[1024], str[1024], hash[280];
+    int ns, elem;
+    char username[1024], resource[1024];
     int ar_mechs;
+    ar_req_t req;
 
     /* can't auth if they're active */
     if(sess->active) {
@@ -291,9 +1392,7 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
         return;
     }
 
-    ar_mechs = c2s->ar_mechanisms;
-    if (sess->s->ssf > 0)
-        ar_mechs = ar_mechs | c2s->ar_ssl_mechanisms;
+    ar_mechs = _authreg_mechs(c2s, sess);
     
     /* no point going on if we have no mechanisms */
     if(!(ar_mechs & (AR_MECH_TRAD_PLAIN | AR_MECH_TRAD_DIGEST | AR_MECH_TRAD_CRAMMD5))) {
@@ -301,133 +1400,14 @@ static void _authreg_auth_set(c2s_t c2s, sess_t sess, nad_t nad) {
         return;
     }
     
-    /* do we have the user? */
-    if((sess->host->ar->user_exists)(sess->host->ar, sess, username, sess->host->realm) == 0) {
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_OLD_UNAUTH), 0));
-        return;
-    }
-    
-    /* handle CRAM-MD5 response */
-    if(!authd && ar_mechs & AR_MECH_TRAD_CRAMMD5 && sess->host->ar->check_response != NULL)
-    {
-        elem = nad_find_elem(nad, 1, ns, "crammd5", 1);
-        if(elem >= 0)
-        {
-            snprintf(str, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
-            if((sess->host->ar->check_response)(sess->host->ar, sess, username, sess->host->realm, sess->auth_challenge, str) == 0)
-            {
-                log_debug(ZONE, "crammd5 auth (check) succeded");
-                authd = 1;
-                _authreg_auth_log(c2s, sess, "traditional.cram-md5", username, resource, TRUE);
-            } else {
-                _authreg_auth_log(c2s, sess, "traditional.cram-md5", username, resource, FALSE);
-            }
-        }
-    }
-
-    /* digest auth */
-    if(!authd && ar_mechs & AR_MECH_TRAD_DIGEST && sess->host->ar->get_password != NULL)
-    {
-        elem = nad_find_elem(nad, 1, ns, "digest", 1);
-        if(elem >= 0)
-        {
-            if((sess->host->ar->get_password)(sess->host->ar, sess, username, sess->host->realm, str) == 0)
-            {
-                snprintf(hash, 280, "%s%s", sess->s->id, str);
-                shahash_r(hash, hash);
-
-                if(strlen(hash) == NAD_CDATA_L(nad, elem) && strncmp(hash, NAD_CDATA(nad, elem), NAD_CDATA_L(nad, elem)) == 0)
-                {
-                    log_debug(ZONE, "digest auth succeeded");
-                    authd = 1;
-                    _authreg_auth_log(c2s, sess, "traditional.digest", username, resource, TRUE);
-                } else {
-                    _authreg_auth_log(c2s, sess, "traditional.digest", username, resource, FALSE);
-                }
-            }
-        }
-    }
-
-    /* plaintext auth (compare) */
-    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && sess->host->ar->get_password != NULL)
-    {
-        elem = nad_find_elem(nad, 1, ns, "password", 1);
-        if(elem >= 0)
-        {
-            if((sess->host->ar->get_password)(sess->host->ar, sess, username, sess->host->realm, str) == 0 &&
-                    strlen(str) == NAD_CDATA_L(nad, elem) && strncmp(str, NAD_CDATA(nad, elem), NAD_CDATA_L(nad, elem)) == 0)
-            {
-                log_debug(ZONE, "plaintext auth (compare) succeeded");
-                authd = 1;
-                _authreg_auth_log(c2s, sess, "traditional.plain(compare)", username, resource, TRUE);
-            } else {
-                _authreg_auth_log(c2s, sess, "traditional.plain(compare)", username, resource, FALSE);
-            }
-        }
-    }
-
-    /* plaintext auth (check) */
-    if(!authd && ar_mechs & AR_MECH_TRAD_PLAIN && sess->host->ar->check_password != NULL)
-    {
-        elem = nad_find_elem(nad, 1, ns, "password", 1);
-        if(elem >= 0)
-        {
-            snprintf(str, 1024, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
-            if((sess->host->ar->check_password)(sess->host->ar, sess, username, sess->host->realm, str) == 0)
-            {
-                log_debug(ZONE, "plaintext auth (check) succeded");
-                authd = 1;
-                _authreg_auth_log(c2s, sess, "traditional.plain", username, resource, TRUE);
-            } else {
-                _authreg_auth_log(c2s, sess, "traditional.plain", username, resource, FALSE);
-            }
-        }
-    }
-
-    /* now, are they authenticated? */
-    if(authd)
-    {
-        /* create new bound jid holder */
-        if(sess->resources == NULL) {
-            sess->resources = (bres_t) calloc(1, sizeof(struct bres_st));
-        }
-
-        /* our local id */
-        sprintf(sess->resources->c2s_id, "%d", sess->s->tag);
-
-        /* the full user jid for this session */
-        sess->resources->jid = jid_new(sess->s->req_to, -1);
-        jid_reset_components(sess->resources->jid, username, sess->resources->jid->domain, resource);
-
-        log_write(sess->c2s->log, LOG_NOTICE, "[%d] requesting session: jid=%s", sess->s->tag, jid_full(sess->resources->jid));
-
-        /* build a result packet, we'll send this back to the client after we have a session for them */
-        sess->result = nad_new();
-
-        ns = nad_add_namespace(sess->result, uri_CLIENT, NULL);
-
-        nad_append_elem(sess->result, ns, "iq", 0);
-        nad_set_attr(sess->result, 0, -1, "type", "result", 6);
-
-        attr = nad_find_attr(nad, 0, -1, "id", NULL);
-        if(attr >= 0)
-            nad_set_attr(sess->result, 0, -1, "id", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
-
-        /* start a session with the sm */
-        sm_start(sess, sess->resources);
-
-        /* finished with the nad */
-        nad_free(nad);
-
-        return;
-    }
-
-    _authreg_auth_log(c2s, sess, "traditional", username, resource, FALSE);
-
-    /* auth failed, so error */
-    sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_OLD_UNAUTH), 0));
-
-    return;
+    /* do we have the user? the mechanisms follow on from there */
+    req = authreg_req_new(sess, ar_op_USER_EXISTS, _authreg_auth_set_done, NULL);
+    strcpy(req->username, username);
+    strcpy(req->resource, resource);
+    req->nad = nad;
+    req->state = _auth_set_EXISTS;
+
+    authreg_async(req);
 }
 
 /** register get handler */
@@ -483,11 +1463,132 @@ static void _authreg_register_get(c2s_t c2s, sess_t sess, nad_t nad) {
     sx_nad_write(sess->s, nad);
 }
 
+/** register set, the user is gone */
+static void _authreg_register_remove_done(ar_req_t req) {
+    sess_t sess = req->sess;
+    c2s_t c2s = sess->c2s;
+
+    if(req->ret != 0) {
+        log_debug(ZONE, "user delete failed");
+        _authreg_req_error(req, stanza_err_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    log_write(c2s->log, LOG_NOTICE, "[%d] deleted user: user=%s; realm=%s", sess->s->tag, req->username, sess->host->realm);
+
+    log_write(c2s->log, LOG_NOTICE, "[%d] registration remove succeeded, requesting user deletion: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
+
+    /* make a result nad */
+    sess->result = _authreg_result_new(req->nad);
+
+    authreg_req_free(req);
+
+    sx_nad_write(sess->s, sess->result);
+    sess->result = NULL;
+
+    /* get the sm to delete them (it will force their sessions to end) */
+    sm_delete(sess, sess->resources);
+}
+
+/** where a register set has got to */
+enum {
+    _register_set_EXISTS,
+    _register_set_CREATE,
+    _register_set_PASSWORD
+};
+
+/** register set, a step has come back */
+static void _authreg_register_set_done(ar_req_t req) {
+    sess_t sess = req->sess;
+    c2s_t c2s = sess->c2s;
+    authreg_t ar = sess->host->ar;
+
+    switch(req->state) {
+        /* if they exist, bounce */
+        case _register_set_EXISTS:
+            if(req->ret) {
+                log_debug(ZONE, "attempt to register %s, but they already exist", req->username);
+                _authreg_req_error(req, stanza_err_CONFLICT);
+                return;
+            }
+
+            /* make sure we can create them */
+            if(ar->create_user == NULL) {
+                _authreg_req_error(req, stanza_err_NOT_ALLOWED);
+                return;
+            }
+
+            /* otherwise, create them */
+            req->op = ar_op_CREATE_USER;
+            req->state = _register_set_CREATE;
+            authreg_async(req);
+            return;
+
+        case _register_set_CREATE:
+            if(req->ret != 0) {
+                log_debug(ZONE, "user create failed");
+                _authreg_req_error(req, stanza_err_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            log_write(c2s->log, LOG_NOTICE, "[%d] created user: user=%s; realm=%s", sess->s->tag, req->username, sess->host->realm);
+
+            /* and give them their password */
+            req->op = ar_op_SET_PASSWORD;
+            req->state = _register_set_PASSWORD;
+            authreg_async(req);
+            return;
+
+        case _register_set_PASSWORD:
+            if(req->ret != 0) {
+                log_debug(ZONE, "password store failed");
+                _authreg_req_error(req, stanza_err_INTERNAL_SERVER_ERROR);
+                return;
+            }
+            break;
+    }
+
+    log_debug(ZONE, "updated auth creds for %s", req->username);
+
+    /* make a result nad */
+    sess->result = _authreg_result_new(req->nad);
+
+    /* if they're active, then this was just a password change, and we're done */
+    if(sess->active) {
+        authreg_req_free(req);
+
+        log_write(c2s->log, LOG_NOTICE, "[%d] password changed: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
+        sx_nad_write(sess->s, sess->result);
+        sess->result = NULL;
+        return;
+    }
+
+    /* create new bound jid holder */
+    if(sess->resources == NULL) {
+        sess->resources = (bres_t) calloc(1, sizeof(struct bres_st));
+    }
+
+    /* our local id */
+    sprintf(sess->resources->c2s_id, "%d", sess->s->tag);
+
+    /* the user jid for this transaction */
+    sess->resources->jid = jid_new(sess->s->req_to, -1);
+    jid_reset_components(sess->resources->jid, req->username, sess->resources->jid->domain, sess->resources->jid->resource);
+
+    authreg_req_free(req);
+
+    log_write(c2s->log, LOG_NOTICE, "[%d] registration succeeded, requesting user creation: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
+
+    /* get the sm to create them */
+    sm_create(sess, sess->resources);
+}
+
 /** register set handler */
 static void _authreg_register_set(c2s_t c2s, sess_t sess, nad_t nad)
 {
-    int ns = 0, elem, attr;
-    char username[1024], password[1024];
+    int ns = 0, elem;
+    char username[1024];
+    ar_req_t req;
 
     /* if we're not configured for registration (or pw changes), or we can't set passwords, fail outright */
     if(!(sess->host->ar_register_enable || sess->host->ar_register_password) || sess->host->ar->set_password == NULL) {
@@ -514,36 +1615,11 @@ static void _authreg_register_set(c2s_t c2s, sess_t sess, nad_t nad)
         }
 
         /* otherwise, delete them */
-        if((sess->host->ar->delete_user)(sess->host->ar, sess, sess->resources->jid->node, sess->host->realm) != 0) {
-            log_debug(ZONE, "user delete failed");
-            sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_INTERNAL_SERVER_ERROR), 0));
-            return;
-        }
-
-        log_write(c2s->log, LOG_NOTICE, "[%d] deleted user: user=%s; realm=%s", sess->s->tag, sess->resources->jid->node, sess->host->realm);
-
-        log_write(c2s->log, LOG_NOTICE, "[%d] registration remove succeeded, requesting user deletion: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
-
-        /* make a result nad */
-        sess->result = nad_new();
-
-        ns = nad_add_namespace(sess->result, uri_CLIENT, NULL);
-
-        nad_append_elem(sess->result, ns, "iq", 0);
-        nad_set_attr(sess->result, 0, -1, "type", "result", 6);
-
-        /* extract the id */
-        attr = nad_find_attr(nad, 0, -1, "id", NULL);
-        if(attr >= 0)
-            nad_set_attr(sess->result, 0, -1, "id", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+        req = authreg_req_new(sess, ar_op_DELETE_USER, _authreg_register_remove_done, NULL);
+        snprintf(req->username, 1024, "%s", sess->resources->jid->node);
+        req->nad = nad;
 
-        nad_free(nad);
-
-        sx_nad_write(sess->s, sess->result);
-        sess->result = NULL;
-
-        /* get the sm to delete them (it will force their sessions to end) */
-        sm_delete(sess, sess->resources);
+        authreg_async(req);
 
         return;
     }
@@ -582,6 +1658,9 @@ static void _authreg_register_set(c2s_t c2s, sess_t sess, nad_t nad)
             sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_OLD_UNAUTH), 0));
             return;
         }
+
+        req = authreg_req_new(sess, ar_op_SET_PASSWORD, _authreg_register_set_done, NULL);
+        req->state = _register_set_PASSWORD;
     }
 
     /* can't go on if we're not doing full reg */
@@ -590,86 +1669,19 @@ static void _authreg_register_set(c2s_t c2s, sess_t sess, nad_t nad)
         return;
     }
 
-    /* if they exist, bounce */
-    else if((sess->host->ar->user_exists)(sess->host->ar, sess, username, sess->host->realm))
-    {
-        log_debug(ZONE, "attempt to register %s, but they already exist", username);
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_CONFLICT), 0));
-        return;
-    }
-
-    /* make sure we can create them */
-    else if(sess->host->ar->create_user == NULL)
-    {
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_NOT_ALLOWED), 0));
-        return;
-    }
-
-    /* otherwise, create them */
-    else if((sess->host->ar->create_user)(sess->host->ar, sess, username, sess->host->realm) != 0)
-    {
-        log_debug(ZONE, "user create failed");
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_INTERNAL_SERVER_ERROR), 0));
-        return;
+    /* a new user, if they don't exist already */
+    else {
+        req = authreg_req_new(sess, ar_op_USER_EXISTS, _authreg_register_set_done, NULL);
+        req->state = _register_set_EXISTS;
     }
 
-    else
-        log_write(c2s->log, LOG_NOTICE, "[%d] created user: user=%s; realm=%s", sess->s->tag, username, sess->host->realm);
+    strcpy(req->username, username);
+    req->nad = nad;
 
     /* extract the password */
-    snprintf(password, 257, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
-
-    /* change it */
-    if((sess->host->ar->set_password)(sess->host->ar, sess, username, sess->host->realm, password) != 0)
-    {
-        log_debug(ZONE, "password store failed");
-        sx_nad_write(sess->s, stanza_tofrom(stanza_error(nad, 0, stanza_err_INTERNAL_SERVER_ERROR), 0));
-        return;
-    }
-
-    log_debug(ZONE, "updated auth creds for %s", username);
-
-    /* make a result nad */
-    sess->result = nad_new();
-
-    ns = nad_add_namespace(sess->result, uri_CLIENT, NULL);
-
-    nad_append_elem(sess->result, ns, "iq", 0);
-    nad_set_attr(sess->result, 0, -1, "type", "result", 6);
-
-    /* extract the id */
-    attr = nad_find_attr(nad, 0, -1, "id", NULL);
-    if(attr >= 0)
-        nad_set_attr(sess->result, 0, -1, "id", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
-
-    /* if they're active, then this was just a password change, and we're done */
-    if(sess->active) {
-        log_write(c2s->log, LOG_NOTICE, "[%d] password changed: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
-        sx_nad_write(sess->s, sess->result);
-        sess->result = NULL;
-        return;
-    }
-
-    /* create new bound jid holder */
-    if(sess->resources == NULL) {
-        sess->resources = (bres_t) calloc(1, sizeof(struct bres_st));
-    }
-
-    /* our local id */
-    sprintf(sess->resources->c2s_id, "%d", sess->s->tag);
-
-    /* the user jid for this transaction */
-    sess->resources->jid = jid_new(sess->s->req_to, -1);
-    jid_reset_components(sess->resources->jid, username, sess->resources->jid->domain, sess->resources->jid->resource);
-
-    log_write(c2s->log, LOG_NOTICE, "[%d] registration succeeded, requesting user creation: jid=%s", sess->s->tag, jid_user(sess->resources->jid));
-
-    /* get the sm to create them */
-    sm_create(sess, sess->resources);
-
-    nad_free(nad);
+    snprintf(req->password, 257, "%.*s", NAD_CDATA_L(nad, elem), NAD_CDATA(nad, elem));
 
-    return;
+    authreg_async(req);
 }
 
 /**
@@ -41,7 +41,9 @@ static void _bind_features(sx_t s, sx_plugin_t p, nad_t nad) {
         nad_append_elem(nad, ns, "auth", 1);
     
         c2s = (c2s_t) p->private;
+        c2s_lock(c2s);
         host = xhash_get(c2s->hosts, s->req_to);
+        c2s_unlock(c2s);
         if(! host) host = c2s->vhost;
         if(host && host->ar_register_enable) {
             ns = nad_add_namespace(nad, uri_IQREGISTER, NULL);
@@ -22,10 +22,80 @@
 #include "c2s.h"
 #include <stringprep.h>
 
+/** milliseconds until the byte and stanza rates let us read again, 0 if they do now */
+static int _c2s_sess_throttle_wait(sess_t sess) {
+    int wait = 0, ms;
+
+    if(sess->rate != NULL && rate_check(sess->rate) == 0)
+        wait = rate_wait(sess->rate);
+
+    if(sess->stanza_rate != NULL && rate_check(sess->stanza_rate) == 0 && (ms = rate_wait(sess->stanza_rate)) > wait)
+        wait = ms;
+
+    return wait;
+}
+
+/** idle timeouts and keepalives, re-armed lazily from last_activity */
+static void _c2s_sess_activity_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    sess_t sess = (sess_t) arg;
+    c2s_t c2s = sess->c2s;
+    time_t now, next, when;
+
+    now = time(NULL);
+
+    if(c2s->io_check_idle > 0 && now > sess->last_activity + c2s->io_check_idle) {
+        log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
+
+        sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
+        sx_close(sess->s);
+
+        return;
+    }
+
+    next = 0;
+    if(c2s->io_check_idle > 0)
+        next = sess->last_activity + c2s->io_check_idle + 1;
+
+    if(c2s->io_check_keepalive > 0) {
+        if(now > sess->last_activity + c2s->io_check_keepalive) {
+            if(sess->s->state >= state_STREAM) {
+                log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
+
+                sx_raw_write(sess->s, " ", 1);
+            }
+
+            /* keep poking them every check interval while they stay quiet */
+            when = now + c2s->io_check_interval;
+        } else
+            when = sess->last_activity + c2s->io_check_keepalive + 1;
+
+        if(next == 0 || when < next)
+            next = when;
+    }
+
+    if(next > 0)
+        twheel_add(w, t, (int) (next > now ? next - now : 1) * 1000);
+}
+
+/** read the pending bytes when rate limit is no longer in effect */
+static void _c2s_sess_throttle_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    sess_t sess = (sess_t) arg;
+    int wait;
+
+    if((wait = _c2s_sess_throttle_wait(sess)) > 0) {
+        twheel_add(w, t, wait);
+        return;
+    }
+
+    log_debug(ZONE, "reading throttled %d", sess->fd->fd);
+    sess->s->want_read = 1;
+    sx_can_read(sess->s);
+}
+
 static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sess_t sess = (sess_t) arg;
     sx_buf_t buf = (sx_buf_t) data;
-    int rlen, len, ns, elem, attr;
+    int rlen, len, ns, elem, attr, ret, wait;
     sx_error_t *sxe;
     nad_t nad;
     char root[9];
@@ -35,34 +105,37 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
     switch(e) {
         case event_WANT_READ:
             log_debug(ZONE, "want read");
-            mio_read(sess->c2s->mio, sess->fd);
+            mio_read(sess->worker->mio, sess->fd);
             break;
 
         case event_WANT_WRITE:
             log_debug(ZONE, "want write");
-            mio_write(sess->c2s->mio, sess->fd);
+            mio_write(sess->worker->mio, sess->fd);
             break;
 
         case event_READ:
             log_debug(ZONE, "reading from %d", sess->fd->fd);
 
             /* check rate limits */
-            if(sess->rate != NULL) {
-                if(rate_check(sess->rate) == 0) {
-
-                    /* inform the app if we haven't already */
-                    if(!sess->rate_log) {
-                        if(s->state >= state_STREAM && sess->resources != NULL)
-                            log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s] is being byte rate limited", sess->fd->fd, jid_user(sess->resources->jid));
-                        else
-                            log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] is being byte rate limited", sess->fd->fd, sess->ip, sess->port);
+            if((wait = _c2s_sess_throttle_wait(sess)) > 0) {
 
-                        sess->rate_log = 1;
-                    }
+                /* inform the app if we haven't already */
+                if(sess->rate != NULL && rate_check(sess->rate) == 0 && !sess->rate_log) {
+                    if(s->state >= state_STREAM && sess->resources != NULL)
+                        log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s] is being byte rate limited", sess->fd->fd, jid_user(sess->resources->jid));
+                    else
+                        log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] is being byte rate limited", sess->fd->fd, sess->ip, sess->port);
 
-                    return -1;
+                    sess->rate_log = 1;
                 }
 
+                /* come back for the pending bytes right when the limit is lifted */
+                twheel_add(sess->worker->timers, &sess->throttle_timer, wait);
+
+                return -1;
+            }
+
+            if(sess->rate != NULL) {
                 /* find out how much we can have */
                 rlen = rate_left(sess->rate);
                 if(rlen > buf->len)
@@ -77,7 +150,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             len = recv(sess->fd->fd, buf->data, rlen, 0);
 
             /* update rate limits */
-            if(sess->rate != NULL)
+            if(sess->rate != NULL && len > 0)
                 rate_add(sess->rate, len);
 
             if(len < 0) {
@@ -110,9 +183,15 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", sess->fd->fd);
 
-            len = send(sess->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(sess->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(sess->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -149,6 +228,8 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                 return 0;
             }
 
+            c2s_lock(sess->c2s);
+
             /* send a see-other-host error if we're configured to do so */
             redirect = (stream_redirect_t) xhash_get(sess->c2s->stream_redirects, s->req_to);
             if (redirect != NULL) {
@@ -156,6 +237,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                 len = strlen(redirect->to_address) + strlen(redirect->to_port) + 1;
                 char *other_host = (char *) malloc(len+1);
                 snprintf(other_host, len+1, "%s:%s", redirect->to_address, redirect->to_port);
+                c2s_unlock(sess->c2s);
                 sx_error_extended(s, stream_err_SEE_OTHER_HOST, other_host);
                 free(other_host);
                 sx_close(s);
@@ -167,6 +249,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             sess->host = xhash_get(sess->c2s->hosts, s->req_to);
 
             if(sess->host == NULL && sess->c2s->vhost == NULL) {
+                c2s_unlock(sess->c2s);
                 log_debug(ZONE, "no host available for requested domain '%s'", s->req_to);
                 sx_error(s, stream_err_HOST_UNKNOWN, "service requested for unknown domain");
                 sx_close(s);
@@ -175,6 +258,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             }
 
             if(xhash_get(sess->c2s->sm_avail, s->req_to) == NULL) {
+                c2s_unlock(sess->c2s);
                 log_debug(ZONE, "sm for domain '%s' is not online", s->req_to);
                 sx_error(s, stream_err_HOST_GONE, "session manager for requested domain is not available");
                 sx_close(s);
@@ -190,6 +274,8 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                 xhash_put(sess->c2s->hosts, pstrdup(xhash_pool(sess->c2s->hosts), s->req_to), sess->host);
             }
 
+            c2s_unlock(sess->c2s);
+
 #ifdef HAVE_SSL
             if(sess->host->host_pemfile != NULL)
                 sess->s->flags |= SX_SSL_STARTTLS_OFFER;
@@ -201,7 +287,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
         case event_PACKET:
             /* we're counting packets */
             sess->packet_count++;
-            sess->c2s->packet_count++;
+            sess->worker->packet_count++;
 
             /* check rate limits */
             if(sess->stanza_rate != NULL) {
@@ -399,8 +485,9 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             }
 #endif
 
-            /* handle iq:auth packets */
-            if(authreg_process(sess->c2s, sess, nad) == 0)
+            /* handle iq:auth packets (the calls to the module lock for themselves) */
+            ret = authreg_process(sess->c2s, sess, nad);
+            if(ret == 0)
                 return 0;
 
             /* drop it if no session */
@@ -467,7 +554,7 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             break;
 
         case event_CLOSED:
-            mio_close(sess->c2s->mio, sess->fd);
+            mio_close(sess->worker->mio, sess->fd);
             sess->fd = NULL;
             return -1;
     }
@@ -476,27 +563,22 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
 }
 
 static int _c2s_client_accept_check(c2s_t c2s, mio_fd_t fd, const char *ip) {
-    rate_t rt;
+    int ok;
 
     if(access_check(c2s->access, ip) == 0) {
         log_write(c2s->log, LOG_NOTICE, "[%d] [%s] access denied by configuration", fd->fd, ip);
         return 1;
     }
 
-    if(c2s->conn_rate_total != 0) {
-        rt = (rate_t) xhash_get(c2s->conn_rates, ip);
-        if(rt == NULL) {
-            rt = rate_new(c2s->conn_rate_total, c2s->conn_rate_seconds, c2s->conn_rate_wait);
-            xhash_put(c2s->conn_rates, pstrdup(xhash_pool(c2s->conn_rates), ip), (void *) rt);
-            pool_cleanup(xhash_pool(c2s->conn_rates), (void (*)(void *)) rate_free, rt);
-        }
+    if(c2s->conn_rates != NULL) {
+        c2s_lock(c2s);
+        ok = rate_table_check(c2s->conn_rates, ip);
+        c2s_unlock(c2s);
 
-        if(rate_check(rt) == 0) {
+        if(!ok) {
             log_write(c2s->log, LOG_NOTICE, "[%d] [%s] is being connect rate limited", fd->fd, ip);
             return 1;
         }
-
-        rate_add(rt, 1);
     }
 
     return 0;
@@ -504,11 +586,13 @@ static int _c2s_client_accept_check(c2s_t c2s, mio_fd_t fd, const char *ip) {
 
 static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     sess_t sess = (sess_t) arg;
-    c2s_t c2s = (c2s_t) arg;
+    c2s_worker_t w = (c2s_worker_t) arg;
+    c2s_t c2s;
     bres_t bres;
     struct sockaddr_storage sa;
     socklen_t namelen = sizeof(sa);
     int port, nbytes, flags = 0;
+    char rstats[160];
 
     switch(a) {
         case action_READ:
@@ -533,7 +617,8 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
         case action_CLOSE:
             log_debug(ZONE, "close action on fd %d", fd->fd);
 
-            log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect jid=%s, packets: %i, bytes: %d", sess->fd->fd, sess->ip, sess->port, ((sess->resources)?((char*) jid_full(sess->resources->jid)):"unbound"), sess->packet_count, sess->s->rbytes_total);
+            sx_read_stats(sess->s, rstats, sizeof(rstats));
+            log_write(sess->c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect jid=%s, packets: %i, %s", sess->fd->fd, sess->ip, sess->port, ((sess->resources)?((char*) jid_full(sess->resources->jid)):"unbound"), sess->packet_count, rstats);
 
             /* tell the sm to close their session */
             if(sess->active)
@@ -542,8 +627,11 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
 
             /* call the session end callback to allow for authreg
              * module to cleanup private data */
-            if(sess->host && sess->host->ar->sess_end != NULL)
+            if(sess->host && sess->host->ar->sess_end != NULL) {
+                c2s_ar_lock(sess->c2s);
                 (sess->host->ar->sess_end)(sess->host->ar, sess);
+                c2s_ar_unlock(sess->c2s);
+            }
 
             /* force free authreg_private if pointer is still set */
             if (sess->authreg_private != NULL) {
@@ -551,17 +639,25 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
                 sess->authreg_private = NULL;
             }
 
-            jqueue_push(sess->c2s->dead, (void *) sess->s, 0);
+            twheel_del(sess->worker->timers, &sess->activity_timer);
+            twheel_del(sess->worker->timers, &sess->throttle_timer);
 
+            /* the stream goes with the session, once its authreg requests are back */
+            sess->closed = 1;
+
+            c2s_lock(sess->c2s);
             xhash_zap(sess->c2s->sessions, sess->skey);
+            c2s_unlock(sess->c2s);
 
-            jqueue_push(sess->c2s->dead_sess, (void *) sess, 0);
+            jqueue_push(sess->worker->dead_sess, (void *) sess, 0);
 
             break;
 
         case action_ACCEPT:
             log_debug(ZONE, "accept action on fd %d", fd->fd);
 
+            c2s = w->c2s;
+
             getpeername(fd->fd, (struct sockaddr *) &sa, &namelen);
             port = j_inet_getport(&sa);
 
@@ -573,6 +669,7 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             sess = (sess_t) calloc(1, sizeof(struct sess_st));
 
             sess->c2s = c2s;
+            sess->worker = w;
 
             sess->fd = fd;
 
@@ -588,12 +685,24 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
             if(c2s->stanza_size_limit != 0)
                 sess->s->rbytesmax = c2s->stanza_size_limit;
 
+            if(c2s->io_read_buffer_max != 0)
+                sess->s->rbufmax = c2s->io_read_buffer_max;
+
             if(c2s->byte_rate_total != 0)
                 sess->rate = rate_new(c2s->byte_rate_total, c2s->byte_rate_seconds, c2s->byte_rate_wait);
 
             if(c2s->stanza_rate_total != 0)
                 sess->stanza_rate = rate_new(c2s->stanza_rate_total, c2s->stanza_rate_seconds, c2s->stanza_rate_wait);
 
+            twheel_timer_init(&sess->activity_timer, _c2s_sess_activity_timer, (void *) sess);
+            twheel_timer_init(&sess->throttle_timer, _c2s_sess_throttle_timer, (void *) sess);
+
+            /* idle and keepalive checks, nothing to do until they have been quiet that long */
+            if(c2s->io_check_interval > 0 && (c2s->io_check_idle > 0 || c2s->io_check_keepalive > 0))
+                twheel_add(w->timers, &sess->activity_timer,
+                           ((c2s->io_check_idle > 0 && (c2s->io_check_keepalive <= 0 || c2s->io_check_idle < c2s->io_check_keepalive)) ?
+                            c2s->io_check_idle : c2s->io_check_keepalive) * 1000 + 1000);
+
             /* give IP to SX */
             sess->s->ip = sess->ip;
             sess->s->port = sess->port;
@@ -604,9 +713,11 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
 
             /* remember it */
             sprintf(sess->skey, "%d", fd->fd);
+            c2s_lock(c2s);
             xhash_put(c2s->sessions, sess->skey, (void *) sess);
+            c2s_unlock(c2s);
 
-            flags = SX_SASL_OFFER;
+            flags = SX_SASL_OFFER | SX_WRITEV;
 #ifdef HAVE_SSL
             /* go ssl wrappermode if they're on the ssl port */
             if(port == c2s->local_ssl_port)
@@ -624,11 +735,69 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
     return 0;
 }
 
-static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
-    int attr;
-    char from[1024];
+/** setup the listening sockets of a loop, returns non-zero if anything is listening */
+int c2s_worker_listen(c2s_worker_t w) {
+    c2s_t c2s = w->c2s;
+
+    if(c2s->local_port != 0) {
+        w->server_fd = mio_listen(w->mio, c2s->local_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+        if(w->server_fd == NULL)
+            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_port);
+        else
+            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for connections (loop %d)", c2s->local_ip, c2s->local_port, w->id);
+    } else
+        w->server_fd = NULL;
+
+#ifdef HAVE_SSL
+    if(c2s->local_ssl_port != 0 && c2s->local_pemfile != NULL) {
+        w->server_ssl_fd = mio_listen(w->mio, c2s->local_ssl_port, c2s->local_ip, _c2s_client_mio_callback, (void *) w);
+        if(w->server_ssl_fd == NULL)
+            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_ssl_port);
+        else
+            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for SSL connections (loop %d)", c2s->local_ip, c2s->local_ssl_port, w->id);
+    } else
+        w->server_ssl_fd = NULL;
+
+    return w->server_fd != NULL || w->server_ssl_fd != NULL;
+#else
+    return w->server_fd != NULL;
+#endif
+}
+
+/** close the sessions this loop serves for a domain whose sm went away */
+void c2s_sm_offline(c2s_worker_t w, const char *domain) {
+    c2s_t c2s = w->c2s;
     sess_t sess;
     union xhashv xhv;
+    jqueue_t closing;
+
+    /* collect them first, closing takes the lock again */
+    closing = jqueue_new();
+
+    c2s_lock(c2s);
+    if(xhash_iter_first(c2s->sessions))
+        do {
+            xhv.sess_val = &sess;
+            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
+
+            if(sess->worker == w && sess->resources != NULL && strcmp(sess->resources->jid->domain, domain) == 0) {
+                log_debug(ZONE, "killing session %s", jid_user(sess->resources->jid));
+
+                sess->active = 0;
+                if(sess->s) jqueue_push(closing, (void *) sess->s, 0);
+            }
+        } while(xhash_iter_next(c2s->sessions));
+    c2s_unlock(c2s);
+
+    while(jqueue_size(closing) > 0)
+        sx_close((sx_t) jqueue_pull(closing));
+
+    jqueue_free(closing);
+}
+
+static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
+    int attr, i, online;
+    char from[1024];
 
     if((attr = nad_find_attr(nad, 0, -1, "from", NULL)) < 0) {
         nad_free(nad);
@@ -643,7 +812,9 @@ static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
 
         log_debug(ZONE, "sm for serviced domain '%s' online", from);
 
+        c2s_lock(c2s);
         xhash_put(c2s->sm_avail, pstrdup(xhash_pool(c2s->sm_avail), from), (void *) 1);
+        c2s_unlock(c2s);
 
         nad_free(nad);
         return;
@@ -656,24 +827,505 @@ static void _c2s_component_presence(c2s_t c2s, nad_t nad) {
 
     log_debug(ZONE, "component unavailable from '%s'", from);
 
-    if(xhash_get(c2s->sm_avail, from) != NULL) {
+    c2s_lock(c2s);
+    online = (xhash_get(c2s->sm_avail, from) != NULL);
+    if(online)
+        xhash_zap(c2s->sm_avail, from);
+    c2s_unlock(c2s);
+
+    if(online) {
         log_debug(ZONE, "sm for serviced domain '%s' offline", from);
 
-        if(xhash_iter_first(c2s->sessions))
-            do {
-                xhv.sess_val = &sess;
-                xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
+        /* every loop closes its own sessions */
+        for(i = 1; i <= c2s->io_workers; i++)
+            c2s_worker_push(&c2s->workers[i], nad_copy(nad));
+
+        c2s_sm_offline(c2s->workers, from);
+    }
+
+    nad_free(nad);
+}
+
+/** which loop serves the session a routed packet is for */
+static c2s_worker_t _c2s_router_owner(c2s_t c2s, nad_t nad) {
+    c2s_worker_t w = c2s->workers;
+    int ns, c2sid;
+    char skey[44];
+    sess_t sess;
+
+    if(c2s->io_workers == 0)
+        return w;
+
+    /* anything we can't place is dropped by the main loop */
+    ns = nad_find_namespace(nad, 1, uri_SESSION, NULL);
+    if(ns < 0 || (c2sid = nad_find_attr(nad, 1, ns, "c2s", NULL)) < 0)
+        return w;
+
+    snprintf(skey, sizeof(skey), "%.*s", NAD_AVAL_L(nad, c2sid), NAD_AVAL(nad, c2sid));
+
+    c2s_lock(c2s);
+    sess = xhash_get(c2s->sessions, skey);
+    if(sess != NULL)
+        w = sess->worker;
+    c2s_unlock(c2s);
+
+    return w;
+}
+
+/** a unicast route from the router, off to the loop serving its session */
+static void _c2s_router_route(nad_t nad, void *arg) {
+    c2s_t c2s = (c2s_t) arg;
+    c2s_worker_t w;
+
+    /* need some payload */
+    if(nad->ecur == 1) {
+        log_debug(ZONE, "no route payload, dropping");
+        nad_free(nad);
+        return;
+    }
+
+    /* hand it over to the loop serving the session */
+    w = _c2s_router_owner(c2s, nad);
+    if(c2s_worker_threaded(w))
+        c2s_worker_push(w, nad);
+    else
+        c2s_router_deliver(w, nad);
+}
+
+/** process a routed packet for one of the sessions this loop serves */
+void c2s_router_deliver(c2s_worker_t w, nad_t nad) {
+    c2s_t c2s = w->c2s;
+    int from, c2sid, smid, action, id, ns, scan, replaced, ret, moved;
+    char skey[44];
+    sess_t sess;
+    bres_t bres, ires;
+    char *smcomp;
+
+    ns = nad_find_namespace(nad, 1, uri_SESSION, NULL);
+    if(ns < 0) {
+        log_debug(ZONE, "not a c2s packet, dropping");
+        nad_free(nad);
+        return;
+    }
+
+    /* figure out the session */
+    c2sid = nad_find_attr(nad, 1, ns, "c2s", NULL);
+    if(c2sid < 0) {
+        log_debug(ZONE, "no c2s id on payload, dropping");
+        nad_free(nad);
+        return;
+    }
+    snprintf(skey, sizeof(skey), "%.*s", NAD_AVAL_L(nad, c2sid), NAD_AVAL(nad, c2sid));
+
+    /* find the session, quietly drop if we don't have it */
+    c2s_lock(c2s);
+    sess = xhash_get(c2s->sessions, skey);
+
+    /* the fd went to a new session on another loop while this was queued,
+     * and only that loop can touch it */
+    moved = sess != NULL && sess->worker != w;
+    c2s_unlock(c2s);
+
+    if(moved) {
+        log_debug(ZONE, "session %s has moved, dropping", skey);
+        nad_free(nad);
+        return;
+    }
+
+    if(sess == NULL) {
+        /* if we get this, the SM probably thinks the session is still active
+         * so we need to tell SM to free it up */
+        log_debug(ZONE, "no session for %s", skey);
 
-                if(sess->resources != NULL && strcmp(sess->resources->jid->domain, from) == 0) {
-                    log_debug(ZONE, "killing session %s", jid_user(sess->resources->jid));
+        /* check if it's a started action; otherwise we could end up in an infinite loop
+         * trying to tell SM to close in response to errors */
+        action = nad_find_attr(nad, 1, -1, "action", NULL);
+        if(action >= 0 && NAD_AVAL_L(nad, action) == 7 && strncmp("started", NAD_AVAL(nad, action), 7) == 0) {
+            int target;
+            bres_t tres;
+            sess_t tsess;
 
-                    sess->active = 0;
-                    if(sess->s) sx_close(sess->s);
+            log_write(c2s->log, LOG_NOTICE, "session %s does not exist; telling sm to close", skey);
+
+            /* we don't have a session and we don't have a resource; we need to forge them both
+             * to get SM to close stuff */
+            target = nad_find_attr(nad, 1, -1, "target", NULL);
+            smid = nad_find_attr(nad, 1, ns, "sm", NULL);
+            if(target < 0 || smid < 0) {
+                const char *buf;
+                int len;
+                nad_print(nad, 0, &buf, &len);
+                log_write(c2s->log, LOG_NOTICE, "sm sent an invalid start packet: %.*s", len, buf );
+                nad_free(nad);
+                return;
+            }
+
+            /* build temporary resource to close session for */
+            tres = NULL;
+            tres = (bres_t) calloc(1, sizeof(struct bres_st));
+            tres->jid = jid_new(NAD_AVAL(nad, target), NAD_AVAL_L(nad, target));
+
+            strncpy(tres->c2s_id, skey, sizeof(tres->c2s_id));
+            snprintf(tres->sm_id, sizeof(tres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
+
+            /* make a temporary session */
+            tsess = (sess_t) calloc(1, sizeof(struct sess_st));
+            tsess->c2s = c2s;
+            tsess->worker = w;
+            tsess->result = nad_new();
+            strncpy(tsess->skey, skey, sizeof(tsess->skey));
+
+            /* end a session with the sm */
+            sm_end(tsess, tres);
+
+            /* free our temporary messes */
+            nad_free(tsess->result);
+            jid_free(tres->jid); //TODO will this crash?
+            free(tsess);
+            free(tres);
+        }
+
+        nad_free(nad);
+        return;
+    }
+
+    /* if they're pre-stream, then this is leftovers from a previous session */
+    if(sess->s && sess->s->state < state_STREAM) {
+        log_debug(ZONE, "session %s is pre-stream", skey);
+
+        nad_free(nad);
+        return;
+    }
+
+    /* check the sm session id if they gave us one */
+    smid = nad_find_attr(nad, 1, ns, "sm", NULL);
+
+    /* get the action attribute */
+    action = nad_find_attr(nad, 1, -1, "action", NULL);
+
+    /* first user created packets - these are out of session */
+    if(action >= 0 && NAD_AVAL_L(nad, action) == 7 && strncmp("created", NAD_AVAL(nad, action), 7) == 0) {
+
+        nad_free(nad);
+
+        if(sess->result) {
+            /* return the result to the client */
+            sx_nad_write(sess->s, sess->result);
+            sess->result = NULL;
+        } else {
+            log_write(sess->c2s->log, LOG_WARNING, "user created for session %s which is already gone", skey);
+        }
+
+        return;
+    }
+
+    /* route errors */
+    if(nad_find_attr(nad, 0, -1, "error", NULL) >= 0) {
+        log_debug(ZONE, "routing error");
+
+        if(sess->s) {
+            sx_error(sess->s, stream_err_INTERNAL_SERVER_ERROR, "internal server error");
+            sx_close(sess->s);
+        }
+
+        nad_free(nad);
+        return;
+    }
+
+    /* all other packets need to contain an sm ID */
+    if (smid < 0) {
+        log_debug(ZONE, "received packet from sm without an sm ID, dropping");
+        nad_free(nad);
+        return;
+    }
+
+    /* find resource that we got packet for */
+    bres = NULL;
+    if(smid >= 0)
+        for(bres = sess->resources; bres != NULL; bres = bres->next){
+            if(bres->sm_id[0] == '\0' || (strlen(bres->sm_id) == NAD_AVAL_L(nad, smid) && strncmp(bres->sm_id, NAD_AVAL(nad, smid), NAD_AVAL_L(nad, smid)) == 0))
+                break;
+        }
+    if(bres == NULL) {
+        jid_t jid = NULL;
+        bres_t tres = NULL;
+
+        /* if it's a failure, just drop it */
+        if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
+            nad_free(nad);
+            return;
+        }
+
+        /* build temporary resource to close session for */
+        tres = (bres_t) calloc(1, sizeof(struct bres_st));
+        if(sess->s) {
+            jid = jid_new(sess->s->auth_id, -1);
+            sprintf(tres->c2s_id, "%d", sess->s->tag);
+        }
+        else {
+            /* does not have SX - extract values from route packet */
+            int c2sid, target;
+            c2sid = nad_find_attr(nad, 1, ns, "c2s", NULL);
+            target = nad_find_attr(nad, 1, -1, "target", NULL);
+            if(c2sid < 0 || target < 0) {
+                log_debug(ZONE, "needed ids not found - c2sid:%d target:%d", c2sid, target);
+                nad_free(nad);
+                free(tres);
+                return;
+            }
+            jid = jid_new(NAD_AVAL(nad, target), NAD_AVAL_L(nad, target));
+            snprintf(tres->c2s_id, sizeof(tres->c2s_id), "%.*s", NAD_AVAL_L(nad, c2sid), NAD_AVAL(nad, c2sid));
+        }
+        tres->jid = jid;
+        snprintf(tres->sm_id, sizeof(tres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
+
+        if(sess->resources) {
+            log_debug(ZONE, "expected packet from sm session %s, but got one from %.*s, ending sm session", sess->resources->sm_id, NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
+        } else {
+            log_debug(ZONE, "no resource bound yet, but got packet from sm session %.*s, ending sm session", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
+        }
+
+        /* end a session with the sm */
+        sm_end(sess, tres);
+
+        /* finished with the nad */
+        nad_free(nad);
+
+        /* free temp objects */
+        jid_free(jid);
+        free(tres);
+
+        return;
+    }
+
+    /* session control packets */
+    if(NAD_ENS(nad, 1) == ns && action >= 0) {
+        /* end responses */
+
+        /* !!! this "replaced" stuff is a hack - its really a subaction of "ended".
+         *     hurrah, another control protocol rewrite is needed :(
+         */
+
+        replaced = 0;
+        if(NAD_AVAL_L(nad, action) == 8 && strncmp("replaced", NAD_AVAL(nad, action), NAD_AVAL_L(nad, action)) == 0)
+            replaced = 1;
+        if(sess->active &&
+           (replaced || (NAD_AVAL_L(nad, action) == 5 && strncmp("ended", NAD_AVAL(nad, action), NAD_AVAL_L(nad, action)) == 0))) {
+
+            sess->bound -= 1;
+            /* no more resources bound? */
+            if(sess->bound < 1){
+                sess->active = 0;
+
+                if(sess->s) {
+                    /* return the unbind result to the client */
+                    if(sess->result != NULL) {
+                        sx_nad_write(sess->s, sess->result);
+                        sess->result = NULL;
+                    }
+
+                    if(replaced)
+                        sx_error(sess->s, stream_err_CONFLICT, NULL);
+
+                    sx_close(sess->s);
+
+                } else {
+                    // handle fake PBX sessions
+                    if(sess->result != NULL) {
+                        nad_free(sess->result);
+                        sess->result = NULL;
+                    }
                 }
-            } while(xhash_iter_next(c2s->sessions));
 
-        xhash_zap(c2s->sm_avail, from);
+                nad_free(nad);
+                return;
+            }
+
+            /* else remove the bound resource */
+            if(bres == sess->resources) {
+                sess->resources = bres->next;
+            } else {
+                for(ires = sess->resources; ires != NULL; ires = ires->next)
+                    if(ires->next == bres)
+                        break;
+                assert(ires != NULL);
+                ires->next = bres->next;
+            }
+
+            log_write(sess->c2s->log, LOG_NOTICE, "[%d] unbound: jid=%s", sess->s->tag, jid_full(bres->jid));
+
+            jid_free(bres->jid);
+            free(bres);
+
+            /* and return the unbind result to the client */
+            if(sess->result != NULL) {
+                sx_nad_write(sess->s, sess->result);
+                sess->result = NULL;
+            }
+
+            return;
+        }
+
+        id = nad_find_attr(nad, 1, -1, "id", NULL);
+
+        /* make sure the id matches */
+        if(id < 0 || bres->sm_request[0] == '\0' || strlen(bres->sm_request) != NAD_AVAL_L(nad, id) || strncmp(bres->sm_request, NAD_AVAL(nad, id), NAD_AVAL_L(nad, id)) != 0) {
+            if(id >= 0) {
+                log_debug(ZONE, "got a response with id %.*s, but we were expecting %s", NAD_AVAL_L(nad, id), NAD_AVAL(nad, id), bres->sm_request);
+            } else {
+                log_debug(ZONE, "got a response with no id, but we were expecting %s", bres->sm_request);
+            }
+
+            nad_free(nad);
+            return;
+        }
+
+        /* failed requests */
+        if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
+            /* handled request */
+            bres->sm_request[0] = '\0';
+
+            /* we only care about failed start and create */
+            if((NAD_AVAL_L(nad, action) == 5 && strncmp("start", NAD_AVAL(nad, action), 5) == 0) ||
+               (NAD_AVAL_L(nad, action) == 6 && strncmp("create", NAD_AVAL(nad, action), 6) == 0)) {
+
+                /* create failed, so we need to remove them from authreg */
+                if(NAD_AVAL_L(nad, action) == 6 && sess->host->ar->delete_user != NULL) {
+                    c2s_ar_lock(c2s);
+                    ret = (sess->host->ar->delete_user)(sess->host->ar, sess, bres->jid->node, sess->host->realm);
+                    c2s_ar_unlock(c2s);
+
+                    if(ret != 0)
+                        log_write(c2s->log, LOG_NOTICE, "[%d] user creation failed, and unable to delete user credentials: user=%s, realm=%s", sess->s->tag, bres->jid->node, sess->host->realm);
+                    else
+                        log_write(c2s->log, LOG_NOTICE, "[%d] user creation failed, so deleted user credentials: user=%s, realm=%s", sess->s->tag, bres->jid->node, sess->host->realm);
+                }
+
+                /* error the result and return it to the client */
+                sx_nad_write(sess->s, stanza_error(sess->result, 0, stanza_err_INTERNAL_SERVER_ERROR));
+                sess->result = NULL;
+
+                /* remove the bound resource */
+                if(bres == sess->resources) {
+                    sess->resources = bres->next;
+                } else {
+                    for(ires = sess->resources; ires != NULL; ires = ires->next)
+                        if(ires->next == bres)
+                            break;
+                    assert(ires != NULL);
+                    ires->next = bres->next;
+                }
+
+                jid_free(bres->jid);
+                free(bres);
+
+                nad_free(nad);
+                return;
+            }
+
+            log_debug(ZONE, "weird, got a failed session response, with a matching id, but the action is bogus *shrug*");
+
+            nad_free(nad);
+            return;
+        }
+
+        /* session started */
+        if(NAD_AVAL_L(nad, action) == 7 && strncmp("started", NAD_AVAL(nad, action), 7) == 0) {
+            /* handled request */
+            bres->sm_request[0] = '\0';
+
+            /* copy the sm id */
+            if(smid >= 0)
+                snprintf(bres->sm_id, sizeof(bres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
+
+            /* and remember the SM that services us */
+            from = nad_find_attr(nad, 0, -1, "from", NULL);
+
+
+            smcomp = malloc(NAD_AVAL_L(nad, from) + 1);
+            snprintf(smcomp, NAD_AVAL_L(nad, from) + 1, "%.*s", NAD_AVAL_L(nad, from), NAD_AVAL(nad, from));
+            sess->smcomp = smcomp;
+
+            nad_free(nad);
+
+            /* bring them online, old-skool */
+            if(!sess->sasl_authd && sess->s) {
+                sx_auth(sess->s, "traditional", jid_full(bres->jid));
+                return;
+            }
+
+            if(sess->result) {
+                /* return the auth result to the client */
+                if(sess->s) sx_nad_write(sess->s, sess->result);
+                /* or follow-up the session creation with cached presence packet */
+                else sm_packet(sess, bres, sess->result);
+            }
+            sess->result = NULL;
+
+            /* we're good to go */
+            sess->active = 1;
+
+            return;
+        }
+
+        /* handled request */
+        bres->sm_request[0] = '\0';
+
+        log_debug(ZONE, "unknown action %.*s", NAD_AVAL_L(nad, id), NAD_AVAL(nad, id));
+
+        nad_free(nad);
+
+        return;
+    }
+
+    /* client packets */
+    if(NAD_NURI_L(nad, NAD_ENS(nad, 1)) == strlen(uri_CLIENT) && strncmp(uri_CLIENT, NAD_NURI(nad, NAD_ENS(nad, 1)), strlen(uri_CLIENT)) == 0) {
+        if(!sess->active || !sess->s) {
+            /* its a strange world .. */
+            log_debug(ZONE, "Got packet for %s - dropping", !sess->s ? "session without stream (PBX pipe session?)" : "inactive session");
+            nad_free(nad);
+            return;
+        }
+
+        /* sm is bouncing something */
+        if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
+            /* there's really no graceful way to handle this */
+            sx_error(sess->s, stream_err_INTERNAL_SERVER_ERROR, "session manager failed control action");
+            sx_close(sess->s);
+
+            nad_free(nad);
+            return;
+        }
+
+        /* we're counting packets */
+        sess->packet_count++;
+        sess->worker->packet_count++;
+
+        /* remove sm specifics */
+        nad_set_attr(nad, 1, ns, "c2s", NULL, 0);
+        nad_set_attr(nad, 1, ns, "sm", NULL, 0);
+
+        /* forget about the internal namespace too */
+        if(nad->elems[1].ns == ns)
+            nad->elems[1].ns = nad->nss[ns].next;
+
+        else {
+            for(scan = nad->elems[1].ns; nad->nss[scan].next != -1 && nad->nss[scan].next != ns; scan = nad->nss[scan].next);
+
+            /* got it */
+            if(nad->nss[scan].next != -1)
+                nad->nss[scan].next = nad->nss[ns].next;
+        }
+
+        sx_nad_write_elem(sess->s, nad, 1);
+
+        return;
     }
+
+    /* its something else */
+    log_debug(ZONE, "unknown packet, dropping");
+
+    nad_free(nad);
 }
 
 int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
@@ -681,11 +1333,7 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sx_buf_t buf = (sx_buf_t) data;
     sx_error_t *sxe;
     nad_t nad;
-    int len, elem, from, c2sid, smid, action, id, ns, attr, scan, replaced;
-    char skey[44];
-    sess_t sess;
-    bres_t bres, ires;
-    char *smcomp;
+    int len, elem, ns, attr, i, listening;
 
     switch(e) {
         case event_WANT_READ:
@@ -731,9 +1379,15 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", c2s->fd->fd);
 
-            len = send(c2s->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(c2s->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(c2s->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -770,6 +1424,7 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             ns = nad_add_namespace(nad, uri_COMPONENT, NULL);
             nad_append_elem(nad, ns, "bind", 0);
             nad_append_attr(nad, -1, "name", c2s->id);
+            nad_append_elem(nad, ns, "multicast", 1);
 
             log_debug(ZONE, "requesting component bind for '%s'", c2s->id);
 
@@ -839,40 +1494,25 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 log_debug(ZONE, "coming online");
 
                 /* if we're coming online for the first time, setup listening sockets */
-#ifdef HAVE_SSL
-                if(c2s->server_fd == 0 && c2s->server_ssl_fd == 0) {
-#else
-                if(c2s->server_fd == 0) {
-#endif
-                    if(c2s->local_port != 0) {
-                        c2s->server_fd = mio_listen(c2s->mio, c2s->local_port, c2s->local_ip, _c2s_client_mio_callback, (void *) c2s);
-                        if(c2s->server_fd == NULL)
-                            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_port);
-                        else
-                            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for connections", c2s->local_ip, c2s->local_port);
-                    } else
-                        c2s->server_fd = NULL;
+                if(!c2s->started) {
+                    listening = 0;
+                    for(i = 0; i <= c2s->io_workers; i++)
+                        listening |= c2s_worker_listen(&c2s->workers[i]);
 
+                    if(!listening && c2s->pbx_pipe == NULL) {
 #ifdef HAVE_SSL
-                    if(c2s->local_ssl_port != 0 && c2s->local_pemfile != NULL) {
-                        c2s->server_ssl_fd = mio_listen(c2s->mio, c2s->local_ssl_port, c2s->local_ip, _c2s_client_mio_callback, (void *) c2s);
-                        if(c2s->server_ssl_fd == NULL)
-                            log_write(c2s->log, LOG_ERR, "[%s, port=%d] failed to listen", c2s->local_ip, c2s->local_ssl_port);
-                        else
-                            log_write(c2s->log, LOG_NOTICE, "[%s, port=%d] listening for SSL connections", c2s->local_ip, c2s->local_ssl_port);
-                    } else
-                        c2s->server_ssl_fd = NULL;
-#endif
-                }
-
-#ifdef HAVE_SSL
-                if(c2s->server_fd == NULL && c2s->server_ssl_fd == NULL && c2s->pbx_pipe == NULL) {
-                    log_write(c2s->log, LOG_ERR, "both normal and SSL ports are disabled, nothing to do!");
+                        log_write(c2s->log, LOG_ERR, "both normal and SSL ports are disabled, nothing to do!");
 #else
-                if(c2s->server_fd == NULL && c2s->pbx_pipe == NULL) {
-                    log_write(c2s->log, LOG_ERR, "server port is disabled, nothing to do!");
+                        log_write(c2s->log, LOG_ERR, "server port is disabled, nothing to do!");
 #endif
-                    exit(1);
+                        exit(1);
+                    }
+
+                    /* listeners are in place, let the workers loose */
+                    if(c2s_workers_start(c2s) != 0) {
+                        log_write(c2s->log, LOG_ERR, "failed to start worker threads");
+                        exit(1);
+                    }
                 }
 
                 /* open PBX integration FIFO */
@@ -907,429 +1547,21 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 return 0;
             }
 
-            /* only handle unicasts */
-            if(nad_find_attr(nad, 0, -1, "type", NULL) >= 0) {
-                log_debug(ZONE, "non-unicast packet, dropping");
-                nad_free(nad);
-                return 0;
-            }
-
-            /* need some payload */
-            if(nad->ecur == 1) {
-                log_debug(ZONE, "no route payload, dropping");
-                nad_free(nad);
-                return 0;
-            }
-
-            ns = nad_find_namespace(nad, 1, uri_SESSION, NULL);
-            if(ns < 0) {
-                log_debug(ZONE, "not a c2s packet, dropping");
-                nad_free(nad);
-                return 0;
-            }
-
-            /* figure out the session */
-            c2sid = nad_find_attr(nad, 1, ns, "c2s", NULL);
-            if(c2sid < 0) {
-                log_debug(ZONE, "no c2s id on payload, dropping");
-                nad_free(nad);
-                return 0;
-            }
-            snprintf(skey, sizeof(skey), "%.*s", NAD_AVAL_L(nad, c2sid), NAD_AVAL(nad, c2sid));
-
-            /* find the session, quietly drop if we don't have it */
-            sess = xhash_get(c2s->sessions, skey);
-            if(sess == NULL) {
-                /* if we get this, the SM probably thinks the session is still active
-                 * so we need to tell SM to free it up */
-                log_debug(ZONE, "no session for %s", skey);
-
-                /* check if it's a started action; otherwise we could end up in an infinite loop
-                 * trying to tell SM to close in response to errors */
-                action = nad_find_attr(nad, 1, -1, "action", NULL);
-                if(action >= 0 && NAD_AVAL_L(nad, action) == 7 && strncmp("started", NAD_AVAL(nad, action), 7) == 0) {
-                    int target;
-                    bres_t tres;
-                    sess_t tsess;
-
-                    log_write(c2s->log, LOG_NOTICE, "session %s does not exist; telling sm to close", skey);
-
-                    /* we don't have a session and we don't have a resource; we need to forge them both
-                     * to get SM to close stuff */
-                    target = nad_find_attr(nad, 1, -1, "target", NULL);
-                    smid = nad_find_attr(nad, 1, ns, "sm", NULL);
-                    if(target < 0 || smid < 0) {
-                        const char *buf;
-                        int len;
-                        nad_print(nad, 0, &buf, &len);
-                        log_write(c2s->log, LOG_NOTICE, "sm sent an invalid start packet: %.*s", len, buf );
-                        nad_free(nad);
-                        return 0;
-                    }
-
-                    /* build temporary resource to close session for */
-                    tres = NULL;
-                    tres = (bres_t) calloc(1, sizeof(struct bres_st));
-                    tres->jid = jid_new(NAD_AVAL(nad, target), NAD_AVAL_L(nad, target));
-
-                    strncpy(tres->c2s_id, skey, sizeof(tres->c2s_id));
-                    snprintf(tres->sm_id, sizeof(tres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
-
-                    /* make a temporary session */
-                    tsess = (sess_t) calloc(1, sizeof(struct sess_st));
-                    tsess->c2s = c2s;
-                    tsess->result = nad_new();
-                    strncpy(tsess->skey, skey, sizeof(tsess->skey));
-
-                    /* end a session with the sm */
-                    sm_end(tsess, tres);
-
-                    /* free our temporary messes */
-                    nad_free(tsess->result);
-                    jid_free(tres->jid); //TODO will this crash?
-                    free(tsess);
-                    free(tres);
-                }
-
-                nad_free(nad);
-                return 0;
-            }
-
-            /* if they're pre-stream, then this is leftovers from a previous session */
-            if(sess->s && sess->s->state < state_STREAM) {
-                log_debug(ZONE, "session %s is pre-stream", skey);
-
-                nad_free(nad);
-                return 0;
-            }
-
-            /* check the sm session id if they gave us one */
-            smid = nad_find_attr(nad, 1, ns, "sm", NULL);
-
-            /* get the action attribute */
-            action = nad_find_attr(nad, 1, -1, "action", NULL);
-
-            /* first user created packets - these are out of session */
-            if(action >= 0 && NAD_AVAL_L(nad, action) == 7 && strncmp("created", NAD_AVAL(nad, action), 7) == 0) {
-
-                nad_free(nad);
-
-                if(sess->result) {
-                    /* return the result to the client */
-                    sx_nad_write(sess->s, sess->result);
-                    sess->result = NULL;
-                } else {
-                    log_write(sess->c2s->log, LOG_WARNING, "user created for session %s which is already gone", skey);
-                }
-
+            /* multicasts become a unicast for every session */
+            if(nad_find_attr(nad, 0, -1, "type", "multicast") >= 0) {
+                stanza_multicast_expand(nad, _c2s_router_route, (void *) c2s);
                 return 0;
             }
 
-            /* route errors */
-            if(nad_find_attr(nad, 0, -1, "error", NULL) >= 0) {
-                log_debug(ZONE, "routing error");
-
-                if(sess->s) {
-                    sx_error(sess->s, stream_err_INTERNAL_SERVER_ERROR, "internal server error");
-                    sx_close(sess->s);
-                }
-
-                nad_free(nad);
-                return 0;
-            }
-
-            /* all other packets need to contain an sm ID */
-            if (smid < 0) {
-                log_debug(ZONE, "received packet from sm without an sm ID, dropping");
-                nad_free(nad);
-                return 0;
-            }
-
-            /* find resource that we got packet for */
-            bres = NULL;
-            if(smid >= 0)
-                for(bres = sess->resources; bres != NULL; bres = bres->next){
-                    if(bres->sm_id[0] == '\0' || (strlen(bres->sm_id) == NAD_AVAL_L(nad, smid) && strncmp(bres->sm_id, NAD_AVAL(nad, smid), NAD_AVAL_L(nad, smid)) == 0))
-                        break;
-                }
-            if(bres == NULL) {
-                jid_t jid = NULL;
-                bres_t tres = NULL;
-
-                /* if it's a failure, just drop it */
-                if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
-                    nad_free(nad);
-                    return 0;
-                }
-
-                /* build temporary resource to close session for */
-                tres = (bres_t) calloc(1, sizeof(struct bres_st));
-                if(sess->s) {
-                    jid = jid_new(sess->s->auth_id, -1);
-                    sprintf(tres->c2s_id, "%d", sess->s->tag);
-                }
-                else {
-                    /* does not have SX - extract values from route packet */
-                    int c2sid, target;
-                    c2sid = nad_find_attr(nad, 1, ns, "c2s", NULL);
-                    target = nad_find_attr(nad, 1, -1, "target", NULL);
-                    if(c2sid < 0 || target < 0) {
-                        log_debug(ZONE, "needed ids not found - c2sid:%d target:%d", c2sid, target);
-                        nad_free(nad);
-                        free(tres);
-                        return 0;
-                    }
-                    jid = jid_new(NAD_AVAL(nad, target), NAD_AVAL_L(nad, target));
-                    snprintf(tres->c2s_id, sizeof(tres->c2s_id), "%.*s", NAD_AVAL_L(nad, c2sid), NAD_AVAL(nad, c2sid));
-                }
-                tres->jid = jid;
-                snprintf(tres->sm_id, sizeof(tres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
-
-                if(sess->resources) {
-                    log_debug(ZONE, "expected packet from sm session %s, but got one from %.*s, ending sm session", sess->resources->sm_id, NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
-                } else {
-                    log_debug(ZONE, "no resource bound yet, but got packet from sm session %.*s, ending sm session", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
-                }
-
-                /* end a session with the sm */
-                sm_end(sess, tres);
-
-                /* finished with the nad */
-                nad_free(nad);
-
-                /* free temp objects */
-                jid_free(jid);
-                free(tres);
-
-                return 0;
-            }
-
-            /* session control packets */
-            if(NAD_ENS(nad, 1) == ns && action >= 0) {
-                /* end responses */
-
-                /* !!! this "replaced" stuff is a hack - its really a subaction of "ended".
-                 *     hurrah, another control protocol rewrite is needed :(
-                 */
-
-                replaced = 0;
-                if(NAD_AVAL_L(nad, action) == 8 && strncmp("replaced", NAD_AVAL(nad, action), NAD_AVAL_L(nad, action)) == 0)
-                    replaced = 1;
-                if(sess->active &&
-                   (replaced || (NAD_AVAL_L(nad, action) == 5 && strncmp("ended", NAD_AVAL(nad, action), NAD_AVAL_L(nad, action)) == 0))) {
-
-                    sess->bound -= 1;
-                    /* no more resources bound? */
-                    if(sess->bound < 1){
-                        sess->active = 0;
-
-                        if(sess->s) {
-                            /* return the unbind result to the client */
-                            if(sess->result != NULL) {
-                                sx_nad_write(sess->s, sess->result);
-                                sess->result = NULL;
-                            }
-
-                            if(replaced)
-                                sx_error(sess->s, stream_err_CONFLICT, NULL);
-
-                            sx_close(sess->s);
-
-                        } else {
-                            // handle fake PBX sessions
-                            if(sess->result != NULL) {
-                                nad_free(sess->result);
-                                sess->result = NULL;
-                            }
-                        }
-
-                        nad_free(nad);
-                        return 0;
-                    }
-
-                    /* else remove the bound resource */
-                    if(bres == sess->resources) {
-                        sess->resources = bres->next;
-                    } else {
-                        for(ires = sess->resources; ires != NULL; ires = ires->next)
-                            if(ires->next == bres)
-                                break;
-                        assert(ires != NULL);
-                        ires->next = bres->next;
-                    }
-
-                    log_write(sess->c2s->log, LOG_NOTICE, "[%d] unbound: jid=%s", sess->s->tag, jid_full(bres->jid));
-
-                    jid_free(bres->jid);
-                    free(bres);
-
-                    /* and return the unbind result to the client */
-                    if(sess->result != NULL) {
-                        sx_nad_write(sess->s, sess->result);
-                        sess->result = NULL;
-                    }
-
-                    return 0;
-                }
-
-                id = nad_find_attr(nad, 1, -1, "id", NULL);
-
-                /* make sure the id matches */
-                if(id < 0 || bres->sm_request[0] == '\0' || strlen(bres->sm_request) != NAD_AVAL_L(nad, id) || strncmp(bres->sm_request, NAD_AVAL(nad, id), NAD_AVAL_L(nad, id)) != 0) {
-                    if(id >= 0) {
-                        log_debug(ZONE, "got a response with id %.*s, but we were expecting %s", NAD_AVAL_L(nad, id), NAD_AVAL(nad, id), bres->sm_request);
-                    } else {
-                        log_debug(ZONE, "got a response with no id, but we were expecting %s", bres->sm_request);
-                    }
-
-                    nad_free(nad);
-                    return 0;
-                }
-
-                /* failed requests */
-                if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
-                    /* handled request */
-                    bres->sm_request[0] = '\0';
-
-                    /* we only care about failed start and create */
-                    if((NAD_AVAL_L(nad, action) == 5 && strncmp("start", NAD_AVAL(nad, action), 5) == 0) ||
-                       (NAD_AVAL_L(nad, action) == 6 && strncmp("create", NAD_AVAL(nad, action), 6) == 0)) {
-
-                        /* create failed, so we need to remove them from authreg */
-                        if(NAD_AVAL_L(nad, action) == 6 && sess->host->ar->delete_user != NULL) {
-                            if((sess->host->ar->delete_user)(sess->host->ar, sess, bres->jid->node, sess->host->realm) != 0)
-                                log_write(c2s->log, LOG_NOTICE, "[%d] user creation failed, and unable to delete user credentials: user=%s, realm=%s", sess->s->tag, bres->jid->node, sess->host->realm);
-                            else
-                                log_write(c2s->log, LOG_NOTICE, "[%d] user creation failed, so deleted user credentials: user=%s, realm=%s", sess->s->tag, bres->jid->node, sess->host->realm);
-                        }
-
-                        /* error the result and return it to the client */
-                        sx_nad_write(sess->s, stanza_error(sess->result, 0, stanza_err_INTERNAL_SERVER_ERROR));
-                        sess->result = NULL;
-
-                        /* remove the bound resource */
-                        if(bres == sess->resources) {
-                            sess->resources = bres->next;
-                        } else {
-                            for(ires = sess->resources; ires != NULL; ires = ires->next)
-                                if(ires->next == bres)
-                                    break;
-                            assert(ires != NULL);
-                            ires->next = bres->next;
-                        }
-
-                        jid_free(bres->jid);
-                        free(bres);
-
-                        nad_free(nad);
-                        return 0;
-                    }
-
-                    log_debug(ZONE, "weird, got a failed session response, with a matching id, but the action is bogus *shrug*");
-
-                    nad_free(nad);
-                    return 0;
-                }
-
-                /* session started */
-                if(NAD_AVAL_L(nad, action) == 7 && strncmp("started", NAD_AVAL(nad, action), 7) == 0) {
-                    /* handled request */
-                    bres->sm_request[0] = '\0';
-
-                    /* copy the sm id */
-                    if(smid >= 0)
-                        snprintf(bres->sm_id, sizeof(bres->sm_id), "%.*s", NAD_AVAL_L(nad, smid), NAD_AVAL(nad, smid));
-
-                    /* and remember the SM that services us */
-                    from = nad_find_attr(nad, 0, -1, "from", NULL);
-
-
-                    smcomp = malloc(NAD_AVAL_L(nad, from) + 1);
-                    snprintf(smcomp, NAD_AVAL_L(nad, from) + 1, "%.*s", NAD_AVAL_L(nad, from), NAD_AVAL(nad, from));
-                    sess->smcomp = smcomp;
-
-                    nad_free(nad);
-
-                    /* bring them online, old-skool */
-                    if(!sess->sasl_authd && sess->s) {
-                        sx_auth(sess->s, "traditional", jid_full(bres->jid));
-                        return 0;
-                    }
-
-                    if(sess->result) {
-                        /* return the auth result to the client */
-                        if(sess->s) sx_nad_write(sess->s, sess->result);
-                        /* or follow-up the session creation with cached presence packet */
-                        else sm_packet(sess, bres, sess->result);
-                    }
-                    sess->result = NULL;
-
-                    /* we're good to go */
-                    sess->active = 1;
-
-                    return 0;
-                }
-
-                /* handled request */
-                bres->sm_request[0] = '\0';
-
-                log_debug(ZONE, "unknown action %.*s", NAD_AVAL_L(nad, id), NAD_AVAL(nad, id));
-
+            /* only handle unicasts */
+            if(nad_find_attr(nad, 0, -1, "type", NULL) >= 0) {
+                log_debug(ZONE, "non-unicast packet, dropping");
                 nad_free(nad);
-
-                return 0;
-            }
-
-            /* client packets */
-            if(NAD_NURI_L(nad, NAD_ENS(nad, 1)) == strlen(uri_CLIENT) && strncmp(uri_CLIENT, NAD_NURI(nad, NAD_ENS(nad, 1)), strlen(uri_CLIENT)) == 0) {
-                if(!sess->active || !sess->s) {
-                    /* its a strange world .. */
-                    log_debug(ZONE, "Got packet for %s - dropping", !sess->s ? "session without stream (PBX pipe session?)" : "inactive session");
-                    nad_free(nad);
-                    return 0;
-                }
-
-                /* sm is bouncing something */
-                if(nad_find_attr(nad, 1, ns, "failed", NULL) >= 0) {
-                    if(s) {
-                        /* there's really no graceful way to handle this */
-                        sx_error(s, stream_err_INTERNAL_SERVER_ERROR, "session manager failed control action");
-                        sx_close(s);
-                    }
-
-                    nad_free(nad);
-                    return 0;
-                }
-
-                /* we're counting packets */
-                sess->packet_count++;
-                sess->c2s->packet_count++;
-
-                /* remove sm specifics */
-                nad_set_attr(nad, 1, ns, "c2s", NULL, 0);
-                nad_set_attr(nad, 1, ns, "sm", NULL, 0);
-
-                /* forget about the internal namespace too */
-                if(nad->elems[1].ns == ns)
-                    nad->elems[1].ns = nad->nss[ns].next;
-
-                else {
-                    for(scan = nad->elems[1].ns; nad->nss[scan].next != -1 && nad->nss[scan].next != ns; scan = nad->nss[scan].next);
-
-                    /* got it */
-                    if(nad->nss[scan].next != -1)
-                        nad->nss[scan].next = nad->nss[ns].next;
-                }
-
-                sx_nad_write_elem(sess->s, nad, 1);
-
                 return 0;
             }
 
-            /* its something else */
-            log_debug(ZONE, "unknown packet, dropping");
+            _c2s_router_route(nad, (void *) c2s);
 
-            nad_free(nad);
             return 0;
 
         case event_CLOSED:
@@ -34,6 +34,9 @@
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #ifdef _WIN32
   #ifdef _USRDLL
@@ -54,6 +57,10 @@ typedef struct c2s_st       *c2s_t;
 typedef struct bres_st      *bres_t;
 typedef struct sess_st      *sess_t;
 typedef struct authreg_st   *authreg_t;
+typedef struct c2s_worker_st *c2s_worker_t;
+typedef struct ar_req_st    *ar_req_t;
+typedef struct ar_async_st  *ar_async_t;
+typedef struct ar_cache_st  *ar_cache_t;
 
 /** list of resources bound to session */
 struct bres_st {
@@ -74,6 +81,9 @@ struct bres_st {
 struct sess_st {
     c2s_t               c2s;
 
+    /** event loop serving this session */
+    c2s_worker_t        worker;
+
     mio_fd_t            fd;
 
     char                skey[44];
@@ -97,6 +107,10 @@ struct sess_st {
     time_t              last_activity;
     unsigned int        packet_count;
 
+    /** idle timeout / keepalive, and resuming throttled reads */
+    struct twheel_timer_st  activity_timer;
+    struct twheel_timer_st  throttle_timer;
+
     /* count of bound resources */
     int                 bound;
     /* list of bound jids */
@@ -114,6 +128,12 @@ struct sess_st {
 
     /* Per user session authreg private data */
     void                *authreg_private;
+
+    /** authreg requests in flight, the session and its stream wait for them before they're freed */
+    int                 ar_pending;
+
+    /** connection has gone, answers to requests are dropped */
+    int                 closed;
 };
 
 /* allowed mechanisms */
@@ -154,6 +174,66 @@ struct host_st {
     int                 ar_register_password;
 };
 
+/** size of the buffer sasl callback results are handed back in */
+#define C2S_SASL_BUF_LEN    (3072)
+
+/**
+ * An event loop serving client connections. The first one is the main
+ * loop, which also talks to the router; with io.workers set each of
+ * the others runs in its own thread, with its own listeners, and only
+ * ever touches the sessions it has accepted.
+ */
+struct c2s_worker_st {
+    c2s_t               c2s;
+
+    int                 id;
+
+    mio_t               mio;
+
+    /** session timers */
+    twheel_t            timers;
+
+    /** listening sockets */
+    mio_fd_t            server_fd;
+#ifdef HAVE_SSL
+    mio_fd_t            server_ssl_fd;
+#endif
+
+    /** list of sx_t on the way out */
+    jqueue_t            dead;
+
+    /** list of sess on the way out */
+    jqueue_t            dead_sess;
+
+    /** packet counter */
+    long long int       packet_count;
+
+    /** sasl callback results are handed back in here */
+    char                sasl_buf[C2S_SASL_BUF_LEN];
+
+    /** authreg requests made from here that haven't come back */
+    int                 ar_pending;
+
+#ifdef HAVE_PTHREAD
+    pthread_t           thread;
+
+    /** router packets for our sessions, woken up through the pipe */
+    mpscq_t             inbox;
+    int                 wake[2];
+    mio_fd_t            wake_fd;
+
+    /** authreg requests coming back, woken up through their own pipe */
+    mpscq_t             ar_done;
+    int                 ar_wake[2];
+    mio_fd_t            ar_wake_fd;
+
+    volatile int        stop;
+#endif
+};
+
+/** the main loop does its own work, everyone else has to go through it */
+#define c2s_worker_threaded(w) ((w) != (w)->c2s->workers)
+
 struct c2s_st {
     /** our id (hostname) with the router */
     const char          *id;
@@ -167,6 +247,7 @@ struct c2s_st {
     const char          *router_cachain;
     const char          *router_private_key_password;
     const char          *router_ciphers;
+    int                 router_binary;
 
     /** mio context */
     mio_t               mio;
@@ -183,25 +264,21 @@ struct c2s_st {
     sx_t                router;
     mio_fd_t            fd;
 
-    /** listening sockets */
-    mio_fd_t            server_fd;
-#ifdef HAVE_SSL
-    mio_fd_t            server_ssl_fd;
-#endif
-
     /** config */
     config_t            config;
 
     /** logging */
     log_t               log;
 
+    /** replaced log, kept until workers are surely done with it */
+    log_t               log_retired;
+
     /** log data */
     log_type_t          log_type;
     const char          *log_facility;
     const char          *log_ident;
 
-    /** packet counter */
-    long long int       packet_count;
+    /** packet counter file */
     const char          *packet_stats;
 
     /** connect retry */
@@ -251,6 +328,32 @@ struct c2s_st {
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** worker threads */
+    int                 io_workers;
+    c2s_worker_t        workers;
+
+#ifdef HAVE_PTHREAD
+    /** sessions, hosts, sm_avail, conn_rates and stream_redirects */
+    pthread_mutex_t     lock;
+
+    /** authreg modules are not thread safe */
+    pthread_mutex_t     ar_lock;
+
+    /** packets for the router from the workers, woken up through the pipe */
+    mpscq_t             router_queue;
+    int                 router_wake[2];
+    mio_fd_t            router_wake_fd;
+#endif
+
+    /** max fds to take from each poll */
+    int                 io_max_events;
+
+    /** largest read buffer a stream may grow */
+    int                 io_read_buffer_max;
+
+    /** edge triggered polling */
+    int                 io_edge_triggered;
+
     /** enable Stream Compression */
     int                 compression;
 
@@ -259,7 +362,8 @@ struct c2s_st {
     int                 io_check_idle;
     int                 io_check_keepalive;
 
-    time_t              next_check;
+    /** session timers */
+    twheel_t            timers;
 
     /** default auth/reg module */
     const char          *ar_module_name;
@@ -268,6 +372,13 @@ struct c2s_st {
     /** loaded auth/reg modules */
     xht                 ar_modules;
 
+    /** authreg threads, NULL if the modules are called from the loops */
+    int                 ar_threads;
+    ar_async_t          ar_async;
+
+    /** outcomes of recent password checks */
+    ar_cache_t          ar_cache;
+
     /** allowed mechanisms */
     int                 ar_mechanisms;
     int                 ar_ssl_mechanisms;
@@ -277,7 +388,7 @@ struct c2s_st {
     int                 conn_rate_seconds;
     int                 conn_rate_wait;
 
-    xht                 conn_rates;
+    rate_table_t        conn_rates;
 
     /** byte rates (karma) */
     int                 byte_rate_total;
@@ -317,8 +428,34 @@ struct c2s_st {
 
 extern sig_atomic_t c2s_lost_router;
 
+/** shared state locking, only needed once there are workers */
+#ifdef HAVE_PTHREAD
+# define c2s_lock(c2s)      do { if((c2s)->io_workers > 0) pthread_mutex_lock(&(c2s)->lock); } while(0)
+# define c2s_unlock(c2s)    do { if((c2s)->io_workers > 0) pthread_mutex_unlock(&(c2s)->lock); } while(0)
+# define c2s_ar_lock(c2s)   do { if((c2s)->io_workers > 0) pthread_mutex_lock(&(c2s)->ar_lock); } while(0)
+# define c2s_ar_unlock(c2s) do { if((c2s)->io_workers > 0) pthread_mutex_unlock(&(c2s)->ar_lock); } while(0)
+#else
+# define c2s_lock(c2s)
+# define c2s_unlock(c2s)
+# define c2s_ar_lock(c2s)
+# define c2s_ar_unlock(c2s)
+#endif
+
 C2S_API int         c2s_router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
 C2S_API int         c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg);
+C2S_API void        c2s_router_deliver(c2s_worker_t w, nad_t nad);
+C2S_API void        c2s_router_write(c2s_worker_t w, nad_t nad);
+C2S_API void        c2s_sm_offline(c2s_worker_t w, const char *domain);
+
+C2S_API void        c2s_worker_init(c2s_worker_t w, c2s_t c2s, int id);
+C2S_API int         c2s_worker_listen(c2s_worker_t w);
+C2S_API int         c2s_workers_start(c2s_t c2s);
+C2S_API void        c2s_workers_stop(c2s_t c2s);
+C2S_API void        c2s_worker_push(c2s_worker_t w, nad_t nad);
+C2S_API void        c2s_worker_close(c2s_worker_t w);
+C2S_API void        c2s_worker_reap(c2s_worker_t w);
+C2S_API void        c2s_router_flush(c2s_t c2s);
+C2S_API int         c2s_router_wake_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
 
 C2S_API void        sm_start(sess_t sess, bres_t res);
 C2S_API void        sm_end(sess_t sess, bres_t res);
@@ -371,6 +508,13 @@ struct authreg_st
     /** Apple extensions for challenge/response authentication methods */
     int         (*create_challenge)(authreg_t ar, sess_t sess, const char *username, const char *realm, char *challenge, int maxlen);
     int         (*check_response)(authreg_t ar, sess_t sess, const char *username, const char *realm, const char *challenge, const char *response);
+
+    /** module name, set by authreg_init */
+    const char  *name;
+
+    /** modules that can wait on their backend without blocking: start the request and return 0,
+      * then hand it back with authreg_async_done() (from any thread); !0 runs it the usual way */
+    int         (*submit)(authreg_t ar, ar_req_t req);
 };
 
 /** get a handle for a single module */
@@ -385,6 +529,89 @@ typedef int (*ar_module_init_fn)(authreg_t);
 /** the main authreg processor */
 C2S_API int         authreg_process(c2s_t c2s, sess_t sess, nad_t nad);
 
+/* asynchronous requests */
+
+/** calls the authreg threads can make */
+typedef enum {
+    ar_op_USER_EXISTS,
+    ar_op_GET_PASSWORD,
+    ar_op_CHECK_PASSWORD,
+    ar_op_SET_PASSWORD,
+    ar_op_CREATE_USER,
+    ar_op_DELETE_USER,
+    ar_op_CREATE_CHALLENGE,
+    ar_op_CHECK_RESPONSE,
+    ar_op_CALL
+} ar_op_t;
+
+/** completion callback, called in the session's loop (and not at all if the session has gone);
+  * the request is the callback's to send again or free */
+typedef void (*ar_req_fn)(ar_req_t req);
+
+/** a request for the authreg threads */
+struct ar_req_st {
+    ar_op_t     op;             /**< what to do */
+
+    sess_t      sess;           /**< session it's for, its host's module does it */
+
+    char        username[1024]; /**< arguments, as for the module calls */
+    const char  *realm;
+    char        password[257];  /**< password to check or set, or the one found */
+    char        challenge[65];  /**< challenge made, or the one the response is for */
+    char        response[1024];
+    char        resource[1024]; /**< for the caller, the resource an auth is for */
+
+    void        (*call)(authreg_t ar, ar_req_t req);   /**< ar_op_CALL: runs with the thread's module,
+                                                             or in the loop without the authreg lock */
+
+    int         ret;            /**< result of the call */
+
+    ar_req_fn   cb;             /**< completion callback */
+    void        *arg;           /**< argument for the callback */
+    nad_t       nad;            /**< packet being answered, freed with the request */
+    int         state;          /**< the caller's, for requests that go round more than once */
+
+    ar_req_t    next;           /**< next request waiting for a thread */
+};
+
+/** start the threads, each with its own instance of every module; 0 on success */
+C2S_API int         authreg_async_start(c2s_t c2s, int threads);
+/** stop the threads; the loops wait for their requests first, anything left is dropped */
+C2S_API void        authreg_async_stop(c2s_t c2s);
+/** let go of a loop's completion queue, once its loop has stopped */
+C2S_API void        authreg_async_free(c2s_worker_t w);
+/** make a request, with op and arguments to fill in */
+C2S_API ar_req_t    authreg_req_new(sess_t sess, ar_op_t op, ar_req_fn cb, void *arg);
+C2S_API void        authreg_req_free(ar_req_t req);
+/** send a request; without threads it runs (and completes) before this returns */
+C2S_API void        authreg_async(ar_req_t req);
+/** hand back a request a module took through submit() */
+C2S_API void        authreg_async_done(ar_req_t req);
+/** run the callbacks of requests that came back to this loop */
+C2S_API void        authreg_async_run(c2s_worker_t w);
+/** run the loop until every request made from it has come back */
+C2S_API void        authreg_async_wait(c2s_worker_t w);
+/** the request the calling authreg thread is working on, NULL elsewhere */
+C2S_API ar_req_t    authreg_current(void);
+/** the instance of a module the calling thread should use */
+C2S_API authreg_t   authreg_local(authreg_t ar);
+/** take a sasl handshake step off the loop (sx_sasl_cb_STEP) */
+C2S_API int         authreg_sasl_step(sess_t sess, sx_sasl_step_t step);
+
+/* credential cache */
+
+/** room for a bcrypt hash */
+#define AR_CACHE_HASH_LEN   (64)
+
+/** set up the cache, if authreg.cache is configured */
+C2S_API void        authreg_cache_init(c2s_t c2s);
+C2S_API void        authreg_cache_free(c2s_t c2s);
+/** forget the outcomes for a user (any realm if NULL), or for everyone if username is NULL */
+C2S_API void        authreg_cache_flush(c2s_t c2s, const char *username, const char *realm);
+C2S_API void        authreg_cache_stats(c2s_t c2s);
+/** the module's check_password(), through the cache */
+C2S_API int         authreg_check_password(authreg_t ar, sess_t sess, const char *username, const char *realm, const char *password);
+
 /*
 int     authreg_user_exists(authreg_t ar, const char *username, const char *realm);
 int     authreg_get_password(authreg_t ar, const char *username, const char *realm, char password[257]);
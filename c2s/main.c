@@ -79,10 +79,10 @@ static void _c2s_pidfile(c2s_t c2s) {
 /** pull values out of the config file */
 static void _c2s_config_expand(c2s_t c2s)
 {
-    const char *str, *ip, *mask;
+    const char *str, *ip, *mask, *file;
     char *req_domain, *to_address, *to_port;
     config_elem_t elem;
-    int i;
+    int i, n;
     stream_redirect_t sr;
 
     set_debug_log_from_config(c2s->config);
@@ -111,6 +111,8 @@ static void _c2s_config_expand(c2s_t c2s)
     c2s->router_private_key_password = config_get_one(c2s->config, "router.private_key_password", 0);
     c2s->router_ciphers = config_get_one(c2s->config, "router.ciphers", 0);
 
+    c2s->router_binary = (config_get(c2s->config, "router.binary") != NULL);
+
     c2s->retry_init = j_atoi(config_get_one(c2s->config, "router.retry.init", 0), 3);
     c2s->retry_lost = j_atoi(config_get_one(c2s->config, "router.retry.lost", 0), 3);
     if((c2s->retry_sleep = j_atoi(config_get_one(c2s->config, "router.retry.sleep", 0), 2)) < 1)
@@ -159,6 +161,14 @@ static void _c2s_config_expand(c2s_t c2s)
     c2s->websocket = (config_get(c2s->config, "io.websocket") != NULL);
 
     c2s->io_max_fds = j_atoi(config_get_one(c2s->config, "io.max_fds", 0), 1024);
+    c2s->io_max_events = j_atoi(config_get_one(c2s->config, "io.max_events", 0), 0);
+    c2s->io_read_buffer_max = j_atoi(config_get_one(c2s->config, "io.read_buffer_max", 0), 0);
+    nad_cache_max(j_atoi(config_get_one(c2s->config, "io.nad_cache", 0), NAD_CACHE_MAX));
+    jid_cache_max(j_atoi(config_get_one(c2s->config, "io.jid_cache", 0), JID_CACHE_MAX));
+    c2s->io_edge_triggered = (config_get(c2s->config, "io.edge_triggered") != NULL);
+    c2s->io_workers = j_atoi(config_get_one(c2s->config, "io.workers", 0), 0);
+    if(c2s->io_workers < 0)
+        c2s->io_workers = 0;
 
     c2s->compression = (config_get(c2s->config, "io.compression") != NULL);
 
@@ -196,6 +206,7 @@ static void _c2s_config_expand(c2s_t c2s)
     }
 
     c2s->ar_module_name = config_get_one(c2s->config, "authreg.module", 0);
+    c2s->ar_threads = j_atoi(config_get_one(c2s->config, "authreg.threads", 0), 0);
 
     if(config_get(c2s->config, "authreg.mechanisms.traditional.plain") != NULL) c2s->ar_mechanisms |= AR_MECH_TRAD_PLAIN;
     if(config_get(c2s->config, "authreg.mechanisms.traditional.digest") != NULL) c2s->ar_mechanisms |= AR_MECH_TRAD_DIGEST;
@@ -235,6 +246,9 @@ static void _c2s_config_expand(c2s_t c2s)
         {
             c2s->conn_rate_seconds = j_atoi(j_attr((const char **) elem->attrs[0], "seconds"), 5);
             c2s->conn_rate_wait = j_atoi(j_attr((const char **) elem->attrs[0], "throttle"), 5);
+            c2s->conn_rates = rate_table_new(c2s->conn_rate_total, c2s->conn_rate_seconds, c2s->conn_rate_wait,
+                                             j_atoi(j_attr((const char **) elem->attrs[0], "ipv4-prefix"), 32),
+                                             j_atoi(j_attr((const char **) elem->attrs[0], "ipv6-prefix"), 128));
         }
     }
 
@@ -262,13 +276,19 @@ static void _c2s_config_expand(c2s_t c2s)
         {
             ip = j_attr((const char **) elem->attrs[i], "ip");
             mask = j_attr((const char **) elem->attrs[i], "mask");
+            file = j_attr((const char **) elem->attrs[i], "file");
+
+            if(file != NULL) {
+                n = access_load(c2s->access, file, 0);
+                if(n < 0)
+                    log_write(c2s->log, LOG_ERR, "couldn't read access allow list %s, ignoring it", file);
+                else
+                    log_write(c2s->log, LOG_NOTICE, "loaded %d access allow rules from %s", n, file);
+            }
 
             if(ip == NULL)
                 continue;
 
-            if(mask == NULL)
-                mask = "255.255.255.255";
-
             access_allow(c2s->access, ip, mask);
         }
     }
@@ -280,13 +300,19 @@ static void _c2s_config_expand(c2s_t c2s)
         {
             ip = j_attr((const char **) elem->attrs[i], "ip");
             mask = j_attr((const char **) elem->attrs[i], "mask");
+            file = j_attr((const char **) elem->attrs[i], "file");
+
+            if(file != NULL) {
+                n = access_load(c2s->access, file, 1);
+                if(n < 0)
+                    log_write(c2s->log, LOG_ERR, "couldn't read access deny list %s, ignoring it", file);
+                else
+                    log_write(c2s->log, LOG_NOTICE, "loaded %d access deny rules from %s", n, file);
+            }
 
             if(ip == NULL)
                 continue;
 
-            if(mask == NULL)
-                mask = "255.255.255.255";
-
             access_deny(c2s->access, ip, mask);
         }
     }
@@ -410,16 +436,16 @@ static int _c2s_router_connect(c2s_t c2s) {
     }
 
     c2s->router = sx_new(c2s->sx_env, c2s->fd->fd, c2s_router_sx_callback, (void *) c2s);
-    sx_client_init(c2s->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(c2s->router, SX_WRITEV | (c2s->router_binary ? SX_BINARY_OFFER : 0), NULL, NULL, NULL, "1.0");
 
     return 0;
 }
 
-static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cbarg) {
-    c2s_t c2s = (c2s_t) cbarg;
+static int _c2s_sx_sasl_cb(int cb, void *arg, void **res, sx_t s, c2s_t c2s) {
     const char *my_realm, *mech;
     sx_sasl_creds_t creds;
-    static char buf[3072];
+    char *buf;
+    int buflen;
     char mechbuf[256];
     struct jid_st jid;
     jid_static_buf jid_buf;
@@ -427,6 +453,8 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
     sess_t sess;
     char skey[44];
     host_t host;
+    ar_req_t req;
+    authreg_t ar;
 
     /* init static jid */
     jid_static(&jid,&jid_buf);
@@ -435,11 +463,29 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
     assert(s != NULL);
     sprintf(skey, "%d", s->tag);
 
-    /*
-     * Retrieve the session, note that depending on the operation,
-     * session may be null.
-     */
-    sess = xhash_get(c2s->sessions, skey);
+    /* steps run by an authreg thread bring their session, and somewhere for results */
+    if((req = authreg_current()) != NULL) {
+        sess = req->sess;
+        buf = req->response;
+        buflen = sizeof(req->response);
+    }
+
+    else {
+        /*
+         * Retrieve the session, note that depending on the operation,
+         * session may be null.
+         */
+        c2s_lock(c2s);
+        sess = xhash_get(c2s->sessions, skey);
+        c2s_unlock(c2s);
+
+        /* results are handed back in a buffer of the calling loop */
+        buf = (sess != NULL ? sess->worker : c2s->workers)->sasl_buf;
+        buflen = C2S_SASL_BUF_LEN;
+    }
+
+    /* and the module instance belonging to the calling thread */
+    ar = (sess != NULL && sess->host != NULL) ? authreg_local(sess->host->ar) : NULL;
 
     switch(cb) {
         case sx_sasl_cb_GET_REALM:
@@ -449,7 +495,13 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
             else {
                 /* get host for request */
-                host = xhash_get(c2s->hosts, s->req_to);
+                if(req != NULL)
+                    host = sess->host;
+                else {
+                    c2s_lock(c2s);
+                    host = xhash_get(c2s->hosts, s->req_to);
+                    c2s_unlock(c2s);
+                }
                 if(host == NULL) {
                     log_write(c2s->log, LOG_ERR, "SASL callback for non-existing host: %s", s->req_to);
                     *res = (void *)NULL;
@@ -474,8 +526,8 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
             log_debug(ZONE, "sx sasl callback: get pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
-            if(sess->host->ar->get_password && (sess->host->ar->get_password)(
-                        sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm: "", buf) == 0) {
+            if(ar->get_password && (ar->get_password)(
+                        ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm: "", buf) == 0) {
                 *res = buf;
                 return sx_sasl_ret_OK;
             }
@@ -488,16 +540,16 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
             log_debug(ZONE, "sx sasl callback: check pass (authnid=%s, realm=%s)", creds->authnid, creds->realm);
 
-            if(sess->host->ar->check_password != NULL) {
-                if ((sess->host->ar->check_password)(
-                            sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm : "", (char *)creds->pass) == 0)
+            if(ar->check_password != NULL) {
+                if (authreg_check_password(
+                            ar, sess, creds->authnid, (creds->realm != NULL) ? creds->realm : "", creds->pass) == 0)
                     return sx_sasl_ret_OK;
                 else
                     return sx_sasl_ret_FAIL;
             }
 
-            if(sess->host->ar->get_password != NULL) {
-                if ((sess->host->ar->get_password)(sess->host->ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm : "", buf) != 0)
+            if(ar->get_password != NULL) {
+                if ((ar->get_password)(ar, sess, (char *)creds->authnid, (creds->realm != NULL) ? (char *)creds->realm : "", buf) != 0)
                     return sx_sasl_ret_FAIL;
 
                 if (strcmp(creds->pass, buf)==0)
@@ -528,12 +580,12 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
                 return sx_sasl_ret_FAIL;
 
             /* and user has right to authorize as */
-            if (sess->host->ar->user_authz_allowed) {
-                if (sess->host->ar->user_authz_allowed(sess->host->ar, sess, (char *)creds->authnid, (char *)creds->realm, (char *)creds->authzid))
+            if (ar->user_authz_allowed) {
+                if (ar->user_authz_allowed(ar, sess, (char *)creds->authnid, (char *)creds->realm, (char *)creds->authzid))
                         return sx_sasl_ret_OK;
             } else {
                 if (strcmp(creds->authnid, jid.node) == 0 &&
-                    (sess->host->ar->user_exists)(sess->host->ar, sess, jid.node, jid.domain))
+                    (ar->user_exists)(ar, sess, jid.node, jid.domain))
                     return sx_sasl_ret_OK;
             }
 
@@ -564,7 +616,13 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
             mechbuf[i]='\0';
 
             /* get host for request */
-            host = xhash_get(c2s->hosts, s->req_to);
+            if(req != NULL)
+                host = sess->host;
+            else {
+                c2s_lock(c2s);
+                host = xhash_get(c2s->hosts, s->req_to);
+                c2s_unlock(c2s);
+            }
             if(host == NULL) {
                 log_write(c2s->log, LOG_WARNING, "SASL callback for non-existing host: %s", s->req_to);
                 return sx_sasl_ret_FAIL;
@@ -587,15 +645,15 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
              * we've finished mechanism establishment
              */
             if (s->ssf>0) {
-                r = snprintf(buf, sizeof(buf), "authreg.ssl-mechanisms.sasl.%s",mechbuf);
-                if (r < -1 || r > sizeof(buf))
+                r = snprintf(buf, buflen, "authreg.ssl-mechanisms.sasl.%s",mechbuf);
+                if (r < -1 || r > buflen)
                     return sx_sasl_ret_FAIL;
                 if(config_get(c2s->config,buf) != NULL)
                     return sx_sasl_ret_OK;
             }
 
-            r = snprintf(buf, sizeof(buf), "authreg.mechanisms.sasl.%s",mechbuf);
-            if (r < -1 || r > sizeof(buf))
+            r = snprintf(buf, buflen, "authreg.mechanisms.sasl.%s",mechbuf);
+            if (r < -1 || r > buflen)
                 return sx_sasl_ret_FAIL;
 
             /* Work out if our configuration will let us use this mechanism */
@@ -603,47 +661,35 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
                 return sx_sasl_ret_OK;
             else
                 return sx_sasl_ret_FAIL;
+
+        case sx_sasl_cb_STEP:
+            /* the handshake goes on without us once the session has gone */
+            if(sess == NULL)
+                return sx_sasl_ret_FAIL;
+
+            return authreg_sasl_step(sess, (sx_sasl_step_t) arg);
+
         default:
             break;
     }
 
     return sx_sasl_ret_FAIL;
 }
-static void _c2s_time_checks(c2s_t c2s) {
-    sess_t sess;
-    time_t now;
-    union xhashv xhv;
-
-    now = time(NULL);
-
-    if(xhash_iter_first(c2s->sessions))
-        do {
-            xhv.sess_val = &sess;
-            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
-
-            if(c2s->io_check_idle > 0 && sess->s && now > sess->last_activity + c2s->io_check_idle) {
-                log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
-
-                sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
-                sx_close(sess->s);
-
-                continue;
-            }
 
-            if(c2s->io_check_keepalive > 0 && now > sess->last_activity + c2s->io_check_keepalive && sess->s->state >= state_STREAM) {
-                log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
+static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cbarg) {
+    c2s_t c2s = (c2s_t) cbarg;
+    int ret;
 
-                sx_raw_write(sess->s, " ", 1);
-            }
+    /* authreg threads have modules of their own */
+    if(authreg_current() != NULL)
+        return _c2s_sx_sasl_cb(cb, arg, res, s, c2s);
 
-            if(sess->rate != NULL && sess->rate->bad != 0 && rate_check(sess->rate) != 0) {
-                /* read the pending bytes when rate limit is no longer in effect */
-                log_debug(ZONE, "reading throttled %d", sess->fd->fd);
-                sess->s->want_read = 1;
-                sx_can_read(sess->s);
-            }
+    /* the authreg modules are not thread safe */
+    c2s_ar_lock(c2s);
+    ret = _c2s_sx_sasl_cb(cb, arg, res, s, c2s);
+    c2s_ar_unlock(c2s);
 
-        } while(xhash_iter_next(c2s->sessions));
+    return ret;
 }
 
 static void _c2s_ar_free(const char *module, int modulelen, void *val, void *arg) {
@@ -657,9 +703,8 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     char *config_file;
     int optchar;
     int mio_timeout;
-    sess_t sess;
-    bres_t res;
-    union xhashv xhv;
+    int i;
+    long long int packet_count;
     time_t check_time = 0;
     const char *cli_id = 0;
 
@@ -768,11 +813,18 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     c2s->log = log_new(c2s->log_type, c2s->log_ident, c2s->log_facility);
     log_write(c2s->log, LOG_NOTICE, "starting up");
 
+#ifndef HAVE_PTHREAD
+    if(c2s->io_workers > 0) {
+        log_write(c2s->log, LOG_WARNING, "built without thread support, ignoring io.workers");
+        c2s->io_workers = 0;
+    }
+#endif
+
     _c2s_pidfile(c2s);
 
     c2s->sessions = xhash_new(1023);
 
-    c2s->conn_rates = xhash_new(101);
+    c2s->timers = twheel_new(100);
 
     c2s->dead = jqueue_new();
 
@@ -820,6 +872,10 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     /* get stanza ack up */
     sx_env_plugin(c2s->sx_env, sx_ack_init);
 
+    /* binary frames to the router, if it'll have them */
+    if(c2s->router_binary)
+        sx_env_plugin(c2s->sx_env, sx_binary_init);
+
     /* and user IP address plugin */
     sx_env_plugin(c2s->sx_env, address_init);
 
@@ -833,7 +889,7 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     /* get bind up */
     sx_env_plugin(c2s->sx_env, bind_init, c2s);
 
-    c2s->mio = mio_new(c2s->io_max_fds);
+    c2s->mio = mio_new_ex(c2s->io_max_fds, c2s->io_max_events, (c2s->io_edge_triggered ? MIO_EDGE_TRIGGERED : 0) | (c2s->io_workers > 0 ? MIO_REUSEPORT : 0));
     if(c2s->mio == NULL) {
         log_write(c2s->log, LOG_ERR, "failed to create MIO, aborting");
         exit(1);
@@ -844,20 +900,65 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     _c2s_hosts_expand(c2s);
     c2s->sm_avail = xhash_new(1021);
 
+    /* the main loop serves clients too, the workers get their own */
+    c2s->workers = (c2s_worker_t) calloc(c2s->io_workers + 1, sizeof(struct c2s_worker_st));
+    c2s->workers[0].c2s = c2s;
+    c2s->workers[0].mio = c2s->mio;
+    c2s->workers[0].timers = c2s->timers;
+    c2s->workers[0].dead = c2s->dead;
+    c2s->workers[0].dead_sess = c2s->dead_sess;
+
+#ifdef HAVE_PTHREAD
+    if(c2s->io_workers > 0) {
+        pthread_mutex_init(&c2s->lock, NULL);
+        pthread_mutex_init(&c2s->ar_lock, NULL);
+
+        c2s->router_queue = mpscq_new();
+        if(pipe(c2s->router_wake) != 0) {
+            log_write(c2s->log, LOG_ERR, "failed to create worker pipe: %s, aborting", strerror(errno));
+            exit(1);
+        }
+        c2s->router_wake_fd = mio_register(c2s->mio, c2s->router_wake[0], c2s_router_wake_mio_callback, (void *) c2s);
+        mio_read(c2s->mio, c2s->router_wake_fd);
+
+        for(i = 1; i <= c2s->io_workers; i++)
+            c2s_worker_init(&c2s->workers[i], c2s, i);
+
+        log_write(c2s->log, LOG_NOTICE, "serving clients from %d worker threads and the main loop", c2s->io_workers);
+    }
+#endif
+
+    authreg_cache_init(c2s);
+
+    /* auth backends get their own threads, so the loops don't wait on them */
+    if(authreg_async_start(c2s, c2s->ar_threads) != 0) {
+        log_write(c2s->log, LOG_ERR, "failed to start authreg threads, aborting");
+        exit(1);
+    }
+
     c2s->retry_left = c2s->retry_init;
     _c2s_router_connect(c2s);
 
-    mio_timeout = ((c2s->io_check_interval != 0 && c2s->io_check_interval < 5) ?
-        c2s->io_check_interval : 5);
-
     while(!c2s_shutdown) {
+        /* sleep until the next session timer is due, but no more than 5 seconds */
+        mio_timeout = twheel_timeout(c2s->timers, 5000);
+
         mio_run(c2s->mio, mio_timeout);
 
+        /* idle timeouts, keepalives and throttled reads */
+        twheel_run(c2s->timers);
+
         if(c2s_logrotate) {
             set_debug_log_from_config(c2s->config);
 
             log_write(c2s->log, LOG_NOTICE, "reopening log ...");
-            log_free(c2s->log);
+            /* workers may still be writing to the old one, it goes on the next rotation */
+            if(c2s->log_retired != NULL)
+                log_free(c2s->log_retired);
+            if(c2s->io_workers > 0)
+                c2s->log_retired = c2s->log;
+            else
+                log_free(c2s->log);
             c2s->log = log_new(c2s->log_type, c2s->log_ident, c2s->log_facility);
             log_write(c2s->log, LOG_NOTICE, "log started");
 
@@ -869,8 +970,7 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
             config_t conf;
             conf = config_new();
             if (conf && config_load(conf, config_file) == 0) {
-                xhash_free(c2s->stream_redirects);
-                c2s->stream_redirects = xhash_new(11);
+                xht stream_redirects = xhash_new(11);
 
                 char *req_domain, *to_address, *to_port;
                 config_elem_t elem;
@@ -882,7 +982,7 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
                 {
                     for(i = 0; i < elem->nvalues; i++)
                     {
-                        sr = (stream_redirect_t) pmalloco(xhash_pool(c2s->stream_redirects), sizeof(struct stream_redirect_st));
+                        sr = (stream_redirect_t) pmalloco(xhash_pool(stream_redirects), sizeof(struct stream_redirect_st));
                         if(!sr) {
                             log_write(c2s->log, LOG_ERR, "cannot allocate memory for new stream redirection record, aborting");
                             exit(1);
@@ -897,17 +997,28 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
                         }
 
                         // Note that to_address should be RFC 3986 compliant
-                        sr->to_address = to_address;
-                        sr->to_port = to_port;
+                        sr->to_address = pstrdup(xhash_pool(stream_redirects), to_address);
+                        sr->to_port = pstrdup(xhash_pool(stream_redirects), to_port);
 
-                        xhash_put(c2s->stream_redirects, pstrdup(xhash_pool(c2s->stream_redirects), req_domain), sr);
+                        xhash_put(stream_redirects, pstrdup(xhash_pool(stream_redirects), req_domain), sr);
                     }
                 }
                 config_free(conf);
+
+                /* workers look these up on stream open */
+                c2s_lock(c2s);
+                xhash_free(c2s->stream_redirects);
+                c2s->stream_redirects = stream_redirects;
+                c2s_unlock(c2s);
             } else {
                 log_write(c2s->log, LOG_WARNING, "couldn't reload config (%s)", config_file);
                 if (conf) config_free(conf);
             }
+
+            /* passwords may have changed behind our back */
+            authreg_cache_stats(c2s);
+            authreg_cache_flush(c2s, NULL, NULL);
+
             c2s_sighup = 0;
         }
 
@@ -934,40 +1045,11 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
             }
         }
 
-        /* cleanup dead sess (before sx_t as sess->result uses sx_t nad cache) */
-        while(jqueue_size(c2s->dead_sess) > 0) {
-            sess = (sess_t) jqueue_pull(c2s->dead_sess);
-
-            /* free sess data */
-            if(sess->ip != NULL) free((void*)sess->ip);
-            if(sess->smcomp != NULL) free((void*)sess->smcomp);
-            if(sess->result != NULL) nad_free(sess->result);
-            if(sess->resources != NULL)
-                for(res = sess->resources; res != NULL;) {
-                    bres_t tmp = res->next;
-                    jid_free(res->jid);
-                    free(res);
-                    res = tmp;
-                }
-            if(sess->rate != NULL) rate_free(sess->rate);
-            if(sess->stanza_rate != NULL) rate_free(sess->stanza_rate);
-
-            free(sess);
-        }
-
-        /* cleanup dead sx_ts */
-        while(jqueue_size(c2s->dead) > 0)
-            sx_free((sx_t) jqueue_pull(c2s->dead));
+        /* packets the workers have for the router */
+        c2s_router_flush(c2s);
 
-        /* time checks */
-        if(c2s->io_check_interval > 0 && time(NULL) >= c2s->next_check) {
-            log_debug(ZONE, "running time checks");
-
-            _c2s_time_checks(c2s);
-
-            c2s->next_check = time(NULL) + c2s->io_check_interval;
-            log_debug(ZONE, "next time check at %d", c2s->next_check);
-        }
+        /* cleanup dead sess and sx_ts */
+        c2s_worker_reap(c2s->workers);
 
         if(time(NULL) > check_time + 60) {
 #ifdef POOL_DEBUG
@@ -977,7 +1059,11 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
                 int fd = open(c2s->packet_stats, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP);
                 if (fd >= 0) {
                     char buf[100];
-                    int len = snprintf(buf, 100, "%lld\n", c2s->packet_count);
+                    int len;
+                    /* a slightly stale count from the workers is fine here */
+                    for(packet_count = 0, i = 0; i <= c2s->io_workers; i++)
+                        packet_count += __atomic_load_n(&c2s->workers[i].packet_count, __ATOMIC_RELAXED);
+                    len = snprintf(buf, 100, "%lld\n", packet_count);
                     if (write(fd, buf, len) != len) {
                         close(fd);
                         fd = -1;
@@ -995,36 +1081,32 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     log_write(c2s->log, LOG_NOTICE, "shutting down");
 
-    if(xhash_iter_first(c2s->sessions))
-        do {
-            xhv.sess_val = &sess;
-            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
-
-            if(sess->active && sess->s)
-                sx_close(sess->s);
-
-        } while(xhash_iter_next(c2s->sessions));
-
-    /* cleanup dead sess */
-    while(jqueue_size(c2s->dead_sess) > 0) {
-        sess = (sess_t) jqueue_pull(c2s->dead_sess);
-
-        /* free sess data */
-        if(sess->ip != NULL) free((void*)sess->ip);
-        if(sess->result != NULL) nad_free(sess->result);
-        if(sess->resources != NULL)
-            for(res = sess->resources; res != NULL;) {
-                bres_t tmp = res->next;
-                jid_free(res->jid);
-                free(res);
-                res = tmp;
-            }
+    /* workers close their sessions on the way out */
+    c2s_workers_stop(c2s);
 
-        free(sess);
-    }
+    nad_cache_log(c2s->log);
+    jid_cache_log(c2s->log);
 
-    while(jqueue_size(c2s->dead) > 0)
-        sx_free((sx_t) jqueue_pull(c2s->dead));
+    c2s_worker_close(c2s->workers);
+    authreg_async_wait(c2s->workers);
+    c2s_worker_reap(c2s->workers);
+
+    authreg_async_stop(c2s);
+    authreg_async_free(c2s->workers);
+
+    authreg_cache_stats(c2s);
+    authreg_cache_free(c2s);
+
+    /* last words from the workers */
+    c2s_router_flush(c2s);
+
+#ifdef HAVE_PTHREAD
+    if(c2s->io_workers > 0) {
+        mio_close(c2s->mio, c2s->router_wake_fd);
+        close(c2s->router_wake[1]);
+        mpscq_free(c2s->router_queue);
+    }
+#endif
 
     if (c2s->fd != NULL) mio_close(c2s->mio, c2s->fd);
     sx_free(c2s->router);
@@ -1035,10 +1117,13 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     xhash_free(c2s->sessions);
 
+    twheel_free(c2s->timers);
+
     xhash_walk(c2s->ar_modules, _c2s_ar_free, NULL);
     xhash_free(c2s->ar_modules);
 
-    xhash_free(c2s->conn_rates);
+    if(c2s->conn_rates != NULL)
+        rate_table_free(c2s->conn_rates);
 
     xhash_free(c2s->stream_redirects);
 
@@ -1052,6 +1137,16 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     access_free(c2s->access);
 
+#ifdef HAVE_PTHREAD
+    if(c2s->io_workers > 0) {
+        pthread_mutex_destroy(&c2s->lock);
+        pthread_mutex_destroy(&c2s->ar_lock);
+    }
+#endif
+    free(c2s->workers);
+
+    if(c2s->log_retired != NULL)
+        log_free(c2s->log_retired);
     log_free(c2s->log);
 
     config_free(c2s->config);
@@ -30,6 +30,7 @@
  * START jid/resource [[priority ]status] [description]  - opens PBX resource session
  * STOP jid/resource [description]                       - closes PBX resource session
  * STATUS                                                - dumps list of currently open PBX sessions
+ * AUTHFLUSH [username[@realm]]                         - drops cached credentials, everyone's if no username
  *
  * [status] in: CHAT, ONLINE, DND, AWAY, XA
  */
@@ -143,7 +144,9 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 				if(*cmd != '\0') cmd++;
 
 				shahash_r(jid_full(jid), sesshash);
+				c2s_lock(c2s);
 				sess = xhash_get(c2s->sessions, hashbuf);
+				c2s_unlock(c2s);
 
 				switch(action) {
 					case 1:
@@ -153,10 +156,13 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 						/* create new session */
 							sess = (sess_t) calloc(1, sizeof(struct sess_st));
 							sess->c2s = c2s;
+							sess->worker = c2s->workers;
 							sess->last_activity = time(NULL);
 							/* put into sessions hash */
 							snprintf(sess->skey, sizeof(sess->skey), "%s", hashbuf);
+							c2s_lock(c2s);
 							xhash_put(c2s->sessions, sess->skey, (void *) sess);
+							c2s_unlock(c2s);
 							/* generate bound resource */
 							sess->resources = (bres_t) calloc(1, sizeof(struct bres_st));
 							snprintf(sess->resources->c2s_id, sizeof(sess->resources->c2s_id), "%s", hashbuf);
@@ -184,8 +190,10 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 							sm_packet(sess, sess->resources, _pbx_presence_nad(0, cmd));
 							/* end the session */
 							sm_end(sess, sess->resources);
+							c2s_lock(c2s);
 							xhash_zap(c2s->sessions, sess->skey);
-							jqueue_push(c2s->dead_sess, (void *) sess, 0);
+							c2s_unlock(c2s);
+							jqueue_push(c2s->workers[0].dead_sess, (void *) sess, 0);
 						}
 
 						break;
@@ -198,6 +206,28 @@ int _pbx_process_command(c2s_t c2s, const char *cmd)
 		/* TODO: generate "ERR" response, return 0 */
 		return -1;
 	}
+	if(!strncasecmp("AUTHFLUSH", cmd, 9)) {
+		char user[1024], *realm;
+
+		cmd += 9;
+		while(*cmd == ' ' || *cmd == '\t') cmd++;
+
+		len = _pbx_command_part_len(cmd);
+		if(len == 0) {
+			authreg_cache_flush(c2s, NULL, NULL);
+			return -1;
+		}
+
+		snprintf(user, sizeof(user), "%.*s", len, cmd);
+		/* sasl usernames may have an @ in them, the realm comes after the last one */
+		realm = strrchr(user, '@');
+		if(realm != NULL)
+			*realm++ = '\0';
+
+		log_debug(ZONE, "AUTHFLUSH for %s@%s", user, realm != NULL ? realm : "*");
+		authreg_cache_flush(c2s, user, realm);
+		return -1;
+	}
 	if(!strncasecmp("STATUS", cmd, 6)) {
 		log_write(c2s->log, LOG_INFO, "STATUS PBX command not implemented yet");
 		return -1;
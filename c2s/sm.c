@@ -66,21 +66,21 @@ static nad_t _sm_build_route(sess_t sess, bres_t res, const char *action, const
 void sm_start(sess_t sess, bres_t res) {
     _sm_generate_id(sess, res, "start");
 
-    sx_nad_write(sess->c2s->router, _sm_build_route(sess, res, "start", jid_full(res->jid), res->sm_request));
+    c2s_router_write(sess->worker, _sm_build_route(sess, res, "start", jid_full(res->jid), res->sm_request));
 }
 
 void sm_end(sess_t sess, bres_t res) {
-    sx_nad_write(sess->c2s->router, _sm_build_route(sess, res, "end", NULL, NULL));
+    c2s_router_write(sess->worker, _sm_build_route(sess, res, "end", NULL, NULL));
 }
 
 void sm_create(sess_t sess, bres_t res) {
     _sm_generate_id(sess, res, "create");
 
-    sx_nad_write(sess->c2s->router, _sm_build_route(sess, res, "create", jid_user(res->jid), res->sm_request));
+    c2s_router_write(sess->worker, _sm_build_route(sess, res, "create", jid_user(res->jid), res->sm_request));
 }
 
 void sm_delete(sess_t sess, bres_t res) {
-    sx_nad_write(sess->c2s->router, _sm_build_route(sess, res, "delete", jid_user(res->jid), NULL));
+    c2s_router_write(sess->worker, _sm_build_route(sess, res, "delete", jid_user(res->jid), NULL));
 }
 
 void sm_packet(sess_t sess, bres_t res, nad_t nad) {
@@ -98,5 +98,5 @@ void sm_packet(sess_t sess, bres_t res, nad_t nad) {
     if(res->c2s_id[0] != '\0')
         nad_set_attr(nad, 1, ns, "sm", res->sm_id, 0);
 
-    sx_nad_write(sess->c2s->router, nad);
+    c2s_router_write(sess->worker, nad);
 }
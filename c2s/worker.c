@@ -0,0 +1,317 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+#include "c2s.h"
+
+#ifdef HAVE_SIGNAL_H
+# include <signal.h>
+#endif
+
+/** @file c2s/worker.c
+  * @brief client event loops
+  *
+  * Every loop owns the sessions it accepted: their sx, their mio fd and
+  * their timers are only ever touched from its thread. The main loop
+  * (workers[0]) also owns the router connection; packets cross between
+  * them through lock-free queues, and a byte down a pipe wakes up the
+  * other side when a queue goes from empty to non-empty.
+  */
+
+/** free sessions and streams that went away (sessions first, sess->result uses the sx_t nad cache) */
+void c2s_worker_reap(c2s_worker_t w) {
+    sess_t sess;
+    bres_t res;
+    int n;
+
+    for(n = jqueue_size(w->dead_sess); n > 0; n--) {
+        sess = (sess_t) jqueue_pull(w->dead_sess);
+
+        /* authreg threads are still working for it, try again next time round */
+        if(sess->ar_pending > 0) {
+            jqueue_push(w->dead_sess, (void *) sess, 0);
+            continue;
+        }
+
+        if(sess->s != NULL)
+            jqueue_push(w->dead, (void *) sess->s, 0);
+
+        /* free sess data */
+        if(sess->ip != NULL) free((void*)sess->ip);
+        if(sess->smcomp != NULL) free((void*)sess->smcomp);
+        if(sess->result != NULL) nad_free(sess->result);
+        if(sess->resources != NULL)
+            for(res = sess->resources; res != NULL;) {
+                bres_t tmp = res->next;
+                jid_free(res->jid);
+                free(res);
+                res = tmp;
+            }
+        if(sess->rate != NULL) rate_free(sess->rate);
+        if(sess->stanza_rate != NULL) rate_free(sess->stanza_rate);
+
+        free(sess);
+    }
+
+    while(jqueue_size(w->dead) > 0)
+        sx_free((sx_t) jqueue_pull(w->dead));
+}
+
+/** close the active sessions this loop serves */
+void c2s_worker_close(c2s_worker_t w) {
+    c2s_t c2s = w->c2s;
+    sess_t sess;
+    union xhashv xhv;
+    jqueue_t closing;
+
+    /* collect them first, closing takes the lock again */
+    closing = jqueue_new();
+
+    c2s_lock(c2s);
+    if(xhash_iter_first(c2s->sessions))
+        do {
+            xhv.sess_val = &sess;
+            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
+
+            if(sess->worker == w && sess->active && sess->s)
+                jqueue_push(closing, (void *) sess->s, 0);
+
+        } while(xhash_iter_next(c2s->sessions));
+    c2s_unlock(c2s);
+
+    while(jqueue_size(closing) > 0)
+        sx_close((sx_t) jqueue_pull(closing));
+
+    jqueue_free(closing);
+}
+
+#ifdef HAVE_PTHREAD
+static void _c2s_worker_wake(int fd) {
+    char c = 0;
+
+    while(write(fd, &c, 1) < 0 && errno == EINTR);
+}
+
+static void _c2s_worker_drain(int fd) {
+    char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+/** router packets for one of our sessions, or an sm that went away */
+static int _c2s_worker_wake_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    c2s_worker_t w = (c2s_worker_t) arg;
+    nad_t nad;
+    int attr;
+    char from[1024];
+
+    switch(a) {
+        case action_READ:
+            _c2s_worker_drain(fd->fd);
+
+            mpscq_woken(w->inbox);
+            while((nad = (nad_t) mpscq_pull(w->inbox)) != NULL) {
+                if(NAD_ENAME_L(nad, 0) == 8 && strncmp("presence", NAD_ENAME(nad, 0), 8) == 0) {
+                    if((attr = nad_find_attr(nad, 0, -1, "from", NULL)) >= 0 && NAD_AVAL_L(nad, attr) < sizeof(from)) {
+                        snprintf(from, sizeof(from), "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+                        c2s_sm_offline(w, from);
+                    }
+                    nad_free(nad);
+                    continue;
+                }
+
+                c2s_router_deliver(w, nad);
+            }
+
+            return 1;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+static void *_c2s_worker_run(void *arg) {
+    c2s_worker_t w = (c2s_worker_t) arg;
+
+    log_debug(ZONE, "worker %d running", w->id);
+
+    while(!w->stop) {
+        /* sleep until the next session timer is due, but no more than 5 seconds */
+        mio_run(w->mio, twheel_timeout(w->timers, 5000));
+
+        /* idle timeouts, keepalives and throttled reads */
+        twheel_run(w->timers);
+
+        c2s_worker_reap(w);
+    }
+
+    log_debug(ZONE, "worker %d stopping", w->id);
+
+    c2s_worker_close(w);
+    authreg_async_wait(w);
+    c2s_worker_reap(w);
+
+    return NULL;
+}
+#endif
+
+void c2s_worker_init(c2s_worker_t w, c2s_t c2s, int id) {
+    w->c2s = c2s;
+    w->id = id;
+
+    /* everyone listens on the same ports, the kernel spreads the connections */
+    w->mio = mio_new_ex(c2s->io_max_fds, c2s->io_max_events, MIO_REUSEPORT | (c2s->io_edge_triggered ? MIO_EDGE_TRIGGERED : 0));
+    if(w->mio == NULL) {
+        log_write(c2s->log, LOG_ERR, "failed to create MIO for worker %d, aborting", id);
+        exit(1);
+    }
+
+    w->timers = twheel_new(100);
+
+    w->dead = jqueue_new();
+    w->dead_sess = jqueue_new();
+
+#ifdef HAVE_PTHREAD
+    w->inbox = mpscq_new();
+
+    if(pipe(w->wake) != 0) {
+        log_write(c2s->log, LOG_ERR, "failed to create pipe for worker %d: %s, aborting", id, strerror(errno));
+        exit(1);
+    }
+
+    w->wake_fd = mio_register(w->mio, w->wake[0], _c2s_worker_wake_mio_callback, (void *) w);
+    mio_read(w->mio, w->wake_fd);
+#endif
+}
+
+int c2s_workers_start(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    sigset_t all, old;
+    int i, ret = 0;
+
+    if(c2s->io_workers == 0)
+        return 0;
+
+    /* signals are for the main loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for(i = 1; i <= c2s->io_workers && ret == 0; i++)
+        if((ret = pthread_create(&c2s->workers[i].thread, NULL, _c2s_worker_run, (void *) &c2s->workers[i])) != 0) {
+            log_write(c2s->log, LOG_ERR, "failed to start worker %d: %s", i, strerror(ret));
+            c2s->io_workers = i - 1;
+        }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+void c2s_workers_stop(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    c2s_worker_t w;
+    nad_t nad;
+    int i;
+
+    for(i = 1; i <= c2s->io_workers; i++) {
+        c2s->workers[i].stop = 1;
+        _c2s_worker_wake(c2s->workers[i].wake[1]);
+    }
+
+    for(i = 1; i <= c2s->io_workers; i++) {
+        w = &c2s->workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        mio_close(w->mio, w->wake_fd);
+        close(w->wake[1]);
+
+        while((nad = (nad_t) mpscq_pull(w->inbox)) != NULL)
+            nad_free(nad);
+        mpscq_free(w->inbox);
+
+        authreg_async_free(w);
+
+        twheel_free(w->timers);
+        jqueue_free(w->dead);
+        jqueue_free(w->dead_sess);
+        mio_free(w->mio);
+    }
+#endif
+}
+
+void c2s_worker_push(c2s_worker_t w, nad_t nad) {
+#ifdef HAVE_PTHREAD
+    if(mpscq_push(w->inbox, (void *) nad))
+        _c2s_worker_wake(w->wake[1]);
+#else
+    c2s_router_deliver(w, nad);
+#endif
+}
+
+void c2s_router_write(c2s_worker_t w, nad_t nad) {
+    c2s_t c2s = w->c2s;
+
+#ifdef HAVE_PTHREAD
+    /* only the main loop may write to the router */
+    if(c2s_worker_threaded(w)) {
+        if(mpscq_push(c2s->router_queue, (void *) nad))
+            _c2s_worker_wake(c2s->router_wake[1]);
+        return;
+    }
+#endif
+
+    sx_nad_write(c2s->router, nad);
+}
+
+void c2s_router_flush(c2s_t c2s) {
+#ifdef HAVE_PTHREAD
+    nad_t nad;
+
+    if(c2s->io_workers == 0)
+        return;
+
+    mpscq_woken(c2s->router_queue);
+    while((nad = (nad_t) mpscq_pull(c2s->router_queue)) != NULL)
+        sx_nad_write(c2s->router, nad);
+#endif
+}
+
+int c2s_router_wake_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+#ifdef HAVE_PTHREAD
+    c2s_t c2s = (c2s_t) arg;
+
+    switch(a) {
+        case action_READ:
+            _c2s_worker_drain(fd->fd);
+            c2s_router_flush(c2s);
+            return 1;
+
+        default:
+            break;
+    }
+#endif
+
+    return 0;
+}
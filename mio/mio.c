@@ -29,38 +29,43 @@
 
 #include "mio.h"
 
-mio_t mio_kqueue_new(int maxfd);
-mio_t mio_epoll_new(int maxfd);
-mio_t mio_poll_new(int maxfd);
-mio_t mio_select_new(int maxfd);
-mio_t mio_wsasync_new(int maxfd);
+mio_t mio_kqueue_new(int maxfd, int maxevents, int flags);
+mio_t mio_epoll_new(int maxfd, int maxevents, int flags);
+mio_t mio_poll_new(int maxfd, int maxevents, int flags);
+mio_t mio_select_new(int maxfd, int maxevents, int flags);
+mio_t mio_wsasync_new(int maxfd, int maxevents, int flags);
 
 mio_t mio_new(int maxfd)
+{
+  return mio_new_ex(maxfd, 0, 0);
+}
+
+mio_t mio_new_ex(int maxfd, int maxevents, int flags)
 {
   mio_t m = NULL;
 
 #ifdef MIO_KQUEUE
-  m = mio_kqueue_new(maxfd);
+  m = mio_kqueue_new(maxfd, maxevents, flags);
   if (m != NULL) return m;
 #endif
 
 #ifdef MIO_EPOLL
-  m = mio_epoll_new(maxfd);
+  m = mio_epoll_new(maxfd, maxevents, flags);
   if (m != NULL) return m;
 #endif
 
 #ifdef MIO_WSASYNC
-  m = mio_wsasync_new(maxfd);
+  m = mio_wsasync_new(maxfd, maxevents, flags);
   if (m != NULL) return m;
 #endif
 
 #ifdef MIO_SELECT
-  m = mio_select_new(maxfd);
+  m = mio_select_new(maxfd, maxevents, flags);
   if (m != NULL) return m;
 #endif
 
 #ifdef MIO_POLL
-  m = mio_poll_new(maxfd);
+  m = mio_poll_new(maxfd, maxevents, flags);
   if (m != NULL) return m;
 #endif
 
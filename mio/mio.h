@@ -131,9 +131,16 @@ typedef struct mio_st
   void (*mio_run)(struct mio_st **m, int timeout);
 } **mio_t;
 
+/** flags for mio_new_ex() */
+#define MIO_EDGE_TRIGGERED  (1<<0)  /* only be told about new events, drain sockets on each (epoll only) */
+#define MIO_REUSEPORT       (1<<1)  /* listeners may share their port with other mio instances */
+
 /** create/free the mio subsytem */
 JABBERD2_API mio_t mio_new(int maxfd); /* returns NULL if failed */
 
+/** same, harvesting up to maxevents ready fds per poll (0 for the default) */
+JABBERD2_API mio_t mio_new_ex(int maxfd, int maxevents, int flags);
+
 #define mio_free(m) (*m)->mio_free(m)
 
 /** for creating a new listen socket in this mio (returns new fd or <0) */
@@ -160,7 +167,7 @@ JABBERD2_API mio_t mio_new(int maxfd); /* returns NULL if failed */
 /** process read events for this fd */
 #define mio_read(m, fd) (*m)->mio_read(m, fd)
 
-/** give some cpu time to mio to check it's sockets, 0 is non-blocking */
+/** give some cpu time to mio to check it's sockets, timeout is in milliseconds, 0 is non-blocking */
 #define mio_run(m, timeout) (*m)->mio_run(m, timeout)
 
 /** all MIO related routines should use those for error reporting */
@@ -22,11 +22,27 @@
 
 #include <sys/epoll.h>
 
+#define MIO_EPOLL_EVENTS 32
+
 #define MIO_FUNCS \
     static int _mio_poll(mio_t m, int t)                                \
     {                                                                   \
-        return epoll_wait(MIO(m)->epoll_fd,                             \
-                          MIO(m)->res_event, 32, t*1000);               \
+        int i, ret;                                                     \
+        mio_priv_fd_t mfd;                                              \
+                                                                        \
+        ret = epoll_wait(MIO(m)->epoll_fd,                              \
+                         MIO(m)->res_event, MIO(m)->max_events, t);     \
+                                                                        \
+        /* remember input we may not be asking for right now */         \
+        if(MIO(m)->edge)                                                \
+            for(i = 0; i < ret; i++)                                    \
+            {                                                           \
+                mfd = (mio_priv_fd_t) MIO(m)->res_event[i].data.ptr;    \
+                if(MIO(m)->res_event[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLERR|EPOLLHUP)) \
+                    mfd->ready = 1;                                     \
+            }                                                           \
+                                                                        \
+        return ret;                                                     \
     }                                                                   \
                                                                         \
     static mio_fd_t _mio_alloc_fd(mio_t m, int fd)                      \
@@ -38,29 +54,106 @@
         priv_fd->mio_fd.fd = fd;                                        \
         priv_fd->events = 0;                                            \
                                                                         \
-        event.events = priv_fd->events;                                 \
+        /* edge triggered fds are registered for everything once */    \
+        if(MIO(m)->edge)                                                \
+            event.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;         \
+        else                                                            \
+            event.events = priv_fd->events;                             \
         event.data.u64 = 0;                                             \
         event.data.ptr = priv_fd;                                       \
         epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_ADD, fd, &event);         \
                                                                         \
         return (mio_fd_t)priv_fd;                                       \
+    }                                                                   \
+                                                                        \
+    static void _mio_set_events(mio_t m, mio_priv_fd_t mfd, uint32_t events) \
+    {                                                                   \
+        struct epoll_event event;                                       \
+        uint32_t added = events & ~mfd->events;                         \
+                                                                        \
+        if(mfd->events == events)                                       \
+            return;                                                     \
+        mfd->events = events;                                           \
+                                                                        \
+        if(MIO(m)->edge)                                                \
+        {                                                               \
+            /* only input that arrived while we weren't reading needs   \
+             * the kernel to report it again here, writes are re-armed  \
+             * by _mio_set_write() */                                   \
+            if(!(added & EPOLLIN) || !mfd->ready)                       \
+                return;                                                 \
+            event.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;         \
+        }                                                               \
+        else                                                            \
+            event.events = events;                                      \
+                                                                        \
+        event.data.u64 = 0;                                             \
+        event.data.ptr = mfd;                                           \
+        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
+                  mfd->mio_fd.fd, &event);                              \
+    }                                                                   \
+                                                                        \
+    static void _mio_set_write(mio_t m, mio_priv_fd_t mfd)              \
+    {                                                                   \
+        struct epoll_event event;                                       \
+                                                                        \
+        if(!MIO(m)->edge)                                               \
+        {                                                               \
+            _mio_set_events(m, mfd, mfd->events | EPOLLOUT);            \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        /* the app only writes a buffer at a time, so the edge that got \
+         * us here may be used up with the socket still writable. ask   \
+         * again, and the kernel reports it now if there's room */      \
+        mfd->events |= EPOLLOUT;                                        \
+        event.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;             \
+        event.data.u64 = 0;                                             \
+        event.data.ptr = mfd;                                           \
+        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
+                  mfd->mio_fd.fd, &event);                              \
+    }                                                                   \
+                                                                        \
+    static int _mio_read_again(mio_t m, mio_priv_fd_t mfd)              \
+    {                                                                   \
+        int avail = 0;                                                  \
+                                                                        \
+        if(ioctl(mfd->mio_fd.fd, FIONREAD, &avail) < 0 || avail <= 0)   \
+        {                                                               \
+            mfd->ready = 0;                                             \
+            return 0;                                                   \
+        }                                                               \
+                                                                        \
+        return 1;                                                       \
     }
 
 
 #define MIO_FD_VARS \
-    uint32_t events;
+    uint32_t events;                                                    \
+    int ready;
 
 #define MIO_VARS \
     int defer_free;                                                     \
     int epoll_fd;                                                       \
-    struct epoll_event res_event[32];
+    int edge;                                                           \
+    int max_events;                                                     \
+    struct epoll_event *res_event;
 
 #define MIO_INIT_VARS(m) \
     do {                                                                \
         MIO(m)->defer_free = 0;                                         \
+        MIO(m)->edge = (flags & MIO_EDGE_TRIGGERED) ? 1 : 0;            \
+        MIO(m)->max_events = maxevents > 0 ? maxevents : MIO_EPOLL_EVENTS; \
+        if ((MIO(m)->res_event = malloc(sizeof(struct epoll_event) * MIO(m)->max_events)) == NULL) \
+        {                                                               \
+            mio_debug(ZONE,"unable to allocate epoll events");          \
+            free(m);                                                    \
+            return NULL;                                                \
+        }                                                               \
         if ((MIO(m)->epoll_fd = epoll_create(maxfd)) < 0)               \
         {                                                               \
             mio_debug(ZONE,"unable to initialize epoll mio");           \
+            free(MIO(m)->res_event);                                    \
             free(m);                                                    \
             return NULL;                                                \
         }                                                               \
@@ -69,6 +162,7 @@
 #define MIO_FREE_VARS(m) \
     do {                                                                \
         close(MIO(m)->epoll_fd);                                        \
+        free(MIO(m)->res_event);                                        \
     } while(0)
 
 
@@ -87,68 +181,25 @@
 
 #define MIO_CHECK(m, t)         _mio_poll(m, t)
 
-#define MIO_SET_READ(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events |= EPOLLIN;                                         \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
-
-#define MIO_SET_WRITE(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events |= EPOLLOUT;                                        \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
-
-#define MIO_UNSET_READ(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events &= ~EPOLLIN;                                        \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
-
-#define MIO_UNSET_WRITE(m, mfd) \
-    do {                                                                \
-        struct epoll_event event;                                       \
-        event.events = mfd->events;                                     \
-        mfd->events &= ~(EPOLLOUT);                                     \
-        if( mfd->events == event.events )                               \
-            break;                                                      \
-        event.events = mfd->events;                                     \
-        event.data.u64 = 0;                                             \
-        event.data.ptr = mfd;                                           \
-        epoll_ctl(MIO(m)->epoll_fd, EPOLL_CTL_MOD,                      \
-                  mfd->mio_fd.fd, &event);                              \
-    } while (0)
-
+#define MIO_SET_READ(m, mfd)    _mio_set_events(m, mfd, mfd->events | EPOLLIN)
+#define MIO_SET_WRITE(m, mfd)   _mio_set_write(m, mfd)
+#define MIO_UNSET_READ(m, mfd)  _mio_set_events(m, mfd, mfd->events & ~EPOLLIN)
+#define MIO_UNSET_WRITE(m, mfd) _mio_set_events(m, mfd, mfd->events & ~EPOLLOUT)
 
+/* edge triggered fds get every event, so filter out what wasn't asked for
+ * (errors and hangups still go to the reader, like in level triggered mode) */
 #define MIO_CAN_READ(m,iter) \
-    (MIO(m)->res_event[iter].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+    ((MIO(m)->res_event[iter].events & (EPOLLERR|EPOLLHUP)) ||          \
+     ((MIO(m)->res_event[iter].events & (EPOLLIN|EPOLLRDHUP)) &&        \
+      (!MIO(m)->edge || (FD(m,MIO(m)->res_event[iter].data.ptr)->events & EPOLLIN))))
 
 #define MIO_CAN_WRITE(m,iter) \
-    (MIO(m)->res_event[iter].events & EPOLLOUT)
+    ((MIO(m)->res_event[iter].events & EPOLLOUT) &&                     \
+     (!MIO(m)->edge || (FD(m,MIO(m)->res_event[iter].data.ptr)->events & EPOLLOUT)))
+
+#define MIO_READ_AGAIN(m, mfd)  (MIO(m)->edge && _mio_read_again(m, mfd))
+#define MIO_ACCEPT_AGAIN(m)     (MIO(m)->edge)
+#define MIO_REARM_WRITE(m, mfd) do { if(MIO(m)->edge) _mio_set_write(m, mfd); } while(0)
 
 #define MIO_CAN_FREE(m)         (!MIO(m)->defer_free)
 
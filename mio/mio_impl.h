@@ -64,6 +64,7 @@ typedef struct mio_priv_st
     struct mio_st *mio;
 
     int maxfd;
+    int flags;
     MIO_VARS
 } *mio_priv_t;
 
@@ -90,6 +91,18 @@ static void _mio_debug(int line, const char *msgfmt, ...)
 
 MIO_FUNCS
 
+/* edge triggered backends need to be told to keep going until the socket is drained,
+ * and to ask for writeability again when the app still has more to write */
+#ifndef MIO_READ_AGAIN
+# define MIO_READ_AGAIN(m, mfd)  0
+#endif
+#ifndef MIO_ACCEPT_AGAIN
+# define MIO_ACCEPT_AGAIN(m)     0
+#endif
+#ifndef MIO_REARM_WRITE
+# define MIO_REARM_WRITE(m, mfd) do { } while(0)
+#endif
+
 /** add and set up this fd to this mio */
 static mio_fd_t _mio_setup_fd(mio_t m, int fd, mio_handler_t app, void *arg)
 {
@@ -146,8 +159,8 @@ static void _mio_close(mio_t m, mio_fd_t fd)
     }
 }
 
-/** internally accept an incoming connection from a listen sock */
-static void _mio_accept(mio_t m, mio_fd_t fd)
+/** internally accept an incoming connection from a listen sock, returns 0 if the queue was empty */
+static int _mio_accept(mio_t m, mio_fd_t fd)
 {
     struct sockaddr_storage serv_addr;
     socklen_t addrlen = (socklen_t) sizeof(serv_addr);
@@ -159,10 +172,10 @@ static void _mio_accept(mio_t m, mio_fd_t fd)
 
     /* pull a socket off the accept queue and check */
     newfd = accept(fd->fd, (struct sockaddr*)&serv_addr, &addrlen);
-    if(newfd <= 0) return;
+    if(newfd <= 0) return 0;
     if(addrlen <= 0) {
         close(newfd);
-        return;
+        return 1;
     }
 
     j_inet_ntop(&serv_addr, ip, sizeof(ip));
@@ -173,7 +186,7 @@ static void _mio_accept(mio_t m, mio_fd_t fd)
 
     if(!mio_fd) {
         close(newfd);
-        return;
+        return 1;
     }
 
     /* tell the app about the new socket, if they reject it clean up */
@@ -187,7 +200,7 @@ static void _mio_accept(mio_t m, mio_fd_t fd)
         MIO_FREE_FD(m, mio_fd);
     }
 
-    return;
+    return 1;
 }
 
 /** internally change a connecting socket to a normal one */
@@ -219,7 +232,7 @@ static void _mio_run(mio_t m, int timeout)
     int retval;
     MIO_INIT_ITERATOR(iter);
 
-    mio_debug(ZONE, "mio running for %d sec", timeout);
+    mio_debug(ZONE, "mio running for %d ms", timeout);
 
     /* wait for a socket event */
     retval = MIO_CHECK(m, timeout);
@@ -249,7 +262,7 @@ static void _mio_run(mio_t m, int timeout)
         /* new conns on a listen socket */
         if(FD(m,fd)->type == type_LISTEN && MIO_CAN_READ(m,iter))
         {
-            _mio_accept(m, fd);
+            while(_mio_accept(m, fd) && MIO_ACCEPT_AGAIN(m) && FD(m,fd)->type == type_LISTEN);
             goto deferred;
         }
 
@@ -264,9 +277,14 @@ static void _mio_run(mio_t m, int timeout)
         /* read from ready sockets */
         if(FD(m,fd)->type == type_NORMAL && MIO_CAN_READ(m,iter))
         {
-            /* if they don't want to read any more right now */
-            if(ACT(m, fd, action_READ, NULL) == 0)
-                MIO_UNSET_READ(m, FD(m,fd));
+            do {
+                /* if they don't want to read any more right now */
+                if(ACT(m, fd, action_READ, NULL) == 0)
+                {
+                    MIO_UNSET_READ(m, FD(m,fd));
+                    break;
+                }
+            } while(FD(m,fd)->type == type_NORMAL && MIO_READ_AGAIN(m, FD(m,fd)));
         }
 
         /* write to ready sockets */
@@ -275,6 +293,8 @@ static void _mio_run(mio_t m, int timeout)
             /* don't wait for writeability if nothing to write anymore */
             if(ACT(m, fd, action_WRITE, NULL) == 0)
                 MIO_UNSET_WRITE(m, FD(m,fd));
+            else if(FD(m,fd)->type == type_NORMAL)
+                MIO_REARM_WRITE(m, FD(m,fd));
         }
 
     deferred:
@@ -346,6 +366,15 @@ static mio_fd_t _mio_listen(mio_t m, int port, const char *sourceip, mio_handler
     /* attempt to create a socket */
     if((fd = socket(sa.ss_family,SOCK_STREAM,0)) < 0) return NULL;
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag)) < 0) return NULL;
+#ifdef SO_REUSEPORT
+    /* let the kernel spread new connections over everyone listening here */
+    if(MIO(m)->flags & MIO_REUSEPORT &&
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag)) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+#endif
 
     /* set up and bind address info */
     j_inet_setport(&sa, port);
@@ -473,7 +502,7 @@ static void _mio_free(mio_t m)
 }
 
 /** eve */
-static mio_t _mio_new(int maxfd)
+static mio_t _mio_new(int maxfd, int maxevents, int flags)
 {
     static struct mio_st mio_impl = {
         _mio_free,
@@ -501,6 +530,7 @@ static mio_t _mio_new(int maxfd)
     /* set up our internal vars */
     *m = &mio_impl;
     MIO(m)->maxfd = maxfd;
+    MIO(m)->flags = flags;
 
     MIO_INIT_VARS(m);
 
@@ -14,8 +14,8 @@
 #include "mio_kqueue.h"
 #include "mio_impl.h"
 
-mio_t mio_kqueue_new(int maxfd)
+mio_t mio_kqueue_new(int maxfd, int maxevents, int flags)
 {
-  return _mio_new(maxfd);
+  return _mio_new(maxfd, maxevents, flags);
 }
 #endif
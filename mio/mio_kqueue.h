@@ -55,8 +55,8 @@
     { \
       struct timespec ts; \
       int ret; \
-      ts.tv_nsec = 0; \
-      ts.tv_sec = timeout; \
+      ts.tv_nsec = (timeout % 1000) * 1000000; \
+      ts.tv_sec = timeout / 1000; \
       ret = kevent(MIO(m)->kq, NULL, 0, MIO(m)->events, sizeof(MIO(m)->events)/sizeof(MIO(m)->events[0]), &ts); \
       if (ret >= 0) \
         MIO(m)->nevents = ret; \
@@ -34,8 +34,8 @@
 #include "mio_poll.h"
 #include "mio_impl.h"
 
-mio_t mio_poll_new(int maxfd)
+mio_t mio_poll_new(int maxfd, int maxevents, int flags)
 {
-  return _mio_new(maxfd);
+  return _mio_new(maxfd, maxevents, flags);
 }
 #endif
@@ -46,7 +46,7 @@
                                                                         \
     static int _mio_poll(mio_priv_t m, int t)                           \
     {                                                                   \
-        return poll(m->pfds, m->highfd + 1, t*1000);                    \
+        return poll(m->pfds, m->highfd + 1, t);                         \
     }
 
 #define MIO_FD_VARS
@@ -50,8 +50,8 @@
         m->rfds_out = m->rfds_in;                                       \
         m->wfds_out = m->wfds_in;                                       \
                                                                         \
-        tv.tv_sec = t;                                                  \
-        tv.tv_usec = 0;                                                 \
+        tv.tv_sec = t / 1000;                                           \
+        tv.tv_usec = (t % 1000) * 1000;                                 \
         return select(m->highfd + 1, &m->rfds_out, &m->wfds_out, NULL, &tv); \
     }
 
@@ -33,9 +33,9 @@
 #include "mio_wsasync.h"
 #include "mio_impl.h"
 
-mio_t mio_wsasync_new(int maxfd)
+mio_t mio_wsasync_new(int maxfd, int maxevents, int flags)
 {
-  return _mio_new(maxfd);
+  return _mio_new(maxfd, maxevents, flags);
 }
 
 LONG CALLBACK _mio_wnd_proc(HWND hwnd, UINT msg, WPARAM wParam, LONG lParam)
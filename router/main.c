@@ -72,11 +72,25 @@ static void _router_pidfile(router_t r) {
 }
 
 /** pull values out of the config file */
+/** parse an output queue policy */
+static int _router_queue_policy(const char *str, int def) {
+    if(str == NULL)
+        return def;
+    if(strcmp(str, "drop") == 0)
+        return outq_DROP;
+    if(strcmp(str, "drop-oldest") == 0)
+        return outq_DROP_OLDEST;
+    if(strcmp(str, "bounce") == 0)
+        return outq_BOUNCE;
+
+    return def;
+}
+
 static void _router_config_expand(router_t r)
 {
-    const char *str, *ip, *mask, *name, *target;
+    const char *str, *ip, *mask, *file, *name, *target;
     config_elem_t elem;
-    int i;
+    int i, n;
     alias_t alias;
 
     r->id = config_get_one(r->config, "id", 0);
@@ -118,6 +132,11 @@ static void _router_config_expand(router_t r)
     r->local_ciphers = config_get_one(r->config, "local.ciphers", 0);
 
     r->io_max_fds = j_atoi(config_get_one(r->config, "io.max_fds", 0), 1024);
+    r->io_max_events = j_atoi(config_get_one(r->config, "io.max_events", 0), 0);
+    r->io_read_buffer_max = j_atoi(config_get_one(r->config, "io.read_buffer_max", 0), 0);
+    nad_cache_max(j_atoi(config_get_one(r->config, "io.nad_cache", 0), NAD_CACHE_MAX));
+    jid_cache_max(j_atoi(config_get_one(r->config, "io.jid_cache", 0), JID_CACHE_MAX));
+    r->io_edge_triggered = (config_get(r->config, "io.edge_triggered") != NULL);
 
     elem = config_get(r->config, "io.limits.bytes");
     if(elem != NULL)
@@ -138,9 +157,24 @@ static void _router_config_expand(router_t r)
         {
             r->conn_rate_seconds = j_atoi(j_attr((const char **) elem->attrs[0], "seconds"), 5);
             r->conn_rate_wait = j_atoi(j_attr((const char **) elem->attrs[0], "throttle"), 5);
+            r->conn_rates = rate_table_new(r->conn_rate_total, r->conn_rate_seconds, r->conn_rate_wait,
+                                             j_atoi(j_attr((const char **) elem->attrs[0], "ipv4-prefix"), 32),
+                                             j_atoi(j_attr((const char **) elem->attrs[0], "ipv6-prefix"), 128));
         }
     }
 
+    r->queue_packets = j_atoi(config_get_one(r->config, "io.queue.packets", 0), 65536);
+    r->queue_bytes = j_atoi(config_get_one(r->config, "io.queue.bytes", 0), 67108864);
+    r->queue_high = j_atoi(config_get_one(r->config, "io.queue.high", 0), 75);
+    r->queue_low = j_atoi(config_get_one(r->config, "io.queue.low", 0), 25);
+    if(r->queue_low > r->queue_high)
+        r->queue_low = r->queue_high;
+
+    r->queue_policy[outq_PRESENCE] = _router_queue_policy(config_get_one(r->config, "io.queue.presence", 0), outq_DROP_OLDEST);
+    r->queue_policy[outq_MESSAGE] = _router_queue_policy(config_get_one(r->config, "io.queue.message", 0), outq_BOUNCE);
+    r->queue_policy[outq_IQ] = _router_queue_policy(config_get_one(r->config, "io.queue.iq", 0), outq_BOUNCE);
+    r->queue_policy[outq_OTHER] = _router_queue_policy(config_get_one(r->config, "io.queue.other", 0), outq_BOUNCE);
+
     str = config_get_one(r->config, "io.access.order", 0);
     if(str == NULL || strcmp(str, "deny,allow") != 0)
         r->access = access_new(0);
@@ -154,13 +188,19 @@ static void _router_config_expand(router_t r)
         {
             ip = j_attr((const char **) elem->attrs[i], "ip");
             mask = j_attr((const char **) elem->attrs[i], "mask");
+            file = j_attr((const char **) elem->attrs[i], "file");
+
+            if(file != NULL) {
+                n = access_load(r->access, file, 0);
+                if(n < 0)
+                    log_write(r->log, LOG_ERR, "couldn't read access allow list %s, ignoring it", file);
+                else
+                    log_write(r->log, LOG_NOTICE, "loaded %d access allow rules from %s", n, file);
+            }
 
             if(ip == NULL)
                 continue;
 
-            if(mask == NULL)
-                mask = "255.255.255.255";
-
             access_allow(r->access, ip, mask);
         }
     }
@@ -172,13 +212,19 @@ static void _router_config_expand(router_t r)
         {
             ip = j_attr((const char **) elem->attrs[i], "ip");
             mask = j_attr((const char **) elem->attrs[i], "mask");
+            file = j_attr((const char **) elem->attrs[i], "file");
+
+            if(file != NULL) {
+                n = access_load(r->access, file, 1);
+                if(n < 0)
+                    log_write(r->log, LOG_ERR, "couldn't read access deny list %s, ignoring it", file);
+                else
+                    log_write(r->log, LOG_NOTICE, "loaded %d access deny rules from %s", n, file);
+            }
 
             if(ip == NULL)
                 continue;
 
-            if(mask == NULL)
-                mask = "255.255.255.255";
-
             access_deny(r->access, ip, mask);
         }
     }
@@ -208,6 +254,10 @@ static void _router_config_expand(router_t r)
 
     r->check_interval = j_atoi(config_get_one(r->config, "check.interval", 0), 60);
     r->check_keepalive = j_atoi(config_get_one(r->config, "check.keepalive", 0), 0);
+
+    r->multi_vnodes = j_atoi(config_get_one(r->config, "multi.vnodes", 0), 160);
+    if(r->multi_vnodes < 0)
+        r->multi_vnodes = 0;
 }
 
 static int _router_sx_sasl_callback(int cb, void *arg, void ** res, sx_t s, void *cbarg) {
@@ -289,6 +339,16 @@ static void _router_time_checks(router_t r) {
                log_debug(ZONE, "sending keepalive for %d", target->fd->fd);
                sx_raw_write(target->s, " ", 1);
           }
+
+          /* queue depths, if there was a queue since last time */
+          if(target->oq->peak_packets > 0) {
+               log_write(r->log, LOG_INFO, "[%s, port=%d] output queue: %d packets (%d bytes), peak %d packets (%d bytes), %lu dropped, %lu bounced, %d senders paused",
+                         target->ip, target->port, target->oq->packets, target->oq->bytes, target->oq->peak_packets, target->oq->peak_bytes,
+                         target->oq->dropped, target->oq->bounced, xhash_count(target->paused));
+
+               target->oq->peak_packets = target->oq->packets;
+               target->oq->peak_bytes = target->oq->bytes;
+          }
        } while(xhash_iter_next(r->components));
    return;
 }
@@ -299,7 +359,6 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
     router_t r;
     char *config_file;
     int optchar;
-    rate_t rt;
     component_t comp;
     union xhashv xhv;
     int close_wait_max;
@@ -407,8 +466,6 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     if(filter_load(r)) exit(1);
 
-    r->conn_rates = xhash_new(101);
-
     r->components = xhash_new(101);
     r->routes = xhash_new(101);
 
@@ -428,6 +485,9 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
     }
 #endif
 
+    /* components that ask can have binary frames */
+    sx_env_plugin(r->sx_env, sx_binary_init);
+
     /* get sasl online */
     r->sx_sasl = sx_env_plugin(r->sx_env, sx_sasl_init, "jabberd-router", _router_sx_sasl_callback, (void *) r);
     if(r->sx_sasl == NULL) {
@@ -435,7 +495,9 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
         exit(1);
     }
 
-    r->mio = mio_new(r->io_max_fds);
+    r->timers = twheel_new(100);
+
+    r->mio = mio_new_ex(r->io_max_fds, r->io_max_events, r->io_edge_triggered ? MIO_EDGE_TRIGGERED : 0);
 
     r->fd = mio_listen(r->mio, r->local_port, r->local_ip, router_mio_callback, (void *) r);
     if(r->fd == NULL) {
@@ -447,7 +509,9 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     while(!router_shutdown)
     {
-        mio_run(r->mio, 5);
+        mio_run(r->mio, twheel_timeout(r->timers, 5000));
+
+        twheel_run(r->timers);
 
         if(router_logrotate)
         {
@@ -501,6 +565,9 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     log_write(r->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_log(r->log);
+    jid_cache_log(r->log);
+
     /* stop accepting new connections */
     if (r->fd) {
         // HACK Do not call router_mio_callback(action_CLOSE) for listenning socket, Just close it and forget.
@@ -525,7 +592,10 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
             log_debug(ZONE, "close component %p", comp);
             if (comp) sx_close(comp->s);
             mio_run(r->mio, 5000);
-            if (1 > close_wait_max--) break;
+            if (1 > close_wait_max--) {
+                xhash_iter_done(r->components);
+                break;
+            }
             sleep(1);
             while(jqueue_size(r->closefd) > 0)
                 mio_close(r->mio, (mio_fd_t) jqueue_pull(r->closefd));
@@ -547,15 +617,10 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
         routes_free((routes_t) jqueue_pull(r->deadroutes));
     jqueue_free(r->deadroutes);
 
-    /* walk r->conn_rates and free */
-    xhv.rt_val = &rt;
-    if(xhash_iter_first(r->conn_rates))
-        do {
-            xhash_iter_get(r->conn_rates, NULL, NULL, xhv.val);
-            rate_free(rt);
-        } while(xhash_iter_next(r->conn_rates));
+    if(r->conn_rates != NULL)
+        rate_table_free(r->conn_rates);
 
-    xhash_free(r->conn_rates);
+    twheel_free(r->timers);
 
     xhash_free(r->log_sinks);
 
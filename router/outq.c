@@ -0,0 +1,142 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+#include "router.h"
+
+/** component output queues */
+
+outq_t outq_new(void) {
+    return (outq_t) calloc(1, sizeof(struct outq_st));
+}
+
+void outq_free(outq_t oq) {
+    nad_t nad;
+
+    while((nad = outq_pull(oq)) != NULL)
+        nad_free(nad);
+
+    free(oq);
+}
+
+/** what's in a route, for picking its policy */
+int outq_kind(nad_t nad) {
+    if(nad->ecur < 2)
+        return outq_OTHER;
+
+    if(NAD_ENAME_L(nad, 1) == 8 && strncmp("presence", NAD_ENAME(nad, 1), 8) == 0)
+        return outq_PRESENCE;
+    if(NAD_ENAME_L(nad, 1) == 7 && strncmp("message", NAD_ENAME(nad, 1), 7) == 0)
+        return outq_MESSAGE;
+    if(NAD_ENAME_L(nad, 1) == 2 && strncmp("iq", NAD_ENAME(nad, 1), 2) == 0)
+        return outq_IQ;
+
+    return outq_OTHER;
+}
+
+/** memory a nad holds, which is what the limits are really about */
+int outq_bytes(nad_t nad) {
+    return sizeof(struct nad_st) + nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen + nad->rlen;
+}
+
+void outq_push(outq_t oq, nad_t nad, int kind, int bytes) {
+    outq_pkt_t pkt;
+
+    pkt = (outq_pkt_t) calloc(1, sizeof(struct outq_pkt_st));
+    pkt->nad = nad;
+    pkt->kind = kind;
+    pkt->bytes = bytes;
+    pkt->seq = oq->seq++;
+
+    pkt->prev = oq->last;
+    if(oq->last != NULL)
+        oq->last->next = pkt;
+    else
+        oq->first = pkt;
+    oq->last = pkt;
+
+    if(oq->klast[kind] != NULL)
+        oq->klast[kind]->knext = pkt;
+    else
+        oq->kfirst[kind] = pkt;
+    oq->klast[kind] = pkt;
+
+    oq->packets++;
+    oq->bytes += bytes;
+    oq->queued++;
+
+    if(oq->packets > oq->peak_packets)
+        oq->peak_packets = oq->packets;
+    if(oq->bytes > oq->peak_bytes)
+        oq->peak_bytes = oq->bytes;
+}
+
+/** take out the oldest of a kind. packets leave in order, so it's
+  * always at the front of its kind, wherever it is in the queue */
+static nad_t _outq_unlink(outq_t oq, int kind) {
+    outq_pkt_t pkt = oq->kfirst[kind];
+    nad_t nad;
+
+    oq->kfirst[kind] = pkt->knext;
+    if(pkt->knext == NULL)
+        oq->klast[kind] = NULL;
+
+    if(pkt->prev != NULL)
+        pkt->prev->next = pkt->next;
+    else
+        oq->first = pkt->next;
+
+    if(pkt->next != NULL)
+        pkt->next->prev = pkt->prev;
+    else
+        oq->last = pkt->prev;
+
+    oq->packets--;
+    oq->bytes -= pkt->bytes;
+
+    nad = pkt->nad;
+    free(pkt);
+
+    return nad;
+}
+
+nad_t outq_pull(outq_t oq) {
+    if(oq->first == NULL)
+        return NULL;
+
+    return _outq_unlink(oq, oq->first->kind);
+}
+
+nad_t outq_pull_kind(outq_t oq, int kind) {
+    if(oq->kfirst[kind] == NULL)
+        return NULL;
+
+    return _outq_unlink(oq, kind);
+}
+
+/** @return which of the kinds has the oldest packet queued, -1 if none of them do */
+int outq_oldest(outq_t oq, int *kinds, int nkinds) {
+    int i, kind = -1;
+
+    for(i = 0; i < nkinds; i++)
+        if(oq->kfirst[kinds[i]] != NULL && (kind < 0 || oq->kfirst[kinds[i]]->seq < oq->kfirst[kind]->seq))
+            kind = kinds[i];
+
+    return kind;
+}
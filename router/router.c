@@ -43,7 +43,7 @@ static void _router_broadcast(const char *key, int keylen, void *val, void *arg)
         if(routes->comp[i] == bc->src || routes->comp[i]->legacy)
             continue;
 
-        sx_nad_write(routes->comp[i]->s, nad_copy(bc->nad));
+        sx_nad_write(routes->comp[i]->s, nad_ref(bc->nad));
     }
 }
 
@@ -132,6 +132,7 @@ static void _router_process_handshake(component_t comp, nad_t nad) {
         /* respond */
         nad->elems[0].icdata = nad->elems[0].itail = -1;
         nad->elems[0].lcdata = nad->elems[0].ltail = 0;
+        NAD_DIRTY(nad);
         sx_nad_write(comp->s, nad);
 
         sx_auth(comp->s, "handshake", comp->s->req_to);
@@ -153,9 +154,87 @@ static void _router_process_handshake(component_t comp, nad_t nad) {
 void routes_free(routes_t routes) {
     if(routes->name) free((void*)routes->name);
     if(routes->comp) free(routes->comp);
+    if(routes->ring) free(routes->ring);
     free(routes);
 }
 
+/** FNV-1a, carried on from a previous value so keys can be hashed in pieces */
+static unsigned int _route_hash(unsigned int h, const char *s, int len) {
+    while(len-- > 0) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/** murmur3 finaliser, FNV alone leaves similar keys clustered on the ring */
+static unsigned int _route_hash_mix(unsigned int h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int _route_point_cmp(const void *a, const void *b) {
+    unsigned int ha = ((route_point_t) a)->hash, hb = ((route_point_t) b)->hash;
+
+    return (ha > hb) - (ha < hb);
+}
+
+/** rebuild the hash ring, every component gets vnodes points keyed on its instance name (or ip:port) */
+static void _route_ring(routes_t routes, int vnodes) {
+    const char *id;
+    unsigned int h;
+    int i, v, n;
+    char buf[16];
+
+    if(routes->ring != NULL)
+        free(routes->ring);
+    routes->ring = NULL;
+    routes->nring = 0;
+
+    if(routes->ncomp < 2 || vnodes <= 0)
+        return;
+
+    routes->ring = (route_point_t) malloc(sizeof(struct route_point_st) * routes->ncomp * vnodes);
+
+    for(i = 0; i < routes->ncomp; i++) {
+        id = routes->comp[i]->instance != NULL ? routes->comp[i]->instance : routes->comp[i]->ipport;
+        h = _route_hash(2166136261U, id, strlen(id));
+
+        for(v = 0; v < vnodes; v++) {
+            n = snprintf(buf, sizeof(buf), "#%d", v);
+            routes->ring[routes->nring].hash = _route_hash_mix(_route_hash(h, buf, n));
+            routes->ring[routes->nring].comp = routes->comp[i];
+            routes->nring++;
+        }
+    }
+
+    qsort(routes->ring, routes->nring, sizeof(struct route_point_st), _route_point_cmp);
+}
+
+/** first point at or after the hash, wrapping around */
+static component_t _route_ring_get(routes_t routes, unsigned int hash) {
+    int lo = 0, hi = routes->nring, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(routes->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo == routes->nring)
+        lo = 0;
+
+    return routes->ring[lo].comp;
+}
+
 static int _route_add(xht hroutes, const char *name, component_t comp, route_type_t rtype) {
     routes_t routes;
 
@@ -170,6 +249,8 @@ static int _route_add(xht hroutes, const char *name, component_t comp, route_typ
     routes->ncomp++;
     xhash_put(hroutes, routes->name, (void *) routes);
 
+    _route_ring(routes, comp->r->multi_vnodes);
+
     if(routes->rtype != rtype)
         log_write(comp->r->log, LOG_ERR, "Mixed route types for '%s' bind request", name);
 
@@ -192,6 +273,8 @@ static void _route_remove(xht hroutes, const char *name, component_t comp) {
                 routes->ncomp--;
             }
         }
+
+        _route_ring(routes, comp->r->multi_vnodes);
     }
     else {
         jqueue_push(comp->r->deadroutes, (void *) routes, 0);
@@ -294,6 +377,16 @@ static void _router_process_bind(component_t comp, nad_t nad) {
 
     free(user);
 
+    /* it can take multicast routes, and let it know it can send them too */
+    if(nad_find_elem(nad, 0, NAD_ENS(nad, 0), "multicast", 1) >= 0) {
+        comp->multicast = 1;
+        nad_set_attr(nad, 0, -1, "multicast", "true", 4);
+    }
+
+    /* stable name for the hash ring, first one wins */
+    if(multi >= 0 && comp->instance == NULL && (attr = nad_find_attr(nad, 0, -1, "instance", NULL)) >= 0 && NAD_AVAL_L(nad, attr) > 0)
+        comp->instance = pstrdupx(xhash_pool(comp->routes), NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+
     n = _route_add(comp->r->routes, name->domain, comp, multi<0?route_SINGLE:route_MULTI_TO);
     xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), name->domain), (void *) comp);
 
@@ -371,15 +464,10 @@ static void _router_process_unbind(component_t comp, nad_t nad) {
     jid_free(name);
 }
 
-static void _router_comp_write(component_t comp, nad_t nad) {
+/** hand a packet to the component's stream */
+static void _router_sx_write(component_t comp, nad_t nad) {
     int attr;
 
-    if(comp->tq != NULL) {
-        log_debug(ZONE, "%s port %d is throttled, jqueueing packet", comp->ip, comp->port);
-        jqueue_push(comp->tq, nad, 0);
-        return;
-    }
-
     /* packets go raw to normal components */
     if(!comp->legacy) {
         sx_nad_write(comp->s, nad);
@@ -388,6 +476,8 @@ static void _router_comp_write(component_t comp, nad_t nad) {
 
     log_debug(ZONE, "packet for legacy component, munging");
 
+    nad = nad_unshare(nad);
+
     attr = nad_find_attr(nad, 0, -1, "error", NULL);
     if(attr >= 0) {
         if(NAD_AVAL_L(nad, attr) == 3 && strncmp("400", NAD_AVAL(nad, attr), 3) == 0)
@@ -399,25 +489,249 @@ static void _router_comp_write(component_t comp, nad_t nad) {
     sx_nad_write_elem(comp->s, nad, 1);
 }
 
+/** true if the output queue holds more than pct percent of either limit */
+static int _router_queue_past(component_t comp, int pct) {
+    router_t r = comp->r;
+
+    return (r->queue_packets > 0 && comp->oq->packets > r->queue_packets / 100.0 * pct) ||
+           (r->queue_bytes > 0 && comp->oq->bytes > r->queue_bytes / 100.0 * pct);
+}
+
+/** true if there's room in the output queue for a packet this big */
+static int _router_queue_fits(component_t comp, int bytes) {
+    router_t r = comp->r;
+
+    return (r->queue_packets == 0 || comp->oq->packets < r->queue_packets) &&
+           (r->queue_bytes == 0 || comp->oq->bytes + bytes <= r->queue_bytes);
+}
+
+/** start reading from the senders we paused again, unless someone else is still holding them */
+static void _router_queue_resume(component_t comp) {
+    component_t sender;
+    union xhashv xhv;
+
+    if(xhash_iter_first(comp->paused))
+        do {
+            xhv.comp_val = &sender;
+            xhash_iter_get(comp->paused, NULL, NULL, xhv.val);
+            xhash_iter_zap(comp->paused);
+
+            if(--sender->pausers == 0) {
+                log_debug(ZONE, "resuming reads from %s, port %d", sender->ip, sender->port);
+                mio_read(comp->r->mio, sender->fd);
+            }
+        } while(xhash_iter_next(comp->paused));
+}
+
+/** move queued routes to the stream, as many as it will take */
+static void _router_comp_flush(component_t comp) {
+    while(!comp->throttled && comp->oq->packets > 0 && jqueue_size(comp->s->wbufq) < ROUTER_STREAM_QUEUE)
+        _router_sx_write(comp, outq_pull(comp->oq));
+
+    if(comp->congested && !_router_queue_past(comp, comp->r->queue_low)) {
+        log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] output queue drained, resuming %d senders", comp->ip, comp->port, xhash_count(comp->paused));
+
+        comp->congested = 0;
+        comp->queue_log = 0;
+        _router_queue_resume(comp);
+    }
+}
+
+/**
+ * write a packet to a component, from the component that sent it if
+ * there is one. when the stream is backed up, routes wait in the output
+ * queue; when that fills up they're dropped or bounced to their sender
+ * according to their kind, and while it's congested we stop reading
+ * from anyone who adds to it.
+ */
+static void _router_comp_route(component_t comp, component_t from, nad_t nad) {
+    router_t r = comp->r;
+    outq_t oq = comp->oq;
+    int kind, bytes, evict[outq_KINDS], nevict, k;
+
+    /* the router's own packets are never held back, routes only if there's a queue */
+    if(NAD_ENAME_L(nad, 0) != 5 || strncmp("route", NAD_ENAME(nad, 0), 5) != 0 ||
+       (!comp->throttled && oq->packets == 0 && jqueue_size(comp->s->wbufq) < ROUTER_STREAM_QUEUE)) {
+        _router_sx_write(comp, nad);
+        return;
+    }
+
+    kind = outq_kind(nad);
+    bytes = outq_bytes(nad);
+
+    /* make room by dropping the oldest of anything that may be dropped that way */
+    if(!_router_queue_fits(comp, bytes)) {
+        for(nevict = 0, k = 0; k < outq_KINDS; k++)
+            if(r->queue_policy[k] == outq_DROP_OLDEST)
+                evict[nevict++] = k;
+
+        while(!_router_queue_fits(comp, bytes) && (k = outq_oldest(oq, evict, nevict)) >= 0) {
+            nad_free(outq_pull_kind(oq, k));
+            oq->dropped++;
+        }
+    }
+
+    if(!_router_queue_fits(comp, bytes)) {
+        if(!comp->queue_log) {
+            log_write(r->log, LOG_NOTICE, "[%s, port=%d] output queue is full (%d packets, %d bytes), refusing packets", comp->ip, comp->port, oq->packets, oq->bytes);
+            comp->queue_log = 1;
+        }
+
+        /* only plain routes can go back, and never errors, or they could bounce forever */
+        if(r->queue_policy[kind] == outq_BOUNCE && from != NULL &&
+           nad_find_attr(nad, 0, -1, "type", NULL) < 0 && nad_find_attr(nad, 0, -1, "error", NULL) < 0) {
+            log_debug(ZONE, "output queue for %s, port %d is full, bouncing", comp->ip, comp->port);
+            nad = nad_unshare(nad);
+            nad_set_attr(nad, 0, -1, "error", _stanza_errors[stanza_err_RESOURCE_CONSTRAINT - stanza_err_BAD_REQUEST].code, 3);
+            _router_comp_route(from, NULL, nad);
+            oq->bounced++;
+            return;
+        }
+
+        log_debug(ZONE, "output queue for %s, port %d is full, dropping", comp->ip, comp->port);
+        nad_free(nad);
+        oq->dropped++;
+        return;
+    }
+
+    log_debug(ZONE, "%s port %d is %s, queueing packet", comp->ip, comp->port, comp->throttled ? "throttled" : "backed up");
+    outq_push(oq, nad, kind, bytes);
+
+    if(!comp->congested && _router_queue_past(comp, r->queue_high)) {
+        log_write(r->log, LOG_NOTICE, "[%s, port=%d] output queue past high watermark (%d packets, %d bytes), pausing senders", comp->ip, comp->port, oq->packets, oq->bytes);
+        comp->congested = 1;
+    }
+
+    /* whoever keeps it filling up waits until it drains */
+    if(comp->congested && from != NULL && from != comp && xhash_get(comp->paused, from->ipport) == NULL) {
+        log_debug(ZONE, "pausing reads from %s, port %d", from->ip, from->port);
+        xhash_put(comp->paused, from->ipport, (void *) from);
+        from->pausers++;
+        oq->pauses++;
+    }
+}
+
+static void _router_comp_write(component_t comp, nad_t nad) {
+    _router_comp_route(comp, NULL, nad);
+}
+
 static void _router_route_log_sink(const char *key, int keylen, void *val, void *arg) {
     component_t comp = (component_t) val;
     nad_t nad = (nad_t) arg;
 
     log_debug(ZONE, "copying route to '%.*s' (%s, port %d)", keylen, key, comp->ip, comp->port);
 
-    nad = nad_copy(nad);
+    _router_comp_write(comp, nad_ref(nad));
+}
+
+/** if logging enabled, log messages that match our criteria */
+static void _router_route_message_log(component_t comp, nad_t nad) {
+    if (comp->r->message_logging_enabled && comp->r->message_logging_file != NULL) {
+        int attr_msg_to;
+        int attr_msg_from;
+        int attr_route_to;
+        int attr_route_from;
+        jid_t jid_msg_from = NULL;
+        jid_t jid_msg_to = NULL;
+        jid_t jid_route_from = NULL;
+        jid_t jid_route_to = NULL;
+
+        if ((NAD_ENAME_L(nad, 1) == 7 && strncmp("message", NAD_ENAME(nad, 1), 7) == 0) &&		// has a "message" element 
+            ((attr_route_from = nad_find_attr(nad, 0, -1, "from", NULL)) >= 0) &&
+            ((attr_route_to = nad_find_attr(nad, 0, -1, "to", NULL)) >= 0) &&
+            ((strncmp(NAD_AVAL(nad, attr_route_to), "c2s", 3)) != 0) &&							// ignore messages to "c2s" or we'd have dups
+            ((jid_route_from = jid_new(NAD_AVAL(nad, attr_route_from), NAD_AVAL_L(nad, attr_route_from))) != NULL) &&	// has valid JID source in route
+            ((jid_route_to = jid_new(NAD_AVAL(nad, attr_route_to), NAD_AVAL_L(nad, attr_route_to))) != NULL) &&		// has valid JID destination in route
+            ((attr_msg_from = nad_find_attr(nad, 1, -1, "from", NULL)) >= 0) &&
+            ((attr_msg_to = nad_find_attr(nad, 1, -1, "to", NULL)) >= 0) &&
+            ((jid_msg_from = jid_new(NAD_AVAL(nad, attr_msg_from), NAD_AVAL_L(nad, attr_msg_from))) != NULL) &&	// has valid JID source in message 
+            ((jid_msg_to = jid_new(NAD_AVAL(nad, attr_msg_to), NAD_AVAL_L(nad, attr_msg_to))) != NULL))			// has valid JID dest in message
+        {
+            message_log(nad, comp->r, jid_full(jid_msg_from), jid_full(jid_msg_to));
+        }
+        if (jid_msg_from != NULL)
+            jid_free(jid_msg_from);
+        if (jid_msg_to != NULL)
+            jid_free(jid_msg_to);
+        if (jid_route_from != NULL)
+            jid_free(jid_route_from);
+        if (jid_route_to != NULL)
+            jid_free(jid_route_to);
+    }
+}
+
+static void _router_process_route(component_t comp, nad_t nad);
+
+/** an address of a multicast, routed on its own */
+static void _router_multicast_route(nad_t nad, void *arg) {
+    _router_process_route((component_t) arg, nad);
+}
+
+/** an address of a multicast, for the log sinks */
+static void _router_multicast_log(nad_t nad, void *arg) {
+    router_t r = (router_t) arg;
+
     nad_set_attr(nad, 0, -1, "type", "log", 3);
-    _router_comp_write(comp, nad);
+    xhash_walk(r->log_sinks, _router_route_log_sink, (void *) nad);
+    nad_free(nad);
+}
+
+/** filter every address of a multicast, the ones caught are bounced or redirected on their own, @return true if any are left */
+static int _router_multicast_filter(component_t comp, nad_t nad, int addrs, const char *domain) {
+    int addr, attr, ret, *drop, ndrop = 0;
+    char jid[MAX_JID];
+    nad_t unicast;
+
+    drop = (int *) malloc(sizeof(int) * nad->ecur);
+
+    for(addr = nad_find_elem(nad, addrs, -1, "address", 1); addr >= 0; addr = nad_find_elem(nad, addr, -1, "address", 0)) {
+        if((attr = nad_find_attr(nad, addr, -1, "jid", NULL)) < 0 || NAD_AVAL_L(nad, attr) >= MAX_JID) {
+            drop[ndrop++] = addr;
+            continue;
+        }
+
+        /* the stanza as it would be for this address */
+        snprintf(jid, MAX_JID, "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+        nad_set_attr(nad, 1, -1, "to", jid, 0);
+
+        ret = filter_packet(comp->r, nad);
+        if(ret == 0)
+            continue;
+
+        unicast = stanza_multicast_unicast(nad, addr);
+        drop[ndrop++] = addr;
+
+        if(ret == stanza_err_REDIRECT) {
+            nad_set_attr(nad, 0, -1, "to", domain, 0);
+            _router_process_route(comp, unicast);
+        }
+        else if(ret > 0) {
+            log_debug(ZONE, "packet to %s filtered out: %s (%s)", jid, _stanza_errors[ret - stanza_err_BAD_REQUEST].name, _stanza_errors[ret - stanza_err_BAD_REQUEST].code);
+            nad_set_attr(unicast, 0, -1, "error", _stanza_errors[ret - stanza_err_BAD_REQUEST].code, 3);
+            _router_comp_write(comp, unicast);
+        }
+    }
+
+    nad_set_attr(nad, 1, -1, "to", NULL, 0);
+
+    /* last first, so the ones before stay where they are */
+    while(ndrop > 0)
+        nad_drop_elem(nad, drop[--ndrop]);
+
+    free(drop);
+
+    return nad_find_elem(nad, addrs, -1, "address", 1) >= 0;
 }
 
 static void _router_process_route(component_t comp, nad_t nad) {
-    int atype, ato, afrom;
+    int atype, ato, afrom, addrs;
     unsigned int dest;
     struct jid_st sto, sfrom;
     jid_static_buf sto_buf, sfrom_buf;
     jid_t to = NULL, from = NULL;
     routes_t targets;
     component_t target;
+    nad_t lnad;
     union xhashv xhv;
 
     /* init static jid */
@@ -490,11 +804,16 @@ static void _router_process_route(component_t comp, nad_t nad) {
             return;
         }
 
-        /* copy to any log sinks */
-        if(xhash_count(comp->r->log_sinks) > 0)
-            xhash_walk(comp->r->log_sinks, _router_route_log_sink, (void *) nad);
+        /* copy to any log sinks, they all get the same one */
+        if(xhash_count(comp->r->log_sinks) > 0) {
+            lnad = nad_copy(nad);
+            nad_set_attr(lnad, 0, -1, "type", "log", 3);
+            xhash_walk(comp->r->log_sinks, _router_route_log_sink, (void *) lnad);
+            nad_free(lnad);
+        }
 
         /* get route candidate */
+        target = NULL;
         if(targets->ncomp == 1) {
             dest = 0;
         }
@@ -531,6 +850,15 @@ static void _router_process_route(component_t comp, nad_t nad) {
                 dest = rand();
                 log_debug(ZONE, "randomized to %u %% %d = %d", dest, targets->ncomp, dest % targets->ncomp);
             }
+            else if(targets->nring > 0) {
+                /* bare JID on the ring, a component coming or going only moves its own share */
+                dest = _route_hash(2166136261U, to->node, strlen(to->node));
+                dest = _route_hash(dest, "@", 1);
+                dest = _route_hash_mix(_route_hash(dest, to->domain, strlen(to->domain)));
+                target = _route_ring_get(targets, dest);
+
+                log_debug(ZONE, "JID %s@%s hashed to %08x on the ring, %s", to->node, to->domain, dest, target->ipport);
+            }
             else {
                 /* use JID hash */
                 unsigned char hashval[20];
@@ -557,46 +885,15 @@ static void _router_process_route(component_t comp, nad_t nad) {
             dest = dest % targets->ncomp;
         }
 
-        target = targets->comp[dest];
+        if(target == NULL)
+            target = targets->comp[dest];
 
         /* push it out */
-        log_debug(ZONE, "writing route for '%s'*%u to %s, port %d", to->domain, dest+1, target->ip, target->port);
-
-        /* if logging enabled, log messages that match our criteria */
-        if (comp->r->message_logging_enabled && comp->r->message_logging_file != NULL) {
-            int attr_msg_to;
-            int attr_msg_from;
-            int attr_route_to;
-            int attr_route_from;
-            jid_t jid_msg_from = NULL;
-            jid_t jid_msg_to = NULL;
-            jid_t jid_route_from = NULL;
-            jid_t jid_route_to = NULL;
-
-            if ((NAD_ENAME_L(nad, 1) == 7 && strncmp("message", NAD_ENAME(nad, 1), 7) == 0) &&		// has a "message" element 
-                ((attr_route_from = nad_find_attr(nad, 0, -1, "from", NULL)) >= 0) &&
-                ((attr_route_to = nad_find_attr(nad, 0, -1, "to", NULL)) >= 0) &&
-                ((strncmp(NAD_AVAL(nad, attr_route_to), "c2s", 3)) != 0) &&							// ignore messages to "c2s" or we'd have dups
-                ((jid_route_from = jid_new(NAD_AVAL(nad, attr_route_from), NAD_AVAL_L(nad, attr_route_from))) != NULL) &&	// has valid JID source in route
-                ((jid_route_to = jid_new(NAD_AVAL(nad, attr_route_to), NAD_AVAL_L(nad, attr_route_to))) != NULL) &&		// has valid JID destination in route
-                ((attr_msg_from = nad_find_attr(nad, 1, -1, "from", NULL)) >= 0) &&
-                ((attr_msg_to = nad_find_attr(nad, 1, -1, "to", NULL)) >= 0) &&
-                ((jid_msg_from = jid_new(NAD_AVAL(nad, attr_msg_from), NAD_AVAL_L(nad, attr_msg_from))) != NULL) &&	// has valid JID source in message 
-                ((jid_msg_to = jid_new(NAD_AVAL(nad, attr_msg_to), NAD_AVAL_L(nad, attr_msg_to))) != NULL))			// has valid JID dest in message
-            {
-                message_log(nad, comp->r, jid_full(jid_msg_from), jid_full(jid_msg_to));
-            }
-            if (jid_msg_from != NULL)
-                jid_free(jid_msg_from);
-            if (jid_msg_to != NULL)
-                jid_free(jid_msg_to);
-            if (jid_route_from != NULL)
-                jid_free(jid_route_from);
-            if (jid_route_to != NULL)
-                jid_free(jid_route_to);
-        }
+        log_debug(ZONE, "writing route for '%s' to %s, port %d", to->domain, target->ip, target->port);
+
+        _router_route_message_log(comp, nad);
 
-        _router_comp_write(target, nad);
+        _router_comp_route(target, comp, nad);
 
         return;
     }
@@ -629,7 +926,7 @@ static void _router_process_route(component_t comp, nad_t nad) {
                 if(target != comp) {
                     log_debug(ZONE, "writing broadcast to %s, port %d", target->ip, target->port);
 
-                    _router_comp_write(target, nad_copy(nad));
+                    _router_comp_route(target, comp, nad_ref(nad));
                 }
             } while(xhash_iter_next(comp->r->components));
 
@@ -638,34 +935,114 @@ static void _router_process_route(component_t comp, nad_t nad) {
         return;
     }
 
+    /* multicast */
+    if(NAD_AVAL_L(nad, atype) == 9 && strncmp("multicast", NAD_AVAL(nad, atype), 9) == 0) {
+        if(to == NULL || from == NULL || (addrs = stanza_multicast_addresses(nad)) < 0) {
+            log_debug(ZONE, "multicast route with missing or invalid to, from or addresses, bouncing");
+            nad_set_attr(nad, 0, -1, "error", "400", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        log_debug(ZONE, "multicast route from %s to %s", from->domain, to->domain);
+
+        /* check the from */
+        if(xhash_get(comp->routes, from->domain) == NULL) {
+            log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] tried to send a packet from '%s', but that name is not bound to this component", comp->ip, comp->port, from->domain);
+            nad_set_attr(nad, 0, -1, "error", "401", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        targets = xhash_get(comp->r->routes, to->domain);
+        if(targets == NULL && comp->r->default_route != NULL && strcmp(from->domain, comp->r->default_route) != 0)
+            targets = xhash_get(comp->r->routes, comp->r->default_route);
+
+        /* where each address could end up somewhere else, or be bounced or logged on its own, let unicast deal with them */
+        if(targets == NULL || targets->ncomp > 1 || !targets->comp[0]->multicast ||
+           (comp->r->message_logging_enabled && NAD_ENAME_L(nad, 1) == 7 && strncmp("message", NAD_ENAME(nad, 1), 7) == 0)) {
+            log_debug(ZONE, "splitting multicast to %s", to->domain);
+            stanza_multicast_expand(nad, _router_multicast_route, (void *) comp);
+            return;
+        }
+
+        /* filter it */
+        if(comp->r->filter != NULL && !_router_multicast_filter(comp, nad, addrs, to->domain)) {
+            log_debug(ZONE, "every address filtered out");
+            nad_free(nad);
+            return;
+        }
+
+        /* log sinks get one for every address */
+        if(xhash_count(comp->r->log_sinks) > 0)
+            stanza_multicast_expand(nad_copy(nad), _router_multicast_log, (void *) comp->r);
+
+        _router_comp_route(targets->comp[0], comp, nad);
+
+        return;
+    }
+
+    /* a copy of a route the component delivered itself, so it is only logged */
+    if(NAD_AVAL_L(nad, atype) == 3 && strncmp("log", NAD_AVAL(nad, atype), 3) == 0) {
+        if(from == NULL || xhash_get(comp->routes, from->domain) == NULL) {
+            log_debug(ZONE, "log route with missing or unbound from, dropping");
+            nad_free(nad);
+            return;
+        }
+
+        log_debug(ZONE, "log route from %s", from->domain);
+
+        _router_route_message_log(comp, nad);
+
+        xhash_walk(comp->r->log_sinks, _router_route_log_sink, (void *) nad);
+
+        nad_free(nad);
+
+        return;
+    }
+
     log_debug(ZONE, "unknown route type '%.*s', dropping", NAD_AVAL_L(nad, atype), NAD_AVAL(nad, atype));
 
     nad_free(nad);
 }
 
 static void _router_process_throttle(component_t comp, nad_t nad) {
-    jqueue_t tq;
-    nad_t pkt;
-
-    if(comp->tq == NULL) {
-        _router_comp_write(comp, nad);
+    _router_sx_write(comp, nad);
 
+    if(!comp->throttled) {
         log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] throttling packets on request", comp->ip, comp->port);
-        comp->tq = jqueue_new();
+        comp->throttled = 1;
     }
 
     else {
         log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] unthrottling packets on request", comp->ip, comp->port);
-        tq = comp->tq;
-        comp->tq = NULL;
+        comp->throttled = 0;
+
+        _router_comp_flush(comp);
+    }
+}
+
+/** read the pending bytes when rate limit is no longer in effect */
+static void _router_throttle_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    component_t comp = (component_t) arg;
+    int wait;
 
-        _router_comp_write(comp, nad);
+    if((wait = rate_wait(comp->rate)) > 0) {
+        twheel_add(w, t, wait);
+        return;
+    }
 
-        while((pkt = jqueue_pull(tq)) != NULL)
-            _router_comp_write(comp, pkt);
+    /* sx has to want to read again either way, but while they're paused
+     * it's _router_queue_resume() that starts reading */
+    comp->s->want_read = 1;
 
-        jqueue_free(tq);
+    if(comp->pausers > 0) {
+        log_debug(ZONE, "rate limit over for %d, but it's paused", comp->fd->fd);
+        return;
     }
+
+    log_debug(ZONE, "reading throttled %d", comp->fd->fd);
+    mio_read(comp->r->mio, comp->fd);
 }
 
 static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
@@ -708,8 +1085,11 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                         comp->rate_log = 1;
                     }
 
+                    /* stop reading (but not writing), and pick up again when the next byte is allowed */
                     log_debug(ZONE, "%d is throttled, delaying read", comp->fd->fd);
+                    twheel_add(comp->r->timers, &comp->throttle_timer, rate_wait(comp->rate));
 
+                    s->want_read = 0;
                     buf->len = 0;
                     return 0;
                 }
@@ -760,9 +1140,15 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", comp->fd->fd);
 
-            len = send(comp->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(comp->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(comp->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -975,26 +1361,14 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 }
 
 static int _router_accept_check(router_t r, mio_fd_t fd, const char *ip) {
-    rate_t rt;
-
     if(access_check(r->access, ip) == 0) {
         log_write(r->log, LOG_NOTICE, "[%d] [%s] access denied by configuration", fd->fd, ip);
         return 1;
     }
 
-    if(r->conn_rate_total != 0) {
-        rt = (rate_t) xhash_get(r->conn_rates, ip);
-        if(rt == NULL) {
-            rt = rate_new(r->conn_rate_total, r->conn_rate_seconds, r->conn_rate_wait);
-            xhash_put(r->conn_rates, pstrdup(xhash_pool(r->conn_rates), ip), (void *) rt);
-        }
-
-        if(rate_check(rt) == 0) {
-            log_write(r->log, LOG_NOTICE, "[%d] [%s] is being rate limited", fd->fd, ip);
-            return 1;
-        }
-
-        rate_add(rt, 1);
+    if(r->conn_rates != NULL && rate_table_check(r->conn_rates, ip) == 0) {
+        log_write(r->log, LOG_NOTICE, "[%d] [%s] is being rate limited", fd->fd, ip);
+        return 1;
     }
 
     return 0;
@@ -1026,16 +1400,23 @@ static void _router_route_unbind_walker(const char *key, int keylen, void *val,
 }
 
 int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
-    component_t comp = (component_t) arg;
+    component_t comp = (component_t) arg, target;
     router_t r = (router_t) arg;
     struct sockaddr_storage sa;
     socklen_t namelen = sizeof(sa);
-    int port, nbytes;
+    int port, nbytes, ret;
+    union xhashv xhv;
 
     switch(a) {
         case action_READ:
             log_debug(ZONE, "read action on fd %d", fd->fd);
 
+            /* held back until the queues they fill drain */
+            if(comp->pausers > 0) {
+                log_debug(ZONE, "%d is paused, not reading", fd->fd);
+                return 0;
+            }
+
             /* they did something */
             comp->last_activity = time(NULL);
 
@@ -1053,7 +1434,15 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
            /* update activity timestamp */
             comp->last_activity = time(NULL);
 
-            return sx_can_write(comp->s);
+            ret = sx_can_write(comp->s);
+
+            /* the stream has room again, top it up */
+            if(comp->oq->packets > 0 && comp->s->state < state_CLOSING) {
+                _router_comp_flush(comp);
+                ret = comp->s->want_write;
+            }
+
+            return ret;
 
         case action_CLOSE:
             log_debug(ZONE, "close action on fd %d", fd->fd);
@@ -1070,10 +1459,24 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
 
             xhash_free(comp->routes);
 
-            if(comp->tq != NULL)
-                /* !!! bounce packets */
-                jqueue_free(comp->tq);
+            /* let go of the senders we held back, and make sure nobody holds a pointer to us */
+            _router_queue_resume(comp);
+            xhash_free(comp->paused);
 
+            if(comp->pausers > 0 && xhash_iter_first(r->components))
+                do {
+                    xhv.comp_val = &target;
+                    xhash_iter_get(r->components, NULL, NULL, xhv.val);
+                    xhash_zap(target->paused, comp->ipport);
+                } while(xhash_iter_next(r->components));
+
+            if(comp->oq->queued > 0)
+                log_write(r->log, LOG_INFO, "[%s, port=%d] output queue: %lu queued, %lu dropped, %lu bounced, %lu senders paused, %d packets left", comp->ip, comp->port, comp->oq->queued, comp->oq->dropped, comp->oq->bounced, comp->oq->pauses, comp->oq->packets);
+
+            /* !!! bounce packets */
+            outq_free(comp->oq);
+
+            twheel_del(r->timers, &comp->throttle_timer);
             rate_free(comp->rate);
 
             jqueue_push(comp->r->dead, (void *) comp->s, 0);
@@ -1107,19 +1510,27 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
             comp->s = sx_new(r->sx_env, fd->fd, _router_sx_callback, (void *) comp);
             mio_app(m, fd, router_mio_callback, (void *) comp);
 
+            if(r->io_read_buffer_max != 0)
+                comp->s->rbufmax = r->io_read_buffer_max;
+
             if(r->byte_rate_total != 0)
                 comp->rate = rate_new(r->byte_rate_total, r->byte_rate_seconds, r->byte_rate_wait);
 
+            twheel_timer_init(&comp->throttle_timer, _router_throttle_timer, (void *) comp);
+
             comp->routes = xhash_new(51);
 
+            comp->oq = outq_new();
+            comp->paused = xhash_new(11);
+
             /* register component */
             log_debug(ZONE, "new component (%p) \"%s\"", comp, comp->ipport);
             xhash_put(r->components, comp->ipport, (void *) comp);
 
 #ifdef HAVE_SSL
-            sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER);
+            sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER | SX_BINARY_OFFER | SX_WRITEV | SX_NAD_RAW);
 #else
-            sx_server_init(comp->s, SX_SASL_OFFER);
+            sx_server_init(comp->s, SX_SASL_OFFER | SX_BINARY_OFFER | SX_WRITEV | SX_NAD_RAW);
 #endif
 
             break;
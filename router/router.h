@@ -53,6 +53,61 @@ typedef struct component_st *component_t;
 typedef struct routes_st    *routes_t;
 typedef struct alias_st     *alias_t;
 
+typedef struct outq_st      *outq_t;
+
+/** kinds of packets, for the output queue policies */
+typedef enum {
+    outq_OTHER = 0,             /**< anything that isn't a stanza */
+    outq_PRESENCE = 1,
+    outq_MESSAGE = 2,
+    outq_IQ = 3
+} outq_kind_t;
+
+#define outq_KINDS  (4)
+
+/** what to do with a packet that doesn't fit in an output queue */
+typedef enum {
+    outq_DROP = 0,              /**< drop it */
+    outq_DROP_OLDEST = 1,       /**< make room by dropping the oldest queued packets with this policy */
+    outq_BOUNCE = 2             /**< bounce it to its sender (resource-constraint) */
+} outq_policy_t;
+
+/** routes handed to a component's stream before it has written them,
+  * the rest wait in the output queue. one writev's worth */
+#define ROUTER_STREAM_QUEUE     (SX_WRITEV_MAX_IOV)
+
+/** a packet in an output queue */
+typedef struct outq_pkt_st *outq_pkt_t;
+struct outq_pkt_st {
+    nad_t               nad;
+    int                 kind;
+    int                 bytes;
+    unsigned long       seq;
+
+    outq_pkt_t          prev, next;     /**< all of them, oldest first */
+    outq_pkt_t          knext;          /**< the next one of the same kind */
+};
+
+/** an output queue */
+struct outq_st {
+    outq_pkt_t          first, last;
+    outq_pkt_t          kfirst[outq_KINDS], klast[outq_KINDS];
+
+    int                 packets;
+    int                 bytes;
+    unsigned long       seq;
+
+    /** the most it held since it was last reported */
+    int                 peak_packets;
+    int                 peak_bytes;
+
+    /** totals */
+    unsigned long       queued;
+    unsigned long       dropped;
+    unsigned long       bounced;
+    unsigned long       pauses;
+};
+
 typedef struct acl_s *acl_t;
 struct acl_s {
     int error;
@@ -100,6 +155,15 @@ struct router_st {
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** max fds to take from each poll */
+    int                 io_max_events;
+
+    /** largest read buffer a stream may grow */
+    int                 io_read_buffer_max;
+
+    /** edge triggered polling */
+    int                 io_edge_triggered;
+
     /** access controls */
     access_t            access;
 
@@ -108,13 +172,24 @@ struct router_st {
     int                 conn_rate_seconds;
     int                 conn_rate_wait;
 
-    xht                 conn_rates;
+    rate_table_t        conn_rates;
 
     /** default byte rates (karma) */
     int                 byte_rate_total;
     int                 byte_rate_seconds;
     int                 byte_rate_wait;
 
+    /** output queue limits, 0 is no limit */
+    int                 queue_packets;
+    int                 queue_bytes;
+
+    /** watermarks, percent of the limits */
+    int                 queue_high;
+    int                 queue_low;
+
+    /** what happens to each kind of packet that doesn't fit */
+    int                 queue_policy[outq_KINDS];
+
     /** sx environment */
     sx_env_t            sx_env;
     sx_plugin_t         sx_ssl;
@@ -126,12 +201,18 @@ struct router_st {
     /** listening socket */
     mio_fd_t            fd;
 
+    /** component timers */
+    twheel_t            timers;
+
     /** time checks */
     int                 check_interval;
     int                 check_keepalive;
 
     time_t              next_check;
 
+    /** points each component gets on a multi route's hash ring, 0 hashes modulo the component count */
+    int                 multi_vnodes;
+
     /** attached components, key is 'ip:port', var is component_t */
     xht                 components;
 
@@ -178,6 +259,9 @@ struct component_st {
     /** ip:port pair */
     char                ipport[INET6_ADDRSTRLEN + 6];
 
+    /** name it asked to be known by on multi routes, survives reconnects unlike ipport (lives in the routes pool) */
+    const char          *instance;
+
     /** our stream */
     sx_t                s;
 
@@ -185,14 +269,35 @@ struct component_st {
     rate_t              rate;
     int                 rate_log;
 
+    /** resumes reading once the rate limit is lifted */
+    struct twheel_timer_st  throttle_timer;
+
     /** valid routes to this component, key is route name */
     xht                 routes;
 
     /** true if this is an old component:accept stream */
     int                 legacy;
 
-    /** throttle queue */
-    jqueue_t            tq;
+    /** true if it asked for multicast routes when it bound */
+    int                 multicast;
+
+    /** routes waiting for the stream to take them */
+    outq_t              oq;
+
+    /** true if it asked us to hold its packets */
+    int                 throttled;
+
+    /** true from when the output queue passes the high watermark until it drains to the low one */
+    int                 congested;
+
+    /** senders we stopped reading from while congested, key is 'ip:port' */
+    xht                 paused;
+
+    /** congested components that stopped us reading */
+    int                 pausers;
+
+    /** true once we've logged that the output queue is full */
+    int                 queue_log;
 
     /** timestamps for idle timeouts */
     time_t              last_activity;
@@ -205,12 +310,22 @@ typedef enum {
     route_MULTI_FROM = 0x11,     /**< multi component route - route by 'from' */
 } route_type_t;
 
+/** a point on a multi route's hash ring */
+typedef struct route_point_st {
+    unsigned int        hash;
+    component_t         comp;
+} *route_point_t;
+
 struct routes_st
 {
     const char          *name;
     route_type_t        rtype;
     component_t         *comp;
     int                 ncomp;
+
+    /** hash ring, sorted by hash, rebuilt when a component joins or leaves */
+    route_point_t       ring;
+    int                 nring;
 };
 
 struct alias_st {
@@ -238,6 +353,15 @@ int     message_log(nad_t nad, router_t r, const char *msg_from, const char *msg
 
 void routes_free(routes_t routes);
 
+outq_t  outq_new(void);
+void    outq_free(outq_t oq);
+int     outq_kind(nad_t nad);
+int     outq_bytes(nad_t nad);
+void    outq_push(outq_t oq, nad_t nad, int kind, int bytes);
+nad_t   outq_pull(outq_t oq);
+nad_t   outq_pull_kind(outq_t oq, int kind);
+int     outq_oldest(outq_t oq, int *kinds, int nkinds);
+
 /* union for xhash_iter_get to comply with strict-alias rules for gcc3 */
 union xhashv
 {
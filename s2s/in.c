@@ -60,13 +60,32 @@ static void _in_result(conn_t in, nad_t nad);
 static void _in_verify(conn_t in, nad_t nad);
 static void _in_packet(conn_t in, nad_t nad);
 
+/** idle timeout, disconnect streams through which no packets have been sent for <idle> seconds */
+static void _in_activity_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    conn_t in = (conn_t) arg;
+    s2s_t s2s = in->s2s;
+    time_t now = time(NULL);
+
+    if(in->online && in->last_packet > 0 && now > in->last_packet + s2s->check_idle && in->s->state >= state_STREAM) {
+        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", in->fd->fd, in->ip, in->port);
+        sx_close(in->s);
+        return;
+    }
+
+    /* not idle long enough yet, come back when it could be */
+    if(in->last_packet > 0 && in->last_packet + s2s->check_idle + 1 > now)
+        twheel_add(w, t, (int) (in->last_packet + s2s->check_idle + 1 - now) * 1000);
+    else
+        twheel_add(w, t, s2s->check_interval * 1000);
+}
+
 int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     conn_t in = (conn_t) arg;
     s2s_t s2s = (s2s_t) arg;
     struct sockaddr_storage sa;
     socklen_t namelen = sizeof(sa);
     int port, nbytes, flags = 0;
-    char ipport[INET6_ADDRSTRLEN + 17];
+    char ipport[INET6_ADDRSTRLEN + 17], rstats[160];
 
     switch(a) {
         case action_READ:
@@ -90,7 +109,8 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             if (fd == s2s->server_fd) break;
 
             /* !!! logging */
-            log_write(in->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, in->ip, in->port, in->packet_count);
+            sx_read_stats(in->s, rstats, sizeof(rstats));
+            log_write(in->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i, %s", fd->fd, in->ip, in->port, in->packet_count, rstats);
 
             jqueue_push(in->s2s->dead, (void *) in->s, 0);
 
@@ -102,6 +122,8 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
                 xhash_zap(in->s2s->in_accept, ipport);
             }
 
+            twheel_del(in->s2s->timers, &in->activity_timer);
+
             jqueue_push(in->s2s->dead_conn, (void *) in, 0);
 
             break;
@@ -137,11 +159,18 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             if(s2s->stanza_size_limit != 0)
                 in->s->rbytesmax = s2s->stanza_size_limit;
 
+            if(s2s->io_read_buffer_max != 0)
+                in->s->rbufmax = s2s->io_read_buffer_max;
+
+            twheel_timer_init(&in->activity_timer, _in_activity_timer, (void *) in);
+            if(s2s->check_interval > 0 && s2s->check_idle > 0)
+                twheel_add(s2s->timers, &in->activity_timer, (s2s->check_idle + 1) * 1000);
+
             /* add to incoming connections hash */
             snprintf(ipport, INET6_ADDRSTRLEN + 16, "%s/%d", in->ip, in->port);
             xhash_put(s2s->in_accept, pstrdup(xhash_pool(s2s->in_accept),ipport), (void *) in);
 
-            flags = S2S_DB_HEADER;
+            flags = S2S_DB_HEADER | SX_WRITEV;
 #ifdef HAVE_SSL
             if(s2s->sx_ssl != NULL)
                 flags |= SX_SSL_STARTTLS_OFFER;
@@ -211,9 +240,15 @@ static int _in_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", in->fd->fd);
 
-            len = send(in->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(in->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(in->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -112,6 +112,8 @@ static void _s2s_config_expand(s2s_t s2s) {
     s2s->router_private_key_password = config_get_one(s2s->config, "router.private_key_password", 0);
     s2s->router_ciphers = config_get_one(s2s->config, "router.ciphers", 0);
 
+    s2s->router_binary = (config_get(s2s->config, "router.binary") != NULL);
+
     s2s->retry_init = j_atoi(config_get_one(s2s->config, "router.retry.init", 0), 3);
     s2s->retry_lost = j_atoi(config_get_one(s2s->config, "router.retry.lost", 0), 3);
     if((s2s->retry_sleep = j_atoi(config_get_one(s2s->config, "router.retry.sleep", 0), 2)) < 1)
@@ -193,6 +195,11 @@ static void _s2s_config_expand(s2s_t s2s) {
     s2s->local_ciphers = config_get_one(s2s->config, "local.ciphers", 0);
 
     s2s->io_max_fds = j_atoi(config_get_one(s2s->config, "io.max_fds", 0), 1024);
+    s2s->io_max_events = j_atoi(config_get_one(s2s->config, "io.max_events", 0), 0);
+    s2s->io_read_buffer_max = j_atoi(config_get_one(s2s->config, "io.read_buffer_max", 0), 0);
+    nad_cache_max(j_atoi(config_get_one(s2s->config, "io.nad_cache", 0), NAD_CACHE_MAX));
+    jid_cache_max(j_atoi(config_get_one(s2s->config, "io.jid_cache", 0), JID_CACHE_MAX));
+    s2s->io_edge_triggered = (config_get(s2s->config, "io.edge_triggered") != NULL);
 
     s2s->compression = (config_get(s2s->config, "io.compression") != NULL);
 
@@ -300,7 +307,7 @@ static int _s2s_router_connect(s2s_t s2s) {
     }
 
     s2s->router = sx_new(s2s->sx_env, s2s->fd->fd, s2s_router_sx_callback, (void *) s2s);
-    sx_client_init(s2s->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(s2s->router, SX_WRITEV | (s2s->router_binary ? SX_BINARY_OFFER : 0), NULL, NULL, NULL, "1.0");
 
     return 0;
 }
@@ -336,6 +343,8 @@ int _s2s_check_conn_routes(s2s_t s2s, conn_t conn, const char *direction)
                  /* close connection as per XMPP/RFC3920 */
                  sx_close(conn->s);
 
+                 xhash_iter_done(conn->states);
+
                  /* indicate that we closed the connection */
                  return 0;
               }
@@ -507,75 +516,6 @@ static void _s2s_time_checks(s2s_t s2s) {
 
     }
 
-    /* keepalives */
-    if(s2s->out_reuse) {
-        if(xhash_iter_first(s2s->out_host))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_host, NULL, NULL, xhv.val);
-
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
-
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_host));
-    } else {
-        if(xhash_iter_first(s2s->out_dest))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_dest, NULL, NULL, xhv.val);
-
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
-
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_dest));
-    }
-
-    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
-    if(s2s->check_idle > 0) {
-
-        /* outgoing connections */
-        if(s2s->out_reuse) {
-            if(xhash_iter_first(s2s->out_host))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_host, (const char **) &key, &keylen, xhv.val);
-                    log_debug(ZONE, "checking idle state for %.*s", keylen, key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_host));
-        } else {
-            if(xhash_iter_first(s2s->out_dest))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_dest, (const char **) &key, &keylen, xhv.val);
-                    log_debug(ZONE, "checking idle state for %s (%s)", conn->dkey, conn->key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_dest));
-        }
-
-        /* incoming connections */
-        if(xhash_iter_first(s2s->in))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->in, (const char **) &key, &keylen, xhv.val);
-                log_debug(ZONE, "checking idle state for %.*s", keylen, key);
-                if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                    log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                    sx_close(conn->s);
-                }
-            } while(xhash_iter_next(s2s->in));
-
-    }
-
     return;
 }
 
@@ -844,6 +784,7 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     dnsres_t res;
     union xhashv xhv;
     time_t check_time = 0, now = 0;
+    int mio_timeout, t;
     const char *cli_id = 0;
 
 #ifdef HAVE_UMASK
@@ -944,6 +885,8 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     s2s->in = xhash_new(401);
     s2s->in_accept = xhash_new(401);
     s2s->dnscache = xhash_new(401);
+
+    s2s->timers = twheel_new(100);
     s2s->dns_bad = xhash_new(401);
 
     s2s->dead = jqueue_new();
@@ -979,6 +922,10 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
         sx_env_plugin(s2s->sx_env, sx_compress_init);
 #endif
 
+    /* binary frames to the router, if it'll have them */
+    if(s2s->router_binary)
+        sx_env_plugin(s2s->sx_env, sx_binary_init);
+
     /* get sasl online */
     s2s->sx_sasl = sx_env_plugin(s2s->sx_env, sx_sasl_init, "xmpp", NULL, NULL);
     if(s2s->sx_sasl == NULL) {
@@ -992,7 +939,7 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
 
     s2s->sx_db = sx_env_plugin(s2s->sx_env, s2s_db_init);
 
-    s2s->mio = mio_new(s2s->io_max_fds);
+    s2s->mio = mio_new_ex(s2s->io_max_fds, s2s->io_max_events, s2s->io_edge_triggered ? MIO_EDGE_TRIGGERED : 0);
 
     if((s2s->udns_fd = dns_init(NULL, 1)) < 0) {
         log_write(s2s->log, LOG_ERR, "unable to initialize dns library, aborting");
@@ -1004,7 +951,19 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     _s2s_router_connect(s2s);
 
     while(!s2s_shutdown) {
-        mio_run(s2s->mio, dns_timeouts(0, 5, time(NULL)));
+        mio_timeout = dns_timeouts(0, 5, time(NULL));
+        if(mio_timeout > 0)
+            mio_timeout *= 1000;
+        if(twheel_count(s2s->timers) > 0 && mio_timeout != 0) {
+            t = twheel_timeout(s2s->timers, 5000);
+            if(mio_timeout < 0 || t < mio_timeout)
+                mio_timeout = t;
+        }
+
+        mio_run(s2s->mio, mio_timeout);
+
+        /* idle timeouts and keepalives */
+        twheel_run(s2s->timers);
 
         now = time(NULL);
 
@@ -1104,6 +1063,9 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
 
     log_write(s2s->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_log(s2s->log);
+    jid_cache_log(s2s->log);
+
     /* close active streams gracefully  */
     xhv.conn_val = &conn;
     if(s2s->out_reuse) {
@@ -1230,6 +1192,8 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
 
     mio_free(s2s->mio);
 
+    twheel_free(s2s->timers);
+
     log_free(s2s->log);
 
     config_free(s2s->config);
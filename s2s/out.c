@@ -108,6 +108,41 @@ static void _out_verify(conn_t out, nad_t nad);
 static void _dns_result_aaaa(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data);
 static void _dns_result_a(struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data);
 
+/** keepalives and idle timeouts, re-armed for whichever is due first */
+static void _out_activity_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    conn_t out = (conn_t) arg;
+    s2s_t s2s = out->s2s;
+    time_t now = time(NULL), next = 0, when;
+
+    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
+    if(s2s->check_idle > 0 && out->last_packet > 0) {
+        if(now > out->last_packet + s2s->check_idle && out->s->state >= state_STREAM) {
+            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", out->fd->fd, out->ip, out->port);
+            sx_close(out->s);
+            return;
+        }
+
+        next = out->last_packet + s2s->check_idle + 1;
+    }
+
+    if(s2s->check_keepalive > 0 && out->last_activity > 0) {
+        if(now > out->last_activity + s2s->check_keepalive && out->s->state >= state_STREAM) {
+            log_debug(ZONE, "sending keepalive for %d", out->fd->fd);
+
+            sx_raw_write(out->s, " ", 1);
+        }
+
+        when = out->last_activity + s2s->check_keepalive + 1;
+        if(next == 0 || when < next)
+            next = when;
+    }
+
+    if(next <= now)
+        next = now + s2s->check_interval;
+
+    twheel_add(w, t, (int) (next - now) * 1000);
+}
+
 /** queue the packet */
 static void _out_packet_queue(s2s_t s2s, pkt_t pkt) {
     char *rkey = s2s_route_key(NULL, pkt->from->domain, pkt->to->domain);
@@ -521,6 +556,10 @@ int out_route(s2s_t s2s, const char *route, int routelen, conn_t *out, int allow
 
             (*out)->init_time = time(NULL);
 
+            twheel_timer_init(&(*out)->activity_timer, _out_activity_timer, (void *) *out);
+            if(s2s->check_interval > 0 && (s2s->check_keepalive > 0 || s2s->check_idle > 0))
+                twheel_add(s2s->timers, &(*out)->activity_timer, s2s->check_interval * 1000);
+
             if (s2s->out_reuse)
                 xhash_put(s2s->out_host, (*out)->key, (void *) *out);
             xhash_put(s2s->out_dest, s2s->out_reuse ? pstrdup(xhash_pool((*out)->routes), dkey) : dkey, (void *) *out);
@@ -570,15 +609,18 @@ int out_route(s2s_t s2s, const char *route, int routelen, conn_t *out, int allow
 
                 (*out)->s = sx_new(s2s->sx_env, (*out)->fd->fd, _out_sx_callback, (void *) *out);
 
+                if(s2s->io_read_buffer_max != 0)
+                    (*out)->s->rbufmax = s2s->io_read_buffer_max;
+
 #ifdef HAVE_SSL
                 /* Send a stream version of 1.0 if we can do STARTTLS */
                 if(s2s->sx_ssl != NULL) {
-                    sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, dkey, pstrdupx(xhash_pool((*out)->routes), route, from_len), "1.0");
+                    sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, dkey, pstrdupx(xhash_pool((*out)->routes), route, from_len), "1.0");
                 } else {
-                    sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, NULL, NULL, NULL);
+                    sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, NULL, NULL, NULL);
                 }
 #else
-                sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, NULL, NULL, NULL);
+                sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, NULL, NULL, NULL);
 #endif
                 /* dkey is now used by the hash table */
                 return 0;
@@ -690,6 +732,7 @@ int out_packet(s2s_t s2s, pkt_t pkt) {
                pkt->nad->elems[0].my_ns = -1;
                pkt->nad->elems[1].ns = -1;
                pkt->nad->elems[1].my_ns = -1;
+               NAD_DIRTY(pkt->nad);
             }
 
             /* send it out */
@@ -1284,7 +1327,7 @@ void out_resolve(s2s_t s2s, const char *domain, xht results, time_t expiry) {
 /** mio callback for outgoing conns */
 static int _out_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
     conn_t out = (conn_t) arg;
-    char ipport[INET6_ADDRSTRLEN + 17];
+    char ipport[INET6_ADDRSTRLEN + 17], rstats[160];
     int nbytes;
 
     switch(a) {
@@ -1315,7 +1358,8 @@ static int _out_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, v
 
             jqueue_push(out->s2s->dead, (void *) out->s, 0);
 
-            log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, out->ip, out->port, out->packet_count);
+            sx_read_stats(out->s, rstats, sizeof(rstats));
+            log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i, %s", fd->fd, out->ip, out->port, out->packet_count, rstats);
 
 
             if (out->s2s->out_reuse) {
@@ -1388,6 +1432,8 @@ static int _out_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, v
                 } while(xhash_iter_next(out->routes));
             }
 
+            twheel_del(out->s2s->timers, &out->activity_timer);
+
             jqueue_push(out->s2s->dead_conn, (void *) out, 0);
 
         case action_ACCEPT:
@@ -1479,9 +1525,15 @@ static int _out_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", out->fd->fd);
 
-            len = send(out->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(out->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(out->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
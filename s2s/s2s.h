@@ -77,6 +77,7 @@ struct s2s_st {
     const char          *router_private_key_password;
     const char          *router_ciphers;
     int                 router_default;
+    int                 router_binary;
 
     /** mio context */
     mio_t               mio;
@@ -147,6 +148,15 @@ struct s2s_st {
     /** max file descriptors */
     int                 io_max_fds;
 
+    /** max fds to take from each poll */
+    int                 io_max_events;
+
+    /** largest read buffer a stream may grow */
+    int                 io_read_buffer_max;
+
+    /** edge triggered polling */
+    int                 io_edge_triggered;
+
     /** maximum stanza size */
     int                 stanza_size_limit;
 
@@ -182,6 +192,9 @@ struct s2s_st {
     time_t              next_check;
     time_t              next_expiry;
 
+    /** connection timers */
+    twheel_t            timers;
+
     /** Apple security options */
 	int					require_tls;
 	int					enable_whitelist;
@@ -283,6 +296,9 @@ struct conn_st {
     time_t              last_activity;
     time_t              last_packet;
 
+    /** idle timeout / keepalive */
+    struct twheel_timer_st  activity_timer;
+
     unsigned int        packet_count;
 };
 
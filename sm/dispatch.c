@@ -32,9 +32,9 @@ void dispatch(sm_t sm, pkt_t pkt) {
     user_t user;
     mod_ret_t ret;
 
-    /* handle broadcasts */
+    /* handle broadcasts, the only ones we know about are user data changes from other sms */
     if(pkt->rtype == route_BROADCAST) {
-        log_debug(ZONE, "can't handle broadcast routes (yet), dropping");
+        user_cache_notified(sm, pkt->nad);
         pkt_free(pkt);
         return;
     }
@@ -81,6 +81,10 @@ void dispatch(sm_t sm, pkt_t pkt) {
         return;
     }
 
+    /* their data is being fetched, this waits for it (in-router modules may want it too, session traffic waits in mod_session) */
+    if(pkt->to != NULL && *pkt->to->node != '\0' && nad_find_namespace(pkt->nad, 1, uri_SESSION, NULL) < 0 && user_load_async(sm, pkt->to, pkt))
+        return;
+
     /* preprocessing */
     if (pkt != NULL && pkt->sm != NULL) {
         ret = mm_in_router(pkt->sm->mm, pkt);
@@ -145,6 +149,8 @@ void dispatch(sm_t sm, pkt_t pkt) {
         return;
     }
 
+    user->busy++;
+
     if (pkt->sm != NULL) {
         ret = mm_pkt_user(pkt->sm->mm, user, pkt);
         switch(ret) {
@@ -166,7 +172,9 @@ void dispatch(sm_t sm, pkt_t pkt) {
         }
     }
 
-    /* if they have no sessions, they were only loaded to do delivery, so free them */
-    if(user->sessions == NULL)
-        user_free(user);
+    user->busy--;
+
+    /* if they have no sessions, they were only loaded to do delivery, so let them go (after any others waiting for them) */
+    if(user->sessions == NULL && !user_loading(sm, user->jid))
+        user_release(user);
 }
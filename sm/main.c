@@ -128,6 +128,14 @@ static void _sm_config_expand(sm_t sm)
 
     sm->router_private_key_password = config_get_one(sm->config, "router.private_key_password", 0);
     sm->router_ciphers = config_get_one(sm->config, "router.ciphers", 0);
+    sm->router_instance = config_get_one(sm->config, "router.instance", 0);
+    sm->router_binary = (config_get(sm->config, "router.binary") != NULL);
+
+    sm->local_delivery = config_get(sm->config, "local.delivery") != NULL;
+    sm->local_mirror = config_get(sm->config, "local.delivery.mirror") != NULL;
+
+    nad_cache_max(j_atoi(config_get_one(sm->config, "io.nad_cache", 0), NAD_CACHE_MAX));
+    jid_cache_max(j_atoi(config_get_one(sm->config, "io.jid_cache", 0), JID_CACHE_MAX));
 
     sm->retry_init = j_atoi(config_get_one(sm->config, "router.retry.init", 0), 3);
     sm->retry_lost = j_atoi(config_get_one(sm->config, "router.retry.lost", 0), 3);
@@ -206,14 +214,30 @@ static int _sm_router_connect(sm_t sm) {
     }
 
     sm->router = sx_new(sm->sx_env, sm->fd->fd, sm_sx_callback, (void *) sm);
-    sx_client_init(sm->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(sm->router, SX_WRITEV | (sm->router_binary ? SX_BINARY_OFFER : 0), NULL, NULL, NULL, "1.0");
+
+    return 0;
+}
+
+/** storage workers finished something */
+static int _sm_storage_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    sm_t sm = (sm_t) arg;
+
+    switch(a) {
+        case action_READ:
+            storage_async_run(sm->st);
+            return 1;
+
+        default:
+            break;
+    }
 
     return 0;
 }
 
 JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server: Session Manager", "jabberd2router\0")
 {
-    int optchar;
+    int optchar, fd;
     sess_t sess;
     char id[1024];
 #ifdef POOL_DEBUG
@@ -366,6 +390,16 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     sm->sessions = xhash_new(401);
 
     sm->users = xhash_new(401);
+    sm->loading = xhash_new(101);
+    sm->load_batch = jqueue_new();
+    sm->local = jqueue_new();
+    sm->fanouts = jqueue_new();
+    sm->fanout_last = xhash_new(101);
+    sm->load_batch_max = j_atoi(config_get_one(sm->config, "storage.batch", 0), 64);
+    if(sm->load_batch_max < 1)
+        sm->load_batch_max = 1;
+
+    user_cache_init(sm);
 
     sm->query_rates = xhash_new(101);
 
@@ -381,6 +415,10 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     }
 #endif
 
+    /* binary frames to the router, if it'll have them */
+    if(sm->router_binary)
+        sx_env_plugin(sm->sx_env, sx_binary_init);
+
     /* get sasl online */
     sm->sx_sasl = sx_env_plugin(sm->sx_env, sx_sasl_init, "xmpp", NULL, NULL);
     if(sm->sx_sasl == NULL) {
@@ -390,6 +428,12 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     sm->mio = mio_new(MIO_MAXFD);
 
+    /* database calls off the main loop */
+    if((fd = storage_async_start(sm->st, j_atoi(config_get_one(sm->config, "storage.workers", 0), 0))) >= 0) {
+        sm->st_fd = mio_register(sm->mio, fd, _sm_storage_mio_callback, (void *) sm);
+        mio_read(sm->mio, sm->st_fd);
+    }
+
     /* vHosts map */
     sm->hosts = xhash_new(1021);
     _sm_hosts_expand(sm);
@@ -398,7 +442,16 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     _sm_router_connect(sm);
     
     while(!sm_shutdown) {
-        mio_run(sm->mio, 5);
+        mio_run(sm->mio, 5000);
+
+        /* ask for the users that turned up this time round */
+        user_load_flush(sm);
+
+        /* write out buffered replaces that have waited long enough */
+        storage_flush(sm->st, 0);
+
+        /* drop old cached users, tell the other sms what we wrote */
+        user_cache_run(sm);
 
         if(sm_logrotate) {
             set_debug_log_from_config(sm->config);
@@ -408,6 +461,8 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
             sm->log = log_new(sm->log_type, sm->log_ident, sm->log_facility);
             log_write(sm->log, LOG_NOTICE, "log started");
 
+            user_cache_stats(sm);
+
             sm_logrotate = 0;
         }
 
@@ -444,6 +499,14 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     log_write(sm->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_log(sm->log);
+    jid_cache_log(sm->log);
+
+    /* let the users still being fetched have their packets */
+    user_load_flush(sm);
+    storage_async_stop(sm->st);
+    if(sm->st_fd != NULL) mio_close(sm->mio, sm->st_fd);
+
     /* shut down sessions */
     if(xhash_iter_first(sm->sessions))
         do {
@@ -454,6 +517,9 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     xhash_free(sm->sessions);
 
+    /* users are left in the cache by the ended sessions */
+    user_cache_free(sm);
+
     if (sm->fd) mio_close(sm->mio, sm->fd);
     mio_free(sm->mio);
 
@@ -466,6 +532,11 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     xhash_free(sm->xmlns);
     xhash_free(sm->xmlns_refcount);
     xhash_free(sm->users);
+    xhash_free(sm->loading);
+    jqueue_free(sm->load_batch);
+    jqueue_free(sm->local);
+    jqueue_free(sm->fanouts);
+    xhash_free(sm->fanout_last);
     xhash_free(sm->hosts);
     xhash_free(sm->query_rates);
 
@@ -67,12 +67,16 @@ static void _active_user_delete(mod_instance_t mi, jid_t jid) {
     storage_delete(mi->sm->st, "active", jid_user(jid), NULL);
 }
 
+/** fetched ahead by the storage workers */
+static const char *_active_user_load_types[] = { "active", NULL };
+
 DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     module_t mod = mi->mod;
 
     if(mod->init) return 0;
 
     mod->user_load = _active_user_load;
+    mod->user_load_types = _active_user_load_types;
     mod->user_create = _active_user_create;
     mod->user_delete = _active_user_delete;
 
@@ -171,11 +171,21 @@ static mod_ret_t _announce_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
     return mod_PASS;
 }
 
+/** who a broadcast went to, their motd times are written out together afterwards */
+typedef struct announce_sent_st {
+    moddata_t   data;
+    const char  **owners;
+    os_t        *os;
+    int         n;
+} *announce_sent_t;
+
 static void _announce_broadcast_user(const char *key, int keylen, void *val, void *arg) {
     user_t user = (user_t) val;
-    moddata_t data = (moddata_t) arg;
+    announce_sent_t sent = (announce_sent_t) arg;
+    moddata_t data = sent->data;
     sess_t sess;
     nad_t nad;
+    int stored = 0;
 
     for(sess = user->sessions; sess != NULL; sess = sess->next) {
         if(!sess->available || sess->pri < 0)
@@ -190,7 +200,13 @@ static void _announce_broadcast_user(const char *key, int keylen, void *val, voi
         pkt_router(pkt_new(user->sm, nad));
 
         sess->user->module_data[data->index] = (void *) data->t;
-        storage_replace(sess->user->sm->st, "motd-times", jid_user(sess->jid), NULL, data->tos);
+
+        if(!stored) {
+            sent->owners[sent->n] = jid_user(sess->jid);
+            sent->os[sent->n] = data->tos;
+            sent->n++;
+            stored = 1;
+        }
     }
 }
 
@@ -205,6 +221,7 @@ static mod_ret_t _announce_pkt_sm(mod_instance_t mi, pkt_t pkt) {
     os_object_t o;
     st_ret_t ret;
     int elem;
+    struct announce_sent_st sent;
 
     /* time of this packet */
     t = time(NULL);
@@ -299,9 +316,22 @@ static mod_ret_t _announce_pkt_sm(mod_instance_t mi, pkt_t pkt) {
     /* hack */
     nad = data->nad;
     data->nad = pkt->nad;
-    xhash_walk(mod->mm->sm->users, _announce_broadcast_user, (void *) data);
+
+    sent.data = data;
+    sent.owners = (const char **) malloc(sizeof(char *) * (xhash_count(mod->mm->sm->users) + 1));
+    sent.os = (os_t *) malloc(sizeof(os_t) * (xhash_count(mod->mm->sm->users) + 1));
+    sent.n = 0;
+
+    xhash_walk(mod->mm->sm->users, _announce_broadcast_user, (void *) &sent);
     data->nad = nad;
 
+    /* one go for everyone, rather than a write per user */
+    if(sent.n > 0)
+        storage_replace_multi(mod->mm->sm->st, "motd-times", sent.owners, sent.n, sent.os);
+
+    free(sent.owners);
+    free(sent.os);
+
     /* done */
     pkt_free(pkt);
 
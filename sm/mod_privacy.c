@@ -645,7 +645,7 @@ static void _unblock_jid(user_t user, storage_t st, zebra_list_t zlist, jid_t ji
             for(sscan = user->sessions; sscan != NULL; sscan = sscan->next) {
                 /* do not update if session is not available,
                  * we sent presence direct or got error bounce */
-                if(!sscan->available || jid_search(sscan->A, notify_jid) || jid_search(sscan->E, notify_jid))
+                if(!sscan->available || jidset_has(sscan->A, notify_jid) || jidset_has(sscan->E, notify_jid))
                     continue;
     
                 log_debug(ZONE, "updating unblocked %s with presence from %s", jid_full(notify_jid), jid_full(sscan->jid));
@@ -780,7 +780,7 @@ static mod_ret_t _privacy_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
                             for(sscan = sess->user->sessions; sscan != NULL; sscan = sscan->next) {
                                 /* do not update if session is not available,
                                  * we sent presence direct or got error bounce */
-                                if(!sscan->available || jid_search(sscan->A, jidt) || jid_search(sscan->E, jidt))
+                                if(!sscan->available || jidset_has(sscan->A, jidt) || jidset_has(sscan->E, jidt))
                                     continue;
                         
                                 log_debug(ZONE, "forcing unavailable to %s from %s after block", jid_full(jidt), jid_full(sscan->jid));
@@ -1320,12 +1320,16 @@ static void _privacy_free(module_t mod) {
      feature_unregister(mod->mm->sm, uri_PRIVACY);
 }
 
+/** fetched ahead by the storage workers */
+static const char *_privacy_user_load_types[] = { "privacy-items", "privacy-default", NULL };
+
 DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     module_t mod = mi->mod;
 
     if (mod->init) return 0;
 
     mod->user_load = _privacy_user_load;
+    mod->user_load_types = _privacy_user_load_types;
     mod->in_router = _privacy_in_router;
     mod->out_router = _privacy_out_router;
     mod->in_sess = _privacy_in_sess;
@@ -828,6 +828,9 @@ static void _roster_free(module_t mod)
     free(mroster);
 }
 
+/** fetched ahead by the storage workers */
+static const char *_roster_user_load_types[] = { "roster-items", "roster-groups", NULL };
+
 DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     module_t mod = mi->mod;
     mod_roster_t mroster;
@@ -843,6 +846,7 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->in_sess = _roster_in_sess;
     mod->pkt_user = _roster_pkt_user;
     mod->user_load = _roster_user_load;
+    mod->user_load_types = _roster_user_load_types;
     mod->user_delete = _roster_user_delete;
     mod->free = _roster_free;
 
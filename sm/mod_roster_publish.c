@@ -200,6 +200,35 @@ static void _roster_publish_save_item(user_t user, item_t item) {
     os_free(os);
 }
 
+/** fetch the active records of everyone on the published roster in one go, the checks below find them preloaded */
+static int _roster_publish_prefetch_active(user_t user, os_t os, char ***owners) {
+    os_t *active;
+    char *str;
+    jid_t jid;
+    int i, n = 0;
+
+    *owners = (char **) malloc(sizeof(char *) * os_count(os));
+
+    if(os_iter_first(os))
+        do {
+            if(os_object_get_str(os, os_iter_object(os), "jid", &str) && strcmp(str, jid_user(user->jid)) != 0 &&
+               (jid = jid_new(str, -1)) != NULL) {
+                (*owners)[n++] = strdup(jid_user(jid));
+                jid_free(jid);
+            }
+        } while(os_iter_next(os));
+
+    active = (os_t *) malloc(sizeof(os_t) * (n > 0 ? n : 1));
+
+    if(n > 0 && storage_get_multi(user->sm->st, "active", (const char **) *owners, n, NULL, active) == st_SUCCESS)
+        for(i = 0; i < n; i++)
+            storage_preload(user->sm->st, "active", (*owners)[i], active[i] != NULL ? st_SUCCESS : st_NOTFOUND, active[i]);
+
+    free(active);
+
+    return n;
+}
+
 /** publish the roster from the database */
 static int _roster_publish_user_load(mod_instance_t mi, user_t user) {
     roster_publish_t roster_publish = (roster_publish_t) mi->mod->private;
@@ -212,6 +241,8 @@ static int _roster_publish_user_load(mod_instance_t mi, user_t user) {
     int i,j,gpos,found,delete,checksm,tmp_to,tmp_from,tmp_do_change;
     item_t item;
     jid_t jid;
+    char **prefetched = NULL;
+    int nprefetched = 0;
 
     /* update roster to match published roster */
     if( roster_publish->publish) {
@@ -234,7 +265,11 @@ static int _roster_publish_user_load(mod_instance_t mi, user_t user) {
 
         if( storage_get(user->sm->st, (roster_publish->dbtable ? roster_publish->dbtable : "published-roster"), fetchkey, NULL, &os) == st_SUCCESS ) {
             if(os_iter_first(os)) {
+                if( roster_publish->removedomain || roster_publish->fixexist )
+                    nprefetched = _roster_publish_prefetch_active(user, os, &prefetched);
+
                 /* iterate on published roster */
+                os_iter_first(os);
                 jid = NULL;
                 do {
                     o = os_iter_object(os);
@@ -498,6 +533,13 @@ static int _roster_publish_user_load(mod_instance_t mi, user_t user) {
                     } /* if( os_object_get(...) */
                 } while(os_iter_next(os));
                 if( jid ) jid_free(jid);
+
+                /* whatever the checks didn't use */
+                for(i = 0; i < nprefetched; i++) {
+                    storage_preload_drop(user->sm->st, "active", prefetched[i]);
+                    free(prefetched[i]);
+                }
+                if( prefetched ) free(prefetched);
             }
             os_free(os);
         }
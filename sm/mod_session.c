@@ -76,7 +76,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
         attr = nad_find_attr(pkt->nad, 1, -1, "target", NULL);
         if(attr < 0 && pkt->type != pkt_SESS_END) {
             nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -88,12 +88,18 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
         if(pkt->type == pkt_SESS) {
             jid = jid_new(NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
 
+            /* start it once their data is in */
+            if(jid != NULL && user_load_async(sm, jid, pkt)) {
+                jid_free(jid);
+                return mod_HANDLED;
+            }
+
             if(jid != NULL)
                 sess = sess_start(sm, jid);
 
             if(jid == NULL || sess == NULL) {
                 nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-                sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+                sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
                 pkt->nad = NULL;
                 pkt_free(pkt);
@@ -125,7 +131,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
 			nad_set_attr(pkt->nad, 0, -1, "to", sm->id, 0);
 
 			/* inform c2s */
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -140,7 +146,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
 
             if(jid == NULL || user_create(sm, jid) != 0) {
                 nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-                sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+                sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
                 pkt->nad = NULL;
                 pkt_free(pkt);
@@ -152,7 +158,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
 
             /* inform c2s */
             nad_set_attr(pkt->nad, 1, -1, "action", "created", 7);
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -173,7 +179,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
 
             /* inform c2s */
             nad_set_attr(pkt->nad, 1, -1, "action", "deleted", 7);
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -187,7 +193,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
         if(attr < 0) {
             log_debug(ZONE, "no session id, bouncing");
             nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -202,7 +208,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
         if(sess == NULL) {
             log_debug(ZONE, "session %.*s doesn't exist, bouncing", NAD_AVAL_L(pkt->nad, attr), NAD_AVAL(pkt->nad, attr));
             nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -249,7 +255,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
             nad_set_attr(pkt->nad, iq, -1, "type", "result", 6);
     
             /* return the result */
-            sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+            sm_route(sm, stanza_tofrom(pkt->nad, 0));
     
             pkt->nad = NULL;
             pkt_free(pkt);
@@ -262,7 +268,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
     if(attr < 0) {
         log_debug(ZONE, "no session id, bouncing");
         nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-        sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+        sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
         pkt->nad = NULL;
         pkt_free(pkt);
@@ -277,7 +283,7 @@ static mod_ret_t _session_in_router(mod_instance_t mi, pkt_t pkt) {
     if(sess == NULL) {
         log_debug(ZONE, "session %.*s doesn't exist, bouncing", NAD_AVAL_L(pkt->nad, attr), NAD_AVAL(pkt->nad, attr));
         nad_set_attr(pkt->nad, 1, ns, "failed", "1", 1);
-        sx_nad_write(sm->router, stanza_tofrom(pkt->nad, 0));
+        sm_route(sm, stanza_tofrom(pkt->nad, 0));
 
         pkt->nad = NULL;
         pkt_free(pkt);
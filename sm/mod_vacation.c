@@ -238,6 +238,9 @@ static void _vacation_free(module_t mod) {
     feature_unregister(mod->mm->sm, uri_VACATION);
 }
 
+/** fetched ahead by the storage workers */
+static const char *_vacation_user_load_types[] = { "vacation-settings", NULL };
+
 DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     module_t mod = mi->mod;
 
@@ -246,6 +249,7 @@ DLLEXPORT int module_init(mod_instance_t mi, const char *arg) {
     mod->in_sess = _vacation_in_sess;
     mod->pkt_user = _vacation_pkt_user;
     mod->user_load = _vacation_user_load;
+    mod->user_load_types = _vacation_user_load_types;
     mod->user_delete = _vacation_user_delete;
     mod->free = _vacation_free; /* mmm good! :) */
 
@@ -271,6 +271,9 @@ static int _verify_user_load(mod_instance_t mi, user_t user)
     return 0;
 }
 
+/** fetched ahead by the storage workers */
+static const char *_verify_user_load_types[] = { "verify", NULL };
+
 DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     module_t mod = mi->mod;
 
@@ -279,6 +282,7 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     log_debug(ZONE, "mod_verify:init: %p", mi);
     mod->in_sess = _verify_in_sess;
     mod->user_load = _verify_user_load;
+    mod->user_load_types = _verify_user_load_types;
     mod->user_delete = _verify_user_delete;
 
     return 0;
@@ -376,6 +376,41 @@ void pkt_id_new(pkt_t pkt) {
     return;
 }
 
+/** hand a routed packet for one of our own hosts straight to the dispatcher */
+static void _pkt_local(pkt_t pkt) {
+    sm_t sm = pkt->sm;
+    nad_t nad, mnad;
+
+    log_debug(ZONE, "delivering pkt for %s locally", pkt->rto->domain);
+
+    nad = pkt->nad;
+    pkt->nad = NULL;
+    pkt_free(pkt);
+
+    /* the router still sees it, if it wants to log it */
+    if(sm->local_mirror && sm->online) {
+        mnad = nad_copy(nad);
+        nad_set_attr(mnad, 0, -1, "type", "log", 3);
+        sx_nad_write(sm->router, mnad);
+    }
+
+    /* packets sent while delivering are queued behind this one, rather than delivered on top of it */
+    jqueue_push(sm->local, (void *) nad, 0);
+    if(sm->local_busy)
+        return;
+
+    sm->local_busy = 1;
+
+    while((nad = (nad_t) jqueue_pull(sm->local)) != NULL) {
+        /* it goes back in just as it would have come from the router */
+        pkt = pkt_new(sm, nad);
+        if(pkt != NULL)
+            dispatch(sm, pkt);
+    }
+
+    sm->local_busy = 0;
+}
+
 void pkt_router(pkt_t pkt) {
     mod_ret_t ret;
     int ns, scan;
@@ -441,7 +476,13 @@ void pkt_router(pkt_t pkt) {
                 }
             }
 
-            sx_nad_write(pkt->sm->router, pkt->nad);
+            /* one of ours, no need to go round the router */
+            if(pkt->sm->local_delivery && xhash_get(pkt->sm->hosts, pkt->rto->domain) != NULL) {
+                _pkt_local(pkt);
+                return;
+            }
+
+            sm_route(pkt->sm, pkt->nad);
 
             /* nad already free'd, free the rest */
             pkt->nad = NULL;
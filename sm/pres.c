@@ -72,7 +72,7 @@ static void _pres_top(user_t user) {
 void pres_update(sess_t sess, pkt_t pkt) {
     item_t item;
     int self;
-    jid_t scan, next;
+    jid_t scan;
     sess_t sscan;
 
     switch(pkt->type) {
@@ -86,6 +86,9 @@ void pres_update(sess_t sess, pkt_t pkt) {
 
             /* B1: forward to all in T, unless in E */
 
+            /* everyone gets the same presence, so let it go out as multicasts */
+            sm_fanout_begin(sess->user->sm);
+
             /* loop the roster, looking for trusted */
             self = 0;
             if(xhash_iter_first(sess->user->roster))
@@ -103,7 +106,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 }
 
                 /* if they can see us, forward */
-                if(item->from && !jid_search(sess->E, item->jid)) {
+                if(item->from && !jidset_has(sess->E, item->jid)) {
                     log_debug(ZONE, "forwarding available to %s", jid_full(item->jid));
                     pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
                 }
@@ -123,6 +126,8 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 }
             }
 
+            sm_fanout_end(sess->user->sm);
+
             /* update vars */
             sess->available = 1;
 
@@ -145,13 +150,15 @@ void pres_update(sess_t sess, pkt_t pkt) {
 
             /* B2: forward to all in T and A, unless in E */
 
+            sm_fanout_begin(sess->user->sm);
+
             /* loop the roster, looking for trusted */
             if(xhash_iter_first(sess->user->roster))
             do {
                 xhash_iter_get(sess->user->roster, NULL, NULL, (void *) &item);
 
                 /* forward if they're trusted and they're not E */
-                if(item->from && !jid_search(sess->E, item->jid)) {
+                if(item->from && !jidset_has(sess->E, item->jid)) {
 
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(item->jid));
                     pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
@@ -159,7 +166,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
             } while(xhash_iter_next(sess->user->roster));
 
             /* walk A and forward to untrusted */
-            for(scan = sess->A; scan != NULL; scan = scan->next)
+            for(scan = jidset_iter_first(sess->A); scan != NULL; scan = jidset_iter_next(sess->A))
                 if(!pres_trust(sess->user, scan)) {
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(scan));
                     pkt_router(pkt_dup(pkt, jid_full(scan), jid_full(sess->jid)));
@@ -173,22 +180,11 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 }
             }
 
-            /* drop A, E */
-            scan = sess->A;
-            while(scan != NULL) {
-                next = scan->next;
-                jid_free(scan);
-                scan = next;
-            }
-            sess->A = NULL;
+            sm_fanout_end(sess->user->sm);
 
-            scan = sess->E;
-            while(scan != NULL) {
-                next = scan->next;
-                jid_free(scan);
-                scan = next;
-            }
-            sess->E = NULL;
+            /* drop A, E */
+            jidset_clear(sess->A);
+            jidset_clear(sess->E);
 
             /* update vars */
             sess->available = 0;
@@ -291,7 +287,7 @@ void pres_in(user_t user, pkt_t pkt) {
             }
 
             /* remove from E */
-            scan->E = jid_zap(scan->E, pkt->from);
+            jidset_zap(scan->E, pkt->from);
 
             continue;
         }
@@ -307,8 +303,8 @@ void pres_in(user_t user, pkt_t pkt) {
 void pres_error(sess_t sess, jid_t jid) {
     /* bounced updates: B5: add to E, remove from A  */
     log_debug(ZONE, "bounced presence from %s, adding to error list", jid_full(jid));
-    sess->E = jid_append(sess->E, jid);
-    sess->A = jid_zap(sess->A, jid);
+    jidset_add(sess->E, jid);
+    jidset_zap(sess->A, jid);
 }
 
 /** outgoing directed presence */
@@ -332,8 +328,8 @@ void pres_deliver(sess_t sess, pkt_t pkt) {
         /* B6: forward, add to A (unless in T), remove from E */
         log_debug(ZONE, "delivering directed available presence to %s", jid_full(pkt->to));
         if(!pres_trust(sess->user, pkt->to))
-            sess->A = jid_append(sess->A, pkt->to);
-        sess->E = jid_zap(sess->E, pkt->to);
+            jidset_add(sess->A, pkt->to);
+        jidset_zap(sess->E, pkt->to);
         pkt_router(pkt);
         return;
     }
@@ -341,8 +337,8 @@ void pres_deliver(sess_t sess, pkt_t pkt) {
     if(pkt->type == pkt_PRESENCE_UN) {
         /* B7: forward, remove from A and E */
         log_debug(ZONE, "delivering directed unavailable presence to %s", jid_full(pkt->to));
-        sess->A = jid_zap(sess->A, pkt->to);
-        sess->E = jid_zap(sess->E, pkt->to);
+        jidset_zap(sess->A, pkt->to);
+        jidset_zap(sess->E, pkt->to);
         pkt_router(pkt);
         return;
     }
@@ -382,7 +378,7 @@ void pres_roster(sess_t sess, item_t item) {
 
     /* if they were trusted previously, but aren't anymore, and we haven't
      * explicitly sent them presence, then make them forget */
-    if(!item->from && !jid_search(sess->A, item->jid) && !jid_search(sess->E, item->jid)) {
+    if(!item->from && !jidset_has(sess->A, item->jid) && !jidset_has(sess->E, item->jid)) {
         log_debug(ZONE, "forcing unavailable to %s after roster change", jid_full(item->jid));
         pkt_router(pkt_create(sess->user->sm, "presence", "unavailable", jid_full(item->jid), jid_full(sess->jid)));
         return;
@@ -390,7 +386,7 @@ void pres_roster(sess_t sess, item_t item) {
 
     /* if they're now trusted and we haven't sent
      * them directed presence, then they get to see us for the first time */
-    if(item->from && !jid_search(sess->A, item->jid) && !jid_search(sess->E, item->jid)) {
+    if(item->from && !jidset_has(sess->A, item->jid) && !jidset_has(sess->E, item->jid)) {
         log_debug(ZONE, "forcing available to %s after roster change", jid_full(item->jid));
         pkt_router(pkt_dup(sess->pres, jid_full(item->jid), jid_full(sess->jid)));
     }
@@ -401,6 +397,8 @@ void pres_probe(user_t user) {
 
     log_debug(ZONE, "full roster probe for %s", jid_user(user->jid));
 
+    sm_fanout_begin(user->sm);
+
     /* loop the roster, looked for trusted */
     if(xhash_iter_first(user->roster))
     do {
@@ -412,4 +410,6 @@ void pres_probe(user_t user) {
             pkt_router(pkt_create(user->sm, "presence", "probe", jid_full(item->jid), jid_user(user->jid)));
         }
     } while(xhash_iter_next(user->roster));
+
+    sm_fanout_end(user->sm);
 }
@@ -49,7 +49,7 @@ void sess_route(sess_t sess, pkt_t pkt) {
     nad_set_attr(pkt->nad, 0, -1, "error", NULL, 0);
 
     /* and send it out */
-    sx_nad_write(sess->user->sm->router, pkt->nad);
+    sm_route(sess->user->sm, pkt->nad);
 
     /* free up the packet */
     if(pkt->rto != NULL) jid_free(pkt->rto);
@@ -63,7 +63,7 @@ static void _sess_end_guts(sess_t sess) {
     sess_t scan;
 
     /* fake an unavailable presence from this session, so that modules and externals know we're gone */
-    if(sess->available || sess->A != NULL)
+    if(sess->available || jidset_count(sess->A) > 0)
         mm_in_sess(sess->user->sm->mm, sess, pkt_create(sess->user->sm, "presence", "unavailable", NULL, NULL));
 
     /* inform the modules */
@@ -89,11 +89,11 @@ void sess_end(sess_t sess) {
 
     log_write(sess->user->sm->log, LOG_NOTICE, "session ended: jid=%s", jid_full(sess->jid));
 
-    /* if it was the last session, free the user */
+    /* if it was the last session, let the user go */
     if(sess->user->sessions == NULL) {
         mm_user_unload(sess->user->sm->mm, sess->user);
         log_write(sess->user->sm->log, LOG_NOTICE, "user unloaded jid=%s", jid_user(sess->jid));
-        user_free(sess->user);
+        user_release(sess->user);
     }
 
     /* free the session */
@@ -170,6 +170,12 @@ sess_t sess_start(sm_t sm, jid_t jid) {
     sess->jid = jid_dup(jid);
     pool_cleanup(sess->p, (void (*))(void *) jid_free, sess->jid);
 
+    /* directed presence tracking */
+    sess->A = jidset_new();
+    pool_cleanup(sess->p, (void (*))(void *) jidset_free, sess->A);
+    sess->E = jidset_new();
+    pool_cleanup(sess->p, (void (*))(void *) jidset_free, sess->E);
+
     /* a place for modules to store stuff */
     sess->module_data = (void **) pmalloco(sess->p, sizeof(void *) * sess->user->sm->mm->nindex);
 
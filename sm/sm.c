@@ -29,6 +29,16 @@
 
 sig_atomic_t sm_lost_router = 0;
 
+/** an address of a multicast from the router, handled like any other packet */
+static void _sm_multicast_route(nad_t nad, void *arg) {
+    sm_t sm = (sm_t) arg;
+    pkt_t pkt;
+
+    pkt = pkt_new(sm, nad);
+    if(pkt != NULL)
+        dispatch(sm, pkt);
+}
+
 /** our master callback */
 int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sm_t sm = (sm_t) arg;
@@ -83,9 +93,15 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", sm->fd->fd);
 
-            len = send(sm->fd->fd, buf->data, buf->len, 0);
+#ifdef HAVE_SYS_UIO_H
+            if(e == event_WRITEV)
+                len = writev(sm->fd->fd, ((sx_iov_t) data)->iov, ((sx_iov_t) data)->iovcnt);
+            else
+#endif
+                len = send(sm->fd->fd, buf->data, buf->len, 0);
             if (len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -122,6 +138,7 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             ns = nad_add_namespace(nad, uri_COMPONENT, NULL);
             nad_append_elem(nad, ns, "bind", 0);
             nad_append_attr(nad, -1, "name", sm->id);
+            nad_append_elem(nad, ns, "multicast", 1);
             log_debug(ZONE, "requesting component bind for '%s'", sm->id);
             sx_nad_write(sm->router, nad);
 
@@ -138,6 +155,8 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 elem = nad_append_elem(nad, ns, "bind", 0);
                 nad_set_attr(nad, elem, -1, "name", domain, len);
                 nad_append_attr(nad, -1, "multi", "to");
+                if(sm->router_instance != NULL)
+                    nad_append_attr(nad, -1, "instance", sm->router_instance);
                 log_debug(ZONE, "requesting domain bind for '%.*s'", len, domain);
                 sx_nad_write(sm->router, nad);
             
@@ -208,6 +227,9 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
                 log_debug(ZONE, "coming online");
 
+                /* routers that know about multicast routes say so */
+                sm->router_multicast = nad_find_attr(nad, 0, -1, "multicast", NULL) >= 0;
+
                 /* we're online */
                 sm->online = sm->started = 1;
                 log_write(sm->log, LOG_NOTICE, "%s ready for sessions", sm->id);
@@ -218,6 +240,14 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             log_debug(ZONE, "got a packet");
 
+            /* one for each address, and whatever they cause goes out as multicasts too */
+            if(NAD_ENAME_L(nad, 0) == 5 && strncmp("route", NAD_ENAME(nad, 0), 5) == 0 && nad_find_attr(nad, 0, -1, "type", "multicast") >= 0) {
+                sm_fanout_begin(sm);
+                stanza_multicast_expand(nad, _sm_multicast_route, (void *) sm);
+                sm_fanout_end(sm);
+                return 0;
+            }
+
             pkt = pkt_new(sm, nad);
             if (pkt == NULL) {
                 log_debug(ZONE, "invalid packet, dropping");
@@ -306,7 +336,97 @@ void sm_c2s_action(sess_t dest, const char *action, const char *target) {
               dest->c2s, dest->user->sm->id, dest->c2s_id, dest->sm_id,
               action, target);
 
-    sx_nad_write(dest->user->sm->router, nad);
+    sm_route(dest->user->sm, nad);
+}
+
+/** true if both routes are from the same place */
+static int _sm_route_same_from(nad_t a, nad_t b) {
+    int fa = nad_find_attr(a, 0, -1, "from", NULL), fb = nad_find_attr(b, 0, -1, "from", NULL);
+
+    if(fa < 0 || fb < 0)
+        return fa == fb;
+
+    return NAD_AVAL_L(a, fa) == NAD_AVAL_L(b, fb) && strncmp(NAD_AVAL(a, fa), NAD_AVAL(b, fb), NAD_AVAL_L(a, fa)) == 0;
+}
+
+/** send a route to the router, or hold it back if we're in a fan-out */
+void sm_route(sm_t sm, nad_t nad) {
+    fanout_t fo;
+    int ato, joinable;
+    char to[1024];
+
+    if(sm->fanout == 0 || !sm->router_multicast) {
+        sx_nad_write(sm->router, nad);
+        return;
+    }
+
+    /* a stanza that can be sent as part of a multicast */
+    joinable = nad->ecur > 1 &&
+               nad_find_attr(nad, 0, -1, "type", NULL) < 0 && nad_find_attr(nad, 0, -1, "error", NULL) < 0 &&
+               nad_find_attr(nad, 1, -1, "to", NULL) >= 0;
+
+    ato = nad_find_attr(nad, 0, -1, "to", NULL);
+    if(ato >= 0 && NAD_AVAL_L(nad, ato) < sizeof(to)) {
+        snprintf(to, sizeof(to), "%.*s", NAD_AVAL_L(nad, ato), NAD_AVAL(nad, ato));
+
+        /* only the last one for the destination can take it, or it would overtake the ones in between */
+        fo = (fanout_t) xhash_get(sm->fanout_last, to);
+        if(joinable && fo != NULL && fo->addrs >= 0 && fo->naddr < SM_FANOUT_MAX && _sm_route_same_from(fo->nad, nad) &&
+           stanza_multicast_match(fo->nad, fo->addrs > 0 ? fo->addrs : fo->nad->ecur, nad)) {
+            if(fo->addrs == 0)
+                fo->addrs = stanza_multicast_new(fo->nad);
+
+            stanza_multicast_add(fo->nad, fo->addrs, nad);
+            fo->naddr++;
+
+            nad_free(nad);
+            return;
+        }
+    }
+
+    fo = (fanout_t) calloc(1, sizeof(struct fanout_st));
+    fo->nad = nad;
+    fo->naddr = 1;
+    if(!joinable)
+        fo->addrs = -1;
+
+    if(ato >= 0 && NAD_AVAL_L(nad, ato) < sizeof(to)) {
+        fo->to = strdup(to);
+        xhash_put(sm->fanout_last, fo->to, (void *) fo);
+    }
+
+    jqueue_push(sm->fanouts, (void *) fo, 0);
+}
+
+/**
+ * start a fan-out. Until the matching sm_fanout_end(), routes are held
+ * back, and copies of the same stanza going to the same component are
+ * gathered into one multicast route.
+ */
+void sm_fanout_begin(sm_t sm) {
+    sm->fanout++;
+}
+
+/** end a fan-out, and send the routes it held back */
+void sm_fanout_end(sm_t sm) {
+    fanout_t fo;
+
+    if(--sm->fanout > 0)
+        return;
+
+    while((fo = (fanout_t) jqueue_pull(sm->fanouts)) != NULL) {
+        if(fo->to != NULL) {
+            if(xhash_get(sm->fanout_last, fo->to) == fo)
+                xhash_zap(sm->fanout_last, fo->to);
+            free(fo->to);
+        }
+
+        if(fo->naddr > 1)
+            log_debug(ZONE, "multicast route for %d addresses", fo->naddr);
+
+        sx_nad_write(sm->router, fo->nad);
+        free(fo);
+    }
 }
 
 /** this is gratuitous, but apache gets one, so why not? */
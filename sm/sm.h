@@ -58,6 +58,7 @@
 /* forward declarations */
 typedef struct sm_st        *sm_t;
 typedef struct user_st      *user_t;
+typedef struct user_cache_st *user_cache_t;
 typedef struct sess_st      *sess_t;
 typedef struct aci_st       *aci_t;
 typedef struct mm_st        *mm_t;
@@ -163,6 +164,17 @@ typedef struct item_st {
     int                 ver;        /**< roster item version number */
 } *item_t;
 
+/** most addresses in one multicast route */
+#define SM_FANOUT_MAX   (256)
+
+/** a route held back until the end of a fan-out, see sm_fanout_begin() */
+typedef struct fanout_st {
+    nad_t               nad;        /**< the route, a multicast once a second address joins it */
+    char                *to;        /**< where it's going */
+    int                 addrs;      /**< addresses element of the multicast, 0 while it's a unicast, -1 if nothing can join it */
+    int                 naddr;      /**< number of addresses */
+} *fanout_t;
+
 /** session manager global context */
 struct sm_st {
     const char          *id;                /**< component id */
@@ -176,6 +188,8 @@ struct sm_st {
     const char          *router_private_key_password;    /** password for private key if pemfile
                                                              key is encrypted */
     const char          *router_ciphers;    /** TLS ciphers */
+    const char          *router_instance;   /**< name to be known by on multi routes */
+    int                 router_binary;      /**< ask the router for binary framing */
 
     mio_t               mio;                /**< mio context */
 
@@ -187,6 +201,10 @@ struct sm_st {
     mio_fd_t            fd;                 /**< file descriptor of router connection */
 
     xht                 users;              /**< pointers to currently loaded users (key is user@@domain) */
+    xht                 loading;            /**< users whose data the storage workers are fetching (key is user@@domain) */
+    jqueue_t            load_batch;         /**< loading users whose data hasn't been asked for yet */
+    int                 load_batch_max;     /**< most users to ask for at once */
+    user_cache_t        ucache;             /**< sessionless users kept for the next packet */
 
     xht                 sessions;           /**< pointers to all connected sessions (key is random sm id) */
 
@@ -209,6 +227,7 @@ struct sm_st {
     int                 retry_left;         /**< number of tries left before failure */
 
     storage_t           st;                 /**< storage subsystem */
+    mio_fd_t            st_fd;              /**< storage worker completions */
 
     mm_t                mm;                 /**< module subsystem */
 
@@ -221,8 +240,19 @@ struct sm_st {
 
     int                 online;             /**< true if we're currently bound in the router */
 
+    int                 router_multicast;   /**< true if the router takes multicast routes from us */
+
+    int                 fanout;             /**< nesting of sm_fanout_begin() calls */
+    jqueue_t            fanouts;            /**< routes held back until the fan-out ends, in order */
+    xht                 fanout_last;        /**< the last of those for each destination */
+
     xht                 hosts;              /**< vHosts map */
 
+    int                 local_delivery;     /**< true if packets for our own hosts skip the router */
+    int                 local_mirror;       /**< true if the router gets a copy of those for its log sinks */
+    jqueue_t            local;              /**< packets for our own hosts waiting to be dispatched */
+    int                 local_busy;         /**< true while the local queue is being run */
+
     /** Database query rate limits */
     int                 query_rate_total;
     int                 query_rate_seconds;
@@ -247,6 +277,32 @@ struct user_st {
     time_t              active;             /**< time that user first logged in (ever) */
 
     void                **module_data;      /**< per-user module data */
+
+    int                 busy;               /**< packets being dispatched to this user */
+    int                 stale;              /**< their data was written behind our back */
+    time_t              loaded;             /**< when their data was loaded */
+
+    int                 cached;             /**< true if they're in the user cache */
+    int                 csize;              /**< bytes counted against the cache */
+    user_t              cprev, cnext;       /**< cache lru list, most recently used first */
+};
+
+/** sessionless users kept around after delivery */
+struct user_cache_st {
+    user_t              head, tail;         /**< most recently used first */
+    int                 count;              /**< users in the cache */
+    long                bytes;              /**< memory they're using */
+
+    int                 max;                /**< most users to keep, 0 if the cache is off */
+    long                max_bytes;          /**< most memory to use */
+    int                 ttl;                /**< seconds before their data is loaded again */
+    int                 invalidate;         /**< true to tell the other sms about writes */
+
+    xht                 types;              /**< storage types users are loaded from */
+    xht                 changed;            /**< users to tell the other sms about */
+    time_t              last_expire;        /**< when we last looked for old users */
+
+    unsigned long       hits, misses, evictions, expired, invalidated;
 };
 
 /** data for a single session */
@@ -268,8 +324,8 @@ struct sess_st {
     int                 pri;                /**< current priority of this session */
     int                 fake;               /**< true if session is fake (ie. PBX) */
 
-    jid_t               A;                  /**< list of jids that this session has sent directed presence to */
-    jid_t               E;                  /**< list of jids that bounced presence updates we sent them */
+    jidset_t            A;                  /**< jids that this session has sent directed presence to */
+    jidset_t            E;                  /**< jids that bounced presence updates we sent them */
 
     void                **module_data;      /**< per-session module data */
 
@@ -289,6 +345,10 @@ SM_API void            sm_timestamp(time_t t, char timestamp[18]);
 SM_API void            sm_c2s_action(sess_t dest, const char *action, const char *target);
 SM_API void            sm_signature(sm_t sm, const char *str);
 
+SM_API void            sm_route(sm_t sm, nad_t nad);
+SM_API void            sm_fanout_begin(sm_t sm);
+SM_API void            sm_fanout_end(sm_t sm);
+
 SM_API int             sm_register_ns(sm_t sm, const char *uri);
 SM_API void            sm_unregister_ns(sm_t sm, const char *uri);
 SM_API int             sm_get_ns(sm_t sm, const char *uri);
@@ -324,7 +384,17 @@ SM_API void            sess_end(sess_t sess);
 SM_API sess_t          sess_match(user_t user, const char *resource);
 
 SM_API user_t          user_load(sm_t sm, jid_t jid);
+SM_API int             user_load_async(sm_t sm, jid_t jid, pkt_t pkt);
+SM_API int             user_loading(sm_t sm, jid_t jid);
+SM_API void            user_load_flush(sm_t sm);
 SM_API void            user_free(user_t user);
+SM_API void            user_release(user_t user);
+SM_API void            user_cache_init(sm_t sm);
+SM_API void            user_cache_free(sm_t sm);
+SM_API void            user_cache_run(sm_t sm);
+SM_API void            user_cache_stats(sm_t sm);
+SM_API void            user_cache_invalidate(sm_t sm, const char *owner);
+SM_API void            user_cache_notified(sm_t sm, nad_t nad);
 SM_API int             user_create(sm_t sm, jid_t jid);
 SM_API void            user_delete(sm_t sm, jid_t jid);
 
@@ -432,6 +502,8 @@ struct module_st {
     mod_ret_t           (*pkt_router)(mod_instance_t mi, pkt_t pkt);                /**< pkt-router handler */
 
     int                 (*user_load)(mod_instance_t mi, user_t user);               /**< user-load handler */
+    const char          **user_load_types;  /**< storage types user-load reads (with no filter), NULL terminated,
+                                                 fetched ahead by the storage workers */
     int                 (*user_unload)(mod_instance_t mi, user_t user);               /**< user-load handler */
 
     int                 (*user_create)(mod_instance_t mi, jid_t jid);               /**< user-create handler */
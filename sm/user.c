@@ -45,20 +45,87 @@ static user_t _user_alloc(sm_t sm, jid_t jid) {
     /* a place for modules to store stuff */
     user->module_data = (void **) pmalloco(p, sizeof(void *) * sm->mm->nindex);
 
+    user->loaded = time(NULL);
+
     return user;
 }
 
+static void _user_cache_unlink(user_cache_t uc, user_t user) {
+    if(user->cprev != NULL) user->cprev->cnext = user->cnext;
+    else uc->head = user->cnext;
+
+    if(user->cnext != NULL) user->cnext->cprev = user->cprev;
+    else uc->tail = user->cprev;
+
+    user->cprev = user->cnext = NULL;
+    user->cached = 0;
+
+    uc->count--;
+    uc->bytes -= user->csize;
+}
+
+static void _user_cache_link(user_cache_t uc, user_t user) {
+    user->cprev = NULL;
+    user->cnext = uc->head;
+
+    if(uc->head != NULL) uc->head->cprev = user;
+    else uc->tail = user;
+
+    uc->head = user;
+    user->cached = 1;
+
+    uc->count++;
+    uc->bytes += user->csize;
+}
+
+/** true if their data has to be loaded again */
+static int _user_cache_old(user_cache_t uc, user_t user, time_t now) {
+    if(user->stale)
+        return 1;
+
+    if(uc->ttl > 0 && now - user->loaded >= uc->ttl) {
+        uc->expired++;
+        return 1;
+    }
+
+    return 0;
+}
+
 /** fetch user data */
 user_t user_load(sm_t sm, jid_t jid) {
     user_t user;
 
     /* already loaded */
     user = xhash_get(sm->users, jid_user(jid));
-    if(user != NULL) {
+
+    /* they came online since they were cached */
+    if(user != NULL && user->cached && user->sessions != NULL)
+        _user_cache_unlink(sm->ucache, user);
+
+    if(user != NULL && user->cached) {
+        /* nobody has them, so if they're out of date they can go */
+        if(user->busy == 0 && _user_cache_old(sm->ucache, user, time(NULL)))
+            user_free(user);
+        else {
+            log_debug(ZONE, "returning cached user data for %s", jid_user(jid));
+
+            sm->ucache->hits++;
+
+            _user_cache_unlink(sm->ucache, user);
+            _user_cache_link(sm->ucache, user);
+
+            return user;
+        }
+    }
+
+    else if(user != NULL) {
         log_debug(ZONE, "returning previously-created user data for %s", jid_user(jid));
         return user;
     }
 
+    if(sm->ucache->max > 0)
+        sm->ucache->misses++;
+
     /* make a new one */
     user = _user_alloc(sm, jid);
 
@@ -77,13 +144,411 @@ user_t user_load(sm_t sm, jid_t jid) {
     return user;
 }
 
+/** a user whose data the storage workers are fetching, packets for them wait here */
+typedef struct user_loading_st {
+    sm_t        sm;
+    jid_t       jid;
+    int         pending;        /**< requests still out */
+    int         done;           /**< data is in, packets are being replayed */
+    jqueue_t    pkts;
+} *user_loading_t;
+
+static void _user_load_finish(user_loading_t ul) {
+    sm_t sm = ul->sm;
+    user_t user;
+    pkt_t pkt;
+    mod_instance_t mi;
+    const char **type;
+    int n;
+
+    log_debug(ZONE, "storage fetched for %s, replaying %d packets", jid_user(ul->jid), jqueue_size(ul->pkts));
+
+    /* the first one loads them from what was fetched, the user stays until the last one is done */
+    ul->done = 1;
+    while((pkt = (pkt_t) jqueue_pull(ul->pkts)) != NULL)
+        dispatch(sm, pkt);
+
+    xhash_zap(sm->loading, jid_user(ul->jid));
+
+    for(n = 0; n < sm->mm->nuser_load; n++)
+        if((mi = sm->mm->user_load[n]) != NULL && mi->mod->user_load_types != NULL)
+            for(type = mi->mod->user_load_types; *type != NULL; type++)
+                storage_preload_drop(sm->st, *type, jid_user(ul->jid));
+
+    /* they were only loaded for these packets */
+    user = xhash_get(sm->users, jid_user(ul->jid));
+    if(user != NULL && user->sessions == NULL)
+        user_release(user);
+
+    jqueue_free(ul->pkts);
+    jid_free(ul->jid);
+    free(ul);
+}
+
+/** users whose data is asked for together, one request per type for all of them */
+typedef struct user_load_batch_st {
+    sm_t            sm;
+    user_loading_t  *uls;
+    int             n;
+    int             pending;        /**< requests still out */
+} *user_load_batch_t;
+
+static void _user_load_fetched(st_req_t req, void *arg) {
+    user_load_batch_t b = (user_load_batch_t) arg;
+    user_loading_t ul;
+    int i;
+
+    for(i = 0; i < b->n; i++) {
+        ul = b->uls[i];
+
+        /* failures are left for the module to try again itself */
+        if(req->ret == st_SUCCESS && req->oss != NULL) {
+            storage_preload(b->sm->st, req->type, req->owners[i], req->oss[i] != NULL ? st_SUCCESS : st_NOTFOUND, req->oss[i]);
+            req->oss[i] = NULL;
+        }
+
+        if(--ul->pending == 0)
+            _user_load_finish(ul);
+    }
+
+    if(--b->pending == 0) {
+        free(b->uls);
+        free(b);
+    }
+}
+
+/** ask the storage workers for the data of the users waiting in the batch */
+void user_load_flush(sm_t sm) {
+    user_load_batch_t b;
+    user_loading_t ul;
+    mod_instance_t mi;
+    const char **type, **owners;
+    int n, i;
+
+    if(jqueue_size(sm->load_batch) == 0)
+        return;
+
+    b = (user_load_batch_t) calloc(1, sizeof(struct user_load_batch_st));
+    b->sm = sm;
+    b->uls = (user_loading_t *) malloc(sizeof(user_loading_t) * jqueue_size(sm->load_batch));
+    owners = (const char **) malloc(sizeof(char *) * jqueue_size(sm->load_batch));
+
+    /* hold the counts up until everything is asked for, in case they come back straight away */
+    while((ul = (user_loading_t) jqueue_pull(sm->load_batch)) != NULL) {
+        ul->pending = 1;
+        owners[b->n] = jid_user(ul->jid);
+        b->uls[b->n++] = ul;
+    }
+    b->pending = 1;
+
+    log_debug(ZONE, "fetching user data for %d users", b->n);
+
+    for(n = 0; n < sm->mm->nuser_load; n++)
+        if((mi = sm->mm->user_load[n]) != NULL && mi->mod->user_load_types != NULL)
+            for(type = mi->mod->user_load_types; *type != NULL; type++) {
+                b->pending++;
+                for(i = 0; i < b->n; i++)
+                    b->uls[i]->pending++;
+
+                storage_async_multi(sm->st, *type, owners, b->n, NULL, _user_load_fetched, (void *) b);
+            }
+
+    free(owners);
+
+    for(i = 0; i < b->n; i++)
+        if(--b->uls[i]->pending == 0)
+            _user_load_finish(b->uls[i]);
+
+    if(--b->pending == 0) {
+        free(b->uls);
+        free(b);
+    }
+}
+
+/** fetch user data in the storage workers, the packet waits until it's in; 0 if the caller should go ahead now */
+int user_load_async(sm_t sm, jid_t jid, pkt_t pkt) {
+    user_loading_t ul;
+    user_t user;
+
+    if(sm->st->async == NULL)
+        return 0;
+
+    user = xhash_get(sm->users, jid_user(jid));
+    if(user != NULL) {
+        if(!user->cached || user->busy > 0 || user->sessions != NULL || !_user_cache_old(sm->ucache, user, time(NULL)))
+            return 0;
+
+        /* fetch them again with the others */
+        user_free(user);
+    }
+
+    /* already on its way */
+    ul = (user_loading_t) xhash_get(sm->loading, jid_user(jid));
+    if(ul != NULL) {
+        if(ul->done)
+            return 0;
+
+        jqueue_push(ul->pkts, (void *) pkt, 0);
+        return 1;
+    }
+
+    ul = (user_loading_t) calloc(1, sizeof(struct user_loading_st));
+    ul->sm = sm;
+    ul->jid = jid_new(jid_user(jid), -1);
+    ul->pkts = jqueue_new();
+
+    jqueue_push(ul->pkts, (void *) pkt, 0);
+    xhash_put(sm->loading, jid_user(ul->jid), (void *) ul);
+
+    log_debug(ZONE, "queueing %s for a user data fetch", jid_user(ul->jid));
+
+    /* asked for with the others that turn up this time round the main loop */
+    jqueue_push(sm->load_batch, (void *) ul, 0);
+    if(jqueue_size(sm->load_batch) >= sm->load_batch_max)
+        user_load_flush(sm);
+
+    return 1;
+}
+
+/** true while the packets that waited for this user's data are replayed */
+int user_loading(sm_t sm, jid_t jid) {
+    return xhash_get(sm->loading, jid_user(jid)) != NULL;
+}
+
 void user_free(user_t user) {
     log_debug(ZONE, "freeing user %s", jid_user(user->jid));
 
+    if(user->cached)
+        _user_cache_unlink(user->sm->ucache, user);
+
     xhash_zap(user->sm->users, jid_user(user->jid));
     pool_free(user->p);
 }
 
+/** done with a user that has no sessions, they go in the cache or get freed */
+void user_release(user_t user) {
+    user_cache_t uc = user->sm->ucache;
+    user_t scan, prev;
+
+    if(user->sessions != NULL || user->busy > 0)
+        return;
+
+    if(uc->max == 0 || _user_cache_old(uc, user, time(NULL))) {
+        user_free(user);
+        return;
+    }
+
+    if(user->cached)
+        _user_cache_unlink(uc, user);
+
+    user->csize = pool_size(user->p);
+    _user_cache_link(uc, user);
+
+    log_debug(ZONE, "caching user %s (%d bytes, %d users, %ld bytes cached)", jid_user(user->jid), user->csize, uc->count, uc->bytes);
+
+    /* make room, oldest first, leaving alone anyone in use */
+    for(scan = uc->tail; scan != NULL && (uc->count > uc->max || uc->bytes > uc->max_bytes); scan = prev) {
+        prev = scan->cprev;
+
+        if(scan->sessions != NULL) {
+            _user_cache_unlink(uc, scan);
+            continue;
+        }
+
+        if(scan->busy > 0)
+            continue;
+
+        log_debug(ZONE, "evicting user %s", jid_user(scan->jid));
+
+        uc->evictions++;
+        user_free(scan);
+    }
+}
+
+/** a user's data was written, if we didn't do it while holding them, what we have is out of date */
+void user_cache_invalidate(sm_t sm, const char *owner) {
+    user_t user;
+
+    user = xhash_get(sm->users, owner);
+    if(user == NULL || user->stale || user->busy > 0 || user->sessions != NULL)
+        return;
+
+    log_debug(ZONE, "user data for %s changed, dropping it when we can", owner);
+
+    user->stale = 1;
+    sm->ucache->invalidated++;
+}
+
+/** storage write notification */
+static void _user_cache_changed(storage_t st, const char *type, const char *owner, void *arg) {
+    sm_t sm = (sm_t) arg;
+    user_cache_t uc = sm->ucache;
+    const char *domain;
+    user_t user;
+
+    if(xhash_get(uc->types, type) == NULL)
+        return;
+
+    /* everyone */
+    if(owner == NULL) {
+        for(user = uc->head; user != NULL; user = user->cnext)
+            user_cache_invalidate(sm, jid_user(user->jid));
+        return;
+    }
+
+    user_cache_invalidate(sm, owner);
+
+    /* the others are told once per trip round the main loop */
+    if(uc->invalidate && (domain = strchr(owner, '@')) != NULL && xhash_get(sm->hosts, domain + 1) != NULL && xhash_get(uc->changed, owner) == NULL)
+        xhash_put(uc->changed, pstrdup(xhash_pool(uc->changed), owner), (void *) 1);
+}
+
+void user_cache_init(sm_t sm) {
+    user_cache_t uc;
+    mod_instance_t mi;
+    const char **type;
+    int n;
+
+    uc = (user_cache_t) calloc(1, sizeof(struct user_cache_st));
+
+    uc->max = j_atoi(config_get_one(sm->config, "user.cache.max", 0), 1000);
+    if(uc->max < 0)
+        uc->max = 0;
+    uc->max_bytes = (long) j_atoi(config_get_one(sm->config, "user.cache.memory", 0), 8192) * 1024;
+    uc->ttl = j_atoi(config_get_one(sm->config, "user.cache.ttl", 0), 300);
+    uc->invalidate = config_get(sm->config, "user.cache.invalidate") != NULL;
+
+    uc->types = xhash_new(51);
+    uc->changed = xhash_new(101);
+
+    for(n = 0; n < sm->mm->nuser_load; n++)
+        if((mi = sm->mm->user_load[n]) != NULL && mi->mod->user_load_types != NULL)
+            for(type = mi->mod->user_load_types; *type != NULL; type++)
+                xhash_put(uc->types, *type, (void *) 1);
+
+    if(uc->max > 0 || uc->invalidate) {
+        sm->st->changed = _user_cache_changed;
+        sm->st->changed_arg = (void *) sm;
+    }
+
+    sm->ucache = uc;
+
+    if(uc->max > 0)
+        log_write(sm->log, LOG_NOTICE, "user cache: %d users, %ld KB, %d second ttl%s", uc->max, uc->max_bytes / 1024, uc->ttl, uc->invalidate ? ", telling other sms about writes" : "");
+}
+
+void user_cache_stats(sm_t sm) {
+    user_cache_t uc = sm->ucache;
+    unsigned long lookups = uc->hits + uc->misses;
+
+    if(uc->max == 0)
+        return;
+
+    log_write(sm->log, LOG_NOTICE, "user cache: %d/%d users, %ld/%ld bytes, %lu hits, %lu misses (%lu%% hit rate), %lu evicted, %lu expired, %lu invalidated",
+              uc->count, uc->max, uc->bytes, uc->max_bytes, uc->hits, uc->misses,
+              lookups > 0 ? uc->hits * 100 / lookups : 0, uc->evictions, uc->expired, uc->invalidated);
+}
+
+void user_cache_free(sm_t sm) {
+    user_cache_t uc = sm->ucache;
+
+    user_cache_stats(sm);
+
+    while(uc->head != NULL) {
+        if(uc->head->sessions != NULL)
+            _user_cache_unlink(uc, uc->head);
+        else
+            user_free(uc->head);
+    }
+
+    sm->st->changed = NULL;
+
+    xhash_free(uc->types);
+    xhash_free(uc->changed);
+    free(uc);
+
+    sm->ucache = NULL;
+}
+
+/** tell the other sms about the writes since last time */
+static void _user_cache_tell(sm_t sm) {
+    user_cache_t uc = sm->ucache;
+    const char *owner;
+    int keylen, ns;
+    nad_t nad;
+
+    if(xhash_count(uc->changed) == 0)
+        return;
+
+    if(sm->online && xhash_iter_first(uc->changed))
+        do {
+            xhash_iter_get(uc->changed, &owner, &keylen, NULL);
+
+            nad = nad_new();
+
+            ns = nad_add_namespace(nad, uri_COMPONENT, NULL);
+            nad_append_elem(nad, ns, "route", 0);
+
+            nad_append_attr(nad, -1, "type", "broadcast");
+            nad_append_attr(nad, -1, "from", strchr(owner, '@') + 1);
+
+            ns = nad_add_namespace(nad, uri_USERCACHE, NULL);
+            nad_append_elem(nad, ns, "changed", 1);
+            nad_append_attr(nad, -1, "jid", owner);
+
+            log_debug(ZONE, "telling the other sms that %s changed", owner);
+
+            sx_nad_write(sm->router, nad);
+        } while(xhash_iter_next(uc->changed));
+
+    xhash_free(uc->changed);
+    uc->changed = xhash_new(101);
+}
+
+/** once round the main loop, drop users that got too old or were written */
+void user_cache_run(sm_t sm) {
+    user_cache_t uc = sm->ucache;
+    user_t scan, prev;
+    time_t now;
+
+    _user_cache_tell(sm);
+
+    now = time(NULL);
+    if(uc->head == NULL || now == uc->last_expire)
+        return;
+
+    uc->last_expire = now;
+
+    for(scan = uc->tail; scan != NULL; scan = prev) {
+        prev = scan->cprev;
+
+        if(scan->sessions != NULL)
+            _user_cache_unlink(uc, scan);
+        else if(scan->busy == 0 && _user_cache_old(uc, scan, now))
+            user_free(scan);
+    }
+}
+
+/** another sm wrote a user's data */
+void user_cache_notified(sm_t sm, nad_t nad) {
+    int attr;
+    jid_t jid;
+
+    if(nad_find_namespace(nad, 1, uri_USERCACHE, NULL) < 0 || (attr = nad_find_attr(nad, 1, -1, "jid", NULL)) < 0) {
+        log_debug(ZONE, "unknown broadcast, dropping");
+        return;
+    }
+
+    jid = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+    if(jid == NULL)
+        return;
+
+    if(*jid->node != '\0' && xhash_get(sm->hosts, jid->domain) != NULL)
+        user_cache_invalidate(sm, jid_user(jid));
+
+    jid_free(jid);
+}
+
 /** initialise a user */
 int user_create(sm_t sm, jid_t jid) {
     user_t user;
@@ -141,5 +606,10 @@ void user_delete(sm_t sm, jid_t jid) {
 
     mm_user_delete(sm->mm, jid);
 
+    /* don't keep what they had around */
+    user = xhash_get(sm->users, jid_user(jid));
+    if(user != NULL && user->sessions == NULL && user->busy == 0)
+        user_free(user);
+
     log_write(sm->log, LOG_NOTICE, "deleted user: jid=%s", jid_user(jid));
 }
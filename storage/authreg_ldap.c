@@ -330,6 +330,7 @@ static int _ldap_user_exists(authreg_t ar, sess_t sess, const char *username, co
             dn = _ldap_search(data, realm, username);
             if (dn != NULL) {
                 ldap_memfree(dn);
+                xhash_iter_done((xht) ar->private);
                 return 1;
             }
         }
@@ -368,6 +369,7 @@ static int _ldap_check_password(authreg_t ar, sess_t sess, const char *username,
                     ldap_memfree(dn);
                 } else {
                     ldap_memfree(dn);
+                    xhash_iter_done((xht) ar->private);
                     return 0;
                 }
             }
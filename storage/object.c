@@ -50,6 +50,35 @@ void os_free(os_t os) {
     pool_free(os->p);
 }
 
+os_t os_copy(os_t os) {
+    os_t copy;
+    os_object_t o, co;
+    os_field_t osf;
+    union xhashv xhv;
+    const char *key;
+    int keylen, ival;
+
+    copy = os_new();
+
+    for(o = os->head; o != NULL; o = o->next) {
+        co = os_object_new(copy);
+
+        xhv.osf_val = &osf;
+        if(xhash_iter_first(o->hash))
+            do {
+                xhash_iter_get(o->hash, &key, &keylen, xhv.val);
+
+                if(osf->type == os_type_BOOLEAN || osf->type == os_type_INTEGER) {
+                    ival = (int) (intptr_t) osf->val;
+                    os_object_put(co, osf->key, &ival, osf->type);
+                } else
+                    os_object_put(co, osf->key, osf->val, osf->type);
+            } while(xhash_iter_next(o->hash));
+    }
+
+    return copy;
+}
+
 int os_count(os_t os) {
     return os->count;
 }
@@ -0,0 +1,194 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+#include "storage.h"
+
+/** @file storage/stmt.c
+  * @brief prepared statement cache
+  *
+  * A small lru of driver statement handles, keyed by their SQL text. Each
+  * driver connection has its own, so no locking is needed. The cache only
+  * does the bookkeeping; preparing, executing and releasing the handles is
+  * up to the driver.
+  */
+
+static unsigned long long _st_stmt_usec(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+#else
+    return (unsigned long long) time(NULL) * 1000000;
+#endif
+}
+
+static void _st_stmt_unlink(st_stmt_cache_t sc, st_stmt_t stmt) {
+    if(stmt->prev != NULL) stmt->prev->next = stmt->next;
+    else sc->head = stmt->next;
+
+    if(stmt->next != NULL) stmt->next->prev = stmt->prev;
+    else sc->tail = stmt->prev;
+
+    stmt->prev = stmt->next = NULL;
+}
+
+static void _st_stmt_link(st_stmt_cache_t sc, st_stmt_t stmt) {
+    stmt->prev = NULL;
+    stmt->next = sc->head;
+
+    if(sc->head != NULL) sc->head->prev = stmt;
+    else sc->tail = stmt;
+
+    sc->head = stmt;
+}
+
+static void _st_stmt_free(st_stmt_cache_t sc, st_stmt_t stmt) {
+    if(stmt->handle != NULL && sc->free != NULL)
+        (sc->free)(stmt->handle, sc->arg);
+
+    free(stmt->sql);
+    free(stmt);
+}
+
+/** take a statement out of the cache */
+static void _st_stmt_remove(st_stmt_cache_t sc, st_stmt_t stmt) {
+    xhash_zap(sc->stmts, stmt->sql);
+    _st_stmt_unlink(sc, stmt);
+    sc->count--;
+
+    stmt->cached = 0;
+}
+
+st_stmt_cache_t st_stmt_cache_new(int max, st_stmt_free_fn free, void *arg) {
+    st_stmt_cache_t sc;
+
+    sc = (st_stmt_cache_t) calloc(1, sizeof(struct st_stmt_cache_st));
+
+    sc->max = max < 0 ? 0 : max;
+    sc->free = free;
+    sc->arg = arg;
+
+    sc->stmts = xhash_new(sc->max > 0 ? sc->max * 2 + 1 : 1);
+
+    return sc;
+}
+
+void st_stmt_cache_flush(st_stmt_cache_t sc) {
+    st_stmt_t stmt;
+
+    while((stmt = sc->head) != NULL) {
+        _st_stmt_remove(sc, stmt);
+        _st_stmt_free(sc, stmt);
+    }
+}
+
+void st_stmt_cache_free(st_stmt_cache_t sc) {
+    st_stmt_cache_flush(sc);
+
+    xhash_free(sc->stmts);
+    free(sc);
+}
+
+st_stmt_t st_stmt_get(st_stmt_cache_t sc, const char *sql) {
+    st_stmt_t stmt;
+
+    stmt = (st_stmt_t) xhash_get(sc->stmts, sql);
+    if(stmt != NULL) {
+        sc->hits++;
+
+        if(stmt != sc->head) {
+            _st_stmt_unlink(sc, stmt);
+            _st_stmt_link(sc, stmt);
+        }
+
+        stmt->start = _st_stmt_usec();
+
+        return stmt;
+    }
+
+    sc->misses++;
+
+    stmt = (st_stmt_t) calloc(1, sizeof(struct st_stmt_st));
+    stmt->sql = strdup(sql);
+
+    if(sc->max > 0) {
+        /* make room, the one we're about to use goes in front so it's never the victim */
+        while(sc->count >= sc->max && sc->tail != NULL) {
+            st_stmt_t victim = sc->tail;
+
+            log_debug(ZONE, "evicting statement: %s", victim->sql);
+
+            _st_stmt_remove(sc, victim);
+            _st_stmt_free(sc, victim);
+
+            sc->evictions++;
+        }
+
+        xhash_put(sc->stmts, stmt->sql, (void *) stmt);
+        _st_stmt_link(sc, stmt);
+        sc->count++;
+
+        stmt->cached = 1;
+    }
+
+    stmt->start = _st_stmt_usec();
+
+    return stmt;
+}
+
+void st_stmt_done(st_stmt_cache_t sc, st_stmt_t stmt) {
+    unsigned long long now = _st_stmt_usec();
+    unsigned long usec = now > stmt->start ? (unsigned long) (now - stmt->start) : 0;
+
+    sc->execs++;
+    sc->usec += usec;
+    if(usec > sc->usec_max)
+        sc->usec_max = usec;
+
+    if(!stmt->cached)
+        _st_stmt_free(sc, stmt);
+}
+
+void st_stmt_drop(st_stmt_cache_t sc, st_stmt_t stmt) {
+    if(stmt->cached)
+        _st_stmt_remove(sc, stmt);
+
+    _st_stmt_free(sc, stmt);
+}
+
+void st_stmt_cache_stats(st_stmt_cache_t sc, log_t log, const char *driver) {
+    unsigned long lookups = sc->hits + sc->misses;
+
+    log_write(log, LOG_NOTICE, "%s: statement cache: %d/%d cached, %lu hits, %lu misses (%lu%% hit rate), %lu evicted",
+              driver, sc->count, sc->max, sc->hits, sc->misses,
+              lookups > 0 ? sc->hits * 100 / lookups : 0, sc->evictions);
+
+    log_write(log, LOG_NOTICE, "%s: statements: %lu executed, %llu usec average, %lu usec max",
+              driver, sc->execs, sc->execs > 0 ? sc->usec / sc->execs : 0, sc->usec_max);
+}
@@ -34,8 +34,111 @@
   #include <dlfcn.h>
 #endif /* _WIN32 */
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+# include <signal.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
 
-storage_t storage_new(config_t config, log_t log) {
+/** objects fetched ahead of a storage_get */
+typedef struct st_preload_st {
+    st_ret_t    ret;
+    os_t        os;
+    char        key[1];         /**< type/owner, allocated past the end */
+} *st_preload_t;
+
+/** a replace waiting to be written */
+typedef struct st_wb_entry_st *st_wb_entry_t;
+struct st_wb_entry_st {
+    char            *type;
+    char            *owner;
+    char            *filter;
+    os_t            os;
+
+    time_t          since;      /**< when it was first buffered */
+    int             tries;      /**< failed writes */
+
+    st_wb_entry_t   prev, next;
+
+    char            key[1];     /**< type/owner, allocated past the end */
+};
+
+/** give up on a replace after this many failed writes */
+#define ST_WB_TRIES (3)
+
+/** write-behind buffer, for types where only the last replace for an owner matters */
+struct st_wb_st {
+    xht             types;      /**< types we buffer */
+    xht             pending;    /**< buffered replaces, at most one per owner (key is type/owner) */
+    st_wb_entry_t   head, tail; /**< oldest first */
+    int             count;
+
+    int             interval;   /**< seconds a replace may wait */
+    int             max;        /**< write out when this many are waiting */
+    time_t          retry;      /**< after a failed write, don't try again before this */
+
+    /* stats */
+    unsigned long   replaces;
+    unsigned long   coalesced;
+    unsigned long   written;
+    unsigned long   batches;
+    unsigned long   failed;
+};
+
+#ifdef HAVE_PTHREAD
+/** worker threads, requests go in under the lock, results come back on the done queue */
+struct st_async_st {
+    int             nworkers;
+    pthread_t       *threads;
+    storage_t       *wst;       /**< each worker's own storage manager, so it has its own database connections */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    st_req_t        head, tail;
+    int             stop;
+
+    mpscq_t         done;
+
+    int             fd[2];      /**< read and write sides of the wakeup, the same eventfd if we have one */
+};
+#endif
+
+static void _st_wb_unlink(st_wb_t wb, st_wb_entry_t e);
+static void _st_wb_entry_free(st_wb_entry_t e);
+
+static void _st_wb_new(storage_t st) {
+    st_wb_t wb;
+    config_elem_t elem;
+    int i;
+
+    elem = config_get(st->config, "storage.write-behind.type");
+    if(elem == NULL || elem->nvalues == 0)
+        return;
+
+    wb = (st_wb_t) calloc(1, sizeof(struct st_wb_st));
+
+    wb->types = xhash_new(31);
+    for(i = 0; i < elem->nvalues; i++)
+        xhash_put(wb->types, pstrdup(xhash_pool(wb->types), elem->values[i]), (void *) 1);
+
+    wb->pending = xhash_new(1021);
+
+    wb->interval = j_atoi(config_get_one(st->config, "storage.write-behind.interval", 0), 5);
+    wb->max = j_atoi(config_get_one(st->config, "storage.write-behind.max", 0), 1000);
+
+    st->wb = wb;
+
+    log_write(st->log, LOG_NOTICE, "writing %d types behind, every %d seconds or %d replaces", elem->nvalues, wb->interval, wb->max);
+}
+
+static storage_t _storage_new(config_t config, log_t log, int wb) {
     storage_t st;
     int i;
     config_elem_t elem;
@@ -48,6 +151,7 @@ storage_t storage_new(config_t config, log_t log) {
     st->log = log;
     st->drivers = xhash_new(101);
     st->types = xhash_new(101);
+    st->preload = xhash_new(101);
 
     /* register types declared in the config file */
     elem = config_get(st->config, "storage.driver");
@@ -57,15 +161,23 @@ storage_t storage_new(config_t config, log_t log) {
             ret = storage_add_type(st, elem->values[i], type);
             /* Initialisation of storage type failed */
             if (ret != st_SUCCESS) {
+              xhash_free(st->preload);
               free(st);
               return NULL;
             }
         }
     }
 
+    if(wb)
+        _st_wb_new(st);
+
     return st;
 }
 
+storage_t storage_new(config_t config, log_t log) {
+    return _storage_new(config, log, 1);
+}
+
 static void _st_driver_reaper(const char *driver, int driverlen, void *val, void *arg) {
     st_driver_t drv = (st_driver_t) val;
 
@@ -74,12 +186,52 @@ static void _st_driver_reaper(const char *driver, int driverlen, void *val, void
     free(drv);
 }
 
+static void _st_preload_reaper(const char *key, int keylen, void *val, void *arg) {
+    st_preload_t pl = (st_preload_t) val;
+
+    if(pl->os != NULL)
+        os_free(pl->os);
+
+    free(pl);
+}
+
 void storage_free(storage_t st) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t e;
+    int i;
+
+    storage_async_stop(st);
+
+    /* nothing buffered gets lost. failed writes come back until they've had
+     * all their tries, so keep going until they're in or given up on */
+    if(wb != NULL) {
+        for(i = 0; i < ST_WB_TRIES && wb->head != NULL; i++)
+            storage_flush(st, 1);
+
+        while((e = wb->head) != NULL) {
+            log_write(st->log, LOG_ERR, "write-behind: giving up on %s for %s", e->type, e->owner);
+            wb->failed++;
+
+            _st_wb_unlink(wb, e);
+            _st_wb_entry_free(e);
+        }
+
+        log_write(st->log, LOG_NOTICE, "write-behind: %lu replaces, %lu coalesced, %lu written in %lu batches, %lu failed",
+                  wb->replaces, wb->coalesced, wb->written, wb->batches, wb->failed);
+
+        xhash_free(wb->types);
+        xhash_free(wb->pending);
+        free(wb);
+    }
+
     /* close down drivers */
     xhash_walk(st->drivers, _st_driver_reaper, NULL);
 
+    xhash_walk(st->preload, _st_preload_reaper, NULL);
+
     xhash_free(st->drivers);
     xhash_free(st->types);
+    xhash_free(st->preload);
     free(st);
 }
 
@@ -191,12 +343,291 @@ st_ret_t storage_add_type(storage_t st, const char *driver, const char *type) {
     return st_SUCCESS;
 }
 
+/** find the driver for this type, registering it with the default driver if we have to */
+static st_driver_t _st_type_driver(storage_t st, const char *type) {
+    st_driver_t drv;
+
+    drv = xhash_get(st->types, type);
+    if(drv == NULL) {
+        drv = st->default_drv;
+        if(drv == NULL || storage_add_type(st, drv->name, type) != st_SUCCESS)
+            return NULL;
+    }
+
+    return drv;
+}
+
+/** see if we buffer this type */
+static int _st_wb_type(storage_t st, const char *type) {
+    return st->wb != NULL && xhash_get(st->wb->types, type) != NULL;
+}
+
+static int _st_wb_key(char *key, int size, const char *type, const char *owner) {
+    int len;
+
+    len = snprintf(key, size, "%s/%s", type, owner);
+
+    return len < size ? len : -1;
+}
+
+/** the buffered replace for this type and owner, whatever its filter */
+static st_wb_entry_t _st_wb_get(storage_t st, const char *type, const char *owner) {
+    char key[1024];
+    int len;
+
+    if(owner == NULL || st->wb->count == 0)
+        return NULL;
+
+    if((len = _st_wb_key(key, sizeof(key), type, owner)) < 0)
+        return NULL;
+
+    return (st_wb_entry_t) xhash_getx(st->wb->pending, key, len);
+}
+
+/** the buffered replace for this type, owner and filter, if there is one */
+static st_wb_entry_t _st_wb_find(storage_t st, const char *type, const char *owner, const char *filter) {
+    st_wb_entry_t e;
+
+    if((e = _st_wb_get(st, type, owner)) == NULL)
+        return NULL;
+
+    if(e->filter == NULL ? filter != NULL : (filter == NULL || strcmp(e->filter, filter) != 0))
+        return NULL;
+
+    return e;
+}
+
+static void _st_wb_link(st_wb_t wb, st_wb_entry_t e) {
+    e->next = NULL;
+    e->prev = wb->tail;
+    if(wb->tail != NULL) wb->tail->next = e;
+    else wb->head = e;
+    wb->tail = e;
+
+    xhash_put(wb->pending, e->key, (void *) e);
+    wb->count++;
+}
+
+static void _st_wb_unlink(st_wb_t wb, st_wb_entry_t e) {
+    if(e->prev != NULL) e->prev->next = e->next;
+    else wb->head = e->next;
+    if(e->next != NULL) e->next->prev = e->prev;
+    else wb->tail = e->prev;
+
+    e->prev = e->next = NULL;
+
+    xhash_zap(wb->pending, e->key);
+    wb->count--;
+}
+
+static void _st_wb_entry_free(st_wb_entry_t e) {
+    os_free(e->os);
+    free(e->type);
+    free(e->owner);
+    if(e->filter != NULL) free(e->filter);
+    free(e);
+}
+
+/** write these out, in one transaction per driver if the driver can do that */
+static void _st_wb_write(storage_t st, st_wb_entry_t list) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t e, next, batch, *btail, rest, *rtail;
+    st_driver_t drv;
+    int n, ok;
+
+    while(list != NULL) {
+        /* everything for the driver of the first one */
+        drv = _st_type_driver(st, list->type);
+
+        batch = rest = NULL;
+        btail = &batch;
+        rtail = &rest;
+        n = 0;
+        for(e = list; e != NULL; e = next) {
+            next = e->next;
+            e->next = NULL;
+
+            if(_st_type_driver(st, e->type) == drv) {
+                *btail = e;
+                btail = &e->next;
+                n++;
+            } else {
+                *rtail = e;
+                rtail = &e->next;
+            }
+        }
+        list = rest;
+
+        ok = 0;
+        if(drv != NULL && n > 1 && drv->batch_begin != NULL && drv->batch_end != NULL && (drv->batch_begin)(drv) == st_SUCCESS) {
+            ok = 1;
+            for(e = batch; e != NULL && ok; e = e->next)
+                if((drv->replace)(drv, e->type, e->owner, e->filter, e->os) != st_SUCCESS)
+                    ok = 0;
+
+            if((drv->batch_end)(drv, ok) != st_SUCCESS)
+                ok = 0;
+
+            if(ok)
+                wb->batches++;
+            else
+                log_write(st->log, LOG_WARNING, "write-behind: batch of %d failed, writing them one by one", n);
+        }
+
+        /* one by one if the batch didn't make it */
+        for(e = batch; e != NULL; e = next) {
+            next = e->next;
+
+            if(ok || (drv != NULL && (drv->replace)(drv, e->type, e->owner, e->filter, e->os) == st_SUCCESS)) {
+                wb->written++;
+                _st_wb_entry_free(e);
+                continue;
+            }
+
+            wb->failed++;
+
+            /* keep it for later, unless it's been replaced in the meantime */
+            if(drv != NULL && ++e->tries < ST_WB_TRIES && xhash_get(wb->pending, e->key) == NULL) {
+                e->since = time(NULL);
+                _st_wb_link(wb, e);
+
+                wb->retry = e->since + wb->interval;
+                continue;
+            }
+
+            log_write(st->log, LOG_ERR, "write-behind: giving up on %s for %s", e->type, e->owner);
+            _st_wb_entry_free(e);
+        }
+    }
+}
+
+/** write out what's buffered for this owner (or for everyone if owner is NULL) */
+static void _st_wb_settle(storage_t st, const char *type, const char *owner) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t e, next, list = NULL, *tail = &list;
+
+    for(e = wb->head; e != NULL; e = next) {
+        next = e->next;
+
+        if(strcmp(e->type, type) != 0 || (owner != NULL && strcmp(e->owner, owner) != 0))
+            continue;
+
+        _st_wb_unlink(wb, e);
+        *tail = e;
+        tail = &e->next;
+    }
+
+    if(list != NULL)
+        _st_wb_write(st, list);
+}
+
+/** forget what's buffered for this owner (or for everyone if owner is NULL) */
+static void _st_wb_drop(storage_t st, const char *type, const char *owner) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t e, next;
+
+    for(e = wb->head; e != NULL; e = next) {
+        next = e->next;
+
+        if(strcmp(e->type, type) != 0 || (owner != NULL && strcmp(e->owner, owner) != 0))
+            continue;
+
+        _st_wb_unlink(wb, e);
+        _st_wb_entry_free(e);
+    }
+}
+
+static void _st_wb_buffer(storage_t st, const char *type, const char *owner, const char *filter, os_t os) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t e;
+    int len;
+
+    wb->replaces++;
+
+    if((e = _st_wb_get(st, type, owner)) != NULL) {
+        if(e->filter == NULL ? filter == NULL : (filter != NULL && strcmp(e->filter, filter) == 0)) {
+            log_debug(ZONE, "coalescing replace for type=%s owner=%s", type, owner);
+
+            os_free(e->os);
+            e->os = os_copy(os);
+            e->tries = 0;
+
+            wb->coalesced++;
+
+            return;
+        }
+
+        /* a replace of everything makes the last one moot, but the last one
+         * has to be in before a replace of some of it */
+        if(filter == NULL) {
+            log_debug(ZONE, "replace for type=%s owner=%s supersedes a filtered one", type, owner);
+
+            _st_wb_unlink(wb, e);
+            _st_wb_entry_free(e);
+
+            wb->coalesced++;
+        } else
+            _st_wb_settle(st, type, owner);
+    }
+
+    len = strlen(type) + 1 + strlen(owner);
+    e = (st_wb_entry_t) calloc(1, sizeof(struct st_wb_entry_st) + len);
+    _st_wb_key(e->key, len + 1, type, owner);
+
+    e->type = strdup(type);
+    e->owner = strdup(owner);
+    e->filter = filter != NULL ? strdup(filter) : NULL;
+    e->os = os_copy(os);
+    e->since = time(NULL);
+
+    _st_wb_link(wb, e);
+
+    if(wb->count >= wb->max && e->since >= wb->retry)
+        storage_flush(st, 1);
+}
+
+void storage_flush(storage_t st, int force) {
+    st_wb_t wb = st->wb;
+    st_wb_entry_t list, e;
+    time_t now;
+
+    if(wb == NULL || wb->head == NULL)
+        return;
+
+    now = time(NULL);
+    if(!force && (now < wb->head->since + wb->interval || now < wb->retry))
+        return;
+
+    log_debug(ZONE, "writing out %d buffered replaces", wb->count);
+
+    /* take them all, the ones that fail come back */
+    list = wb->head;
+    for(e = list; e != NULL; e = e->next)
+        xhash_zap(wb->pending, e->key);
+    wb->head = wb->tail = NULL;
+    wb->count = 0;
+
+    _st_wb_write(st, list);
+}
+
+/** let whoever keeps copies of an owner's data know it's about to change */
+static void _st_changed(storage_t st, const char *type, const char *owner) {
+    if(st->changed != NULL)
+        (st->changed)(st, type, owner, st->changed_arg);
+}
+
 st_ret_t storage_put(storage_t st, const char *type, const char *owner, os_t os) {
     st_driver_t drv;
     st_ret_t ret;
 
     log_debug(ZONE, "storage_put: type=%s owner=%s os=%X", type, owner, os);
 
+    _st_changed(st, type, owner);
+
+    /* anything buffered goes first */
+    if(_st_wb_type(st, type))
+        _st_wb_settle(st, type, owner);
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -217,12 +648,83 @@ st_ret_t storage_put(storage_t st, const char *type, const char *owner, os_t os)
     return (drv->put)(drv, type, owner, os);
 }
 
+void storage_preload(storage_t st, const char *type, const char *owner, st_ret_t ret, os_t os) {
+    st_preload_t pl;
+    int len;
+
+    storage_preload_drop(st, type, owner);
+
+    len = strlen(type) + 1 + strlen(owner);
+    pl = (st_preload_t) malloc(sizeof(struct st_preload_st) + len);
+    sprintf(pl->key, "%s/%s", type, owner);
+    pl->ret = ret;
+    pl->os = os;
+
+    xhash_put(st->preload, pl->key, (void *) pl);
+}
+
+/** take the preloaded objects out, NULL if there are none */
+static st_preload_t _st_preload_take(storage_t st, const char *type, const char *owner) {
+    st_preload_t pl;
+    char key[1024];
+    int len;
+
+    len = snprintf(key, sizeof(key), "%s/%s", type, owner);
+    if(len >= sizeof(key))
+        return NULL;
+
+    pl = (st_preload_t) xhash_getx(st->preload, key, len);
+    if(pl != NULL)
+        xhash_zapx(st->preload, key, len);
+
+    return pl;
+}
+
+void storage_preload_drop(storage_t st, const char *type, const char *owner) {
+    st_preload_t pl;
+
+    if((pl = _st_preload_take(st, type, owner)) != NULL)
+        _st_preload_reaper(NULL, 0, (void *) pl, NULL);
+}
+
 st_ret_t storage_get(storage_t st, const char *type, const char *owner, const char *filter, os_t *os) {
     st_driver_t drv;
     st_ret_t ret;
+    st_preload_t pl;
+    st_wb_entry_t e;
 
     log_debug(ZONE, "storage_get: type=%s owner=%s filter=%s", type, owner, filter);
 
+    /* fetched already */
+    if(filter == NULL && owner != NULL && xhash_count(st->preload) > 0 && (pl = _st_preload_take(st, type, owner)) != NULL) {
+        log_debug(ZONE, "using preloaded objects for type=%s owner=%s", type, owner);
+
+        ret = pl->ret;
+        if(ret == st_SUCCESS)
+            *os = pl->os;
+        else if(pl->os != NULL)
+            os_free(pl->os);
+
+        free(pl);
+
+        return ret;
+    }
+
+    if(_st_wb_type(st, type)) {
+        /* the last replace is what the database would say */
+        if((e = _st_wb_find(st, type, owner, filter)) != NULL) {
+            log_debug(ZONE, "using buffered objects for type=%s owner=%s", type, owner);
+
+            if(os_count(e->os) == 0)
+                return st_NOTFOUND;
+
+            *os = os_copy(e->os);
+            return st_SUCCESS;
+        }
+
+        _st_wb_settle(st, type, owner);
+    }
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -250,6 +752,10 @@ st_ret_t storage_get_custom_sql(storage_t st, const char* request, os_t* os, con
 
     log_debug(ZONE, "storage_get_custom_sql: query='%s'", request);
 
+    /* no telling what it reads */
+    if(st->wb != NULL)
+        storage_flush(st, 1);
+
     if (type) {
         /* find the handler for this type */
         drv = xhash_get(st->types, type);
@@ -282,9 +788,20 @@ st_ret_t storage_get_custom_sql(storage_t st, const char* request, os_t* os, con
 st_ret_t storage_count(storage_t st, const char *type, const char *owner, const char *filter, int *count) {
     st_driver_t drv;
     st_ret_t ret;
+    st_wb_entry_t e;
 
     log_debug(ZONE, "storage_count: type=%s owner=%s filter=%s", type, owner, filter);
 
+    if(_st_wb_type(st, type)) {
+        if((e = _st_wb_find(st, type, owner, filter)) != NULL) {
+            if(count != NULL)
+                *count = os_count(e->os);
+            return st_SUCCESS;
+        }
+
+        _st_wb_settle(st, type, owner);
+    }
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -311,6 +828,16 @@ st_ret_t storage_delete(storage_t st, const char *type, const char *owner, const
 
     log_debug(ZONE, "storage_zap: type=%s owner=%s filter=%s", type, owner, filter);
 
+    _st_changed(st, type, owner);
+
+    if(_st_wb_type(st, type)) {
+        /* everything goes, so there's no point writing it first */
+        if(filter == NULL)
+            _st_wb_drop(st, type, owner);
+        else
+            _st_wb_settle(st, type, owner);
+    }
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -337,6 +864,13 @@ st_ret_t storage_replace(storage_t st, const char *type, const char *owner, cons
 
     log_debug(ZONE, "storage_replace: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
 
+    _st_changed(st, type, owner);
+
+    if(owner != NULL && _st_wb_type(st, type)) {
+        _st_wb_buffer(st, type, owner, filter, os);
+        return st_SUCCESS;
+    }
+
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
     if(drv == NULL) {
@@ -357,6 +891,505 @@ st_ret_t storage_replace(storage_t st, const char *type, const char *owner, cons
     return (drv->replace)(drv, type, owner, filter, os);
 }
 
+st_ret_t storage_get_multi(storage_t st, const char *type, const char **owners, int nowners, const char *filter, os_t *os) {
+    st_driver_t drv;
+    st_ret_t ret = st_SUCCESS;
+    st_wb_entry_t e;
+    xht seen;
+    const char **want;
+    int *wanted, i, j, nwant = 0;
+    os_t *got;
+
+    log_debug(ZONE, "storage_get_multi: type=%s owners=%d filter=%s", type, nowners, filter);
+
+    if(nowners < 0)
+        return st_FAILED;
+
+    for(i = 0; i < nowners; i++)
+        os[i] = NULL;
+
+    if(nowners == 0)
+        return st_SUCCESS;
+
+    if((drv = _st_type_driver(st, type)) == NULL)
+        return st_NOTIMPL;
+
+    want = (const char **) malloc(sizeof(char *) * nowners);
+    wanted = (int *) malloc(sizeof(int) * nowners);
+    seen = xhash_new(nowners * 2 + 1);
+
+    /* the driver only gets each owner once, and none that are buffered */
+    for(i = 0; i < nowners; i++) {
+        if(_st_wb_type(st, type)) {
+            if((e = _st_wb_find(st, type, owners[i], filter)) != NULL) {
+                if(os_count(e->os) > 0)
+                    os[i] = os_copy(e->os);
+                continue;
+            }
+
+            _st_wb_settle(st, type, owners[i]);
+        }
+
+        if(xhash_get(seen, owners[i]) != NULL)
+            continue;
+
+        xhash_put(seen, owners[i], (void *) (intptr_t) (i + 1));
+        want[nwant] = owners[i];
+        wanted[nwant] = i;
+        nwant++;
+    }
+
+    got = (os_t *) calloc(nwant > 0 ? nwant : 1, sizeof(os_t));
+
+    if(nwant == 0)
+        ;
+    else if(drv->get_multi != NULL)
+        ret = (drv->get_multi)(drv, type, want, nwant, filter, got);
+    else
+        for(j = 0; j < nwant; j++) {
+            ret = (drv->get)(drv, type, want[j], filter, &got[j]);
+            if(ret == st_NOTFOUND) {
+                got[j] = NULL;
+                ret = st_SUCCESS;
+            } else if(ret != st_SUCCESS) {
+                got[j] = NULL;
+                break;
+            }
+        }
+
+    if(ret == st_SUCCESS) {
+        for(j = 0; j < nwant; j++)
+            os[wanted[j]] = got[j];
+
+        /* repeats get their own copy */
+        for(i = 0; i < nowners; i++) {
+            j = (int) (intptr_t) xhash_get(seen, owners[i]) - 1;
+            if(j >= 0 && j != i && os[j] != NULL)
+                os[i] = os_copy(os[j]);
+        }
+    } else {
+        for(j = 0; j < nwant; j++)
+            if(got[j] != NULL) os_free(got[j]);
+        for(i = 0; i < nowners; i++)
+            if(os[i] != NULL) {
+                os_free(os[i]);
+                os[i] = NULL;
+            }
+    }
+
+    free(got);
+    xhash_free(seen);
+    free(wanted);
+    free(want);
+
+    return ret;
+}
+
+static st_ret_t _storage_put_multi(storage_t st, const char *type, const char **owners, int nowners, os_t *os, int replace) {
+    st_driver_t drv;
+    st_ret_t ret = st_SUCCESS;
+    xht seen;
+    const char **put;
+    os_t *pos;
+    int i, j, nput = 0;
+
+    if(nowners < 0)
+        return st_FAILED;
+
+    if(nowners == 0)
+        return st_SUCCESS;
+
+    for(i = 0; i < nowners; i++)
+        _st_changed(st, type, owners[i]);
+
+    if(_st_wb_type(st, type)) {
+        if(replace) {
+            for(i = 0; i < nowners; i++)
+                _st_wb_buffer(st, type, owners[i], NULL, os[i]);
+            return st_SUCCESS;
+        }
+
+        for(i = 0; i < nowners; i++)
+            _st_wb_settle(st, type, owners[i]);
+    }
+
+    if((drv = _st_type_driver(st, type)) == NULL)
+        return st_NOTIMPL;
+
+    put = (const char **) malloc(sizeof(char *) * nowners);
+    pos = (os_t *) malloc(sizeof(os_t) * nowners);
+    seen = xhash_new(nowners * 2 + 1);
+
+    /* when replacing, the last one for an owner wins */
+    for(i = 0; i < nowners; i++) {
+        if(replace && (j = (int) (intptr_t) xhash_get(seen, owners[i])) > 0) {
+            pos[j - 1] = os[i];
+            continue;
+        }
+
+        put[nput] = owners[i];
+        pos[nput] = os[i];
+        nput++;
+
+        if(replace)
+            xhash_put(seen, owners[i], (void *) (intptr_t) nput);
+    }
+
+    if(drv->put_multi != NULL)
+        ret = (drv->put_multi)(drv, type, put, nput, pos, replace);
+    else
+        for(i = 0; i < nput && ret == st_SUCCESS; i++)
+            ret = replace ? (drv->replace)(drv, type, put[i], NULL, pos[i]) : (drv->put)(drv, type, put[i], pos[i]);
+
+    xhash_free(seen);
+    free(pos);
+    free(put);
+
+    return ret;
+}
+
+st_ret_t storage_put_multi(storage_t st, const char *type, const char **owners, int nowners, os_t *os) {
+    log_debug(ZONE, "storage_put_multi: type=%s owners=%d", type, nowners);
+
+    return _storage_put_multi(st, type, owners, nowners, os, 0);
+}
+
+st_ret_t storage_replace_multi(storage_t st, const char *type, const char **owners, int nowners, os_t *os) {
+    log_debug(ZONE, "storage_replace_multi: type=%s owners=%d", type, nowners);
+
+    return _storage_put_multi(st, type, owners, nowners, os, 1);
+}
+
+/** run a request against a storage manager */
+static void _st_req_exec(storage_t st, st_req_t req) {
+    switch(req->op) {
+        case st_op_PUT:
+            req->ret = storage_put(st, req->type, req->owner, req->os);
+            break;
+
+        case st_op_GET:
+            req->os = NULL;
+            req->ret = storage_get(st, req->type, req->owner, req->filter, &req->os);
+            break;
+
+        case st_op_COUNT:
+            req->ret = storage_count(st, req->type, req->owner, req->filter, &req->count);
+            break;
+
+        case st_op_DELETE:
+            req->ret = storage_delete(st, req->type, req->owner, req->filter);
+            break;
+
+        case st_op_REPLACE:
+            req->ret = storage_replace(st, req->type, req->owner, req->filter, req->os);
+            break;
+
+        case st_op_GET_MULTI:
+            req->oss = (os_t *) calloc(req->nowners > 0 ? req->nowners : 1, sizeof(os_t));
+            req->ret = storage_get_multi(st, req->type, (const char **) req->owners, req->nowners, req->filter, req->oss);
+            break;
+    }
+}
+
+static void _st_req_done(st_req_t req) {
+    int i;
+
+    (req->cb)(req, req->arg);
+
+    for(i = 0; i < req->nowners; i++) {
+        if(req->oss != NULL && req->oss[i] != NULL) os_free(req->oss[i]);
+        free(req->owners[i]);
+    }
+    if(req->oss != NULL) free(req->oss);
+    if(req->owners != NULL) free(req->owners);
+
+    if(req->os != NULL) os_free(req->os);
+    if(req->type != NULL) free(req->type);
+    if(req->owner != NULL) free(req->owner);
+    if(req->filter != NULL) free(req->filter);
+    free(req);
+}
+
+#ifdef HAVE_PTHREAD
+static void _st_async_wake(st_async_t sa) {
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+
+    while(write(sa->fd[1], &one, sizeof(one)) < 0 && errno == EINTR);
+#else
+    char c = 0;
+
+    while(write(sa->fd[1], &c, 1) < 0 && errno == EINTR);
+#endif
+}
+
+typedef struct st_worker_st {
+    st_async_t  sa;
+    storage_t   st;
+} *st_worker_t;
+
+static void *_st_async_worker(void *arg) {
+    st_worker_t w = (st_worker_t) arg;
+    st_async_t sa = w->sa;
+    storage_t st = w->st;
+    st_req_t req;
+
+    free(w);
+
+    while(1) {
+        pthread_mutex_lock(&sa->lock);
+        while(!sa->stop && sa->head == NULL)
+            pthread_cond_wait(&sa->cond, &sa->lock);
+
+        if(sa->stop) {
+            pthread_mutex_unlock(&sa->lock);
+            break;
+        }
+
+        req = sa->head;
+        sa->head = req->next;
+        if(sa->head == NULL)
+            sa->tail = NULL;
+        pthread_mutex_unlock(&sa->lock);
+
+        _st_req_exec(st, req);
+
+        if(mpscq_push(sa->done, (void *) req))
+            _st_async_wake(sa);
+    }
+
+    return NULL;
+}
+
+int storage_async_start(storage_t st, int workers) {
+    st_async_t sa;
+    st_worker_t w;
+    sigset_t all, old;
+    int i, err;
+
+    if(workers <= 0 || st->async != NULL)
+        return -1;
+
+    sa = (st_async_t) calloc(1, sizeof(struct st_async_st));
+
+#ifdef HAVE_SYS_EVENTFD_H
+    if((sa->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        log_write(st->log, LOG_ERR, "failed to create storage worker eventfd: %s", strerror(errno));
+        free(sa);
+        return -1;
+    }
+    sa->fd[1] = sa->fd[0];
+#else
+    if(pipe(sa->fd) != 0) {
+        log_write(st->log, LOG_ERR, "failed to create storage worker pipe: %s", strerror(errno));
+        free(sa);
+        return -1;
+    }
+    fcntl(sa->fd[0], F_SETFL, fcntl(sa->fd[0], F_GETFL) | O_NONBLOCK);
+#endif
+
+    pthread_mutex_init(&sa->lock, NULL);
+    pthread_cond_init(&sa->cond, NULL);
+    sa->done = mpscq_new();
+
+    /* every worker connects to the databases itself, drivers keep one connection each */
+    sa->wst = (storage_t *) calloc(workers, sizeof(storage_t));
+    sa->threads = (pthread_t *) calloc(workers, sizeof(pthread_t));
+
+    st->async = sa;
+
+    /* signals are for the main loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for(i = 0; i < workers; i++) {
+        /* workers write straight through, the buffer is the main loop's */
+        if((sa->wst[i] = _storage_new(st->config, st->log, 0)) == NULL) {
+            log_write(st->log, LOG_ERR, "failed to initialise storage drivers for worker %d", i);
+            break;
+        }
+
+        w = (st_worker_t) malloc(sizeof(struct st_worker_st));
+        w->sa = sa;
+        w->st = sa->wst[i];
+
+        if((err = pthread_create(&sa->threads[i], NULL, _st_async_worker, (void *) w)) != 0) {
+            log_write(st->log, LOG_ERR, "failed to start storage worker %d: %s", i, strerror(err));
+            storage_free(sa->wst[i]);
+            free(w);
+            break;
+        }
+
+        sa->nworkers++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(sa->nworkers == 0) {
+        storage_async_stop(st);
+        return -1;
+    }
+
+    log_write(st->log, LOG_NOTICE, "started %d storage workers", sa->nworkers);
+
+    return sa->fd[0];
+}
+
+void storage_async_stop(storage_t st) {
+    st_async_t sa = st->async;
+    st_req_t req;
+    int i;
+
+    if(sa == NULL)
+        return;
+
+    pthread_mutex_lock(&sa->lock);
+    sa->stop = 1;
+    pthread_cond_broadcast(&sa->cond);
+    pthread_mutex_unlock(&sa->lock);
+
+    for(i = 0; i < sa->nworkers; i++) {
+        pthread_join(sa->threads[i], NULL);
+        storage_free(sa->wst[i]);
+    }
+
+    /* whatever they didn't get to fails */
+    while((req = sa->head) != NULL) {
+        sa->head = req->next;
+        req->ret = st_FAILED;
+        mpscq_push(sa->done, (void *) req);
+    }
+
+    /* finish up in the caller, from here on everything runs there */
+    st->async = NULL;
+    while((req = (st_req_t) mpscq_pull(sa->done)) != NULL)
+        _st_req_done(req);
+
+    if(sa->fd[1] != sa->fd[0])
+        close(sa->fd[1]);
+
+    mpscq_free(sa->done);
+    pthread_cond_destroy(&sa->cond);
+    pthread_mutex_destroy(&sa->lock);
+    free(sa->threads);
+    free(sa->wst);
+    free(sa);
+}
+#else
+int storage_async_start(storage_t st, int workers) {
+    if(workers > 0)
+        log_write(st->log, LOG_WARNING, "no thread support, storage calls will run in the main loop");
+
+    return -1;
+}
+
+void storage_async_stop(storage_t st) {
+}
+#endif
+
+/** hand a request to the workers, or run it now if there aren't any */
+static void _st_req_queue(storage_t st, st_req_t req) {
+#ifdef HAVE_PTHREAD
+    if(st->async != NULL) {
+        st_async_t sa = st->async;
+
+        pthread_mutex_lock(&sa->lock);
+        if(sa->tail != NULL)
+            sa->tail->next = req;
+        else
+            sa->head = req;
+        sa->tail = req;
+        pthread_cond_signal(&sa->cond);
+        pthread_mutex_unlock(&sa->lock);
+
+        return;
+    }
+#endif
+
+    _st_req_exec(st, req);
+    _st_req_done(req);
+}
+
+void storage_async(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, os_t os, st_req_fn cb, void *arg) {
+    st_req_t req;
+
+    req = (st_req_t) calloc(1, sizeof(struct st_req_st));
+    req->op = op;
+    req->type = strdup(type);
+    req->owner = owner != NULL ? strdup(owner) : NULL;
+    req->filter = filter != NULL ? strdup(filter) : NULL;
+    req->os = os;
+    req->cb = cb;
+    req->arg = arg;
+
+#ifdef HAVE_PTHREAD
+    /* the workers can't see the buffer, so write it out or answer from it here */
+    if(st->async != NULL && _st_wb_type(st, type)) {
+        if(op == st_op_REPLACE || (op == st_op_GET && _st_wb_find(st, type, owner, filter) != NULL)) {
+            _st_req_exec(st, req);
+            _st_req_done(req);
+            return;
+        }
+
+        _st_wb_settle(st, type, owner);
+    }
+#endif
+
+    /* without workers it goes through the synchronous calls, which say so themselves */
+    if(st->async != NULL && (op == st_op_PUT || op == st_op_DELETE || op == st_op_REPLACE))
+        _st_changed(st, type, owner);
+
+    _st_req_queue(st, req);
+}
+
+void storage_async_multi(storage_t st, const char *type, const char **owners, int nowners, const char *filter, st_req_fn cb, void *arg) {
+    st_req_t req;
+    int i;
+
+    req = (st_req_t) calloc(1, sizeof(struct st_req_st));
+    req->op = st_op_GET_MULTI;
+    req->type = strdup(type);
+    req->filter = filter != NULL ? strdup(filter) : NULL;
+    req->owners = (char **) malloc(sizeof(char *) * (nowners > 0 ? nowners : 1));
+    for(i = 0; i < nowners; i++)
+        req->owners[i] = strdup(owners[i]);
+    req->nowners = nowners;
+    req->cb = cb;
+    req->arg = arg;
+
+    /* the workers can't see the buffer */
+    if(st->async != NULL && _st_wb_type(st, type))
+        for(i = 0; i < nowners; i++)
+            _st_wb_settle(st, type, owners[i]);
+
+    _st_req_queue(st, req);
+}
+
+void storage_async_run(storage_t st) {
+#ifdef HAVE_PTHREAD
+    st_async_t sa = st->async;
+    st_req_t req;
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t n;
+#else
+    char buf[64];
+#endif
+
+    if(sa == NULL)
+        return;
+
+#ifdef HAVE_SYS_EVENTFD_H
+    while(read(sa->fd[0], &n, sizeof(n)) < 0 && errno == EINTR);
+#else
+    while(read(sa->fd[0], buf, sizeof(buf)) > 0);
+#endif
+
+    mpscq_woken(sa->done);
+    while((req = (st_req_t) mpscq_pull(sa->done)) != NULL)
+        _st_req_done(req);
+#endif
+}
+
 static st_filter_t _storage_filter(pool_t p, const char *f, int len) {
     char *c, *key, *val, *sub;
     int vallen;
@@ -106,6 +106,8 @@ struct os_object_st {
 ST_API os_t        os_new(void);
 /** free an object set */
 ST_API void        os_free(os_t os);
+/** copy an object set */
+ST_API os_t        os_copy(os_t os);
 
 /** number of objects in a set */
 ST_API int         os_count(os_t os);
@@ -160,6 +162,13 @@ typedef enum {
 
 typedef struct st_driver_st *st_driver_t;
 
+typedef struct st_async_st *st_async_t;
+
+typedef struct st_wb_st *st_wb_t;
+
+/** told before something is written for an owner (NULL for everyone), so copies kept elsewhere can go */
+typedef void (*st_changed_fn)(storage_t st, const char *type, const char *owner, void *arg);
+
 /** storage manager data */
 struct storage_st {
 //    sm_t        sm;             /**< sm context */
@@ -171,6 +180,15 @@ struct storage_st {
 
     st_driver_t default_drv;    /**< default driver (used when there is no module
                                      explicitly registered for a type) */
+
+    st_async_t  async;          /**< worker threads, NULL if everything runs in the caller */
+
+    xht         preload;        /**< objects fetched ahead of a storage_get (key is type/owner) */
+
+    st_wb_t     wb;             /**< write-behind buffer, NULL if no types are written behind */
+
+    st_changed_fn changed;      /**< write notification, called in the thread that does the write */
+    void        *changed_arg;   /**< argument for the notification */
 };
 
 /** data for a single storage driver */
@@ -207,8 +225,21 @@ struct st_driver_st {
 
     /** called when driver is freed */
     void        (*free)(st_driver_t drv);
+
+    /** start a batch, puts and replaces up to batch_end go into one transaction (optional) */
+    st_ret_t    (*batch_begin)(st_driver_t drv);
+    /** end a batch, committing it if ok is set and rolling it back otherwise */
+    st_ret_t    (*batch_end)(st_driver_t drv, int ok);
+
+    /** get handler for several (distinct) owners at once, os[i] gets the objects of owners[i] or NULL (optional) */
+    st_ret_t    (*get_multi)(st_driver_t drv, const char *type, const char **owners, int nowners, const char *filter, os_t *os);
+    /** put handler for several owners at once, first deleting everything they had if replace is set (optional) */
+    st_ret_t    (*put_multi)(st_driver_t drv, const char *type, const char **owners, int nowners, os_t *os, int replace);
 };
 
+/** most owners a driver should name in one query */
+#define ST_MULTI_MAX (128)
+
 /** allocate a storage manager instance */
 ST_API storage_t       storage_new(config_t config, log_t log);
 /** free a storage manager instance */
@@ -230,6 +261,74 @@ ST_API st_ret_t        storage_delete(storage_t st, const char *type, const char
 /** replace objects matching this filter with objects in this set (atomic delete + get) */
 ST_API st_ret_t        storage_replace(storage_t st, const char *type, const char *owner, const char *filter, os_t os);
 
+/** get objects for several owners, os[i] is set to the objects of owners[i] or NULL if there are none */
+ST_API st_ret_t        storage_get_multi(storage_t st, const char *type, const char **owners, int nowners, const char *filter, os_t *os);
+/** store objects for several owners, os[i] goes to owners[i] */
+ST_API st_ret_t        storage_put_multi(storage_t st, const char *type, const char **owners, int nowners, os_t *os);
+/** replace everything several owners have, os[i] goes to owners[i] */
+ST_API st_ret_t        storage_replace_multi(storage_t st, const char *type, const char **owners, int nowners, os_t *os);
+
+/** write out buffered replaces when they're due, or all of them if force is set */
+ST_API void            storage_flush(storage_t st, int force);
+
+/* asynchronous requests */
+
+/** operations the storage workers can run */
+typedef enum {
+    st_op_PUT,
+    st_op_GET,
+    st_op_COUNT,
+    st_op_DELETE,
+    st_op_REPLACE,
+    st_op_GET_MULTI
+} st_op_t;
+
+typedef struct st_req_st *st_req_t;
+
+/** completion callback, always called in the thread that runs storage_async_run() */
+typedef void (*st_req_fn)(st_req_t req, void *arg);
+
+/** a request for the storage workers */
+struct st_req_st {
+    st_op_t     op;             /**< what to do */
+
+    char        *type;          /**< arguments, as for the synchronous calls */
+    char        *owner;
+    char        *filter;
+
+    os_t        os;             /**< objects to store (freed with the request), or objects
+                                     found (set to NULL to keep them) */
+    int         count;          /**< result of a count */
+
+    char        **owners;       /**< owners for a multi get */
+    int         nowners;
+    os_t        *oss;           /**< objects found for each owner (set to NULL to keep them) */
+
+    st_ret_t    ret;            /**< result of the call */
+
+    st_req_fn   cb;             /**< completion callback */
+    void        *arg;           /**< argument for the callback */
+
+    st_req_t    next;           /**< next request waiting for a worker */
+};
+
+/** start worker threads, each with its own drivers; returns a descriptor that becomes readable
+  * when requests complete (the caller closes it, after storage_async_stop), or -1 */
+ST_API int             storage_async_start(storage_t st, int workers);
+/** stop the workers, requests they haven't started complete with st_FAILED */
+ST_API void            storage_async_stop(storage_t st);
+/** queue a request, without workers it runs (and completes) before this returns */
+ST_API void            storage_async(storage_t st, st_op_t op, const char *type, const char *owner, const char *filter, os_t os, st_req_fn cb, void *arg);
+/** queue a multi get, oss is NULL in the callback if the request failed before it ran */
+ST_API void            storage_async_multi(storage_t st, const char *type, const char **owners, int nowners, const char *filter, st_req_fn cb, void *arg);
+/** run the callbacks of completed requests */
+ST_API void            storage_async_run(storage_t st);
+
+/** hand objects fetched in advance to the next storage_get for this type and owner (with no filter) */
+ST_API void            storage_preload(storage_t st, const char *type, const char *owner, st_ret_t ret, os_t os);
+/** forget objects that weren't asked for after all */
+ST_API void            storage_preload_drop(storage_t st, const char *type, const char *owner);
+
 /** type for the driver init function */
 typedef st_ret_t (*st_driver_init_fn)(st_driver_t);
 
@@ -263,6 +362,68 @@ ST_API st_filter_t     storage_filter(const char *filter);
 /** see if the object matches the filter */
 ST_API int             storage_match(st_filter_t filter, os_object_t o, os_t os);
 
+
+/*
+ * prepared statement cache for the SQL drivers
+ *
+ * Statements are keyed by their SQL text. The drivers generate it with
+ * placeholders for every value, so the text only depends on the operation,
+ * the type and the shape of the filter (or the columns of a put), and two
+ * requests of the same kind share a statement.
+ */
+
+typedef struct st_stmt_st *st_stmt_t;
+/** a cached statement */
+struct st_stmt_st {
+    char                *sql;       /**< key */
+    void                *handle;    /**< driver statement handle */
+
+    int                 cached;     /**< in the cache, not released when done */
+
+    unsigned long long  start;      /**< usec, for the latency stats */
+
+    st_stmt_t           prev, next; /**< lru list, most recent first */
+};
+
+/** callback to release a statement handle */
+typedef void (*st_stmt_free_fn)(void *handle, void *arg);
+
+typedef struct st_stmt_cache_st *st_stmt_cache_t;
+/** per-connection statement cache */
+struct st_stmt_cache_st {
+    xht                 stmts;
+    st_stmt_t           head, tail;
+
+    int                 count;
+    int                 max;        /**< 0 disables caching */
+
+    st_stmt_free_fn     free;
+    void                *arg;
+
+    /* stats */
+    unsigned long       hits;
+    unsigned long       misses;
+    unsigned long       evictions;
+    unsigned long       execs;
+    unsigned long long  usec;       /**< total execution time */
+    unsigned long       usec_max;
+};
+
+/** create a cache holding up to max statements */
+ST_API st_stmt_cache_t st_stmt_cache_new(int max, st_stmt_free_fn free, void *arg);
+/** free the cache and all its statements */
+ST_API void            st_stmt_cache_free(st_stmt_cache_t sc);
+/** release all statements (eg after a reconnect) */
+ST_API void            st_stmt_cache_flush(st_stmt_cache_t sc);
+/** find a statement for this sql; if its handle is NULL the driver has to prepare it */
+ST_API st_stmt_t       st_stmt_get(st_stmt_cache_t sc, const char *sql);
+/** done with a statement, record its latency and release it if it didn't make it into the cache */
+ST_API void            st_stmt_done(st_stmt_cache_t sc, st_stmt_t stmt);
+/** drop a statement whose handle went bad */
+ST_API void            st_stmt_drop(st_stmt_cache_t sc, st_stmt_t stmt);
+/** log the stats */
+ST_API void            st_stmt_cache_stats(st_stmt_cache_t sc, log_t log, const char *driver);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -28,6 +28,11 @@
 #include "storage.h"
 #include <mysql.h>
 
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80000 && MYSQL_VERSION_ID < 100000
+/* mysql 8 went to plain bool */
+typedef bool my_bool;
+#endif
+
 /** internal structure, holds our data */
 typedef struct drvdata_st {
     MYSQL *conn;
@@ -35,8 +40,18 @@ typedef struct drvdata_st {
     const char *prefix;
 
     int txn;
+    int batch;              /* in a batch transaction, put and replace don't start their own */
+
+    st_stmt_cache_t stmts;
+    unsigned long thread;   /* connection id the statements were prepared on */
 } *drvdata_t;
 
+/** values for the placeholders of a statement */
+typedef struct myparams_st {
+    char **vals;
+    int n, len;
+} *myparams_t;
+
 #define FALLBACK_BLOCKSIZE (4096)
 
 /** internal: do and return the math and ensure it gets realloc'd */
@@ -68,101 +83,289 @@ static size_t _st_mysql_realloc(char **oblocks, size_t len) {
 /** this is the safety check used to make sure there's always enough mem */
 #define MYSQL_SAFE(blocks, size, len) if((unsigned int)(size) >= (unsigned int)(len)) len = _st_mysql_realloc(&(blocks),(size + 1));
 
-static void _st_mysql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, int *buflen, int *nbuf) {
-    drvdata_t data = (drvdata_t) drv->private;
+static void _st_mysql_param(myparams_t params, char *val) {
+    if(params->n == params->len) {
+        params->len = params->len * 2 + 8;
+        params->vals = (char **) realloc(params->vals, sizeof(char *) * params->len);
+    }
+
+    params->vals[params->n++] = val;
+}
+
+static void _st_mysql_params_free(myparams_t params) {
+    int i;
+
+    for(i = 0; i < params->n; i++)
+        free(params->vals[i]);
+    free(params->vals);
+
+    params->vals = NULL;
+    params->n = params->len = 0;
+}
+
+static void _st_mysql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, int *buflen, int *nbuf, myparams_t params) {
     st_filter_t scan; 
-    char *cval;
-    int vlen;
 
     switch(f->type) {
         case st_filter_type_PAIR:
+            /* values go in as parameters, only the key ends up in the sql */
+            _st_mysql_param(params, strdup(f->val));
 
-            /* do sql escape processing of f->val */
-            cval = (char *) malloc(sizeof(char) * ((strlen((char *) f->val) * 2) + 1));
-            vlen = mysql_real_escape_string(data->conn, cval, (char *) f->val, strlen((char *) f->val));
-
-            MYSQL_SAFE((*buf), *buflen + 12 + strlen(f->key) + vlen, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( `%s` = \'%s\' ) ", f->key, cval);
-            free(cval);
+            MYSQL_SAFE((*buf), *nbuf + 12 + strlen(f->key), *buflen);
+            *nbuf += sprintf(&((*buf)[*nbuf]), "( `%s` = ? ) ", f->key);
 
             break;
 
         case st_filter_type_AND:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, params);
 
                 if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 4, *buflen);
+                    MYSQL_SAFE((*buf), *nbuf + 4, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
                 }
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_OR:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, params);
 
                 if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 3, *buflen);
+                    MYSQL_SAFE((*buf), *nbuf + 3, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
                 }
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_NOT:
-            MYSQL_SAFE((*buf), *buflen + 6, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 6, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
 
-            _st_mysql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_mysql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf, params);
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
+            MYSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
     }
 }
 
-static char *_st_mysql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
+/** the condition for this owner and filter, the values are added to params */
+static char *_st_mysql_convert_filter(st_driver_t drv, const char *owner, const char *filter, myparams_t params) {
     char *buf = NULL;
     int buflen = 0, nbuf = 0;
     st_filter_t f;
 
-    MYSQL_SAFE(buf, 23 + strlen(owner), buflen);
+    _st_mysql_param(params, strdup(owner));
+
+    MYSQL_SAFE(buf, 24, buflen);
+
+    nbuf = sprintf(buf, "`collection-owner` = ?");
+
+    f = storage_filter(filter);
+    if(f == NULL)
+        return buf;
+
+    MYSQL_SAFE(buf, nbuf + 5, buflen);
+    nbuf += sprintf(&buf[nbuf], " AND ");
+
+    _st_mysql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf, params);
+
+    pool_free(f->p);
+
+    return buf;
+}
+
+/** like convert_filter, but for several owners, padded to slots placeholders so the statement cache only sees a few shapes */
+static char *_st_mysql_convert_filter_multi(st_driver_t drv, const char **owners, int nowners, int slots, const char *filter, myparams_t params) {
+    char *buf = NULL;
+    int buflen = 0, nbuf = 0, i;
+    st_filter_t f;
+
+    MYSQL_SAFE(buf, 24 + slots * 3, buflen);
+    nbuf = sprintf(buf, "`collection-owner` IN ( ?");
+    _st_mysql_param(params, strdup(owners[0]));
 
-    nbuf = sprintf(buf, "`collection-owner` = '%s'", owner);
+    for(i = 1; i < slots; i++) {
+        nbuf += sprintf(&buf[nbuf], ", ?");
+        _st_mysql_param(params, strdup(owners[i < nowners ? i : nowners - 1]));
+    }
+
+    nbuf += sprintf(&buf[nbuf], " )");
 
     f = storage_filter(filter);
     if(f == NULL)
         return buf;
 
-    MYSQL_SAFE(buf, buflen + 5, buflen);
+    MYSQL_SAFE(buf, nbuf + 5, buflen);
     nbuf += sprintf(&buf[nbuf], " AND ");
 
-    _st_mysql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+    _st_mysql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf, params);
 
     pool_free(f->p);
 
     return buf;
 }
 
+static int _st_mysql_slots(int n) {
+    int slots;
+
+    for(slots = 1; slots < n; slots <<= 1);
+
+    return slots;
+}
+
+static void _st_mysql_stmt_close(void *handle, void *arg) {
+    mysql_stmt_close((MYSQL_STMT *) handle);
+}
+
+/** make sure we're still connected, statements from before a reconnect are no good */
+static int _st_mysql_ping(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    if(mysql_ping(data->conn) != 0)
+        return 1;
+
+    if(mysql_thread_id(data->conn) != data->thread) {
+        if(data->stmts->count > 0)
+            log_write(drv->st->log, LOG_NOTICE, "mysql: reconnected to database, dropping prepared statements");
+
+        st_stmt_cache_flush(data->stmts);
+        data->thread = mysql_thread_id(data->conn);
+    }
+
+    return 0;
+}
+
+/** bind the parameters and execute, 0 on success */
+static int _st_mysql_run(st_driver_t drv, MYSQL_STMT *handle, myparams_t params, const char *what) {
+    MYSQL_BIND *bind = NULL;
+    int i;
+
+    if(params->n > 0) {
+        bind = (MYSQL_BIND *) calloc(params->n, sizeof(MYSQL_BIND));
+        for(i = 0; i < params->n; i++) {
+            if(params->vals[i] == NULL) {
+                bind[i].buffer_type = MYSQL_TYPE_NULL;
+                continue;
+            }
+
+            bind[i].buffer_type = MYSQL_TYPE_STRING;
+            bind[i].buffer = params->vals[i];
+            bind[i].buffer_length = strlen(params->vals[i]);
+        }
+    }
+
+    if((bind != NULL && mysql_stmt_bind_param(handle, bind) != 0) || mysql_stmt_execute(handle) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql %s failed: %s", what, mysql_stmt_error(handle));
+        free(bind);
+        return 1;
+    }
+
+    free(bind);
+
+    return 0;
+}
+
+/** run a statement (prepared once and cached if we can), NULL on failure */
+static st_stmt_t _st_mysql_exec(st_driver_t drv, const char *sql, myparams_t params, const char *what) {
+    drvdata_t data = (drvdata_t) drv->private;
+    st_stmt_t stmt;
+    MYSQL_STMT *handle;
+
+    stmt = st_stmt_get(data->stmts, sql);
+    if(stmt->handle == NULL) {
+        log_debug(ZONE, "preparing sql: %s", sql);
+
+        handle = mysql_stmt_init(data->conn);
+        if(handle == NULL) {
+            log_write(drv->st->log, LOG_ERR, "mysql: sql %s failed: %s", what, mysql_error(data->conn));
+            st_stmt_drop(data->stmts, stmt);
+            return NULL;
+        }
+
+        if(mysql_stmt_prepare(handle, sql, strlen(sql)) != 0) {
+            log_write(drv->st->log, LOG_ERR, "mysql: sql %s failed: %s", what, mysql_stmt_error(handle));
+            mysql_stmt_close(handle);
+            st_stmt_drop(data->stmts, stmt);
+            return NULL;
+        }
+
+        stmt->handle = (void *) handle;
+    }
+
+    if(_st_mysql_run(drv, (MYSQL_STMT *) stmt->handle, params, what) != 0) {
+        /* it may not be the statement's fault, but start over with it anyway */
+        st_stmt_drop(data->stmts, stmt);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+/** done with the results, statement goes back to the cache */
+static void _st_mysql_done(st_driver_t drv, st_stmt_t stmt) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    mysql_stmt_free_result((MYSQL_STMT *) stmt->handle);
+
+    st_stmt_done(data->stmts, stmt);
+}
+
 static st_ret_t _st_mysql_add_type(st_driver_t drv, const char *type) {
     return st_SUCCESS;
 }
 
+/** a field as a parameter value, NULL for unknown types */
+static char *_st_mysql_value(void *val, os_type_t ot) {
+    char *cval = NULL;
+    const char *xml;
+    int xlen;
+
+    switch(ot) {
+        case os_type_BOOLEAN:
+            cval = ((int)val != 0) ? strdup("1") : strdup("0");
+            break;
+
+        case os_type_INTEGER:
+            cval = (char *) malloc(sizeof(char) * 20);
+            sprintf(cval, "%d", (int) val);
+            break;
+
+        case os_type_STRING:
+            cval = strdup((char *) val);
+            break;
+
+        case os_type_NAD:
+            nad_print((nad_t) val, 0, &xml, &xlen);
+            cval = (char *) malloc(sizeof(char) * (xlen + 4));
+            memcpy(cval, "NAD", 3);
+            memcpy(&cval[3], xml, xlen);
+            cval[xlen + 3] = '\0';
+            break;
+
+        case os_type_UNKNOWN:
+            break;
+    }
+
+    return cval;
+}
+
 static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
     char *left = NULL, *right = NULL;
@@ -171,9 +374,9 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
     char *key, *cval = NULL;
     void *val;
     os_type_t ot;
-    const char *xml;
-    int xlen;
     char tbuf[128];
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
@@ -188,8 +391,10 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
             MYSQL_SAFE(left, strlen(type) + 35, lleft);
             nleft = sprintf(left, "INSERT INTO `%s` ( `collection-owner`", type);
     
-            MYSQL_SAFE(right, strlen(owner) + 14, lright);
-            nright = sprintf(right, " ) VALUES ( '%s'", owner);
+            _st_mysql_param(&params, strdup(owner));
+
+            MYSQL_SAFE(right, 14, lright);
+            nright = sprintf(right, " ) VALUES ( ?");
     
             o = os_iter_object(os);
             if(os_object_iter_first(o))
@@ -200,55 +405,37 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
                      */
                     val = NULL;
                     os_object_iter_get(o, &key, &val, &ot);
-        
-                    switch(ot) {
-                        case os_type_BOOLEAN:
-                            cval = ((int)val != 0) ? strdup("1") : strdup("0");
-                            break;
-        
-                        case os_type_INTEGER:
-                            cval = (char *) malloc(sizeof(char) * 20);
-                            sprintf(cval, "%d", (int) val);
-                            break;
-        
-                        case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            mysql_real_escape_string(data->conn, cval, (char *) val, strlen((char *) val));
-                            break;
-        
-                        case os_type_NAD:
-                            nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            mysql_real_escape_string(data->conn, &cval[3], xml, xlen);
-                            strncpy(cval, "NAD", 3);
-                            break;
-
-                        case os_type_UNKNOWN:
-                            break;
-                    }
+
+                    cval = _st_mysql_value(val, ot);
         
                     log_debug(ZONE, "key %s val %s", key, cval);
         
-                    MYSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
+                    _st_mysql_param(&params, cval);
+
+                    MYSQL_SAFE(left, nleft + strlen(key) + 4, lleft);
                     nleft += sprintf(&left[nleft], ", `%s`", key);
         
-                    MYSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
+                    MYSQL_SAFE(right, nright + 3, lright);
+                    nright += sprintf(&right[nright], ", ?");
         
-                    free(cval);
                 } while(os_object_iter_next(o));
     
-            MYSQL_SAFE(left, lleft + strlen(right) + 2, lleft);
+            MYSQL_SAFE(left, nleft + nright + 2, lleft);
             sprintf(&left[nleft], "%s )", right);
         
             log_debug(ZONE, "prepared sql: %s", left);
     
-            if(mysql_query(data->conn, left) != 0) {
-                log_write(drv->st->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(data->conn));
+            stmt = _st_mysql_exec(drv, left, &params, "insert");
+
+            _st_mysql_params_free(&params);
+
+            if(stmt == NULL) {
                 free(left);
                 free(right);
                 return st_FAILED;
             }
+
+            _st_mysql_done(drv, stmt);
     
         } while(os_iter_next(os));
 
@@ -260,16 +447,17 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
 
 static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
 
-    if(mysql_ping(data->conn) != 0) {
+    if(_st_mysql_ping(drv) != 0) {
         log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
 
-    if(data->txn) {
+    if(txn) {
         if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
             return st_FAILED;
@@ -282,12 +470,12 @@ static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *own
     }
 
     if(_st_mysql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
+        if(txn)
             mysql_query(data->conn, "ROLLBACK");
         return st_FAILED;
     }
 
-    if(data->txn)
+    if(txn)
         if(mysql_query(data->conn, "COMMIT") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
             mysql_query(data->conn, "ROLLBACK");
@@ -297,55 +485,42 @@ static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *own
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
-    drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+/** turn the rows of an executed select into objects; they all go in *os, or if idx is set, in the os it has for their owner */
+static st_ret_t _st_mysql_fetch(st_driver_t drv, st_stmt_t stmt, os_t *os, xht idx) {
     MYSQL_RES *res;
-    int ntuples, nfields, i, j;
+    int ntuples, nfields, j, ret, owner = -1;
     MYSQL_FIELD *fields;
-    MYSQL_ROW tuple;
+    MYSQL_BIND *bind;
+    unsigned long *lengths;
+    my_bool *nulls, one = 1;
     os_object_t o;
+    os_t *where;
     char *val;
     os_type_t ot;
     int ival;
-    char tbuf[128];
-
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
-    if(data->prefix != NULL) {
-        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
-        type = tbuf;
-    }
-
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    MYSQL_STMT *handle;
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 50, buflen);
-    sprintf(buf, "SELECT * FROM `%s` WHERE %s ORDER BY `object-sequence`", type, cond);
-    free(cond);
+    if(idx == NULL)
+        *os = NULL;
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    handle = (MYSQL_STMT *) stmt->handle;
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
-        return st_FAILED;
-    }
-    free(buf);
+    /* we want to know how big the buffers have to be */
+    mysql_stmt_attr_set(handle, STMT_ATTR_UPDATE_MAX_LENGTH, &one);
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+    res = mysql_stmt_result_metadata(handle);
+    if(res == NULL || mysql_stmt_store_result(handle) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(handle));
+        if(res != NULL)
+            mysql_free_result(res);
+        _st_mysql_done(drv, stmt);
         return st_FAILED;
     }
 
-    ntuples = mysql_num_rows(res);
-    if(ntuples == 0) {
+    ntuples = mysql_stmt_num_rows(handle);
+    if(ntuples == 0 && idx == NULL) {
         mysql_free_result(res);
+        _st_mysql_done(drv, stmt);
         return st_NOTFOUND;
     }
 
@@ -353,31 +528,59 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
 
     nfields = mysql_num_fields(res);
 
-    if(nfields == 0) {
+    if(nfields == 0 && idx == NULL) {
         log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
         mysql_free_result(res);
+        _st_mysql_done(drv, stmt);
         return st_NOTFOUND;
     }
 
     fields = mysql_fetch_fields(res);
 
-    *os = os_new();
+    /* everything comes back as text, like it did with mysql_query */
+    bind = (MYSQL_BIND *) calloc(nfields, sizeof(MYSQL_BIND));
+    lengths = (unsigned long *) calloc(nfields, sizeof(unsigned long));
+    nulls = (my_bool *) calloc(nfields, sizeof(my_bool));
+
+    for(j = 0; j < nfields; j++) {
+        if(strcmp(fields[j].name, "collection-owner") == 0)
+            owner = j;
+
+        /* max_length is only updated for variable length types, numbers fit in 64 */
+        bind[j].buffer_length = (fields[j].max_length > 64 ? fields[j].max_length : 64) + 1;
+        bind[j].buffer = malloc(bind[j].buffer_length);
+        bind[j].buffer_type = MYSQL_TYPE_STRING;
+        bind[j].length = &lengths[j];
+        bind[j].is_null = &nulls[j];
+    }
 
-    for(i = 0; i < ntuples; i++) {
-        o = os_object_new(*os);
+    mysql_stmt_bind_result(handle, bind);
 
-        if((tuple = mysql_fetch_row(res)) == NULL)
-            break;
+    while((ret = mysql_stmt_fetch(handle)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+        where = os;
+        if(idx != NULL) {
+            if(owner < 0 || nulls[owner])
+                continue;
+
+            val = (char *) bind[owner].buffer;
+            val[lengths[owner] < bind[owner].buffer_length ? lengths[owner] : bind[owner].buffer_length - 1] = '\0';
+
+            if((where = (os_t *) xhash_get(idx, val)) == NULL)
+                continue;
+        }
+
+        if(*where == NULL)
+            *where = os_new();
+
+        o = os_object_new(*where);
 
         for(j = 0; j < nfields; j++) {
             if(strcmp(fields[j].name, "collection-owner") == 0)
                 continue;
 
-            if(tuple[j] == NULL)
+            if(nulls[j])
                 continue;
 
-            // mysql_fetch_lengths(res); // TODO check if mysql_fetch_lengths must be called.
-
             switch(fields[j].type) {
                 case FIELD_TYPE_TINY:   /* tinyint */
                     ot = os_type_BOOLEAN;
@@ -397,7 +600,8 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
                     continue;
             }
 
-            val = tuple[j];
+            val = (char *) bind[j].buffer;
+            val[lengths[j] < bind[j].buffer_length ? lengths[j] : bind[j].buffer_length - 1] = '\0';
 
             switch(ot) {
                 case os_type_BOOLEAN:
@@ -421,21 +625,30 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
         }
     }
 
+    for(j = 0; j < nfields; j++)
+        free(bind[j].buffer);
+    free(bind);
+    free(lengths);
+    free(nulls);
+
     mysql_free_result(res);
+    _st_mysql_done(drv, stmt);
+
+    if(idx == NULL && *os == NULL)
+        return st_NOTFOUND;
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
+static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
     drvdata_t data = (drvdata_t) drv->private;
     char *cond, *buf = NULL;
     int buflen = 0;
-    MYSQL_RES *res;
-    int ntuples, nfields;
-    MYSQL_ROW tuple;
     char tbuf[128];
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
 
-    if(mysql_ping(data->conn) != 0) {
+    if(_st_mysql_ping(drv) != 0) {
         log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
@@ -445,51 +658,148 @@ static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *o
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
+    cond = _st_mysql_convert_filter(drv, owner, filter, &params);
     log_debug(ZONE, "generated filter: %s", cond);
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
-    sprintf(buf, "SELECT COUNT(*) FROM `%s` WHERE %s", type, cond);
+    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 50, buflen);
+    sprintf(buf, "SELECT * FROM `%s` WHERE %s ORDER BY `object-sequence`", type, cond);
     free(cond);
 
     log_debug(ZONE, "prepared sql: %s", buf);
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
+    stmt = _st_mysql_exec(drv, buf, &params, "select");
+    _st_mysql_params_free(&params);
+    free(buf);
+
+    if(stmt == NULL)
+        return st_FAILED;
+
+    return _st_mysql_fetch(drv, stmt, os, NULL);
+}
+
+static st_ret_t _st_mysql_get_multi(st_driver_t drv, const char *type, const char **owners, int nowners, const char *filter, os_t *os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    char *cond, *buf = NULL;
+    int buflen = 0, first, n, i;
+    char tbuf[128];
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
+    xht idx;
+    st_ret_t ret = st_SUCCESS;
+
+    if(_st_mysql_ping(drv) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
+
+    if(data->prefix != NULL) {
+        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
+        type = tbuf;
+    }
+
+    /* which os a row goes to */
+    idx = xhash_new(nowners * 2 + 1);
+    for(i = 0; i < nowners; i++)
+        xhash_put(idx, owners[i], (void *) &os[i]);
+
+    for(first = 0; first < nowners && ret == st_SUCCESS; first += n) {
+        n = nowners - first;
+        if(n > ST_MULTI_MAX)
+            n = ST_MULTI_MAX;
+
+        cond = _st_mysql_convert_filter_multi(drv, &owners[first], n, _st_mysql_slots(n), filter, &params);
+
+        MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 50, buflen);
+        sprintf(buf, "SELECT * FROM `%s` WHERE %s ORDER BY `object-sequence`", type, cond);
+        free(cond);
+
+        log_debug(ZONE, "prepared sql: %s", buf);
+
+        stmt = _st_mysql_exec(drv, buf, &params, "select");
+        _st_mysql_params_free(&params);
+
+        if(stmt == NULL || _st_mysql_fetch(drv, stmt, NULL, idx) != st_SUCCESS)
+            ret = st_FAILED;
+    }
+
     free(buf);
+    xhash_free(idx);
+
+    if(ret != st_SUCCESS)
+        for(i = 0; i < nowners; i++)
+            if(os[i] != NULL) {
+                os_free(os[i]);
+                os[i] = NULL;
+            }
+
+    return ret;
+}
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
+    drvdata_t data = (drvdata_t) drv->private;
+    char *cond, *buf = NULL;
+    int buflen = 0;
+    MYSQL_BIND bind;
+    char val[32];
+    unsigned long length = 0;
+    my_bool null = 0;
+    char tbuf[128];
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
+    MYSQL_STMT *handle;
+
+    if(_st_mysql_ping(drv) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
 
-    ntuples = mysql_num_rows(res);
-    if(ntuples == 0) {
-        mysql_free_result(res);
-        return st_NOTFOUND;
+    if(data->prefix != NULL) {
+        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
+        type = tbuf;
     }
 
-    log_debug(ZONE, "%d tuples returned", ntuples);
+    cond = _st_mysql_convert_filter(drv, owner, filter, &params);
+    log_debug(ZONE, "generated filter: %s", cond);
 
-    nfields = mysql_num_fields(res);
+    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
+    sprintf(buf, "SELECT COUNT(*) FROM `%s` WHERE %s", type, cond);
+    free(cond);
 
-    if(nfields == 0) {
-        log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        mysql_free_result(res);
-        return st_NOTFOUND;
+    log_debug(ZONE, "prepared sql: %s", buf);
+
+    stmt = _st_mysql_exec(drv, buf, &params, "select");
+    _st_mysql_params_free(&params);
+    free(buf);
+
+    if(stmt == NULL)
+        return st_FAILED;
+
+    handle = (MYSQL_STMT *) stmt->handle;
+
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = val;
+    bind.buffer_length = sizeof(val);
+    bind.length = &length;
+    bind.is_null = &null;
+
+    if(mysql_stmt_bind_result(handle, &bind) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(handle));
+        _st_mysql_done(drv, stmt);
+        return st_FAILED;
     }
 
-    if((tuple = mysql_fetch_row(res)) == NULL)
+    if(mysql_stmt_fetch(handle) != 0 || null) {
+        _st_mysql_done(drv, stmt);
         return st_NOTFOUND;
+    }
+
+    val[length < sizeof(val) ? length : sizeof(val) - 1] = '\0';
 
     if (count!=NULL)
-        *count = atoi(tuple[0]);
+        *count = atoi(val);
 
-    mysql_free_result(res);
+    _st_mysql_done(drv, stmt);
 
     return st_SUCCESS;
 }
@@ -499,8 +809,10 @@ static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *
     char *cond, *buf = NULL;
     int buflen = 0;
     char tbuf[128];
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
 
-    if(mysql_ping(data->conn) != 0) {
+    if(_st_mysql_ping(drv) != 0) {
         log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
@@ -510,7 +822,7 @@ static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
+    cond = _st_mysql_convert_filter(drv, owner, filter, &params);
     log_debug(ZONE, "generated filter: %s", cond);
 
     MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 21, buflen);
@@ -519,25 +831,28 @@ static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *
 
     log_debug(ZONE, "prepared sql: %s", buf);
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->log, LOG_ERR, "mysql: sql delete failed: %s", mysql_error(data->conn));
-        free(buf);
-        return st_FAILED;
-    }
+    stmt = _st_mysql_exec(drv, buf, &params, "delete");
+    _st_mysql_params_free(&params);
     free(buf);
 
+    if(stmt == NULL)
+        return st_FAILED;
+
+    _st_mysql_done(drv, stmt);
+
     return st_SUCCESS;
 }
 
 static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
 
-    if(mysql_ping(data->conn) != 0) {
+    if(_st_mysql_ping(drv) != 0) {
         log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
         return st_FAILED;
     }
 
-    if(data->txn) {
+    if(txn) {
         if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
             return st_FAILED;
@@ -550,18 +865,18 @@ static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char
     }
 
     if(_st_mysql_delete(drv, type, owner, filter) == st_FAILED) {
-        if(data->txn)
+        if(txn)
             mysql_query(data->conn, "ROLLBACK");
         return st_FAILED;
     }
 
     if(_st_mysql_put_guts(drv, type, owner, os) == st_FAILED) {
-        if(data->txn)
+        if(txn)
             mysql_query(data->conn, "ROLLBACK");
         return st_FAILED;
     }
 
-    if(data->txn)
+    if(txn)
         if(mysql_query(data->conn, "COMMIT") != 0) {
             log_write(drv->st->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
             mysql_query(data->conn, "ROLLBACK");
@@ -571,9 +886,241 @@ static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char
     return st_SUCCESS;
 }
 
+static st_ret_t _st_mysql_batch_begin(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    if(!data->txn)
+        return st_NOTIMPL;
+
+    if(_st_mysql_ping(drv) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
+        return st_FAILED;
+    }
+
+    if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
+        return st_FAILED;
+    }
+
+    if(mysql_query(data->conn, "BEGIN") != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(data->conn));
+        return st_FAILED;
+    }
+
+    data->batch = 1;
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_mysql_batch_end(st_driver_t drv, int ok) {
+    drvdata_t data = (drvdata_t) drv->private;
+    unsigned long thread = data->thread;
+
+    data->batch = 0;
+
+    if(!ok) {
+        mysql_query(data->conn, "ROLLBACK");
+        return st_SUCCESS;
+    }
+
+    /* a reconnect in the middle means the start of the batch is gone */
+    if(_st_mysql_ping(drv) != 0 || data->thread != thread) {
+        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost during batch");
+        mysql_query(data->conn, "ROLLBACK");
+        return st_FAILED;
+    }
+
+    if(mysql_query(data->conn, "COMMIT") != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
+        mysql_query(data->conn, "ROLLBACK");
+        return st_FAILED;
+    }
+
+    return st_SUCCESS;
+}
+
+/** delete everything these owners have, type already has the prefix */
+static st_ret_t _st_mysql_delete_owners(st_driver_t drv, const char *type, const char **owners, int nowners) {
+    char *cond, *buf = NULL;
+    int buflen = 0, first, n;
+    struct myparams_st params = { NULL, 0, 0 };
+    st_stmt_t stmt;
+
+    for(first = 0; first < nowners; first += n) {
+        n = nowners - first;
+        if(n > ST_MULTI_MAX)
+            n = ST_MULTI_MAX;
+
+        cond = _st_mysql_convert_filter_multi(drv, &owners[first], n, _st_mysql_slots(n), NULL, &params);
+
+        MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 21, buflen);
+        sprintf(buf, "DELETE FROM `%s` WHERE %s", type, cond);
+        free(cond);
+
+        log_debug(ZONE, "prepared sql: %s", buf);
+
+        stmt = _st_mysql_exec(drv, buf, &params, "delete");
+        _st_mysql_params_free(&params);
+
+        if(stmt == NULL) {
+            free(buf);
+            return st_FAILED;
+        }
+
+        _st_mysql_done(drv, stmt);
+    }
+
+    free(buf);
+
+    return st_SUCCESS;
+}
+
+/** run a multi row insert, its shape depends on how many rows there are so it doesn't go in the statement cache */
+static st_ret_t _st_mysql_insert(st_driver_t drv, const char *sql, myparams_t params) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MYSQL_STMT *handle;
+    int err;
+
+    log_debug(ZONE, "prepared sql: %s", sql);
+
+    handle = mysql_stmt_init(data->conn);
+    if(handle == NULL) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(data->conn));
+        _st_mysql_params_free(params);
+        return st_FAILED;
+    }
+
+    if(mysql_stmt_prepare(handle, sql, strlen(sql)) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_stmt_error(handle));
+        err = 1;
+    } else
+        err = _st_mysql_run(drv, handle, params, "insert");
+
+    mysql_stmt_close(handle);
+    _st_mysql_params_free(params);
+
+    return err ? st_FAILED : st_SUCCESS;
+}
+
+/** insert the objects of several owners, consecutive objects with the same fields share an insert */
+static st_ret_t _st_mysql_put_multi_guts(st_driver_t drv, const char *type, const char **owners, int nowners, os_t *os) {
+    char *sql = NULL, *cols = NULL, *group = NULL;
+    int lsql = 0, lcols = 0, nsql = 0, ncols, rows = 0, i;
+    os_object_t o;
+    char *key;
+    void *val;
+    os_type_t ot;
+    struct myparams_st params = { NULL, 0, 0 };
+
+    for(i = 0; i < nowners; i++) {
+        if(os[i] == NULL || !os_iter_first(os[i]))
+            continue;
+
+        do {
+            o = os_iter_object(os[i]);
+
+            /* the columns this one needs */
+            ncols = 0;
+            MYSQL_SAFE(cols, 1, lcols);
+            cols[0] = '\0';
+            if(os_object_iter_first(o))
+                do {
+                    os_object_iter_get(o, &key, &val, &ot);
+                    MYSQL_SAFE(cols, ncols + strlen(key) + 4, lcols);
+                    ncols += sprintf(&cols[ncols], ", `%s`", key);
+                } while(os_object_iter_next(o));
+
+            /* different columns, or as big as we want it, so send what we've got */
+            if(rows > 0 && (strcmp(cols, group) != 0 || rows >= ST_MULTI_MAX)) {
+                if(_st_mysql_insert(drv, sql, &params) != st_SUCCESS) {
+                    free(sql); free(cols); free(group);
+                    return st_FAILED;
+                }
+                rows = 0;
+            }
+
+            if(rows == 0) {
+                if(group != NULL) free(group);
+                group = strdup(cols);
+
+                MYSQL_SAFE(sql, strlen(type) + ncols + 40, lsql);
+                nsql = sprintf(sql, "INSERT INTO `%s` ( `collection-owner`%s ) VALUES ", type, cols);
+            } else {
+                MYSQL_SAFE(sql, nsql + 2, lsql);
+                nsql += sprintf(&sql[nsql], ", ");
+            }
+
+            _st_mysql_param(&params, strdup(owners[i]));
+            MYSQL_SAFE(sql, nsql + 3, lsql);
+            nsql += sprintf(&sql[nsql], "( ?");
+
+            if(os_object_iter_first(o))
+                do {
+                    val = NULL;
+                    os_object_iter_get(o, &key, &val, &ot);
+
+                    _st_mysql_param(&params, _st_mysql_value(val, ot));
+
+                    MYSQL_SAFE(sql, nsql + 3, lsql);
+                    nsql += sprintf(&sql[nsql], ", ?");
+                } while(os_object_iter_next(o));
+
+            MYSQL_SAFE(sql, nsql + 2, lsql);
+            nsql += sprintf(&sql[nsql], " )");
+
+            rows++;
+        } while(os_iter_next(os[i]));
+    }
+
+    if(rows > 0 && _st_mysql_insert(drv, sql, &params) != st_SUCCESS) {
+        free(sql); free(cols); free(group);
+        return st_FAILED;
+    }
+
+    if(sql != NULL) free(sql);
+    if(cols != NULL) free(cols);
+    if(group != NULL) free(group);
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_mysql_put_multi(st_driver_t drv, const char *type, const char **owners, int nowners, os_t *os, int replace) {
+    drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
+    char tbuf[128];
+    st_ret_t ret = st_SUCCESS;
+
+    if(txn) {
+        if(_st_mysql_batch_begin(drv) != st_SUCCESS)
+            return st_FAILED;
+    } else if(_st_mysql_ping(drv) != 0) {
+        log_write(drv->st->log, LOG_ERR, "mysql: connection to database lost");
+        return st_FAILED;
+    }
+
+    if(data->prefix != NULL) {
+        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
+        type = tbuf;
+    }
+
+    if(replace)
+        ret = _st_mysql_delete_owners(drv, type, owners, nowners);
+
+    if(ret == st_SUCCESS)
+        ret = _st_mysql_put_multi_guts(drv, type, owners, nowners, os);
+
+    if(txn && _st_mysql_batch_end(drv, ret == st_SUCCESS) != st_SUCCESS)
+        ret = st_FAILED;
+
+    return ret;
+}
+
 static void _st_mysql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
 
+    st_stmt_cache_stats(data->stmts, drv->st->log, "mysql");
+    st_stmt_cache_free(data->stmts);
+
     mysql_close(data->conn);
 
     free(data);
@@ -625,6 +1172,9 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
 
     data->prefix = config_get_one(drv->st->config, "storage.mysql.prefix", 0);
 
+    data->stmts = st_stmt_cache_new(j_atoi(config_get_one(drv->st->config, "storage.mysql.statements", 0), 64), _st_mysql_stmt_close, NULL);
+    data->thread = mysql_thread_id(conn);
+
     drv->private = (void *) data;
 
     drv->add_type = _st_mysql_add_type;
@@ -634,6 +1184,10 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     drv->delete = _st_mysql_delete;
     drv->replace = _st_mysql_replace;
     drv->free = _st_mysql_free;
+    drv->batch_begin = _st_mysql_batch_begin;
+    drv->batch_end = _st_mysql_batch_end;
+    drv->get_multi = _st_mysql_get_multi;
+    drv->put_multi = _st_mysql_put_multi;
 
     return st_SUCCESS;
 }
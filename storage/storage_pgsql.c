@@ -35,8 +35,19 @@ typedef struct drvdata_st {
     const char *prefix;
 
     int txn;
+    int batch;              /* in a batch transaction, put and replace don't start their own */
+
+    st_stmt_cache_t stmts;
+    unsigned int nstmts;    /* for statement names */
+    int lost;               /* connection was reset, server side statements are gone */
 } *drvdata_t;
 
+/** values for the placeholders of a statement */
+typedef struct pgparams_st {
+    char **vals;
+    int n, len;
+} *pgparams_t;
+
 #define FALLBACK_BLOCKSIZE (4096)
 
 /** internal: do and return the math and ensure it gets realloc'd */
@@ -68,100 +79,273 @@ static size_t _st_pgsql_realloc(char **oblocks, size_t len) {
 /** this is the safety check used to make sure there's always enough mem */
 #define PGSQL_SAFE(blocks, size, len) if((size) >= len) len = _st_pgsql_realloc(&(blocks),(size + 1));
 
-static void _st_pgsql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, unsigned int *buflen, unsigned int *nbuf) {
+static void _st_pgsql_param(pgparams_t params, char *val) {
+    if(params->n == params->len) {
+        params->len = params->len * 2 + 8;
+        params->vals = (char **) realloc(params->vals, sizeof(char *) * params->len);
+    }
+
+    params->vals[params->n++] = val;
+}
+
+static void _st_pgsql_params_free(pgparams_t params) {
+    int i;
+
+    for(i = 0; i < params->n; i++)
+        free(params->vals[i]);
+    free(params->vals);
+
+    params->vals = NULL;
+    params->n = params->len = 0;
+}
+
+static void _st_pgsql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, unsigned int *buflen, unsigned int *nbuf, pgparams_t params) {
     st_filter_t scan;
-    int vlen;
-    char *cval;
 
     switch(f->type) {
         case st_filter_type_PAIR:
-            /* do sql escaping for apostrophes */
-            cval = (char *) malloc(sizeof(char) * ((strlen(f->val) * 2) + 1));
-            vlen = PQescapeString(cval, f->val, strlen(f->val));
+            /* values go in as parameters, only the key ends up in the sql */
+            _st_pgsql_param(params, strdup(f->val));
 
-            PGSQL_SAFE((*buf), *buflen + 12 + vlen - strlen(f->val), *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( \"%s\" = \'%s\' ) ", f->key, f->val);
-            free(cval);
+            PGSQL_SAFE((*buf), *nbuf + strlen(f->key) + 24, *buflen);
+            *nbuf += sprintf(&((*buf)[*nbuf]), "( \"%s\" = $%d ) ", f->key, params->n);
 
             break;
 
         case st_filter_type_AND:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, params);
 
                 if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 4, *buflen);
+                    PGSQL_SAFE((*buf), *nbuf + 4, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
                 }
             }
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_OR:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf, params);
 
                 if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 3, *buflen);
+                    PGSQL_SAFE((*buf), *nbuf + 3, *buflen);
                     *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
                 }
             }
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
 
         case st_filter_type_NOT:
-            PGSQL_SAFE((*buf), *buflen + 6, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 6, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
 
-            _st_pgsql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_pgsql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf, params);
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
+            PGSQL_SAFE((*buf), *nbuf + 2, *buflen);
             *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
 
             return;
     }
 }
 
-static char *_st_pgsql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
+/** the condition for this owner and filter, the values are added to params */
+static char *_st_pgsql_convert_filter(st_driver_t drv, const char *owner, const char *filter, pgparams_t params) {
     /* drvdata_t data = (drvdata_t) drv->private;*/
     char *buf = NULL;
     unsigned int buflen = 0, nbuf = 0;
     st_filter_t f;
 
-    PGSQL_SAFE(buf, 24 + strlen(owner), buflen);
+    _st_pgsql_param(params, strdup(owner));
 
-    nbuf = sprintf(buf, "\"collection-owner\" = '%s'", owner);
+    PGSQL_SAFE(buf, 32, buflen);
+    nbuf = sprintf(buf, "\"collection-owner\" = $%d", params->n);
 
     f = storage_filter(filter);
     if(f == NULL)
         return buf;
 
-    PGSQL_SAFE(buf, buflen + 5, buflen);
+    PGSQL_SAFE(buf, nbuf + 5, buflen);
     nbuf += sprintf(&buf[nbuf], " AND ");
 
-    _st_pgsql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+    _st_pgsql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf, params);
 
     pool_free(f->p);
 
     return buf;
 }
 
+/** a text array literal holding these values */
+static char *_st_pgsql_array(const char **vals, int n) {
+    char *buf, *c;
+    const char *v;
+    int i, len = 3;
+
+    for(i = 0; i < n; i++)
+        len += strlen(vals[i]) * 2 + 3;
+
+    c = buf = (char *) malloc(len);
+
+    *c++ = '{';
+    for(i = 0; i < n; i++) {
+        if(i > 0)
+            *c++ = ',';
+        *c++ = '"';
+        for(v = vals[i]; *v != '\0'; v++) {
+            if(*v == '"' || *v == '\\')
+                *c++ = '\\';
+            *c++ = *v;
+        }
+        *c++ = '"';
+    }
+    *c++ = '}';
+    *c = '\0';
+
+    return buf;
+}
+
+/** like convert_filter, but for several owners, which go in as one array so the statement is the same however many there are */
+static char *_st_pgsql_convert_filter_multi(st_driver_t drv, const char **owners, int nowners, const char *filter, pgparams_t params) {
+    char *buf = NULL;
+    unsigned int buflen = 0, nbuf = 0;
+    st_filter_t f;
+
+    _st_pgsql_param(params, _st_pgsql_array(owners, nowners));
+
+    PGSQL_SAFE(buf, 40, buflen);
+    nbuf = sprintf(buf, "\"collection-owner\" = ANY($%d)", params->n);
+
+    f = storage_filter(filter);
+    if(f == NULL)
+        return buf;
+
+    PGSQL_SAFE(buf, nbuf + 5, buflen);
+    nbuf += sprintf(&buf[nbuf], " AND ");
+
+    _st_pgsql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf, params);
+
+    pool_free(f->p);
+
+    return buf;
+}
+
+static void _st_pgsql_deallocate(void *handle, void *arg) {
+    drvdata_t data = (drvdata_t) arg;
+    char sql[64];
+
+    if(!data->lost) {
+        snprintf(sql, sizeof(sql), "DEALLOCATE \"%s\"", (char *) handle);
+        PQclear(PQexec(data->conn, sql));
+    }
+
+    free(handle);
+}
+
+/** run a statement (prepared once and cached if we can), reconnect if the connection went away */
+static PGresult *_st_pgsql_exec(st_driver_t drv, const char *sql, pgparams_t params) {
+    drvdata_t data = (drvdata_t) drv->private;
+    st_stmt_t stmt;
+    PGresult *res;
+    ExecStatusType status;
+    char name[32];
+    int retry;
+
+    for(retry = 0; ; retry++) {
+        stmt = st_stmt_get(data->stmts, sql);
+
+        res = NULL;
+        if(!stmt->cached)
+            /* caching is off, don't spend a round trip on preparing */
+            res = PQexecParams(data->conn, sql, params->n, NULL, (const char * const *) params->vals, NULL, NULL, 0);
+
+        else if(stmt->handle == NULL) {
+            log_debug(ZONE, "preparing sql: %s", sql);
+
+            snprintf(name, sizeof(name), "jabberd%u", ++data->nstmts);
+            res = PQprepare(data->conn, name, sql, 0, NULL);
+            if(PQresultStatus(res) == PGRES_COMMAND_OK) {
+                PQclear(res);
+                res = NULL;
+                stmt->handle = strdup(name);
+            } else {
+                st_stmt_drop(data->stmts, stmt);
+                stmt = NULL;
+            }
+        }
+
+        if(res == NULL)
+            res = PQexecPrepared(data->conn, (const char *) stmt->handle, params->n, (const char * const *) params->vals, NULL, NULL, 0);
+
+        if(stmt != NULL)
+            st_stmt_done(data->stmts, stmt);
+
+        status = PQresultStatus(res);
+        /* reconnecting in the middle of a batch would lose the start of it, let the caller redo it */
+        if(status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK || retry || data->batch || PQstatus(data->conn) == CONNECTION_OK)
+            return res;
+
+        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+        PQclear(res);
+        PQreset(data->conn);
+
+        /* prepared statements don't survive the reconnect */
+        data->lost = 1;
+        st_stmt_cache_flush(data->stmts);
+        data->lost = 0;
+    }
+}
+
 static st_ret_t _st_pgsql_add_type(st_driver_t drv, const char *type) {
     return st_SUCCESS;
 }
 
+/** a field as a parameter value, NULL for unknown types */
+static char *_st_pgsql_value(void *val, os_type_t ot) {
+    char *cval = NULL;
+    const char *xml;
+    int xlen;
+
+    switch(ot) {
+        case os_type_BOOLEAN:
+            cval = ((int)val != 0) ? strdup("t") : strdup("f");
+            break;
+
+        case os_type_INTEGER:
+            cval = (char *) malloc(sizeof(char) * 20);
+            sprintf(cval, "%d", (int)val);
+            break;
+
+        case os_type_STRING:
+            cval = strdup((char *) val);
+            break;
+
+        case os_type_NAD:
+            nad_print((nad_t) val, 0, &xml, &xlen);
+            cval = (char *) malloc(sizeof(char) * (xlen + 4));
+            memcpy(cval, "NAD", 3);
+            memcpy(&cval[3], xml, xlen);
+            cval[xlen + 3] = '\0';
+            break;
+
+        case os_type_UNKNOWN:
+            break;
+    }
+
+    return cval;
+}
+
 static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
     char *left = NULL, *right = NULL;
@@ -170,10 +354,9 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
     char *key, *cval = NULL;
     void *val;
     os_type_t ot;
-    const char *xml;
-    int xlen;
     PGresult *res;
     char tbuf[128];
+    struct pgparams_st params = { NULL, 0, 0 };
 
     if(os_count(os) == 0)
         return st_SUCCESS;
@@ -188,8 +371,10 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
             PGSQL_SAFE(left, strlen(type) + 55, lleft);
             nleft = sprintf(left, "INSERT INTO \"%s\" ( \"collection-owner\", \"object-sequence\"", type);
 
-            PGSQL_SAFE(right, strlen(owner) + 43, lright);
-            nright = sprintf(right, " ) VALUES ( '%s', nextval('object-sequence')", owner);
+            _st_pgsql_param(&params, strdup(owner));
+
+            PGSQL_SAFE(right, 43, lright);
+            nright = sprintf(right, " ) VALUES ( $1, nextval('object-sequence')");
 
             o = os_iter_object(os);
             if(os_object_iter_first(o))
@@ -202,56 +387,29 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
                     val = NULL;
                     os_object_iter_get(o, &key, &val, &ot);
 
-                    switch(ot) {
-                        case os_type_BOOLEAN:
-                            cval = ((int)val != 0) ? strdup("t") : strdup("f");
-                            break;
-
-                        case os_type_INTEGER:
-                            cval = (char *) malloc(sizeof(char) * 20);
-                            sprintf(cval, "%d", (int)val);
-                            break;
-
-                        case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            PQescapeString(cval, (char *) val, strlen((char *) val));
-                            break;
-
-                        case os_type_NAD:
-                            nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            PQescapeString(&cval[3], xml, xlen);
-                            strncpy(cval, "NAD", 3);
-                            break;
-
-                        case os_type_UNKNOWN:
-                            break;
-                    }
+                    cval = _st_pgsql_value(val, ot);
 
                     log_debug(ZONE, "key %s val %s", key, cval);
 
-                    PGSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
+                    _st_pgsql_param(&params, cval);
+
+                    PGSQL_SAFE(left, nleft + strlen(key) + 4, lleft);
                     nleft += sprintf(&left[nleft], ", \"%s\"", key);
 
-                    PGSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
+                    PGSQL_SAFE(right, nright + 16, lright);
+                    nright += sprintf(&right[nright], ", $%d", params.n);
 
-                    free(cval);
                 } while(os_object_iter_next(o));
 
-            PGSQL_SAFE(left, lleft + strlen(right) + 3, lleft);
-            sprintf(&left[nleft], "%s );", right);
-    
+            PGSQL_SAFE(left, nleft + nright + 3, lleft);
+            sprintf(&left[nleft], "%s )", right);
+
             log_debug(ZONE, "prepared sql: %s", left);
 
-            res = PQexec(data->conn, left);
+            res = _st_pgsql_exec(drv, left, &params);
+
+            _st_pgsql_params_free(&params);
 
-            if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-                log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-                PQclear(res);
-                PQreset(data->conn);
-                res = PQexec(data->conn, left);
-            }
             if(PQresultStatus(res) != PGRES_COMMAND_OK) {
                 log_write(drv->st->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
                 free(left);
@@ -272,12 +430,13 @@ static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char
 
 static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
     PGresult *res;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
 
-    if(data->txn) {
+    if(txn) {
         res = PQexec(data->conn, "BEGIN;");
         if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
             log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
@@ -309,12 +468,12 @@ static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *own
     }
 
     if(_st_pgsql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
+        if(txn)
             PQclear(PQexec(data->conn, "ROLLBACK;"));
         return st_FAILED;
     }
 
-    if(data->txn) {
+    if(txn) {
         res = PQexec(data->conn, "COMMIT;");
         if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
             log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
@@ -334,41 +493,89 @@ static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *own
     return st_SUCCESS;
 }
 
+/** turn row i of the result into an object */
+static void _st_pgsql_row(PGresult *res, int i, os_object_t o) {
+    int nfields = PQnfields(res), j;
+    char *fname, *val;
+    os_type_t ot;
+    int ival;
+
+    for(j = 0; j < nfields; j++) {
+        fname = PQfname(res, j);
+        if(strcmp(fname, "collection-owner") == 0)
+            continue;
+
+        switch(PQftype(res, j)) {
+            case 16:    /* boolean */
+                ot = os_type_BOOLEAN;
+                break;
+
+            case 23:    /* integer */
+                ot = os_type_INTEGER;
+                break;
+
+            case 25:    /* text */
+                ot = os_type_STRING;
+                break;
+
+            default:
+                log_debug(ZONE, "unknown oid %d, ignoring it", PQfname(res, j));
+                continue;
+        }
+
+        if(PQgetisnull(res, i, j))
+            continue;
+
+        val = PQgetvalue(res, i, j);
+
+        switch(ot) {
+            case os_type_BOOLEAN:
+                ival = (val[0] == 't') ? 1 : 0;
+                os_object_put(o, fname, &ival, ot);
+                break;
+
+            case os_type_INTEGER:
+                ival = atoi(val);
+                os_object_put(o, fname, &ival, ot);
+                break;
+
+            case os_type_STRING:
+                os_object_put(o, fname, val, os_type_STRING);
+                break;
+
+            case os_type_NAD:
+            case os_type_UNKNOWN:
+                break;
+        }
+    }
+}
+
 static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
     drvdata_t data = (drvdata_t) drv->private;
     char *cond, *buf = NULL;
     int buflen = 0;
     PGresult *res;
-    int ntuples, nfields, i, j;
-    os_object_t o;
-    char *fname, *val;
-    os_type_t ot;
-    int ival;
+    int ntuples, nfields, i;
     char tbuf[128];
+    struct pgparams_st params = { NULL, 0, 0 };
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
+    cond = _st_pgsql_convert_filter(drv, owner, filter, &params);
     log_debug(ZONE, "generated filter: %s", cond);
 
     PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 51, buflen);
-    sprintf(buf, "SELECT * FROM \"%s\" WHERE %s ORDER BY \"object-sequence\";", type, cond);
+    sprintf(buf, "SELECT * FROM \"%s\" WHERE %s ORDER BY \"object-sequence\"", type, cond);
     free(cond);
 
     log_debug(ZONE, "prepared sql: %s", buf);
 
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, &params);
 
+    _st_pgsql_params_free(&params);
     free(buf);
 
     if(PQresultStatus(res) != PGRES_TUPLES_OK) {
@@ -395,62 +602,91 @@ static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *own
 
     *os = os_new();
 
-    for(i = 0; i < ntuples; i++) {
-        o = os_object_new(*os);
+    for(i = 0; i < ntuples; i++)
+        _st_pgsql_row(res, i, os_object_new(*os));
 
-        for(j = 0; j < nfields; j++) {
-            fname = PQfname(res, j);
-            if(strcmp(fname, "collection-owner") == 0)
-                continue;
+    PQclear(res);
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_pgsql_get_multi(st_driver_t drv, const char *type, const char **owners, int nowners, const char *filter, os_t *os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    char *cond, *buf = NULL;
+    int buflen = 0;
+    PGresult *res;
+    int first, n, ntuples, col, i;
+    char tbuf[128];
+    struct pgparams_st params = { NULL, 0, 0 };
+    xht idx;
+    os_t *where;
+    st_ret_t ret = st_SUCCESS;
+
+    if(data->prefix != NULL) {
+        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
+        type = tbuf;
+    }
 
-            switch(PQftype(res, j)) {
-                case 16:    /* boolean */
-                    ot = os_type_BOOLEAN;
-                    break;
+    /* which os a row goes to */
+    idx = xhash_new(nowners * 2 + 1);
+    for(i = 0; i < nowners; i++)
+        xhash_put(idx, owners[i], (void *) &os[i]);
 
-                case 23:    /* integer */
-                    ot = os_type_INTEGER;
-                    break;
+    for(first = 0; first < nowners && ret == st_SUCCESS; first += n) {
+        n = nowners - first;
+        if(n > ST_MULTI_MAX)
+            n = ST_MULTI_MAX;
 
-                case 25:    /* text */
-                    ot = os_type_STRING;
-                    break;
+        cond = _st_pgsql_convert_filter_multi(drv, &owners[first], n, filter, &params);
 
-                default:
-                    log_debug(ZONE, "unknown oid %d, ignoring it", PQfname(res, j));
-                    continue;
-            }
+        PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 51, buflen);
+        sprintf(buf, "SELECT * FROM \"%s\" WHERE %s ORDER BY \"object-sequence\"", type, cond);
+        free(cond);
 
-            if(PQgetisnull(res, i, j))
-                continue;
+        log_debug(ZONE, "prepared sql: %s", buf);
 
-            val = PQgetvalue(res, i, j);
+        res = _st_pgsql_exec(drv, buf, &params);
 
-            switch(ot) {
-                case os_type_BOOLEAN:
-                    ival = (val[0] == 't') ? 1 : 0;
-                    os_object_put(o, fname, &ival, ot);
-                    break;
+        _st_pgsql_params_free(&params);
 
-                case os_type_INTEGER:
-                    ival = atoi(val);
-                    os_object_put(o, fname, &ival, ot);
-                    break;
+        if(PQresultStatus(res) != PGRES_TUPLES_OK) {
+            log_write(drv->st->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
+            PQclear(res);
+            ret = st_FAILED;
+            break;
+        }
 
-                case os_type_STRING:
-                    os_object_put(o, fname, val, os_type_STRING);
-                    break;
+        ntuples = PQntuples(res);
+        log_debug(ZONE, "%d tuples returned for %d owners", ntuples, n);
 
-                case os_type_NAD:
-                case os_type_UNKNOWN:
-                    break;
-            }
+        for(col = PQnfields(res) - 1; col >= 0; col--)
+            if(strcmp(PQfname(res, col), "collection-owner") == 0)
+                break;
+
+        for(i = 0; i < ntuples && col >= 0; i++) {
+            if((where = (os_t *) xhash_get(idx, PQgetvalue(res, i, col))) == NULL)
+                continue;
+
+            if(*where == NULL)
+                *where = os_new();
+
+            _st_pgsql_row(res, i, os_object_new(*where));
         }
+
+        PQclear(res);
     }
 
-    PQclear(res);
+    free(buf);
+    xhash_free(idx);
 
-    return st_SUCCESS;
+    if(ret != st_SUCCESS)
+        for(i = 0; i < nowners; i++)
+            if(os[i] != NULL) {
+                os_free(os[i]);
+                os[i] = NULL;
+            }
+
+    return ret;
 }
 
 static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
@@ -460,13 +696,14 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
     PGresult *res;
     int ntuples, nfields;
     char tbuf[128];
+    struct pgparams_st params = { NULL, 0, 0 };
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
+    cond = _st_pgsql_convert_filter(drv, owner, filter, &params);
     log_debug(ZONE, "generated filter: %s", cond);
 
     PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
@@ -475,15 +712,9 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
 
     log_debug(ZONE, "prepared sql: %s", buf);
 
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, &params);
 
+    _st_pgsql_params_free(&params);
     free(buf);
 
     if(PQresultStatus(res) != PGRES_TUPLES_OK) {
@@ -508,8 +739,10 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
         return st_NOTFOUND;
     }
 
-    if(PQgetisnull(res, 0, 0) || PQftype(res, 0) != 20)
+    if(PQgetisnull(res, 0, 0) || PQftype(res, 0) != 20) {
+        PQclear(res);
         return st_NOTFOUND;
+    }
 
     if (count!=NULL)
         *count = atoi(PQgetvalue(res, 0, 0));
@@ -525,30 +758,25 @@ static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *
     int buflen = 0;
     PGresult *res;
     char tbuf[128];
+    struct pgparams_st params = { NULL, 0, 0 };
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
+    cond = _st_pgsql_convert_filter(drv, owner, filter, &params);
     log_debug(ZONE, "generated filter: %s", cond);
 
     PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 23, buflen);
-    sprintf(buf, "DELETE FROM \"%s\" WHERE %s;", type, cond);
+    sprintf(buf, "DELETE FROM \"%s\" WHERE %s", type, cond);
     free(cond);
 
     log_debug(ZONE, "prepared sql: %s", buf);
 
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
+    res = _st_pgsql_exec(drv, buf, &params);
 
+    _st_pgsql_params_free(&params);
     free(buf);
 
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
@@ -564,9 +792,10 @@ static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *
 
 static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
     PGresult *res;
 
-    if(data->txn) {
+    if(txn) {
         res = PQexec(data->conn, "BEGIN;");
         if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
             log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
@@ -598,18 +827,18 @@ static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char
     }
 
     if(_st_pgsql_delete(drv, type, owner, filter) == st_FAILED) {
-        if(data->txn)
+        if(txn)
             PQclear(PQexec(data->conn, "ROLLBACK;"));
         return st_FAILED;
     }
 
     if(_st_pgsql_put_guts(drv, type, owner, os) == st_FAILED) {
-        if(data->txn)
+        if(txn)
             PQclear(PQexec(data->conn, "ROLLBACK;"));
         return st_FAILED;
     }
 
-    if(data->txn) {
+    if(txn) {
         res = PQexec(data->conn, "COMMIT;");
         if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
             log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
@@ -629,9 +858,240 @@ static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char
     return st_SUCCESS;
 }
 
+static st_ret_t _st_pgsql_batch_begin(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+    PGresult *res;
+
+    if(!data->txn)
+        return st_NOTIMPL;
+
+    res = PQexec(data->conn, "BEGIN;");
+    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+        PQclear(res);
+        PQreset(data->conn);
+
+        data->lost = 1;
+        st_stmt_cache_flush(data->stmts);
+        data->lost = 0;
+
+        res = PQexec(data->conn, "BEGIN;");
+    }
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return st_FAILED;
+    }
+    PQclear(res);
+
+    data->batch = 1;
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_pgsql_batch_end(st_driver_t drv, int ok) {
+    drvdata_t data = (drvdata_t) drv->private;
+    PGresult *res;
+
+    data->batch = 0;
+
+    if(!ok) {
+        PQclear(PQexec(data->conn, "ROLLBACK;"));
+        return st_SUCCESS;
+    }
+
+    res = PQexec(data->conn, "COMMIT;");
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        PQclear(PQexec(data->conn, "ROLLBACK;"));
+        return st_FAILED;
+    }
+    PQclear(res);
+
+    return st_SUCCESS;
+}
+
+/** delete everything these owners have, type already has the prefix */
+static st_ret_t _st_pgsql_delete_owners(st_driver_t drv, const char *type, const char **owners, int nowners) {
+    char *cond, *buf = NULL;
+    int buflen = 0, first, n;
+    PGresult *res;
+    struct pgparams_st params = { NULL, 0, 0 };
+
+    for(first = 0; first < nowners; first += n) {
+        n = nowners - first;
+        if(n > ST_MULTI_MAX)
+            n = ST_MULTI_MAX;
+
+        cond = _st_pgsql_convert_filter_multi(drv, &owners[first], n, NULL, &params);
+
+        PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 23, buflen);
+        sprintf(buf, "DELETE FROM \"%s\" WHERE %s", type, cond);
+        free(cond);
+
+        log_debug(ZONE, "prepared sql: %s", buf);
+
+        res = _st_pgsql_exec(drv, buf, &params);
+
+        _st_pgsql_params_free(&params);
+
+        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_write(drv->st->log, LOG_ERR, "pgsql: sql delete failed: %s", PQresultErrorMessage(res));
+            PQclear(res);
+            free(buf);
+            return st_FAILED;
+        }
+
+        PQclear(res);
+    }
+
+    free(buf);
+
+    return st_SUCCESS;
+}
+
+/** run a multi row insert */
+static st_ret_t _st_pgsql_insert(st_driver_t drv, const char *sql, pgparams_t params) {
+    drvdata_t data = (drvdata_t) drv->private;
+    PGresult *res;
+
+    log_debug(ZONE, "prepared sql: %s", sql);
+
+    /* the shape depends on how many rows there are, so it's not worth a place in the statement cache */
+    res = PQexecParams(data->conn, sql, params->n, NULL, (const char * const *) params->vals, NULL, NULL, 0);
+
+    _st_pgsql_params_free(params);
+
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return st_FAILED;
+    }
+
+    PQclear(res);
+
+    return st_SUCCESS;
+}
+
+/** insert the objects of several owners, consecutive objects with the same fields share an insert */
+static st_ret_t _st_pgsql_put_multi_guts(st_driver_t drv, const char *type, const char **owners, int nowners, os_t *os) {
+    char *sql = NULL, *cols = NULL, *group = NULL;
+    int lsql = 0, lcols = 0, nsql = 0, ncols, nkeys, rows = 0, i;
+    os_object_t o;
+    char *key;
+    void *val;
+    os_type_t ot;
+    struct pgparams_st params = { NULL, 0, 0 };
+
+    for(i = 0; i < nowners; i++) {
+        if(os[i] == NULL || !os_iter_first(os[i]))
+            continue;
+
+        do {
+            o = os_iter_object(os[i]);
+
+            /* the columns this one needs */
+            ncols = nkeys = 0;
+            PGSQL_SAFE(cols, 1, lcols);
+            cols[0] = '\0';
+            if(os_object_iter_first(o))
+                do {
+                    os_object_iter_get(o, &key, &val, &ot);
+                    PGSQL_SAFE(cols, ncols + strlen(key) + 4, lcols);
+                    ncols += sprintf(&cols[ncols], ", \"%s\"", key);
+                    nkeys++;
+                } while(os_object_iter_next(o));
+
+            /* different columns, or as big as we want it, so send what we've got */
+            if(rows > 0 && (strcmp(cols, group) != 0 || rows >= ST_MULTI_MAX)) {
+                if(_st_pgsql_insert(drv, sql, &params) != st_SUCCESS) {
+                    free(sql); free(cols); free(group);
+                    return st_FAILED;
+                }
+                rows = 0;
+            }
+
+            if(rows == 0) {
+                if(group != NULL) free(group);
+                group = strdup(cols);
+
+                PGSQL_SAFE(sql, strlen(type) + ncols + 64, lsql);
+                nsql = sprintf(sql, "INSERT INTO \"%s\" ( \"collection-owner\", \"object-sequence\"%s ) VALUES ", type, cols);
+            } else {
+                PGSQL_SAFE(sql, nsql + 2, lsql);
+                nsql += sprintf(&sql[nsql], ", ");
+            }
+
+            _st_pgsql_param(&params, strdup(owners[i]));
+            PGSQL_SAFE(sql, nsql + 48, lsql);
+            nsql += sprintf(&sql[nsql], "( $%d, nextval('object-sequence')", params.n);
+
+            if(os_object_iter_first(o))
+                do {
+                    val = NULL;
+                    os_object_iter_get(o, &key, &val, &ot);
+
+                    _st_pgsql_param(&params, _st_pgsql_value(val, ot));
+
+                    PGSQL_SAFE(sql, nsql + 16, lsql);
+                    nsql += sprintf(&sql[nsql], ", $%d", params.n);
+                } while(os_object_iter_next(o));
+
+            PGSQL_SAFE(sql, nsql + 2, lsql);
+            nsql += sprintf(&sql[nsql], " )");
+
+            rows++;
+        } while(os_iter_next(os[i]));
+    }
+
+    if(rows > 0 && _st_pgsql_insert(drv, sql, &params) != st_SUCCESS) {
+        free(sql); free(cols); free(group);
+        return st_FAILED;
+    }
+
+    if(sql != NULL) free(sql);
+    if(cols != NULL) free(cols);
+    if(group != NULL) free(group);
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_pgsql_put_multi(st_driver_t drv, const char *type, const char **owners, int nowners, os_t *os, int replace) {
+    drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
+    char tbuf[128];
+    st_ret_t ret = st_SUCCESS;
+
+    if(data->prefix != NULL) {
+        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
+        type = tbuf;
+    }
+
+    if(txn && _st_pgsql_batch_begin(drv) != st_SUCCESS)
+        return st_FAILED;
+
+    if(replace)
+        ret = _st_pgsql_delete_owners(drv, type, owners, nowners);
+
+    if(ret == st_SUCCESS)
+        ret = _st_pgsql_put_multi_guts(drv, type, owners, nowners, os);
+
+    if(txn && _st_pgsql_batch_end(drv, ret == st_SUCCESS) != st_SUCCESS)
+        ret = st_FAILED;
+
+    return ret;
+}
+
 static void _st_pgsql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
 
+    st_stmt_cache_stats(data->stmts, drv->st->log, "pgsql");
+
+    /* the server drops them with the connection */
+    data->lost = 1;
+    st_stmt_cache_free(data->stmts);
+
     PQfinish(data->conn);
 
     free(data);
@@ -681,6 +1141,8 @@ st_ret_t st_init(st_driver_t drv) {
 
     data->prefix = config_get_one(drv->st->config, "storage.pgsql.prefix", 0);
 
+    data->stmts = st_stmt_cache_new(j_atoi(config_get_one(drv->st->config, "storage.pgsql.statements", 0), 64), _st_pgsql_deallocate, (void *) data);
+
     drv->private = (void *) data;
 
     drv->add_type = _st_pgsql_add_type;
@@ -690,6 +1152,10 @@ st_ret_t st_init(st_driver_t drv) {
     drv->delete = _st_pgsql_delete;
     drv->replace = _st_pgsql_replace;
     drv->free = _st_pgsql_free;
+    drv->batch_begin = _st_pgsql_batch_begin;
+    drv->batch_end = _st_pgsql_batch_end;
+    drv->get_multi = _st_pgsql_get_multi;
+    drv->put_multi = _st_pgsql_put_multi;
 
     return st_SUCCESS;
 }
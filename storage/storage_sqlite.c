@@ -35,6 +35,8 @@ typedef struct drvdata_st {
     sqlite3 *db;
     const char *prefix;
     int txn;
+    int batch;      /* in a batch transaction, put and replace don't start their own */
+    st_stmt_cache_t stmts;
 } *drvdata_t;
 
 #define BLOCKSIZE (1024)
@@ -133,16 +135,14 @@ static void _st_sqlite_convert_filter_recursive (st_filter_t f, char **buf,
 }
 
 static char *_st_sqlite_convert_filter (st_driver_t drv, const char *owner,
-					const char *filter) {
+					st_filter_t f) {
 
     char *buf = NULL;
     int buflen = 0, nbuf = 0;
-    st_filter_t f;
 
 
     SQLITE_SAFE_CAT (buf, nbuf, buflen, "\"collection-owner\" = ?");
 
-    f = storage_filter (filter);
     if (f == NULL) {
 	return buf;
     }
@@ -151,61 +151,152 @@ static char *_st_sqlite_convert_filter (st_driver_t drv, const char *owner,
 
     _st_sqlite_convert_filter_recursive (f, &buf, &buflen, &nbuf);
 
-    pool_free (f->p);
+    return buf;
+}
+
+/** like convert_filter, but for several owners (slots placeholders) */
+static char *_st_sqlite_convert_filter_multi (int slots, st_filter_t f) {
+
+    char *buf = NULL;
+    int buflen = 0, nbuf = 0;
+    int i;
+
+    SQLITE_SAFE_CAT (buf, nbuf, buflen, "\"collection-owner\" IN ( ?");
+    for (i = 1; i < slots; i++) {
+	SQLITE_SAFE_CAT (buf, nbuf, buflen, ", ?");
+    }
+    SQLITE_SAFE_CAT (buf, nbuf, buflen, " )");
+
+    if (f == NULL) {
+	return buf;
+    }
+
+    SQLITE_SAFE_CAT (buf, nbuf, buflen, " AND ");
+
+    _st_sqlite_convert_filter_recursive (f, &buf, &buflen, &nbuf);
 
     return buf;
 }
 
-static void _st_sqlite_bind_filter_recursive (st_filter_t f,
-					      sqlite3_stmt *stmt,
-					      unsigned int bind_off) {
+/** placeholders for n owners, rounded up so the statement cache only sees a few shapes */
+static int _st_sqlite_slots (int n) {
+
+    int slots;
+
+    for (slots = 1; slots < n; slots <<= 1);
+
+    return slots;
+}
+
+/** bind n owners to the first slots placeholders, repeating the last one to fill them */
+static void _st_sqlite_bind_owners (const char **owners, int n, int slots,
+				    sqlite3_stmt *stmt) {
+
+    int i;
+    const char *owner;
+
+    for (i = 0; i < slots; i++) {
+	owner = owners[i < n ? i : n - 1];
+	sqlite3_bind_text (stmt, i + 1, owner, strlen (owner),
+			   SQLITE_TRANSIENT);
+    }
+}
+
+/** bind the filter values in the order convert put their placeholders, returns the next index */
+static int _st_sqlite_bind_filter_recursive (st_filter_t f,
+					     sqlite3_stmt *stmt,
+					     int bind_off) {
 
     st_filter_t scan;
-    unsigned int i;
 
     switch (f->type) {
      case st_filter_type_PAIR:
       sqlite3_bind_text (stmt, bind_off, f->val, strlen (f->val),
 			 SQLITE_TRANSIENT);
-      break;
+      return bind_off + 1;
 
      case st_filter_type_AND:
-      for (scan = f->sub, i = 0; scan != NULL; scan = scan->next, ++i) {
-	  _st_sqlite_bind_filter_recursive (scan, stmt, bind_off + i);
-      }
-      return;
-
      case st_filter_type_OR:
-      for (scan = f->sub, i = 0; scan != NULL; scan = scan->next, ++i) {
-	  _st_sqlite_bind_filter_recursive (scan, stmt, bind_off + i);
+      for (scan = f->sub; scan != NULL; scan = scan->next) {
+	  bind_off = _st_sqlite_bind_filter_recursive (scan, stmt, bind_off);
       }
-      return;
+      return bind_off;
 
      case st_filter_type_NOT:
-      _st_sqlite_bind_filter_recursive(f->sub, stmt, bind_off);
-      return;
+      return _st_sqlite_bind_filter_recursive (f->sub, stmt, bind_off);
     }
+
+    return bind_off;
 }
 
 static void _st_sqlite_bind_filter (st_driver_t drv, const char *owner,
-				    const char *filter,
+				    st_filter_t f,
 				    sqlite3_stmt *stmt,
 				    unsigned int bind_off) {
 
-    st_filter_t f;
-
-
     sqlite3_bind_text (stmt, bind_off, owner, strlen (owner),
 		       SQLITE_TRANSIENT);
 
-    f = storage_filter (filter);
     if (f == NULL) {
 	return;
     }
 
     _st_sqlite_bind_filter_recursive (f, stmt, bind_off + 1);
+}
+
+/** build "<head> "<type>" WHERE <cond><tail>" */
+static char *_st_sqlite_sql (const char *head, const char *type,
+			     const char *cond, const char *tail) {
+
+    int len = strlen (head) + strlen (type) + strlen (cond) + strlen (tail) + 10;
+    char *buf = (char *) malloc (len);
+
+    snprintf (buf, len, "%s\"%s\" WHERE %s%s", head, type, cond, tail);
+
+    return buf;
+}
+
+/** get a prepared statement for this sql, from the cache if we can */
+static st_stmt_t _st_sqlite_prepare (st_driver_t drv, const char *sql) {
+
+    drvdata_t data = (drvdata_t) drv->private;
+    st_stmt_t stmt;
+    sqlite3_stmt *handle;
+
+    stmt = st_stmt_get (data->stmts, sql);
+    if (stmt->handle != NULL) {
+	return stmt;
+    }
+
+    log_debug (ZONE, "preparing sql: %s", sql);
+
+    if (sqlite3_prepare_v2 (data->db, sql, -1, &handle, NULL) != SQLITE_OK) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql prepare failed: %s",
+		   sqlite3_errmsg (data->db));
+	st_stmt_drop (data->stmts, stmt);
+	return NULL;
+    }
+
+    stmt->handle = (void *) handle;
+
+    return stmt;
+}
+
+/** make a statement ready for the next caller */
+static void _st_sqlite_done (st_driver_t drv, st_stmt_t stmt) {
+
+    drvdata_t data = (drvdata_t) drv->private;
 
-    pool_free (f->p);
+    sqlite3_reset ((sqlite3_stmt *) stmt->handle);
+    sqlite3_clear_bindings ((sqlite3_stmt *) stmt->handle);
+
+    st_stmt_done (data->stmts, stmt);
+}
+
+static void _st_sqlite_finalize (void *handle, void *arg) {
+
+    sqlite3_finalize ((sqlite3_stmt *) handle);
 }
 
 static st_ret_t _st_sqlite_add_type (st_driver_t drv, const char *type) {
@@ -242,6 +333,7 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 
 	    unsigned int i = 0;
 	    unsigned int nleft = 0, nright = 0;
+	    st_stmt_t st;
 	    sqlite3_stmt *stmt;
 
 
@@ -275,17 +367,16 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 
 	    log_debug (ZONE, "prepared sql: %s", left);
 
-	    res = sqlite3_prepare (data->db, left, strlen (left), &stmt, NULL);
+	    st = _st_sqlite_prepare (drv, left);
 	    free (left);
 	    left = NULL;
 	    lleft = 0;
-	    if (res != SQLITE_OK) {
-		log_write (drv->st->log, LOG_ERR,
-			   "sqlite: sql insert failed: %s",
-			   sqlite3_errmsg (data->db));
+	    if (st == NULL) {
 		return st_FAILED;
 	    }
 
+	    stmt = (sqlite3_stmt *) st->handle;
+
 	    sqlite3_bind_text (stmt, 1, owner, strlen (owner),
 			       SQLITE_TRANSIENT);
 
@@ -340,10 +431,10 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 		log_write (drv->st->log, LOG_ERR,
 			   "sqlite: sql insert failed: %s",
 			   sqlite3_errmsg (data->db));
-		sqlite3_finalize (stmt);
+		_st_sqlite_done (drv, st);
 		return st_FAILED;
 	    }
-	    sqlite3_finalize (stmt);
+	    _st_sqlite_done (drv, st);
 
 	} while (os_iter_next (os));
     }
@@ -355,6 +446,7 @@ static st_ret_t _st_sqlite_put (st_driver_t drv, const char *type,
 				const char *owner, os_t os) {
 
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
     int res;
     char *err_msg = NULL;
 
@@ -362,7 +454,7 @@ static st_ret_t _st_sqlite_put (st_driver_t drv, const char *type,
 	return st_SUCCESS;
     }
 
-    if (data->txn) {
+    if (txn) {
 
 	res = sqlite3_exec (data->db,
 			    "BEGIN", NULL, NULL,
@@ -377,14 +469,14 @@ static st_ret_t _st_sqlite_put (st_driver_t drv, const char *type,
     }
 
     if (_st_sqlite_put_guts (drv, type, owner, os) != st_SUCCESS) {
-	if (data->txn) {
+	if (txn) {
 	    res = sqlite3_exec (data->db, "ROLLBACK",
 				NULL, NULL, NULL);
 	}
 	return st_FAILED;
     }
 
-    if (data->txn) {
+    if (txn) {
 
 	res = sqlite3_exec (data->db, "COMMIT", NULL, NULL, &err_msg);
 	if (res != SQLITE_OK) {
@@ -398,22 +490,71 @@ static st_ret_t _st_sqlite_put (st_driver_t drv, const char *type,
     return st_SUCCESS;
 }
 
+/** turn the current row into an object */
+static void _st_sqlite_row (st_driver_t drv, sqlite3_stmt *stmt,
+			    os_object_t o) {
+
+    int i, num_cols;
+    const char *val;
+    os_type_t ot;
+    int ival;
+
+    num_cols = sqlite3_data_count (stmt);
+
+    for (i = 0; i < num_cols; i++) {
+
+	const char *colname;
+	int coltype;
+
+	colname = sqlite3_column_name (stmt, i);
+
+	if (strcmp (colname, "collection-owner") == 0) {
+	    continue;
+	}
+
+	coltype = sqlite3_column_type (stmt, i);
+
+	if (coltype == SQLITE_NULL) {
+	    log_debug (ZONE, "coldata is NULL");
+	    continue;
+	}
+
+	if (coltype == SQLITE_INTEGER) {
+	    if (!strcmp (sqlite3_column_decltype (stmt, i), "BOOL")) {
+		ot = os_type_BOOLEAN;
+	    } else {
+		ot = os_type_INTEGER;
+	    }
+
+	    ival = sqlite3_column_int (stmt, i);
+	    os_object_put (o, colname, &ival, ot);
+
+	} else if (coltype == SQLITE3_TEXT) {
+	    ot = os_type_STRING;
+
+	    val = (const char*)sqlite3_column_text (stmt, i);
+	    os_object_put (o, colname, val, ot);
+
+	} else {
+	    log_write (drv->st->log,
+		       LOG_NOTICE,
+		       "sqlite: unknown field: %s:%d",
+		       colname, coltype);
+	}
+    }
+}
+
 static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
 				const char *owner, const char *filter,
 				os_t *os) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
-    int i;
+    char *cond, *buf;
     unsigned int num_rows = 0;
-    os_object_t o;
-    const char *val;
-    os_type_t ot;
-    int ival;
     char tbuf[128];
+    st_filter_t f;
 
+    st_stmt_t st;
     sqlite3_stmt *stmt;
     int result;
 
@@ -422,105 +563,169 @@ static st_ret_t _st_sqlite_get (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
+    f = storage_filter (filter);
+    cond = _st_sqlite_convert_filter (drv, owner, f);
 
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "SELECT * FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
-    strcpy (&buf[strlen(buf)], " ORDER BY \"object-sequence\"");
+    buf = _st_sqlite_sql ("SELECT * FROM ", type, cond,
+			  " ORDER BY \"object-sequence\"");
     free (cond);
 
     log_debug (ZONE, "prepared sql: %s", buf);
 
-    result = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    st = _st_sqlite_prepare (drv, buf);
     free (buf);
-    if (result != SQLITE_OK) {
+    if (st == NULL) {
+	if (f != NULL) pool_free (f->p);
 	return st_FAILED;
     }
 
-    _st_sqlite_bind_filter (drv, owner, filter, stmt, 1);
+    stmt = (sqlite3_stmt *) st->handle;
+
+    _st_sqlite_bind_filter (drv, owner, f, stmt, 1);
+    if (f != NULL) pool_free (f->p);
 
     *os = os_new ();
 
     do {
 
-	unsigned int num_cols;
-
 	result = sqlite3_step (stmt);
 
 	if (result != SQLITE_ROW) {
 	    continue;
 	}
 
-	o = os_object_new (*os);
-	num_cols = sqlite3_data_count (stmt);
+	_st_sqlite_row (drv, stmt, os_object_new (*os));
 
-	for (i = 0; i < num_cols; i++) {
+	num_rows++;
 
-	    const char *colname;
-	    int coltype;
+    } while (result == SQLITE_ROW);
 
-	    colname = sqlite3_column_name (stmt, i);
+    _st_sqlite_done (drv, st);
 
-	    if (strcmp (colname, "collection-owner") == 0) {
-		continue;
-	    }
+    if (num_rows == 0) {
+        os_free(*os);
+        *os = NULL;
+        return st_NOTFOUND;
+    }
 
-	    coltype = sqlite3_column_type (stmt, i);
+    return st_SUCCESS;
+}
 
-	    if (coltype == SQLITE_NULL) {
-		log_debug (ZONE, "coldata is NULL");
-		continue;
-	    }
+static st_ret_t _st_sqlite_get_multi (st_driver_t drv, const char *type,
+				      const char **owners, int nowners,
+				      const char *filter, os_t *os) {
 
-	    if (coltype == SQLITE_INTEGER) {
-		if (!strcmp (sqlite3_column_decltype (stmt, i), "BOOL")) {
-		    ot = os_type_BOOLEAN;
-		} else {
-		    ot = os_type_INTEGER;
-		}
+    drvdata_t data = (drvdata_t) drv->private;
+    char *cond, *buf;
+    char tbuf[128];
+    st_filter_t f;
+    st_stmt_t st;
+    sqlite3_stmt *stmt;
+    xht idx;
+    const char *owner;
+    int first, n, slots, i, col, result;
+    st_ret_t ret = st_SUCCESS;
 
-		ival = sqlite3_column_int (stmt, i);
-		os_object_put (o, colname, &ival, ot);
+    if (data->prefix != NULL) {
+	snprintf (tbuf, sizeof (tbuf), "%s%s", data->prefix, type);
+	type = tbuf;
+    }
 
-	    } else if (coltype == SQLITE3_TEXT) {
-		ot = os_type_STRING;
+    /* which os a row goes to */
+    idx = xhash_new (nowners * 2 + 1);
+    for (i = 0; i < nowners; i++) {
+	xhash_put (idx, owners[i], (void *) &os[i]);
+    }
 
-		val = (const char*)sqlite3_column_text (stmt, i);
-		os_object_put (o, colname, val, ot);
+    f = storage_filter (filter);
 
-	    } else {
-		log_write (drv->st->log,
-			   LOG_NOTICE,
-			   "sqlite: unknown field: %s:%d",
-			   colname, coltype);
+    for (first = 0; first < nowners && ret == st_SUCCESS; first += n) {
+
+	n = nowners - first;
+	if (n > ST_MULTI_MAX) {
+	    n = ST_MULTI_MAX;
+	}
+	slots = _st_sqlite_slots (n);
+
+	cond = _st_sqlite_convert_filter_multi (slots, f);
+	buf = _st_sqlite_sql ("SELECT * FROM ", type, cond,
+			      " ORDER BY \"object-sequence\"");
+	free (cond);
+
+	log_debug (ZONE, "prepared sql: %s", buf);
+
+	st = _st_sqlite_prepare (drv, buf);
+	free (buf);
+	if (st == NULL) {
+	    ret = st_FAILED;
+	    break;
+	}
+
+	stmt = (sqlite3_stmt *) st->handle;
+
+	_st_sqlite_bind_owners (&owners[first], n, slots, stmt);
+	if (f != NULL) {
+	    _st_sqlite_bind_filter_recursive (f, stmt, slots + 1);
+	}
+
+	col = -1;
+	while ((result = sqlite3_step (stmt)) == SQLITE_ROW) {
+	    os_t *where;
+
+	    if (col < 0) {
+		for (col = 0; col < sqlite3_data_count (stmt); col++) {
+		    if (strcmp (sqlite3_column_name (stmt, col), "collection-owner") == 0) {
+			break;
+		    }
+		}
 	    }
+
+	    owner = (const char *) sqlite3_column_text (stmt, col);
+	    if (owner == NULL || (where = (os_t *) xhash_get (idx, owner)) == NULL) {
+		continue;
+	    }
+
+	    if (*where == NULL) {
+		*where = os_new ();
+	    }
+
+	    _st_sqlite_row (drv, stmt, os_object_new (*where));
 	}
 
-	num_rows++;
+	if (result != SQLITE_DONE) {
+	    log_write (drv->st->log, LOG_ERR,
+		       "sqlite: sql select failed: %s",
+		       sqlite3_errmsg (data->db));
+	    ret = st_FAILED;
+	}
 
-    } while (result == SQLITE_ROW);
+	_st_sqlite_done (drv, st);
+    }
 
-    sqlite3_finalize (stmt);
+    if (f != NULL) pool_free (f->p);
+    xhash_free (idx);
 
-    if (num_rows == 0) {
-        os_free(*os);
-        *os = NULL;
-        return st_NOTFOUND;
+    if (ret != st_SUCCESS) {
+	for (i = 0; i < nowners; i++) {
+	    if (os[i] != NULL) {
+		os_free (os[i]);
+		os[i] = NULL;
+	    }
+	}
     }
 
-    return st_SUCCESS;
+    return ret;
 }
 
 static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 				   const char *owner, const char *filter, int *count) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
+    char *cond, *buf;
     char tbuf[128];
     int res, coltype;
+    st_filter_t f;
+    st_stmt_t st;
     sqlite3_stmt *stmt;
 
     if (data->prefix != NULL) {
@@ -528,30 +733,33 @@ static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
+    f = storage_filter (filter);
+    cond = _st_sqlite_convert_filter (drv, owner, f);
     log_debug (ZONE, "generated filter: %s", cond);
 
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "SELECT COUNT(*) FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
+    buf = _st_sqlite_sql ("SELECT COUNT(*) FROM ", type, cond, "");
     free (cond);
 
     log_debug (ZONE, "prepared sql: %s", buf);
 
-    res = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    st = _st_sqlite_prepare (drv, buf);
     free (buf);
-    if (res != SQLITE_OK) {
+    if (st == NULL) {
+	if (f != NULL) pool_free (f->p);
 	return st_FAILED;
     }
 
-    _st_sqlite_bind_filter (drv, owner, filter, stmt, 1);
+    stmt = (sqlite3_stmt *) st->handle;
+
+    _st_sqlite_bind_filter (drv, owner, f, stmt, 1);
+    if (f != NULL) pool_free (f->p);
 
     res = sqlite3_step (stmt);
     if (res != SQLITE_ROW) {
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: sql select failed: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_done (drv, st);
 	return st_FAILED;
     }
 
@@ -561,13 +769,13 @@ static st_ret_t _st_sqlite_count (st_driver_t drv, const char *type,
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: weird, count() returned non integer value: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_done (drv, st);
 	return st_FAILED;
     }
 
     *count = sqlite3_column_int (stmt, 0);
 
-    sqlite3_finalize (stmt);
+    _st_sqlite_done (drv, st);
 
     return st_SUCCESS;
 }
@@ -576,11 +784,11 @@ static st_ret_t _st_sqlite_delete (st_driver_t drv, const char *type,
 				   const char *owner, const char *filter) {
 
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    unsigned int nbuf = 0;
-    unsigned int buflen = 0;
+    char *cond, *buf;
     char tbuf[128];
     int res;
+    st_filter_t f;
+    st_stmt_t st;
     sqlite3_stmt *stmt;
 
     if (data->prefix != NULL) {
@@ -588,33 +796,36 @@ static st_ret_t _st_sqlite_delete (st_driver_t drv, const char *type,
 	type = tbuf;
     }
 
-    cond = _st_sqlite_convert_filter (drv, owner, filter);
+    f = storage_filter (filter);
+    cond = _st_sqlite_convert_filter (drv, owner, f);
     log_debug (ZONE, "generated filter: %s", cond);
 
-    SQLITE_SAFE_CAT3 (buf, nbuf, buflen,
-		      "DELETE FROM \"", type, "\" WHERE ");
-    strcpy (&buf[nbuf], cond);
+    buf = _st_sqlite_sql ("DELETE FROM ", type, cond, "");
     free (cond);
 
     log_debug (ZONE, "prepared sql: %s", buf);
 
-    res = sqlite3_prepare (data->db, buf, strlen (buf), &stmt, NULL);
+    st = _st_sqlite_prepare (drv, buf);
     free (buf);
-    if (res != SQLITE_OK) {
+    if (st == NULL) {
+	if (f != NULL) pool_free (f->p);
 	return st_FAILED;
     }
 
-    _st_sqlite_bind_filter (drv, owner, filter, stmt, 1);
+    stmt = (sqlite3_stmt *) st->handle;
+
+    _st_sqlite_bind_filter (drv, owner, f, stmt, 1);
+    if (f != NULL) pool_free (f->p);
 
     res = sqlite3_step (stmt);
     if (res != SQLITE_DONE) {
 	log_write (drv->st->log, LOG_ERR,
 		   "sqlite: sql delete failed: %s",
 		   sqlite3_errmsg (data->db));
-	sqlite3_finalize (stmt);
+	_st_sqlite_done (drv, st);
 	return st_FAILED;
     }
-    sqlite3_finalize (stmt);
+    _st_sqlite_done (drv, st);
 
     return st_SUCCESS;
 }
@@ -624,11 +835,12 @@ static st_ret_t _st_sqlite_replace (st_driver_t drv, const char *type,
 				    os_t os) {
 
     drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
 
     int res;
     char *err_msg = NULL;
 
-    if (data->txn) {
+    if (txn) {
 
 	res = sqlite3_exec (data->db, "BEGIN", NULL, NULL, &err_msg);
 	if (res != SQLITE_OK) {
@@ -641,20 +853,20 @@ static st_ret_t _st_sqlite_replace (st_driver_t drv, const char *type,
     }
 
     if (_st_sqlite_delete (drv, type, owner, filter) == st_FAILED) {
-	if (data->txn) {
+	if (txn) {
 	    sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
 	}
 	return st_FAILED;
     }
 
     if (_st_sqlite_put_guts (drv, type, owner, os) == st_FAILED) {
-	if (data->txn) {
+	if (txn) {
 	    sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
 	}
 	return st_FAILED;
     }
 
-    if (data->txn) {
+    if (txn) {
 
 	res = sqlite3_exec (data->db, "COMMIT", NULL, NULL, &err_msg);
 
@@ -671,10 +883,160 @@ static st_ret_t _st_sqlite_replace (st_driver_t drv, const char *type,
     return st_SUCCESS;
 }
 
+/** delete everything these owners have, type already has the prefix */
+static st_ret_t _st_sqlite_delete_owners (st_driver_t drv, const char *type,
+					  const char **owners, int nowners) {
+
+    drvdata_t data = (drvdata_t) drv->private;
+    char *cond, *buf;
+    st_stmt_t st;
+    int first, n, slots, res;
+
+    for (first = 0; first < nowners; first += n) {
+
+	n = nowners - first;
+	if (n > ST_MULTI_MAX) {
+	    n = ST_MULTI_MAX;
+	}
+	slots = _st_sqlite_slots (n);
+
+	cond = _st_sqlite_convert_filter_multi (slots, NULL);
+	buf = _st_sqlite_sql ("DELETE FROM ", type, cond, "");
+	free (cond);
+
+	log_debug (ZONE, "prepared sql: %s", buf);
+
+	st = _st_sqlite_prepare (drv, buf);
+	free (buf);
+	if (st == NULL) {
+	    return st_FAILED;
+	}
+
+	_st_sqlite_bind_owners (&owners[first], n, slots,
+				(sqlite3_stmt *) st->handle);
+
+	res = sqlite3_step ((sqlite3_stmt *) st->handle);
+	_st_sqlite_done (drv, st);
+
+	if (res != SQLITE_DONE) {
+	    log_write (drv->st->log, LOG_ERR,
+		       "sqlite: sql delete failed: %s",
+		       sqlite3_errmsg (data->db));
+	    return st_FAILED;
+	}
+    }
+
+    return st_SUCCESS;
+}
+
+/** the inserts stay one row at a time, they're prepared once and there's no round trip to save */
+static st_ret_t _st_sqlite_put_multi (st_driver_t drv, const char *type,
+				      const char **owners, int nowners,
+				      os_t *os, int replace) {
+
+    drvdata_t data = (drvdata_t) drv->private;
+    int txn = data->txn && !data->batch;
+    char *err_msg = NULL;
+    char tbuf[128];
+    int i;
+
+    if (txn) {
+
+	if (sqlite3_exec (data->db, "BEGIN", NULL, NULL, &err_msg) != SQLITE_OK) {
+	    log_write (drv->st->log, LOG_ERR,
+		       "sqlite: sql transaction begin failed: %s",
+		       err_msg);
+	    sqlite3_free (err_msg);
+	    return st_FAILED;
+	}
+    }
+
+    if (replace) {
+	snprintf (tbuf, sizeof (tbuf), "%s%s",
+		  data->prefix != NULL ? data->prefix : "", type);
+
+	if (_st_sqlite_delete_owners (drv, tbuf, owners, nowners) != st_SUCCESS) {
+	    if (txn) {
+		sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	    }
+	    return st_FAILED;
+	}
+    }
+
+    for (i = 0; i < nowners; i++) {
+	if (_st_sqlite_put_guts (drv, type, owners[i], os[i]) != st_SUCCESS) {
+	    if (txn) {
+		sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	    }
+	    return st_FAILED;
+	}
+    }
+
+    if (txn) {
+
+	if (sqlite3_exec (data->db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+	    log_write (drv->st->log, LOG_ERR,
+		       "sqlite: sql transaction commit failed: %s",
+		       err_msg);
+	    sqlite3_free (err_msg);
+	    sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	    return st_FAILED;
+	}
+    }
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_sqlite_batch_begin (st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+    char *err_msg = NULL;
+
+    if (!data->txn)
+	return st_NOTIMPL;
+
+    if (sqlite3_exec (data->db, "BEGIN", NULL, NULL, &err_msg) != SQLITE_OK) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql transaction begin failed: %s", err_msg);
+	sqlite3_free (err_msg);
+	return st_FAILED;
+    }
+
+    data->batch = 1;
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_sqlite_batch_end (st_driver_t drv, int ok) {
+    drvdata_t data = (drvdata_t) drv->private;
+    char *err_msg = NULL;
+
+    data->batch = 0;
+
+    if (!ok) {
+	sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	return st_SUCCESS;
+    }
+
+    if (sqlite3_exec (data->db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+	log_write (drv->st->log, LOG_ERR,
+		   "sqlite: sql transaction commit failed: %s", err_msg);
+	sqlite3_free (err_msg);
+	sqlite3_exec (data->db, "ROLLBACK", NULL, NULL, NULL);
+	return st_FAILED;
+    }
+
+    return st_SUCCESS;
+}
+
 static void _st_sqlite_free (st_driver_t drv) {
 
     drvdata_t data = (drvdata_t) drv->private;
 
+    st_stmt_cache_stats (data->stmts, drv->st->log, "sqlite");
+
+    /* statements have to go before the database can be closed */
+    st_stmt_cache_free (data->stmts);
+
     sqlite3_close (data->db);
 
     free (data);
@@ -724,6 +1086,10 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     data->prefix = config_get_one (drv->st->config,
 				   "storage.sqlite.prefix", 0);
 
+    data->stmts = st_stmt_cache_new (j_atoi (config_get_one (drv->st->config,
+				     "storage.sqlite.statements", 0), 64),
+				     _st_sqlite_finalize, NULL);
+
     drv->private = (void *) data;
     drv->add_type = _st_sqlite_add_type;
     drv->put = _st_sqlite_put;
@@ -732,6 +1098,10 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     drv->delete = _st_sqlite_delete;
     drv->replace = _st_sqlite_replace;
     drv->free = _st_sqlite_free;
+    drv->batch_begin = _st_sqlite_batch_begin;
+    drv->batch_end = _st_sqlite_batch_end;
+    drv->get_multi = _st_sqlite_get_multi;
+    drv->put_multi = _st_sqlite_put_multi;
 
     return st_SUCCESS;
 }
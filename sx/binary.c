@@ -0,0 +1,314 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/*
+ * this plugin moves an authenticated stream over to binary frames: nads go
+ * out nad_serialize()d instead of printed, and come in through
+ * nad_deserialize() instead of expat. it's for the component protocol,
+ * where we're at both ends and the xml is only ever parsed to be printed
+ * again at the next hop.
+ *
+ * the server offers <binary/> in its features once the stream is open. a
+ * client that wants it sends <binary/> and writes frames after it; the
+ * server reads frames after that element, answers with its own <binary/>
+ * and writes frames after it, and the client reads frames after that. so
+ * each direction changes at a known element, and nothing that was queued
+ * before goes in the wrong format.
+ *
+ * a frame is a 32 bit payload length in network byte order, a type byte
+ * (SX_BINARY_NAD, _PING for whitespace keepalives or _CLOSE for the end of
+ * the stream), and the payload.
+ */
+
+#include "sx.h"
+
+#define _sx_binary_elem "<binary xmlns='" uri_BINARY "'/>"
+
+/** is this <binary/> */
+static int _sx_binary_marker(nad_t nad) {
+    return NAD_ENS(nad, 0) >= 0 &&
+           NAD_NURI_L(nad, NAD_ENS(nad, 0)) == sizeof(uri_BINARY) - 1 && strncmp(NAD_NURI(nad, NAD_ENS(nad, 0)), uri_BINARY, sizeof(uri_BINARY) - 1) == 0 &&
+           NAD_ENAME_L(nad, 0) == 6 && strncmp(NAD_ENAME(nad, 0), "binary", 6) == 0;
+}
+
+/** send <binary/>, everything after it is frames */
+static void _sx_binary_start(sx_t s) {
+    jqueue_push(s->wbufq, _sx_buffer_new(_sx_binary_elem, sizeof(_sx_binary_elem) - 1, NULL, NULL), 0);
+    s->want_write = 1;
+
+    s->binary |= SX_BINARY_WRITE;
+}
+
+/** the parser just finished this nad, true if what comes after it is frames */
+int _sx_binary_switch(sx_t s, nad_t nad) {
+#ifdef HAVE_XML_STOPPARSER
+    if(!(s->flags & SX_BINARY_OFFER) || s->state != state_OPEN || (s->binary & SX_BINARY_READ))
+        return 0;
+
+    /* the server's answer only counts once we've asked */
+    if(s->type == type_CLIENT && !(s->binary & SX_BINARY_WRITE))
+        return 0;
+
+    return _sx_binary_marker(nad);
+#else
+    return 0;
+#endif
+}
+
+sx_buf_t _sx_binary_frame(int type, const char *data, int len) {
+    sx_buf_t buf;
+    uint32_t n = htonl((uint32_t) len);
+
+    buf = _sx_buffer_new(NULL, SX_BINARY_HEADER + len, NULL, NULL);
+
+    memcpy(buf->data, &n, sizeof(uint32_t));
+    buf->data[4] = (char) type;
+    if(len > 0)
+        memcpy(buf->data + SX_BINARY_HEADER, data, len);
+
+    return buf;
+}
+
+sx_buf_t _sx_binary_nad(nad_t nad, int elem) {
+    sx_buf_t buf;
+    const char *xml;
+    char *ser;
+    int len;
+
+    /* part of a nad only ever goes to legacy components, so it can go the long way */
+    if(elem > 0) {
+        nad_print(nad, elem, &xml, &len);
+        return _sx_binary_xml(xml, len);
+    }
+
+    nad_serialize(nad, &ser, &len);
+    buf = _sx_binary_frame(SX_BINARY_NAD, ser, len);
+    free(ser);
+
+    return buf;
+}
+
+sx_buf_t _sx_binary_xml(const char *xml, int len) {
+    sx_buf_t buf;
+    nad_t nad;
+    int i;
+
+    /* whitespace is a keepalive */
+    for(i = 0; i < len && isspace((unsigned char) xml[i]); i++);
+    if(i == len)
+        return _sx_binary_frame(SX_BINARY_PING, NULL, 0);
+
+    if((nad = nad_parse(xml, len)) == NULL) {
+        _sx_debug(ZONE, "can't frame unparseable xml, dropping: %.*s", len, xml);
+        return NULL;
+    }
+
+    buf = _sx_binary_nad(nad, 0);
+    nad_free(nad);
+
+    return buf;
+}
+
+/** give up on a stream that sent us a bad frame */
+static int _sx_binary_fail(sx_t s, int err, const char *why) {
+    sx_error_t sxe;
+
+    _sx_debug(ZONE, "binary frame error: %s", why);
+
+    _sx_gen_error(sxe, SX_ERR_BINARY, "binary frame error", why);
+    _sx_event(s, event_ERROR, (void *) &sxe);
+
+    _sx_error(s, err, why);
+    _sx_close(s);
+
+    s->fail = 1;
+
+    return 0;
+}
+
+/** check a frame header, @return the payload length, or -1 if it's no good */
+static int _sx_binary_len(sx_t s, const char *head) {
+    uint32_t n;
+
+    memcpy(&n, head, sizeof(uint32_t));
+    n = ntohl(n);
+
+    if(n > SX_BINARY_FRAME_MAX) {
+        _sx_binary_fail(s, stream_err_POLICY_VIOLATION, "Maximum frame size exceeded");
+        return -1;
+    }
+
+    if(s->rbytesmax && n > s->rbytesmax) {
+        _sx_binary_fail(s, stream_err_POLICY_VIOLATION, "Maximum stanza size exceeded");
+        return -1;
+    }
+
+    return (int) n;
+}
+
+/** a whole frame, @return 0 if it was bad */
+static int _sx_binary_process_frame(sx_t s, int type, const char *data, int len) {
+    nad_t nad;
+
+    switch(type) {
+        case SX_BINARY_PING:
+            return 1;
+
+        case SX_BINARY_NAD:
+            if((nad = nad_deserialize(data, len)) == NULL || nad->ecur == 0) {
+                if(nad != NULL) nad_free(nad);
+                return _sx_binary_fail(s, stream_err_BAD_FORMAT, "Invalid serialized nad");
+            }
+
+            /* completed nad, same as the parser would have made */
+            jqueue_push(s->rnadq, nad, 0);
+            return 1;
+
+        case SX_BINARY_CLOSE:
+            s->depth = -1;
+            return 1;
+    }
+
+    return _sx_binary_fail(s, stream_err_BAD_FORMAT, "Unknown frame type");
+}
+
+/** frames that came in, @return 0 if something was wrong with them (and the stream is closing) */
+int _sx_binary_read(sx_t s, const char *data, int len) {
+    sx_buf_t f;
+    int flen, n;
+
+    /* nothing more after the close */
+    while(len > 0 && s->depth >= 0) {
+        f = s->rframe;
+
+        /* whole frames straight out of the read buffer */
+        if(f == NULL && len >= SX_BINARY_HEADER) {
+            if((flen = _sx_binary_len(s, data)) < 0)
+                return 0;
+
+            if(len >= SX_BINARY_HEADER + flen) {
+                if(!_sx_binary_process_frame(s, data[4], data + SX_BINARY_HEADER, flen))
+                    return 0;
+
+                data += SX_BINARY_HEADER + flen;
+                len -= SX_BINARY_HEADER + flen;
+                continue;
+            }
+        }
+
+        /* otherwise gather it up, header first */
+        if(f == NULL) {
+            f = s->rframe = _sx_buffer_new(NULL, SX_BINARY_HEADER, NULL, NULL);
+            f->len = 0;
+        }
+
+        flen = 0;
+        if(f->len >= SX_BINARY_HEADER)
+            flen = _sx_binary_len(s, f->data);
+
+        n = SX_BINARY_HEADER + flen - f->len;
+        if(n > len)
+            n = len;
+
+        memcpy(f->data + f->len, data, n);
+        f->len += n;
+        data += n;
+        len -= n;
+
+        /* got the header, make room for the rest */
+        if(f->len == SX_BINARY_HEADER) {
+            if((flen = _sx_binary_len(s, f->data)) < 0)
+                return 0;
+
+            if(flen > 0) {
+                f->heap = f->data = (char *) realloc(f->heap, SX_BINARY_HEADER + flen);
+                continue;
+            }
+        }
+
+        if(f->len == SX_BINARY_HEADER + flen) {
+            s->rframe = NULL;
+
+            n = _sx_binary_process_frame(s, f->data[4], f->data + SX_BINARY_HEADER, flen);
+            _sx_buffer_free(f);
+
+            if(!n)
+                return 0;
+        }
+    }
+
+    /* what's left over counts towards the next stanza */
+    s->rbytes = s->rframe != NULL ? s->rframe->len : 0;
+
+    return 1;
+}
+
+/** offer it once we're authenticated */
+static void _sx_binary_features(sx_t s, sx_plugin_t p, nad_t nad) {
+#ifdef HAVE_XML_STOPPARSER
+    if(!(s->flags & SX_BINARY_OFFER) || s->state != state_OPEN || (s->binary & SX_BINARY_WRITE))
+        return;
+
+    _sx_debug(ZONE, "offering binary framing");
+
+    nad_append_elem(nad, nad_add_namespace(nad, uri_BINARY, NULL), "binary", 1);
+#endif
+}
+
+static int _sx_binary_process(sx_t s, sx_plugin_t p, nad_t nad) {
+    int ns;
+
+    if(!(s->flags & SX_BINARY_OFFER) || s->state != state_OPEN)
+        return 1;
+
+    /* a client asks as soon as it's offered, the app still gets the features */
+    if(s->type == type_CLIENT && !(s->binary & SX_BINARY_WRITE)) {
+        if(NAD_ENS(nad, 0) >= 0 && NAD_NURI_L(nad, NAD_ENS(nad, 0)) == sizeof(uri_STREAMS) - 1 && strncmp(NAD_NURI(nad, NAD_ENS(nad, 0)), uri_STREAMS, sizeof(uri_STREAMS) - 1) == 0 &&
+           NAD_ENAME_L(nad, 0) == 8 && strncmp(NAD_ENAME(nad, 0), "features", 8) == 0 &&
+           (ns = nad_find_scoped_namespace(nad, uri_BINARY, NULL)) >= 0 && nad_find_elem(nad, 0, ns, "binary", 1) >= 0) {
+            _sx_debug(ZONE, "binary framing offered, switching");
+            _sx_binary_start(s);
+        }
+
+        return 1;
+    }
+
+    if(!_sx_binary_marker(nad))
+        return 1;
+
+    /* they've switched, so do we */
+    if(s->type == type_SERVER && (s->binary & SX_BINARY_READ) && !(s->binary & SX_BINARY_WRITE)) {
+        _sx_debug(ZONE, "client switched to binary framing, following");
+        _sx_binary_start(s);
+    }
+
+    nad_free(nad);
+    return 0;
+}
+
+/** args: none */
+int sx_binary_init(sx_env_t env, sx_plugin_t p, va_list args) {
+    log_debug(ZONE, "initialising binary framing sx plugin");
+
+    p->features = _sx_binary_features;
+    p->process = _sx_binary_process;
+
+    return 0;
+}
@@ -20,6 +20,29 @@
 
 #include "sx.h"
 
+/** was this namespace declared inside the element we're reading, so that
+  * its raw xml still means the same outside of this stream */
+static int _sx_raw_declared(nad_t nad, const char *uri, const char *prefix) {
+    int ns, luri, lprefix;
+
+    /* always there */
+    if(prefix != NULL && strcmp(prefix, "xml") == 0)
+        return 1;
+
+    luri = strlen(uri);
+    lprefix = prefix != NULL ? strlen(prefix) : 0;
+
+    for(ns = 0; ns < nad->ncur; ns++)
+        if(NAD_NURI_L(nad, ns) == luri && strncmp(NAD_NURI(nad, ns), uri, luri) == 0) {
+            if(prefix == NULL && nad->nss[ns].iprefix < 0)
+                return 1;
+            if(prefix != NULL && nad->nss[ns].iprefix >= 0 && NAD_NPREFIX_L(nad, ns) == lprefix && strncmp(NAD_NPREFIX(nad, ns), prefix, lprefix) == 0)
+                return 1;
+        }
+
+    return 0;
+}
+
 /** primary expat callbacks */
 void _sx_element_start(void *arg, const char *name, const char **atts) {
     sx_t s = (sx_t) arg;
@@ -35,6 +58,10 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
     if(s->nad == NULL)
         s->nad = nad_new();
 
+    /* top-level element, note where it starts */
+    if(s->depth == 1)
+        s->rrawstart = (s->flags & SX_NAD_RAW) ? XML_GetCurrentByteIndex(s->expat) : -1;
+
     /* make a copy */
     strncpy(buf, name, 1024);
     buf[1023] = '\0';
@@ -56,6 +83,8 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
             *prefix = '\0';
             prefix++;
         }
+        if(s->rrawstart >= 0 && !_sx_raw_declared(s->nad, uri, prefix))
+            s->rrawstart = -1;
         ns = nad_add_namespace(s->nad, uri, prefix);
     } else {
         /* un-namespaced, just take it as-is */
@@ -87,6 +116,8 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
                 *prefix = '\0';
                 prefix++;
             }
+            if(s->rrawstart >= 0 && !_sx_raw_declared(s->nad, uri, prefix))
+                s->rrawstart = -1;
             ns = nad_append_namespace(s->nad, el, uri, prefix);
         } else {
             /* un-namespaced, just take it as-is */
@@ -107,14 +138,37 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
 
 void _sx_element_end(void *arg, const char *name) {
     sx_t s = (sx_t) arg;
+    XML_Index start, end;
 
     if(s->fail) return;
 
     s->depth--;
 
     if(s->depth == 1) {
+        /* if all of it came in this read, keep it as it was */
+        if(s->rrawstart >= 0 && s->rchunk != NULL) {
+            start = s->rrawstart - s->rchunkoff;
+            end = XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat) - s->rchunkoff;
+
+            if(start >= 0 && end > start && end <= s->rchunklen)
+                nad_set_raw(s->nad, s->rchunk + start, end - start);
+        }
+        s->rrawstart = -1;
+
         /* completed nad, save it for later processing */
         jqueue_push(s->rnadq, s->nad, 0);
+
+#ifdef HAVE_XML_STOPPARSER
+        /* binary frames follow this one, they're not for the parser */
+        if(s->rchunk != NULL && _sx_binary_switch(s, s->nad)) {
+            end = XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat) - s->rchunkoff;
+
+            s->binary |= SX_BINARY_READ;
+            s->rbinoff = (end >= 0 && end <= s->rchunklen) ? (int) end : -1;
+            XML_StopParser(s->expat, XML_FALSE);
+        }
+#endif
+
         s->nad = NULL;
 
         /* and reset read bytes counter */
@@ -49,6 +49,21 @@ static const char *_stream_errors[] = {
     NULL
 };
 
+/** queue the error, as a frame if the stream has gone binary */
+static void _sx_error_push(sx_t s, sx_buf_t buf) {
+    sx_buf_t frame;
+
+    if(s->binary & SX_BINARY_WRITE) {
+        frame = _sx_binary_xml(buf->data, buf->len);
+        _sx_buffer_free(buf);
+
+        if((buf = frame) == NULL)
+            return;
+    }
+
+    jqueue_push(s->wbufq, buf, 0);
+}
+
 /** send an error */
 void _sx_error(sx_t s, int err, const char *text) {
     int len = 0;
@@ -77,7 +92,7 @@ void _sx_error(sx_t s, int err, const char *text) {
     assert(len == buf->len);
 
     _sx_debug(ZONE, "prepared error: %.*s", buf->len, buf->data);
-    jqueue_push(s->wbufq, buf, 0);
+    _sx_error_push(s, buf);
 
     /* close the stream if needed */
     if(s->state < state_STREAM) {
@@ -131,7 +146,7 @@ void _sx_error_extended(sx_t s, int err, const char *content) {
     _sx_debug(ZONE, "prepared error: %.*s", buf->len, buf->data);
 
     /* go */
-    jqueue_push(s->wbufq, buf, 0);
+    _sx_error_push(s, buf);
 
     /* stuff to write */
     s->want_write = 1;
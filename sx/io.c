@@ -20,12 +20,23 @@
 
 #include "sx.h"
 
-/** handler for read data */
+/** what goes out to end the stream */
+static sx_buf_t _sx_close_buffer(sx_t s) {
+    if(s->binary & SX_BINARY_WRITE)
+        return _sx_binary_frame(SX_BINARY_CLOSE, NULL, 0);
+
+    if(s->flags & SX_WEBSOCKET_WRAPPER)
+        return _sx_buffer_new("<close xmlns='" uri_XFRAMING "' />", sizeof(uri_XFRAMING) + 17, NULL, NULL);
+
+    return _sx_buffer_new("</stream:stream>", 16, NULL, NULL);
+}
+
+/** handler for read data, the buffer stays with the caller */
 void _sx_process_read(sx_t s, sx_buf_t buf) {
     sx_error_t sxe;
     nad_t nad;
     char *errstring;
-    int i;
+    int i, ret;
     int ns, elem;
 
     /* Note that buf->len can validly be 0 here, if we got data from
@@ -35,30 +46,58 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     /* count bytes read */
     s->rbytes += buf->len;
 
-    /* parse it */
-    if(XML_Parse(s->expat, buf->data, buf->len, 0) == 0) {
+    /* frames don't go near the parser */
+    if(s->binary & SX_BINARY_READ)
+        ret = _sx_binary_read(s, buf->data, buf->len);
+
+    else {
+        /* parse it, element callbacks may keep some of it as is */
+        s->rchunk = buf->data;
+        s->rchunklen = buf->len;
+        s->rchunkoff = s->rbytes_total;
+
+        ret = XML_Parse(s->expat, buf->data, buf->len, 0);
+
+        s->rchunk = NULL;
+
+#ifdef HAVE_XML_STOPPARSER
+        /* the parser was stopped where the frames start */
+        if(ret == 0 && (s->binary & SX_BINARY_READ) && XML_GetErrorCode(s->expat) == XML_ERROR_ABORTED) {
+            if(s->rbinoff < 0 || s->rbinoff > buf->len) {
+                _sx_debug(ZONE, "binary frames start outside the read buffer (%d of %d)", s->rbinoff, buf->len);
+                _sx_gen_error(sxe, SX_ERR_BINARY, "binary frame error", "Lost the start of the frames");
+                _sx_event(s, event_ERROR, (void *) &sxe);
+
+                _sx_error(s, stream_err_INTERNAL_SERVER_ERROR, "Lost the start of the frames");
+                _sx_close(s);
+
+                return;
+            }
+
+            ret = _sx_binary_read(s, buf->data + s->rbinoff, buf->len - s->rbinoff);
+        }
+#endif
+    }
+
+    if(ret == 0) {
         /* only report error we haven't already */
         if(!s->fail) {
             /* parse error */
             errstring = (char *) XML_ErrorString(XML_GetErrorCode(s->expat));
 
             _sx_debug(ZONE, "XML parse error: %s, character %d: %.*s",
-                      errstring, XML_GetCurrentByteIndex(s->expat) - s->rbytes_total, buf->len, buf->data);
+                      errstring, (int) (XML_GetCurrentByteIndex(s->expat) - s->rbytes_total), buf->len, buf->data);
             _sx_gen_error(sxe, SX_ERR_XML_PARSE, "XML parse error", errstring);
             _sx_event(s, event_ERROR, (void *) &sxe);
 
             _sx_error(s, stream_err_XML_NOT_WELL_FORMED, errstring);
             _sx_close(s);
 
-            _sx_buffer_free(buf);
-
             return;
         }
 
         /* !!! is this the right thing to do? we should probably set
          *     s->fail and let the code further down handle it. */
-        _sx_buffer_free(buf);
-
         return;
     }
 
@@ -75,17 +114,12 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
         _sx_error(s, stream_err_POLICY_VIOLATION, errstring);
         _sx_close(s);
 
-        _sx_buffer_free(buf);
-
         return;
     }
 
     /* count bytes processed */
     s->rbytes_total += buf->len;
 
-    /* done with the buffer */
-    _sx_buffer_free(buf);
-
     /* process completed nads */
     if(s->state >= state_STREAM)
         while((nad = jqueue_pull(s->rnadq)) != NULL) {
@@ -96,6 +130,8 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
             _sx_debug(ZONE, "completed nad: %.*s", len, out);
 #endif
 
+            s->rstanzas++;
+
             /* check for errors */
             if(NAD_ENS(nad, 0) >= 0 && NAD_NURI_L(nad, NAD_ENS(nad, 0)) == strlen(uri_STREAMS) && strncmp(NAD_NURI(nad, NAD_ENS(nad, 0)), uri_STREAMS, strlen(uri_STREAMS)) == 0 && NAD_ENAME_L(nad, 0) == 5 && strncmp(NAD_ENAME(nad, 0), "error", 5) == 0) {
 
@@ -179,10 +215,7 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
         /* close the stream if necessary */
 
         if(s->state >= state_STREAM_SENT) {
-            if (s->flags & SX_WEBSOCKET_WRAPPER)
-                jqueue_push(s->wbufq, _sx_buffer_new("<close xmlns='" uri_XFRAMING "' />", sizeof(uri_XFRAMING) + 17, NULL, NULL), 0);
-            else
-                jqueue_push(s->wbufq, _sx_buffer_new("</stream:stream>", 16, NULL, NULL), 0);
+            jqueue_push(s->wbufq, _sx_close_buffer(s), 0);
             s->want_write = 1;
         }
 
@@ -192,9 +225,77 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     }
 }
 
+/** get the read buffer ready, at the size we want it */
+static sx_buf_t _sx_read_buffer(sx_t s) {
+    sx_buf_t buf;
+
+    /* it's ours until we're done with it */
+    buf = s->rbuf;
+    s->rbuf = NULL;
+
+    if(buf == NULL) {
+        buf = _sx_buffer_new(NULL, 0, NULL, NULL);
+        s->rbufsize = 0;
+    }
+
+    if(s->rbufwant < SX_READ_BUF_MIN)
+        s->rbufwant = SX_READ_BUF_MIN;
+
+    if(buf->heap == NULL || s->rbufsize != s->rbufwant) {
+        if(buf->heap != NULL)
+            free(buf->heap);
+
+        buf->heap = (char *) malloc(sizeof(char) * s->rbufwant);
+        s->rbufsize = s->rbufwant;
+        s->rallocs++;
+    }
+
+    buf->data = buf->heap;
+    buf->len = s->rbufsize;
+    buf->notify = NULL;
+    buf->notify_arg = NULL;
+
+    return buf;
+}
+
+/** done reading, size the buffer for next time and keep it */
+static void _sx_read_buffer_done(sx_t s, sx_buf_t buf, char *heap, int read) {
+    int max;
+
+    /* a plugin swapped the memory, we don't know how big it is */
+    if(buf->heap != heap)
+        s->rbufsize = 0;
+
+    /* we were reset (or reentered) meanwhile and have a new one */
+    if(s->rbuf != NULL) {
+        _sx_buffer_free(buf);
+        return;
+    }
+
+    s->rbuf = buf;
+
+    if(read <= 0)
+        return;
+
+    max = s->rbufmax > SX_READ_BUF_MIN ? s->rbufmax : SX_READ_BUF_MIN;
+
+    /* filled it up, there's probably more where that came from */
+    if(read >= s->rbufwant) {
+        s->rbufwant = s->rbufwant * 2 < max ? s->rbufwant * 2 : max;
+        s->rbufavg = s->rbufwant;
+        return;
+    }
+
+    /* otherwise follow what we get, giving memory back slowly */
+    s->rbufavg = (s->rbufavg * 7 + read) / 8;
+    if(s->rbufavg * 4 < s->rbufwant && s->rbufwant > SX_READ_BUF_MIN)
+        s->rbufwant /= 2;
+}
+
 /** we can read */
 int sx_can_read(sx_t s) {
-    sx_buf_t in, out;
+    sx_buf_t buf;
+    char *heap;
     int read, ret;
 
     assert((int) (s != NULL));
@@ -205,15 +306,19 @@ int sx_can_read(sx_t s) {
 
     _sx_debug(ZONE, "%d ready for reading", s->tag);
 
-    /* new buffer */
-    in = _sx_buffer_new(NULL, 1024, NULL, NULL);
+    buf = _sx_read_buffer(s);
+    heap = buf->heap;
 
     /* get them to read stuff */
-    read = _sx_event(s, event_READ, (void *) in);
+    s->rreads++;
+    read = _sx_event(s, event_READ, (void *) buf);
+
+    if(read > 0)
+        s->rwire += read;
 
     /* bail if something went wrong */
     if(read < 0) {
-        _sx_buffer_free(in);
+        _sx_read_buffer_done(s, buf, heap, 0);
         s->want_read = 0;
         s->want_write = 0;
         return 0;
@@ -225,16 +330,13 @@ int sx_can_read(sx_t s) {
          * thus there is something to read, or error handled
          * via (read < 0) block before (errors return -1) */
         _sx_debug(ZONE, "decoded 0 bytes read data - this should not happen");
-        _sx_buffer_free(in);
+        _sx_read_buffer_done(s, buf, heap, 0);
 
     } else {
-        _sx_debug(ZONE, "passed %d read bytes", in->len);
+        _sx_debug(ZONE, "passed %d read bytes", buf->len);
 
-        /* make a copy for processing */
-        out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
-
-        /* run it by the plugins */
-        ret = _sx_chain_io_read(s, out);
+        /* run it by the plugins, they work on it in place */
+        ret = _sx_chain_io_read(s, buf);
         if(ret <= 0) {
             if(ret < 0) {
                 /* permanent failure, its all over */
@@ -242,20 +344,19 @@ int sx_can_read(sx_t s) {
                 s->want_read = s->want_write = 0;
             }
 
-            _sx_buffer_free(in);
-            _sx_buffer_free(out);
+            _sx_read_buffer_done(s, buf, heap, read);
 
             /* done */
             if(s->want_write) _sx_event(s, event_WANT_WRITE, NULL);
             return s->want_read;
         }
 
-        _sx_buffer_free(in);
-
-        _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", out->len, out->len, out->data);
+        _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", buf->len, buf->len, buf->data);
 
         /* into the parser with you */
-        _sx_process_read(s, out);
+        _sx_process_read(s, buf);
+
+        _sx_read_buffer_done(s, buf, heap, read);
     }
 
     /* if we've written everything, and we're closed, then inform the app it can kill us */
@@ -295,6 +396,20 @@ static int _sx_get_pending_write(sx_t s) {
     /* if there's more to write, we want to make sure we get it */
     s->want_write = jqueue_size(s->wbufq);
 
+    /* nothing to transform it, so it can go as it is */
+    if(s->wio == NULL) {
+        if(in->len == 0) {
+            /* nothing to hand over, but whoever queued it still hears it went */
+            if(in->notify != NULL)
+                (in->notify)(s, in->notify_arg);
+
+            _sx_buffer_free(in);
+        } else
+            s->wbufpending = in;
+
+        return 0;
+    }
+
     /* make a copy for processing */
     out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
 
@@ -330,17 +445,97 @@ static int _sx_get_pending_write(sx_t s) {
     return 0;
 }
 
-int sx_can_write(sx_t s) {
-    sx_buf_t out;
-    int ret, written;
+#ifdef HAVE_SYS_UIO_H
+/** hand the app everything we can in one go; returns -1 if it failed, 1 if there was nothing to write */
+static int _sx_writev(sx_t s) {
+    struct iovec iov[SX_WRITEV_MAX_IOV];
+    struct _sx_iov_st v;
+    _jqueue_node_t qn;
+    sx_buf_t buf;
+    int written, bytes, pending;
+
+    v.iov = iov;
+    v.iovcnt = 0;
+    bytes = 0;
+
+    /* the rest of a partial write goes first, the queue may have been jumped since */
+    pending = (s->wbufpending != NULL);
+    if(pending) {
+        iov[0].iov_base = s->wbufpending->data;
+        iov[0].iov_len = s->wbufpending->len;
+        v.iovcnt = 1;
+        bytes = s->wbufpending->len;
+    }
 
-    assert((int) (s != NULL));
+    /* a notify can change how anything after it is written (starttls,
+     * compression), so a buffer with one is always the last we take */
+    for(qn = s->wbufq->front; qn != NULL && (!pending || s->wbufpending->notify == NULL) && v.iovcnt < SX_WRITEV_MAX_IOV && bytes < SX_WRITEV_MAX_BYTES; qn = qn->prev) {
+        buf = (sx_buf_t) qn->data;
 
-    /* do we care? */
-    if(!s->want_write && s->state < state_CLOSING)
-        return 0;           /* no more thanks */
+        iov[v.iovcnt].iov_base = buf->data;
+        iov[v.iovcnt].iov_len = buf->len;
+        v.iovcnt++;
+        bytes += buf->len;
 
-    _sx_debug(ZONE, "%d ready for writing", s->tag);
+        if(buf->notify != NULL)
+            break;
+    }
+
+    /* if there's nothing to write, then we're done */
+    if(v.iovcnt == 0)
+        return 1;
+
+    written = 0;
+    if(bytes > 0) {
+        _sx_debug(ZONE, "handing app %d bytes in %d buffers to write", bytes, v.iovcnt);
+        written = _sx_event(s, event_WRITEV, (void *) &v);
+
+        if(written < 0) {
+            /* bail if something went wrong */
+            s->want_read = 0;
+            s->want_write = 0;
+            return -1;
+        }
+    }
+
+    /* retire what went out */
+    for(; v.iovcnt > 0; v.iovcnt--) {
+        if(pending) {
+            buf = s->wbufpending;
+            s->wbufpending = NULL;
+            pending = 0;
+        } else
+            buf = (sx_buf_t) jqueue_pull(s->wbufq);
+
+        if(written < buf->len) {
+            /* not fully written, this buffer is still pending */
+            buf->len -= written;
+            buf->data += written;
+            s->wbufpending = buf;
+            break;
+        }
+
+        written -= buf->len;
+
+        /* notify */
+        if(buf->notify != NULL)
+            (buf->notify)(s, buf->notify_arg);
+
+        /* done with this */
+        _sx_buffer_free(buf);
+    }
+
+    /* if there's more to write, we want to make sure we get it */
+    s->want_write = jqueue_size(s->wbufq) + (s->wbufpending != NULL);
+
+    return 0;
+}
+#endif
+
+/** hand the app the next buffer, after the plugins have had a go at it; returns -1 if it failed, 1 if there was nothing to write */
+static int _sx_write(sx_t s) {
+    sx_buf_t out;
+    int ret, written;
 
     ret = _sx_get_pending_write(s);
     if (ret < 0) {
@@ -348,14 +543,12 @@ int sx_can_write(sx_t s) {
         _sx_debug(ZONE, "fatal error after attempt to write on fd %d", s->tag);
         /* permanent error so inform the app it can kill us */
         sx_kill(s);
-        return 0;
+        return -1;
     }
 
     /* if there's nothing to write, then we're done */
-    if(s->wbufpending == NULL) {
-        if(s->want_read) _sx_event(s, event_WANT_READ, NULL);
-        return s->want_write;
-    }
+    if(s->wbufpending == NULL)
+        return 1;
 
     out = s->wbufpending;
     s->wbufpending = NULL;
@@ -369,7 +562,7 @@ int sx_can_write(sx_t s) {
         _sx_buffer_free(out);
         s->want_read = 0;
         s->want_write = 0;
-        return 0;
+        return -1;
     } else if(written < out->len) {
         /* if not fully written, this buffer is still pending */
         out->len -= written;
@@ -385,6 +578,36 @@ int sx_can_write(sx_t s) {
         _sx_buffer_free(out);
     }
 
+    return 0;
+}
+
+int sx_can_write(sx_t s) {
+    int ret;
+
+    assert((int) (s != NULL));
+
+    /* do we care? */
+    if(!s->want_write && s->state < state_CLOSING)
+        return 0;           /* no more thanks */
+
+    _sx_debug(ZONE, "%d ready for writing", s->tag);
+
+#ifdef HAVE_SYS_UIO_H
+    /* the app can take it all at once if no plugin has to transform it */
+    if((s->flags & SX_WRITEV) && s->wio == NULL)
+        ret = _sx_writev(s);
+    else
+#endif
+        ret = _sx_write(s);
+
+    if(ret < 0)
+        return 0;
+
+    if(ret > 0) {
+        if(s->want_read) _sx_event(s, event_WANT_READ, NULL);
+        return s->want_write;
+    }
+
     /* if we've written everything, and we're closed, then inform the app it can kill us */
     if(s->want_write == 0 && s->state == state_CLOSING) {
         _sx_state(s, state_CLOSED);
@@ -401,6 +624,7 @@ int sx_can_write(sx_t s) {
 
 /** send a new nad out */
 int _sx_nad_write(sx_t s, nad_t nad, int elem) {
+    sx_buf_t buf;
     const char *out;
     int len;
 
@@ -416,15 +640,26 @@ int _sx_nad_write(sx_t s, nad_t nad, int elem) {
         return 1;
 
     /* serialise it */
-    nad_print(nad, elem, &out, &len);
+    if(s->binary & SX_BINARY_WRITE) {
+        buf = _sx_binary_nad(nad, elem);
 
-    _sx_debug(ZONE, "queueing for write: %.*s", len, out);
+        _sx_debug(ZONE, "queueing %d byte frame for write", buf != NULL ? buf->len : 0);
+    } else {
+        nad_print(nad, elem, &out, &len);
 
-    /* ready to go */
-    jqueue_push(s->wbufq, _sx_buffer_new(out, len, NULL, NULL), 0);
+        _sx_debug(ZONE, "queueing for write: %.*s", len, out);
+
+        buf = _sx_buffer_new(out, len, NULL, NULL);
+    }
 
     nad_free(nad);
 
+    if(buf == NULL)
+        return 1;
+
+    /* ready to go */
+    jqueue_push(s->wbufq, buf, 0);
+
     /* things to write */
     s->want_write = 1;
 
@@ -448,6 +683,8 @@ void sx_nad_write_elem(sx_t s, nad_t nad, int elem) {
 
 /** send raw data out */
 int _sx_raw_write(sx_t s, const char *buf, int len) {
+    sx_buf_t out;
+
     /* siltently drop it if we're closing or closed */
     if(s->state >= state_CLOSING) {
         log_debug(ZONE, "stream closed, dropping outgoing raw data");
@@ -456,8 +693,17 @@ int _sx_raw_write(sx_t s, const char *buf, int len) {
 
     _sx_debug(ZONE, "queuing for write: %.*s", len, buf);
 
+    /* on binary streams it has to be framed, whitespace is a ping */
+    if(s->binary & SX_BINARY_WRITE)
+        out = _sx_binary_xml(buf, len);
+    else
+        out = _sx_buffer_new(buf, len, NULL, NULL);
+
+    if(out == NULL)
+        return 1;
+
     /* ready to go */
-    jqueue_push(s->wbufq, _sx_buffer_new(buf, len, NULL, NULL), 0);
+    jqueue_push(s->wbufq, out, 0);
 
     /* things to write */
     s->want_write = 1;
@@ -485,10 +731,7 @@ void sx_raw_write(sx_t s, const char *buf, int len) {
 void _sx_close(sx_t s) {
     /* close the stream if necessary */
     if(s->state >= state_STREAM_SENT) {
-        if (s->flags & SX_WEBSOCKET_WRAPPER)
-            jqueue_push(s->wbufq, _sx_buffer_new("<close xmlns='" uri_XFRAMING "' />", sizeof(uri_XFRAMING) + 17, NULL, NULL), 0);
-        else
-            jqueue_push(s->wbufq, _sx_buffer_new("</stream:stream>", 16, NULL, NULL), 0);
+        jqueue_push(s->wbufq, _sx_close_buffer(s), 0);
         s->want_write = 1;
     }
 
@@ -516,3 +759,10 @@ void sx_kill(sx_t s) {
     _sx_state(s, state_CLOSED);
     _sx_event(s, event_CLOSED, NULL);
 }
+
+void sx_read_stats(sx_t s, char *buf, int len) {
+    snprintf(buf, len, "bytes: %lld, stanzas: %d, reads: %d (%.2f per KB), read buffers: %d (%.2f per stanza)",
+             s->rwire, s->rstanzas,
+             s->rreads, s->rwire > 0 ? s->rreads * 1024.0 / s->rwire : 0.0,
+             s->rallocs, s->rstanzas > 0 ? (double) s->rallocs / s->rstanzas : 0.0);
+}
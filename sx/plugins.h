@@ -33,6 +33,8 @@
 
 #define SX_WEBSOCKET_WRAPPER    (1<<6)    /** indicates stream over WebSocket connection */
 
+#define SX_BINARY_OFFER         (1<<9)    /** offer (server) or ask for (client) binary framing */
+
 /** magic numbers, so plugins can find each other */
 #define SX_SSL_MAGIC        (0x01)
 
@@ -45,6 +47,8 @@
 #define SX_ERR_COMPRESS         (0x020)
 #define SX_ERR_COMPRESS_FAILURE (0x021)
 
+#define SX_ERR_BINARY           (0x030)
+
 
 #define SX_CONN_EXTERNAL_ID_MAX_COUNT 8
 
@@ -113,6 +117,7 @@ typedef int                 (*sx_sasl_callback_t)(int cb, void *arg, void **res,
 #define sx_sasl_cb_CHECK_AUTHZID    (0x03)
 #define sx_sasl_cb_GEN_AUTHZID      (0x04)
 #define sx_sasl_cb_CHECK_MECH       (0x05)
+#define sx_sasl_cb_STEP             (0x06)
 
 /* error codes */
 #define sx_sasl_ret_OK		    (0)
@@ -129,6 +134,21 @@ typedef struct sx_sasl_creds_st {
     const char                  *pass;
 } *sx_sasl_creds_t;
 
+/**
+ * a handshake step (sx_sasl_cb_STEP hands it to the app, which takes it
+ * by returning sx_sasl_ret_OK); the app runs it from wherever it likes,
+ * then finishes it in the stream's thread. The stream must not be freed
+ * while it is running, and no more sasl packets are processed until it
+ * is finished.
+ */
+typedef struct sx_sasl_step_st *sx_sasl_step_t;
+
+/** run the step, the callbacks it makes come from the calling thread */
+JABBERD2_API void                        sx_sasl_step_run(sx_sasl_step_t step);
+
+/** answer the client, and free the step */
+JABBERD2_API void                        sx_sasl_step_done(sx_sasl_step_t step);
+
 
 /* Stream Compression plugin */
 #ifdef HAVE_LIBZ
@@ -154,6 +174,10 @@ typedef struct _sx_compress_conn_st {
 #endif /* HAVE_LIBZ */
 
 
+/* binary framing plugin */
+/** init function */
+JABBERD2_API int sx_binary_init(sx_env_t env, sx_plugin_t p, va_list args);
+
 /* Stanza Acknowledgements plugin */
 /** init function */
 JABBERD2_API int sx_ack_init(sx_env_t env, sx_plugin_t p, va_list args);
@@ -41,8 +41,26 @@ typedef struct _sx_sasl_st {
 typedef struct _sx_sasl_sess_st {
     sx_t            s;
     _sx_sasl_t      ctx;
+
+    /** step the app is running for us */
+    sx_sasl_step_t  step;
 } *_sx_sasl_sess_t;
 
+/** a gsasl step, and what came out of it */
+struct sx_sasl_step_st {
+    sx_t            s;
+    sx_plugin_t     p;
+    Gsasl_session   *sd;
+
+    char            *in;
+    size_t          inlen;
+
+    char            *out;
+    size_t          outlen;
+
+    int             ret;
+};
+
 /** utility: generate a success nad */
 static nad_t _sx_sasl_success(sx_t s, const char *data, int dlen) {
     nad_t nad;
@@ -310,6 +328,108 @@ static void _sx_sasl_notify_success(sx_t s, void *arg) {
     sx_server_init(s, s->flags);
 }
 
+/** run a step, in whatever thread the app likes */
+void sx_sasl_step_run(sx_sasl_step_t step) {
+    step->ret = gsasl_step(step->sd, step->in, step->inlen, &step->out, &step->outlen);
+}
+
+/** answer the client with what came out of a step */
+void sx_sasl_step_done(sx_sasl_step_t step) {
+    sx_t s = step->s;
+    sx_plugin_t p = step->p;
+    _sx_sasl_sess_t sctx = gsasl_session_hook_get(step->sd);
+    char *buf = NULL, *out = step->out;
+    size_t buflen, outlen = step->outlen;
+    int ret = step->ret, deferred = 0;
+
+    if(sctx != NULL && sctx->step == step) {
+        sctx->step = NULL;
+        deferred = 1;
+    }
+
+    if(step->in != NULL) free(step->in);
+    free(step);
+
+    /* auth completed */
+    if(ret == GSASL_OK) {
+        _sx_debug(ZONE, "sasl handshake completed");
+
+        /* encode the leftover response */
+        ret = gsasl_base64_to(out, outlen, &buf, &buflen);
+        if (ret == GSASL_OK) {
+            /* send success */
+            if(_sx_nad_write(s, _sx_sasl_success(s, buf, buflen), 0) == 0) {
+                /* set a notify on the success nad buffer (the last one in, we may have been waiting a while) */
+                ((sx_buf_t) s->wbufq->back->data)->notify = _sx_sasl_notify_success;
+                ((sx_buf_t) s->wbufq->back->data)->notify_arg = (void *) p;
+            }
+            free(buf);
+        }
+        else {
+            _sx_debug(ZONE, "gsasl_base64_to failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
+            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_INCORRECT_ENCODING), 0);
+            if(buf != NULL) free(buf);
+        }
+    }
+
+    /* in progress */
+    else if(ret == GSASL_NEEDS_MORE) {
+        _sx_debug(ZONE, "sasl handshake in progress (challenge: %.*s)", outlen, out);
+
+        /* encode the challenge */
+        ret = gsasl_base64_to(out, outlen, &buf, &buflen);
+        if (ret == GSASL_OK) {
+            _sx_nad_write(s, _sx_sasl_challenge(s, buf, buflen), 0);
+            free(buf);
+        }
+        else {
+            _sx_debug(ZONE, "gsasl_base64_to failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
+            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_INCORRECT_ENCODING), 0);
+            if(buf != NULL) free(buf);
+        }
+    }
+
+    /* its over */
+    else {
+        _sx_debug(ZONE, "sasl handshake failed; (%d): %s", ret, gsasl_strerror(ret));
+
+        /* !!! TODO XXX check ret and flag error appropriately */
+        _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_MALFORMED_REQUEST), 0);
+    }
+
+    if(out != NULL) free(out);
+
+    /* nobody else is going to flush it for us */
+    if(deferred && s->want_write)
+        _sx_event(s, event_WANT_WRITE, NULL);
+}
+
+/** take a step, or let the app take it for us */
+static void _sx_sasl_step(sx_t s, sx_plugin_t p, Gsasl_session *sd, char *in, size_t inlen) {
+    _sx_sasl_t ctx = (_sx_sasl_t) p->private;
+    _sx_sasl_sess_t sctx = gsasl_session_hook_get(sd);
+    sx_sasl_step_t step;
+
+    step = (sx_sasl_step_t) calloc(1, sizeof(struct sx_sasl_step_st));
+    step->s = s;
+    step->p = p;
+    step->sd = sd;
+    step->in = in;
+    step->inlen = inlen;
+    step->ret = GSASL_AUTHENTICATION_ERROR;
+
+    /* the app may not want to wait on its callbacks here */
+    if(ctx->cb != NULL && sctx != NULL) {
+        sctx->step = step;
+        if((ctx->cb)(sx_sasl_cb_STEP, (void *) step, NULL, s, ctx->cbarg) == sx_sasl_ret_OK)
+            return;
+        sctx->step = NULL;
+    }
+
+    sx_sasl_step_run(step);
+    sx_sasl_step_done(step);
+}
+
 /** process handshake packets from the client */
 static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, const char *mech, const char *in, int inlen) {
     _sx_sasl_t ctx = (_sx_sasl_t) p->private;
@@ -320,7 +440,7 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
 #ifdef HAVE_SSL
     int i;
 #endif
-    size_t buflen, outlen;
+    size_t buflen;
 
     if(mech != NULL) {
         _sx_debug(ZONE, "auth request from client (mechanism=%s)", mech);
@@ -411,14 +531,6 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
             }
         }
 
-        ret = gsasl_step(sd, buf, buflen, &out, &outlen);
-        if(ret != GSASL_OK && ret != GSASL_NEEDS_MORE) {
-            _sx_debug(ZONE, "gsasl_step failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
-            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_MALFORMED_REQUEST), 0);
-            if(out != NULL) free(out);
-            if(buf != NULL) free(buf);
-            return;
-        }
     }
 
     else {
@@ -437,65 +549,10 @@ static void _sx_sasl_client_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
             return;
         }
         _sx_debug(ZONE, "response from client (decoded: %.*s)", buflen, buf);
-        ret = gsasl_step(sd, buf, buflen, &out, &outlen);
-    }
-
-    if(buf != NULL) free(buf);
-
-    /* auth completed */
-    if(ret == GSASL_OK) {
-        _sx_debug(ZONE, "sasl handshake completed");
-
-        /* encode the leftover response */
-        ret = gsasl_base64_to(out, outlen, &buf, &buflen);
-        if (ret == GSASL_OK) {
-            /* send success */
-            _sx_nad_write(s, _sx_sasl_success(s, buf, buflen), 0);
-            free(buf);
-
-            /* set a notify on the success nad buffer */
-            ((sx_buf_t) s->wbufq->front->data)->notify = _sx_sasl_notify_success;
-            ((sx_buf_t) s->wbufq->front->data)->notify_arg = (void *) p;
-        }
-        else {
-            _sx_debug(ZONE, "gsasl_base64_to failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
-            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_INCORRECT_ENCODING), 0);
-            if(buf != NULL) free(buf);
-        }
-
-        if(out != NULL) free(out);
-
-        return;
-    }
-
-    /* in progress */
-    if(ret == GSASL_NEEDS_MORE) {
-        _sx_debug(ZONE, "sasl handshake in progress (challenge: %.*s)", outlen, out);
-
-        /* encode the challenge */
-        ret = gsasl_base64_to(out, outlen, &buf, &buflen);
-        if (ret == GSASL_OK) {
-            _sx_nad_write(s, _sx_sasl_challenge(s, buf, buflen), 0);
-            free(buf);
-        }
-        else {
-            _sx_debug(ZONE, "gsasl_base64_to failed, no sasl for this conn; (%d): %s", ret, gsasl_strerror(ret));
-            _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_INCORRECT_ENCODING), 0);
-            if(buf != NULL) free(buf);
-        }
-
-        if(out != NULL) free(out);
-
-        return;
     }
 
-    if(out != NULL) free(out);
-
-    /* its over */
-    _sx_debug(ZONE, "sasl handshake failed; (%d): %s", ret, gsasl_strerror(ret));
-
-    /* !!! TODO XXX check ret and flag error appropriately */
-    _sx_nad_write(s, _sx_sasl_failure(s, _sasl_err_MALFORMED_REQUEST), 0);
+    /* the step has the buffer now */
+    _sx_sasl_step(s, p, sd, buf, buflen);
 }
 
 /** process handshake packets from the server */
@@ -545,6 +602,7 @@ static void _sx_sasl_server_process(sx_t s, sx_plugin_t p, Gsasl_session *sd, co
 /** main nad processor */
 static int _sx_sasl_process(sx_t s, sx_plugin_t p, nad_t nad) {
     Gsasl_session *sd = (Gsasl_session *) s->plugin_data[p->index];
+    _sx_sasl_sess_t sctx;
     int attr;
     char mech[128];
     sx_error_t sxe;
@@ -578,6 +636,13 @@ static int _sx_sasl_process(sx_t s, sx_plugin_t p, nad_t nad) {
         }
 #endif
 
+        /* still waiting on the app for the last step */
+        if(sd != NULL && (sctx = gsasl_session_hook_get(sd)) != NULL && sctx->step != NULL) {
+            _sx_debug(ZONE, "sasl step in progress, ignoring");
+            nad_free(nad);
+            return 0;
+        }
+
         /* auth */
         if(NAD_ENAME_L(nad, 0) == 4 && strncmp("auth", NAD_ENAME(nad, 0), NAD_ENAME_L(nad, 0)) == 0) {
             /* require mechanism */
@@ -701,6 +766,12 @@ static void _sx_sasl_free(sx_t s, sx_plugin_t p) {
     /* we need to clean up our per session context but keep sasl ctx */
     sctx = gsasl_session_hook_get(sd);
     if (sctx != NULL){
+        /* a step the app never finished, it made sure it's not running */
+        if(sctx->step != NULL) {
+            if(sctx->step->in != NULL) free(sctx->step->in);
+            if(sctx->step->out != NULL) free(sctx->step->out);
+            free(sctx->step);
+        }
         free(sctx);
         gsasl_session_hook_set(sd, (void *) NULL);
     }
@@ -69,7 +69,9 @@ static void _sx_server_notify_header(sx_t s, void *arg) {
     /* if they sent packets before the stream was established, process the now */
     if(jqueue_size(s->rnadq) > 0 && (s->state == state_STREAM || s->state == state_OPEN)) {
         _sx_debug(ZONE, "processing packets sent before stream, naughty them");
-        _sx_process_read(s, _sx_buffer_new(c, 0, NULL, NULL));
+        buf = _sx_buffer_new(c, 0, NULL, NULL);
+        _sx_process_read(s, buf);
+        _sx_buffer_free(buf);
     }
 }
 
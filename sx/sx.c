@@ -54,6 +54,9 @@ sx_t sx_new(sx_env_t env, int tag, sx_callback_t cb, void *arg) {
     s->wbufq = jqueue_new();
     s->rnadq = jqueue_new();
 
+    s->rbufmax = SX_READ_BUF_MAX;
+    s->rrawstart = -1;
+
     if(env != NULL) {
         s->plugin_data = (void **) calloc(1, sizeof(void *) * env->nplugins);
 
@@ -98,6 +101,12 @@ void sx_free(sx_t s) {
     if (s->wbufpending != NULL)
         _sx_buffer_free(s->wbufpending);
 
+    if(s->rbuf != NULL)
+        _sx_buffer_free(s->rbuf);
+
+    if(s->rframe != NULL)
+        _sx_buffer_free(s->rframe);
+
     while((nad = jqueue_pull(s->rnadq)) != NULL)
         nad_free(nad);
 
@@ -178,8 +187,19 @@ void _sx_reset(sx_t s) {
     temp.wnad = s->wnad;
     temp.rnad = s->rnad;
     temp.rbytesmax = s->rbytesmax;
+    temp.rbuf = s->rbuf;
+    temp.rbufsize = s->rbufsize;
+    temp.rbufwant = s->rbufwant;
+    temp.rbufmax = s->rbufmax;
+    temp.rbufavg = s->rbufavg;
+    temp.rreads = s->rreads;
+    temp.rallocs = s->rallocs;
+    temp.rwire = s->rwire;
+    temp.rstanzas = s->rstanzas;
     temp.plugin_data = s->plugin_data;
 
+    s->rbuf = NULL;
+
     s->reentry = 0;
 
     s->env = NULL;  /* we get rid of this, because we don't want plugin data to be freed */
@@ -206,6 +226,15 @@ void _sx_reset(sx_t s) {
     s->wnad = temp.wnad;
     s->rnad = temp.rnad;
     s->rbytesmax = temp.rbytesmax;
+    s->rbuf = temp.rbuf;
+    s->rbufsize = temp.rbufsize;
+    s->rbufwant = temp.rbufwant;
+    s->rbufmax = temp.rbufmax;
+    s->rbufavg = temp.rbufavg;
+    s->rreads = temp.rreads;
+    s->rallocs = temp.rallocs;
+    s->rwire = temp.rwire;
+    s->rstanzas = temp.rstanzas;
     s->plugin_data = temp.plugin_data;
 
     s->has_reset = 1;
@@ -30,6 +30,10 @@
 #include <expat.h>
 #include <util/util.h>
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
 /* jabberd2 Windows DLL */
 #ifndef JABBERD2_API
 # ifdef _WIN32
@@ -62,7 +66,8 @@ typedef enum {
     event_OPEN,             /* normal operation */
     event_PACKET,           /* got a packet */
     event_CLOSED,           /* its over */
-    event_ERROR             /* something's wrong */
+    event_ERROR,            /* something's wrong */
+    event_WRITEV            /* write these to the fd in one go (SX_WRITEV streams only) */
 } sx_event_t;
 
 /** connection states */
@@ -120,6 +125,46 @@ struct _sx_buf_st {
     void                    *notify_arg;
 };
 
+/** utility: buffers gathered for event_WRITEV */
+typedef struct _sx_iov_st *sx_iov_t;
+struct _sx_iov_st {
+    struct iovec   *iov;      /* buffers, in order */
+    int            iovcnt;    /* number of buffers */
+};
+
+/** stream flag: the app handles event_WRITEV, so when no plugin needs to
+  * transform outgoing data the whole write queue is handed over at once */
+#ifdef HAVE_SYS_UIO_H
+# define SX_WRITEV              (1<<7)
+#else
+# define SX_WRITEV              (0)
+#endif
+
+/** stream flag: nads read keep the xml they came from (nad_set_raw()), so
+  * the ones that get passed on unchanged don't have to be printed again */
+#define SX_NAD_RAW              (1<<8)
+
+/** read buffer starts at SX_READ_BUF_MIN and follows the size of the reads,
+  * up to the stream's rbufmax (SX_READ_BUF_MAX unless the app sets it) */
+#define SX_READ_BUF_MIN         (1024)
+#define SX_READ_BUF_MAX         (65536)
+
+/** gathered writes stop at this many buffers or bytes, whichever comes first */
+#define SX_WRITEV_MAX_IOV       (64)
+#define SX_WRITEV_MAX_BYTES     (65536)
+
+/** binary frames (see binary.c) are a 32 bit length and a type, then the payload */
+#define SX_BINARY_HEADER        (5)
+#define SX_BINARY_FRAME_MAX     (16777216)
+
+#define SX_BINARY_PING          (0)
+#define SX_BINARY_NAD           (1)
+#define SX_BINARY_CLOSE         (2)
+
+/** directions of a stream that have switched to binary frames */
+#define SX_BINARY_READ          (1<<0)
+#define SX_BINARY_WRITE         (1<<1)
+
 /* stream errors */
 #define stream_err_BAD_FORMAT               (0)
 #define stream_err_BAD_NAMESPACE_PREFIX     (1)
@@ -185,6 +230,9 @@ JABBERD2_API void                        sx_error_extended(sx_t s, int err, cons
 JABBERD2_API void                        sx_close(sx_t s);
 JABBERD2_API void                        sx_kill(sx_t s);
 
+/* what reading this stream has cost, for the disconnect log line */
+JABBERD2_API void                        sx_read_stats(sx_t s, char *buf, int len);
+
 
 /* helper functions */
 JABBERD2_API char*                       _sx_flags(sx_t s);
@@ -232,6 +280,13 @@ JABBERD2_API int                         _sx_nad_write(sx_t s, nad_t nad, int el
 /** sending raw data (internal) */
 JABBERD2_API void                        sx_raw_write(sx_t s, const char *buf, int len);
 
+/* binary framing */
+JABBERD2_API int                         _sx_binary_switch(sx_t s, nad_t nad);
+JABBERD2_API int                         _sx_binary_read(sx_t s, const char *data, int len);
+JABBERD2_API sx_buf_t                    _sx_binary_frame(int type, const char *data, int len);
+JABBERD2_API sx_buf_t                    _sx_binary_nad(nad_t nad, int elem);
+JABBERD2_API sx_buf_t                    _sx_binary_xml(const char *xml, int len);
+
 /** reset stream state without informing the app */
 JABBERD2_API void                        _sx_reset(sx_t s);
 
@@ -307,11 +362,37 @@ struct _sx_st {
 
     /* bytes read from socket */
     int                      rbytes;
-    int                      rbytes_total;
+    XML_Index                rbytes_total;
 
     /* read bytes maximum */
     int                      rbytesmax;
 
+    /* read buffer, kept between reads; its current and wanted size, cap, and smoothed read size */
+    sx_buf_t                 rbuf;
+    int                      rbufsize;
+    int                      rbufwant;
+    int                      rbufmax;
+    int                      rbufavg;
+
+    /* read events, read buffer allocations, bytes off the wire and stanzas, for stats */
+    int                      rreads;
+    int                      rallocs;
+    long long                rwire;
+    int                      rstanzas;
+
+    /* data being parsed and where it starts in the stream, and where the
+     * current top-level element started (-1 if we can't keep it raw) */
+    const char               *rchunk;
+    int                      rchunklen;
+    XML_Index                rchunkoff;
+    XML_Index                rrawstart;
+
+    /* directions that have gone over to binary frames, where the xml ended
+     * in the chunk the read switched in, and a frame we've only got part of */
+    int                      binary;
+    int                      rbinoff;
+    sx_buf_t                 rframe;
+
     /* current state */
     _sx_state_t              state;
 
@@ -0,0 +1,105 @@
+/*
+ * jid parsing throughput, with and without the stringprep cache.
+ *
+ * Not run as part of "make check", build it with "make bench_jid".
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stringprep.h>
+
+#include "util/util.h"
+
+#define JIDS        1000
+#define ROUNDS      200
+
+static double _now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/** a few users talking a lot, like the traffic through sm */
+static void _make_jids(char (*jids)[128], int n, int ascii)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        if(ascii)
+            snprintf(jids[i], sizeof(jids[i]), "User%d@Example.com/Home%d", i % 100, i % 7);
+        else
+            snprintf(jids[i], sizeof(jids[i]), "J\xc3\xbcrgen%d@\xc3\xa9xample.com/B\xc3\xbcro%d", i % 100, i % 7);
+}
+
+/** what every jid used to cost, stringprep on all three parts */
+static double _run_stringprep(char (*jids)[128], int n)
+{
+    char node[1024], domain[1024], resource[1024];
+    double start;
+    int r, i;
+
+    start = _now();
+    for(r = 0; r < ROUNDS; r++)
+        for(i = 0; i < n; i++) {
+            if(sscanf(jids[i], "%1023[^@]@%1023[^/]/%1023s", node, domain, resource) != 3)
+                abort();
+
+            stringprep_xmpp_nodeprep(node, 1024);
+            stringprep_nameprep(domain, 1024);
+            stringprep_xmpp_resourceprep(resource, 1024);
+        }
+
+    return n * ROUNDS / (_now() - start);
+}
+
+static double _run_jid_new(char (*jids)[128], int n)
+{
+    double start;
+    jid_t jid;
+    int r, i;
+
+    start = _now();
+    for(r = 0; r < ROUNDS; r++)
+        for(i = 0; i < n; i++) {
+            if((jid = jid_new(jids[i], -1)) == NULL)
+                abort();
+            jid_free(jid);
+        }
+
+    return n * ROUNDS / (_now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    char (*jids)[128];
+    struct jid_cache_stats_st stats;
+    int ascii;
+
+    jids = malloc(JIDS * sizeof(*jids));
+
+    for(ascii = 1; ascii >= 0; ascii--) {
+        _make_jids(jids, JIDS, ascii);
+
+        printf("%s jids:\n", ascii ? "ascii" : "non-ascii");
+
+        printf("  stringprep every part  %10.0f jids/sec\n", _run_stringprep(jids, JIDS));
+
+        jid_cache_max(0);
+        printf("  jid_new, no cache      %10.0f jids/sec\n", _run_jid_new(jids, JIDS));
+
+        jid_cache_max(JID_CACHE_MAX);
+        printf("  jid_new, cache         %10.0f jids/sec\n", _run_jid_new(jids, JIDS));
+
+        jid_cache_stats(&stats);
+        printf("  %lu fast, %lu hits, %lu misses, %lu evicted, %d cached\n", stats.fast, stats.hits, stats.misses, stats.evicted, stats.cached);
+    }
+
+    free(jids);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Stanzas per second through nad_parse -> nad_print -> nad_free, with the
+ * nad cache switched off and on, single threaded and from several threads
+ * at once.
+ *
+ * Not run as part of "make check", build it with "make bench_nad".
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "util/util.h"
+
+#define STANZAS 200000
+#define THREADS 4
+
+static const char *stanzas[] = {
+    "<message xmlns='jabber:client' to='romeo@example.net' from='juliet@example.com/balcony' type='chat' id='ktx72v49'>"
+        "<body>Art thou not Romeo, and a Montague?</body>"
+        "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+    "</message>",
+
+    "<presence xmlns='jabber:client' from='juliet@example.com/balcony'>"
+        "<show>away</show><status>be right back</status><priority>0</priority>"
+        "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='http://psi-im.org' ver='q07IKJEyjvHSyhy//CH0CxmKi8w='/>"
+    "</presence>",
+
+    "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='sm' from='c2s'>"
+        "<sm xmlns='http://jabberd.jabberstudio.org/ns/session/1.0' sm='ca3ba8d2' c2s='1a2b3c4d' action='started'/>"
+        "<iq xmlns='jabber:client' type='get' id='roster_1'><query xmlns='jabber:iq:roster'/></iq>"
+    "</route>",
+};
+
+static double _now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *_bench_run(void *arg)
+{
+    unsigned int i, n = sizeof(stanzas) / sizeof(stanzas[0]);
+    const char *xml;
+    int len;
+    nad_t nad;
+
+    for(i = 0; i < STANZAS; i++) {
+        nad = nad_parse(stanzas[i % n], 0);
+        nad_print(nad, 0, &xml, &len);
+        nad_free(nad);
+    }
+
+    return NULL;
+}
+
+static double _bench(int threads)
+{
+    double start;
+#ifdef HAVE_PTHREAD
+    pthread_t tid[THREADS];
+    int i;
+
+    start = _now();
+    for(i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, _bench_run, NULL);
+    for(i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+#else
+    start = _now();
+    _bench_run(NULL);
+    threads = 1;
+#endif
+
+    return (double) STANZAS * threads / (_now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    static const int threads[] = { 1, THREADS };
+    struct nad_cache_stats_st stats;
+    double off, on;
+    unsigned int t;
+
+    for(t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        nad_cache_max(0);
+        off = _bench(threads[t]);
+
+        nad_cache_max(NAD_CACHE_MAX);
+        on = _bench(threads[t]);
+
+        printf("%d thread(s): no cache %9.0f stanzas/s, cache %9.0f stanzas/s (%+.1f%%)\n",
+               threads[t], off, on, (on - off) * 100 / off);
+    }
+
+    nad_cache_stats(&stats);
+    printf("cache: %lu hits, %lu misses, %lu recycled, %lu dropped\n",
+           stats.hits, stats.misses, stats.recycled, stats.dropped);
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * routes per second from a component through the router to another
+ * component, with xml and with binary framing on both links. the streams
+ * are joined up in memory, so this is only the cost of sx and the nads.
+ *
+ * Not run as part of "make check", build it with "make bench_route".
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "sx/sx.h"
+#include "sx/plugins.h"
+
+#define ROUTES      200000
+#define BATCH       64
+
+static const char *routes[] = {
+    "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='c2s' from='sm'>"
+        "<message xmlns='jabber:client' xmlns:sm='http://jabberd.jabberstudio.org/ns/session/1.0' to='romeo@example.net/orchard' from='juliet@example.com/balcony' type='chat' id='ktx72v49' sm:c2s='1a2b3c4d' sm:sm='ca3ba8d2'>"
+            "<body>Art thou not Romeo, and a Montague?</body>"
+            "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+        "</message>"
+    "</route>",
+
+    "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='c2s' from='sm'>"
+        "<presence xmlns='jabber:client' xmlns:sm='http://jabberd.jabberstudio.org/ns/session/1.0' to='romeo@example.net/orchard' from='juliet@example.com/balcony' sm:c2s='1a2b3c4d' sm:sm='ca3ba8d2'>"
+            "<show>away</show><status>be right back</status><priority>0</priority>"
+            "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='http://psi-im.org' ver='q07IKJEyjvHSyhy//CH0CxmKi8w='/>"
+        "</presence>"
+    "</route>",
+
+    "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='sm' from='c2s'>"
+        "<iq xmlns='jabber:client' xmlns:sm='http://jabberd.jabberstudio.org/ns/session/1.0' type='get' id='roster_1' sm:c2s='1a2b3c4d' sm:sm='ca3ba8d2'><query xmlns='jabber:iq:roster'/></iq>"
+    "</route>",
+};
+
+/** one direction of a connection */
+typedef struct wire_st {
+    char        *data;
+    int         len, size;
+    long        total;
+} *wire_t;
+
+/** one end of a connection, and the router end it's passing packets to */
+typedef struct end_st {
+    wire_t      in, out;
+    sx_t        s;
+    sx_t        forward;
+    int         packets;
+} *end_t;
+
+static double _now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int _bench_callback(sx_t s, sx_event_t e, void *data, void *arg)
+{
+    end_t end = (end_t) arg;
+    sx_buf_t buf = (sx_buf_t) data;
+    int len;
+
+    switch(e) {
+        case event_READ:
+            len = end->in->len < buf->len ? end->in->len : buf->len;
+            memcpy(buf->data, end->in->data, len);
+            memmove(end->in->data, end->in->data + len, end->in->len - len);
+            end->in->len -= len;
+            buf->len = len;
+            return len;
+
+        case event_WRITE:
+            if(end->out->len + buf->len > end->out->size) {
+                end->out->size = (end->out->len + buf->len) * 2;
+                end->out->data = (char *) realloc(end->out->data, end->out->size);
+            }
+            memcpy(end->out->data + end->out->len, buf->data, buf->len);
+            end->out->len += buf->len;
+            end->out->total += buf->len;
+            return buf->len;
+
+        case event_PACKET:
+            end->packets++;
+            if(end->forward != NULL)
+                sx_nad_write(end->forward, (nad_t) data);
+            else
+                nad_free((nad_t) data);
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+/** no sasl here, the stream is authenticated as soon as it's up */
+static void _bench_stream(sx_t s, sx_plugin_t p)
+{
+    if(s->state < state_OPEN)
+        sx_auth(s, "bench", "bench");
+}
+
+static int _bench_auth_init(sx_env_t env, sx_plugin_t p, va_list args)
+{
+    p->stream = _bench_stream;
+    return 0;
+}
+
+/** move everything that's waiting across */
+static void _pump(end_t *ends, int n)
+{
+    int i, busy;
+
+    do {
+        busy = 0;
+        for(i = 0; i < n; i++) {
+            if(ends[i]->s->want_write) {
+                sx_can_write(ends[i]->s);
+                busy = 1;
+            }
+            if(ends[i]->in->len > 0) {
+                ends[i]->s->want_read = 1;
+                sx_can_read(ends[i]->s);
+                busy = 1;
+            }
+        }
+    } while(busy);
+}
+
+static double _run(sx_env_t env, int binary)
+{
+    struct wire_st w[4];
+    struct end_st sm, rsm, rc2s, c2s;
+    end_t ends[4] = { &sm, &rsm, &rc2s, &c2s };
+    unsigned int i, n = sizeof(routes) / sizeof(routes[0]);
+    double start, rate;
+
+    memset(w, 0, sizeof(w));
+    memset(ends[0], 0, sizeof(struct end_st));
+    memset(ends[1], 0, sizeof(struct end_st));
+    memset(ends[2], 0, sizeof(struct end_st));
+    memset(ends[3], 0, sizeof(struct end_st));
+
+    /* sm <-> router <-> c2s */
+    sm.out = rsm.in = &w[0];
+    rsm.out = sm.in = &w[1];
+    c2s.out = rc2s.in = &w[2];
+    rc2s.out = c2s.in = &w[3];
+
+    sm.s = sx_new(env, 1, _bench_callback, &sm);
+    rsm.s = sx_new(env, 2, _bench_callback, &rsm);
+    rc2s.s = sx_new(env, 3, _bench_callback, &rc2s);
+    c2s.s = sx_new(env, 4, _bench_callback, &c2s);
+
+    rsm.forward = rc2s.s;
+
+    sx_server_init(rsm.s, SX_BINARY_OFFER | SX_NAD_RAW);
+    sx_server_init(rc2s.s, SX_BINARY_OFFER | SX_NAD_RAW);
+    sx_client_init(sm.s, binary ? SX_BINARY_OFFER : 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(c2s.s, binary ? SX_BINARY_OFFER : 0, NULL, NULL, NULL, "1.0");
+
+    _pump(ends, 4);
+
+    if(binary && (sm.s->binary != (SX_BINARY_READ | SX_BINARY_WRITE) || c2s.s->binary != (SX_BINARY_READ | SX_BINARY_WRITE))) {
+        fprintf(stderr, "binary framing wasn't negotiated\n");
+        exit(1);
+    }
+
+    /* just the routes from here */
+    c2s.packets = 0;
+    w[0].total = 0;
+
+    start = _now();
+    for(i = 0; i < ROUTES; i++) {
+        sx_nad_write(sm.s, nad_parse(routes[i % n], 0));
+        if(i % BATCH == BATCH - 1)
+            _pump(ends, 4);
+    }
+    _pump(ends, 4);
+    rate = ROUTES / (_now() - start);
+
+    if(c2s.packets != ROUTES) {
+        fprintf(stderr, "%d of %d routes arrived\n", c2s.packets, ROUTES);
+        exit(1);
+    }
+
+    printf("  %10ld bytes/route from sm\n", w[0].total / ROUTES);
+
+    for(i = 0; i < 4; i++) {
+        sx_free(ends[i]->s);
+        free(w[i].data);
+    }
+
+    return rate;
+}
+
+int main(int argc, char **argv)
+{
+    sx_env_t env;
+
+    env = sx_env_new();
+    sx_env_plugin(env, _bench_auth_init);
+    sx_env_plugin(env, sx_binary_init);
+
+    printf("xml framing:\n");
+    printf("  %10.0f routes/sec\n", _run(env, 0));
+
+    printf("binary framing:\n");
+    printf("  %10.0f routes/sec\n", _run(env, 1));
+
+    sx_env_free(env);
+
+    return 0;
+}
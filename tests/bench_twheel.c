@@ -0,0 +1,103 @@
+/*
+ * Cost of the periodic idle check: a full scan of the sessions hash
+ * against per-session timers on the wheel.
+ *
+ * Sessions go idle uniformly over a 10 second window. The scan walks
+ * every session once per second, the wheel fires only the sessions
+ * that are due during that second, re-arming each one for another
+ * 10 seconds.
+ *
+ * Not run as part of "make check", build it with "make bench_twheel".
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "util/util.h"
+
+#define IDLE_MS 10000
+
+typedef struct bsess_st {
+    char                    key[16];
+    time_t                  last_activity;
+    struct twheel_timer_st  timer;
+} *bsess_t;
+
+static int expired;
+
+static uint64_t _bench_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void _bench_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    expired++;
+    twheel_add(w, t, IDLE_MS);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 10000, 100000, 1000000 };
+    unsigned int s, i, n;
+    uint64_t start, scan_us, wheel_us, end;
+    bsess_t sess, bs;
+    time_t now;
+    twheel_t w;
+    xht h;
+
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n = sizes[s];
+        sess = calloc(n, sizeof(struct bsess_st));
+        h = xhash_new(1023);
+        w = twheel_new(10);
+
+        now = time(NULL);
+        for(i = 0; i < n; i++) {
+            bs = &sess[i];
+            snprintf(bs->key, sizeof(bs->key), "%u", i);
+            bs->last_activity = now - (i % 10);
+            xhash_put(h, bs->key, bs);
+
+            twheel_timer_init(&bs->timer, _bench_timer, bs);
+            twheel_add(w, &bs->timer, (int) ((uint64_t) i * IDLE_MS / n));
+        }
+
+        /* one pass of the old time check */
+        start = _bench_us();
+        expired = 0;
+        if(xhash_iter_first(h))
+            do {
+                xhash_iter_get(h, NULL, NULL, (void **) &bs);
+                if(now > bs->last_activity + 5)
+                    expired++;
+            } while(xhash_iter_next(h));
+        scan_us = _bench_us() - start;
+
+        /* one second of the wheel, only counting the time spent in it */
+        expired = 0;
+        wheel_us = 0;
+        end = twheel_clock() + 1000;
+        while(twheel_clock() < end) {
+            start = _bench_us();
+            twheel_run(w);
+            wheel_us += _bench_us() - start;
+
+            usleep(twheel_timeout(w, 10) * 1000);
+        }
+
+        printf("%8u sessions: scan %8llu us/check, wheel %8llu us/s (%d timers fired)\n",
+               n, (unsigned long long) scan_us, (unsigned long long) wheel_us, expired);
+
+        twheel_free(w);
+        xhash_free(h);
+        free(sess);
+    }
+
+    return 0;
+}
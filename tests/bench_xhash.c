@@ -0,0 +1,60 @@
+/*
+ * xhash lookup latency against table size.
+ *
+ * Not run as part of "make check", build it with "make bench_xhash".
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define LOOKUPS 2000000
+
+static double _now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+    char (*keys)[32];
+    unsigned int i, s, n;
+    double start, elapsed;
+    xht h;
+
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n = sizes[s];
+        keys = malloc(n * sizeof(*keys));
+
+        /* same initial size sm uses for its users and sessions */
+        h = xhash_new(401);
+
+        start = _now();
+        for(i = 0; i < n; i++) {
+            snprintf(keys[i], sizeof(keys[i]), "user%u@example.com", i);
+            xhash_put(h, keys[i], keys[i]);
+        }
+        elapsed = _now() - start;
+        printf("%8u entries: insert %7.1f ns/op", n, elapsed * 1e9 / n);
+
+        start = _now();
+        for(i = 0; i < LOOKUPS; i++)
+            if(xhash_get(h, keys[(i * 7919) % n]) == NULL)
+                abort();
+        elapsed = _now() - start;
+        printf(", lookup %7.1f ns/op\n", elapsed * 1e9 / LOOKUPS);
+
+        xhash_free(h);
+        free(keys);
+    }
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define PREFIXES 2000
+
+static unsigned char keys[PREFIXES][IPTRIE_KEYLEN];
+static int lens[PREFIXES];
+static int live[PREFIXES];
+
+/** the longest live prefix of key, the slow way */
+static int _longest(const unsigned char *key) {
+    int i, b, best = -1;
+
+    for(i = 0; i < PREFIXES; i++) {
+        if(!live[i] || (best >= 0 && lens[i] <= lens[best]))
+            continue;
+
+        for(b = 0; b < lens[i]; b++)
+            if(((key[b / 8] ^ keys[i][b / 8]) >> (7 - b % 8)) & 1)
+                break;
+
+        if(b == lens[i])
+            best = i;
+    }
+
+    return best;
+}
+
+static void _random_key(unsigned char *key) {
+    int i;
+
+    /* few distinct top bytes, so prefixes nest and share paths */
+    for(i = 0; i < IPTRIE_KEYLEN; i++)
+        key[i] = rand() & (i < 2 ? 0x03 : 0xff);
+}
+
+START_TEST (check_iptrie_match)
+{
+    iptrie_t t = iptrie_new();
+    unsigned char key[IPTRIE_KEYLEN];
+    int i, j, want, bits, n = 0;
+    void *val;
+
+    srand(1);
+
+    for(i = 0; i < PREFIXES; i++) {
+        _random_key(keys[i]);
+        lens[i] = rand() % 129;
+
+        /* only compare against what the trie can tell apart */
+        for(j = lens[i]; j < IPTRIE_KEYLEN * 8; j++)
+            keys[i][j / 8] &= ~(0x80 >> (j % 8));
+
+        live[i] = 1;
+        for(j = 0; j < i; j++)
+            if(live[j] && lens[j] == lens[i] && memcmp(keys[j], keys[i], IPTRIE_KEYLEN) == 0)
+                live[j] = 0;
+
+        iptrie_put(t, keys[i], lens[i], &keys[i]);
+    }
+
+    for(i = 0; i < PREFIXES; i++)
+        if(live[i])
+            n++;
+
+    ck_assert_int_eq (n, iptrie_count(t));
+
+    for(i = 0; i < PREFIXES * 2; i++) {
+        if(i < PREFIXES)
+            memcpy(key, keys[i], IPTRIE_KEYLEN);
+        else
+            _random_key(key);
+
+        want = _longest(key);
+        val = iptrie_match(t, key, &bits);
+
+        if(want < 0)
+            ck_assert_ptr_eq (NULL, val);
+        else {
+            ck_assert_ptr_eq (&keys[want], val);
+            ck_assert_int_eq (lens[want], bits);
+        }
+    }
+
+    /* take half of them out, and everything else still has to be found */
+    for(i = 0; i < PREFIXES; i += 2) {
+        if(!live[i])
+            continue;
+
+        ck_assert_ptr_eq (&keys[i], iptrie_zap(t, keys[i], lens[i]));
+        ck_assert_ptr_eq (NULL, iptrie_zap(t, keys[i], lens[i]));
+
+        live[i] = 0;
+        n--;
+    }
+
+    ck_assert_int_eq (n, iptrie_count(t));
+
+    for(i = 1; i < PREFIXES; i += 2) {
+        if(live[i])
+            ck_assert_ptr_eq (&keys[i], iptrie_get(t, keys[i], lens[i]));
+
+        want = _longest(keys[i]);
+        ck_assert_ptr_eq (want < 0 ? NULL : &keys[want], iptrie_match(t, keys[i], NULL));
+    }
+
+    iptrie_free(t, NULL);
+}
+END_TEST
+
+START_TEST (check_iptrie_access)
+{
+    access_t access = access_new(0);
+
+    access_deny(access, "10.1.0.0", "16");
+    access_deny(access, "192.168.1.0", "255.255.255.0");
+    access_deny(access, "2001:db8::", "32");
+    access_allow(access, "10.1.2.0", "24");
+    access_deny(access, "172.16.0.1", NULL);
+
+    ck_assert_int_eq (4, access->ndeny);
+
+    /* allow,deny */
+    ck_assert_int_eq (0, access_check(access, "10.1.3.4"));
+    ck_assert_int_eq (1, access_check(access, "10.1.2.3"));
+    ck_assert_int_eq (1, access_check(access, "10.2.0.1"));
+    ck_assert_int_eq (0, access_check(access, "192.168.1.200"));
+    ck_assert_int_eq (1, access_check(access, "192.168.2.1"));
+    ck_assert_int_eq (0, access_check(access, "172.16.0.1"));
+    ck_assert_int_eq (1, access_check(access, "172.16.0.2"));
+    ck_assert_int_eq (0, access_check(access, "2001:db8:1::1"));
+    ck_assert_int_eq (1, access_check(access, "2001:db9::1"));
+
+    /* IPv4 rules cover mapped addresses */
+    ck_assert_int_eq (0, access_check(access, "::ffff:10.1.3.4"));
+
+    ck_assert_int_eq (0, access_check(access, "not an address"));
+
+    access->order = 1;
+
+    /* deny,allow */
+    ck_assert_int_eq (0, access_check(access, "10.1.2.3"));
+    ck_assert_int_eq (0, access_check(access, "10.2.0.1"));
+
+    access_free(access);
+}
+END_TEST
+
+START_TEST (check_iptrie_rate_table)
+{
+    rate_table_t rtt = rate_table_new(2, 60, 60, 24, 64);
+
+    ck_assert_int_eq (1, rate_table_check(rtt, "10.0.0.1"));
+    ck_assert_int_eq (1, rate_table_check(rtt, "10.0.0.2"));
+
+    /* same /24 */
+    ck_assert_int_eq (0, rate_table_check(rtt, "10.0.0.3"));
+    ck_assert_int_eq (1, rate_table_check(rtt, "10.0.1.1"));
+
+    /* same /64 */
+    ck_assert_int_eq (1, rate_table_check(rtt, "2001:db8::1"));
+    ck_assert_int_eq (1, rate_table_check(rtt, "2001:db8::2:1"));
+    ck_assert_int_eq (0, rate_table_check(rtt, "2001:db8::3:1"));
+    ck_assert_int_eq (1, rate_table_check(rtt, "2001:db8:0:1::1"));
+
+    rate_table_free(rtt);
+}
+END_TEST
+
+Suite* iptrie_suite (void)
+{
+    Suite *s = suite_create ("iptrie");
+
+    TCase *tc_iptrie = tcase_create ("Prefixes");
+    tcase_add_test (tc_iptrie, check_iptrie_match);
+    tcase_add_test (tc_iptrie, check_iptrie_access);
+    tcase_add_test (tc_iptrie, check_iptrie_rate_table);
+    suite_add_tcase (s, tc_iptrie);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = iptrie_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
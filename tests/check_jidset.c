@@ -0,0 +1,117 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define JIDS 500
+
+START_TEST (check_jidset_order)
+{
+    jidset_t set = jidset_new();
+    jid_t jids[JIDS], jid, next;
+    char buf[64];
+    int i, n;
+
+    ck_assert_int_eq (0, jidset_count(set));
+    ck_assert_ptr_eq (NULL, jidset_iter_first(set));
+
+    for(i = 0; i < JIDS; i++) {
+        snprintf(buf, sizeof(buf), "room%d@conference.example.com/nick", i);
+        jids[i] = jid_new(buf, -1);
+
+        ck_assert_int_eq (1, jidset_add(set, jids[i]));
+    }
+
+    /* no dups */
+    for(i = 0; i < JIDS; i++)
+        ck_assert_int_eq (0, jidset_add(set, jids[i]));
+
+    ck_assert_int_eq (JIDS, jidset_count(set));
+
+    /* full jids, not bare ones */
+    jid = jid_new("room1@conference.example.com", -1);
+    ck_assert_int_eq (0, jidset_has(set, jid));
+    jid_free(jid);
+
+    /* take out every third one, some of them in the middle of a walk */
+    for(i = 0; i < JIDS; i += 3)
+        ck_assert_int_eq (1, jidset_zap(set, jids[i]));
+    ck_assert_int_eq (0, jidset_zap(set, jids[0]));
+
+    for(i = 0, jid = jidset_iter_first(set); jid != NULL; jid = jidset_iter_next(set)) {
+        while(i % 3 == 0)
+            i++;
+
+        ck_assert_int_eq (0, jid_compare_full(jid, jids[i]));
+        ck_assert_ptr_ne (jids[i], jid);
+
+        if(i % 3 == 1)
+            jidset_zap(set, jid);
+
+        i++;
+    }
+    ck_assert_int_eq (JIDS, i);
+
+    for(i = 0, n = 0; i < JIDS; i++) {
+        ck_assert_int_eq (i % 3 == 2, jidset_has(set, jids[i]));
+        n += i % 3 == 2;
+    }
+    ck_assert_int_eq (n, jidset_count(set));
+
+    /* back in, at the end */
+    jidset_add(set, jids[0]);
+    for(jid = jidset_iter_first(set); (next = jidset_iter_next(set)) != NULL; jid = next);
+    ck_assert_int_eq (0, jid_compare_full(jid, jids[0]));
+
+    jidset_clear(set);
+    ck_assert_int_eq (0, jidset_count(set));
+    ck_assert_int_eq (0, jidset_has(set, jids[2]));
+    ck_assert_int_eq (1, jidset_add(set, jids[2]));
+
+    jidset_free(set);
+
+    for(i = 0; i < JIDS; i++)
+        jid_free(jids[i]);
+}
+END_TEST
+
+START_TEST (check_jidset_null)
+{
+    jid_t jid = jid_new("user@example.com/res", -1);
+
+    ck_assert_int_eq (0, jidset_has(NULL, jid));
+    ck_assert_int_eq (0, jidset_count(NULL));
+    ck_assert_ptr_eq (NULL, jidset_iter_first(NULL));
+
+    jidset_free(NULL);
+    jid_free(jid);
+}
+END_TEST
+
+Suite* jidset_suite (void)
+{
+    Suite *s = suite_create ("jidset");
+
+    TCase *tc_jidset = tcase_create ("Sets");
+    tcase_add_test (tc_jidset, check_jidset_order);
+    tcase_add_test (tc_jidset, check_jidset_null);
+    suite_add_tcase (s, tc_jidset);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = jidset_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
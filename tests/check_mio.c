@@ -0,0 +1,98 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "mio/mio.h"
+
+/* the app hands over this much per write action, like sx does a buffer at a
+ * time. all of it fits in the socket buffer, so the socket never stops being
+ * writable and edge triggered mode gets just the one edge for it */
+#define CHUNK   1024
+#define TOTAL   (CHUNK * 16)
+
+static int written;
+
+static int _check_writer(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    char buf[CHUNK];
+    int len;
+
+    if(a != action_WRITE)
+        return 0;
+
+    if(written >= TOTAL)
+        return 0;
+
+    memset(buf, 'x', sizeof(buf));
+    len = write(fd->fd, buf, TOTAL - written < CHUNK ? TOTAL - written : CHUNK);
+    if(len > 0)
+        written += len;
+
+    /* more to go */
+    return written < TOTAL;
+}
+
+static void _check_queued_writes(int flags) {
+    mio_t m;
+    mio_fd_t fd;
+    int sv[2], i;
+
+    fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0);
+
+    m = mio_new_ex(64, 0, flags);
+    fail_if(m == NULL);
+
+    written = 0;
+
+    /* nobody reads the other end, so no wakeups come from there */
+    fd = mio_register(m, sv[0], _check_writer, NULL);
+    mio_write(m, fd);
+
+    for(i = 0; i < 64 && written < TOTAL; i++)
+        mio_run(m, 10);
+
+    ck_assert_int_eq(TOTAL, written);
+
+    mio_close(m, fd);
+    mio_free(m);
+    close(sv[1]);
+}
+
+START_TEST (check_mio_write_level)
+{
+    _check_queued_writes(0);
+}
+END_TEST
+
+START_TEST (check_mio_write_edge)
+{
+    _check_queued_writes(MIO_EDGE_TRIGGERED);
+}
+END_TEST
+
+Suite* mio_suite (void)
+{
+    Suite *s = suite_create ("mio");
+
+    TCase *tc_write = tcase_create ("Queued writes");
+    tcase_add_test (tc_write, check_mio_write_level);
+    tcase_add_test (tc_write, check_mio_write_edge);
+    suite_add_tcase (s, tc_write);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = mio_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
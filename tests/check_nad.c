@@ -199,6 +199,238 @@ START_TEST (check_leaf_path)
 }
 END_TEST
 
+START_TEST (check_cache_reuse)
+{
+    const char *buf, *cbuf;
+    char *ser;
+    int len, clen, slen;
+    struct nad_cache_stats_st before, after;
+    nad_t nad, copy;
+
+    nad_cache_max(NAD_CACHE_MAX);
+    nad_cache_flush();
+
+    /* a big one goes in, a small one must come out of it clean */
+    nad_free(nad_parse(nadtxt[1], 0));
+
+    nad_cache_stats(&before);
+    nad = nad_parse(nadtxt[2], 0);
+    nad_cache_stats(&after);
+    ck_assert(after.hits > before.hits);
+
+    ck_assert(nad_find_elem(nad, 0, -1, "body", 1) > 0);
+    ck_assert(nad_find_attr(nad, 0, -1, "from", "blip@blip.pl/blip") >= 0);
+
+    /* copies and deserialized nads land on recycled arrays too */
+    nad_free(nad_parse(nadtxt[1], 0));
+    copy = nad_copy(nad);
+    nad_print(copy, 0, &cbuf, &clen);
+    nad_print(nad, 0, &buf, &len);
+    ck_assert_int_eq(len, clen);
+    fail_if(strncmp(buf, cbuf, len));
+    nad_free(copy);
+
+    /* the raw xml doesn't travel, compare it built up */
+    NAD_DIRTY(nad);
+    nad_print(nad, 0, &buf, &len);
+
+    nad_serialize(nad, &ser, &slen);
+    copy = nad_deserialize(ser, slen);
+    free(ser);
+    nad_print(copy, 0, &cbuf, &clen);
+    ck_assert_int_eq(len, clen);
+    fail_if(strncmp(buf, cbuf, len));
+    nad_free(copy);
+
+    nad_free(nad);
+
+    /* switched off, nothing is kept */
+    nad_cache_flush();
+    nad_cache_max(0);
+    nad_cache_stats(&before);
+    nad_free(nad_parse(nadtxt[0], 0));
+    nad_cache_stats(&after);
+    ck_assert(after.recycled == before.recycled);
+    ck_assert_int_eq(0, after.cached[0] + after.cached[1] + after.cached[2] + after.cached[3]);
+
+    nad_cache_max(NAD_CACHE_MAX);
+}
+END_TEST
+
+START_TEST (check_shared)
+{
+    const char *buf, *buf2;
+    int len, len2, clen;
+    nad_t nad, shared, mine;
+
+    nad = nad_parse(nadtxt[0], 0);
+
+    /* shared nads print once */
+    shared = nad_ref(nad);
+    ck_assert(shared == nad);
+    nad_print(nad, 0, &buf, &len);
+    clen = nad->ccur;
+    nad_print(shared, 0, &buf2, &len2);
+    ck_assert_int_eq(len, len2);
+    ck_assert(buf == buf2);
+    ck_assert_int_eq(clen, nad->ccur);
+
+    /* changing it gets you your own */
+    mine = nad_unshare(shared);
+    ck_assert(mine != nad);
+    ck_assert_int_eq(1, nad->refs);
+    nad_set_attr(mine, 0, -1, "type", "unavailable", 0);
+    nad_print(mine, 0, &buf2, &len2);
+    ck_assert(len2 > len);
+    nad_free(mine);
+
+    /* and the last one left can change it in place */
+    mine = nad_unshare(nad);
+    ck_assert(mine == nad);
+    nad_set_attr(mine, 0, -1, "type", "unavailable", 0);
+    nad_print(mine, 0, &buf2, &len2);
+    ck_assert(len2 > len);
+
+    nad_free(mine);
+}
+END_TEST
+
+START_TEST (check_raw)
+{
+    const char *buf;
+    int len;
+    const char *xml = "<?xml version='1.0'?>\n<iq type='get' id='1'><query xmlns='jabber:iq:version'/></iq>\n";
+    nad_t nad, copy;
+
+    /* unchanged, it prints as it was parsed */
+    nad = nad_parse(xml, 0);
+    nad_print(nad, 0, &buf, &len);
+    ck_assert_int_eq(strlen(xml) - 23, len);
+    fail_if(strncmp(xml + 22, buf, len));
+
+    copy = nad_copy(nad);
+    nad_print(copy, 0, &buf, &len);
+    fail_if(strncmp(xml + 22, buf, len));
+    nad_free(copy);
+
+    /* changed, it doesn't */
+    nad_set_attr(nad, 0, -1, "type", "result", 0);
+    nad_print(nad, 0, &buf, &len);
+    ck_assert(len == strlen(xml) - 20);
+    fail_if(strncmp("<iq ", buf, 4));
+
+    nad_free(nad);
+}
+END_TEST
+
+static nad_t _session_route(const char *to, const char *c2s, const char *show) {
+    char xml[512];
+
+    snprintf(xml, sizeof(xml),
+        "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='c2s' from='sm'>"
+            "<presence xmlns='jabber:client' xmlns:sm='http://jabberd.jabberstudio.org/ns/session/1.0' to='%s' from='a@b/c' sm:c2s='%s' sm:sm='1'>"
+                "<show>%s</show>"
+            "</presence>"
+        "</route>", to, c2s, show);
+
+    return nad_parse(xml, 0);
+}
+
+static int expanded;
+
+static void _check_unicast(nad_t nad, void *arg) {
+    char want[16];
+    int ns;
+
+    snprintf(want, sizeof(want), "u%d@d/r", ++expanded);
+    ck_assert_int_eq (-1, nad_find_attr(nad, 0, -1, "type", NULL));
+    fail_if (nad_find_attr(nad, 1, -1, "to", want) < 0);
+
+    snprintf(want, sizeof(want), "s%d", expanded);
+    ns = nad_find_namespace(nad, 1, "http://jabberd.jabberstudio.org/ns/session/1.0", NULL);
+    fail_if (ns < 0 || nad_find_attr(nad, 1, ns, "c2s", want) < 0);
+
+    nad_free(nad);
+}
+
+START_TEST (check_multicast)
+{
+    nad_t mc, u2, u3, parsed;
+    const char *buf;
+    int addrs;
+
+    mc = _session_route("u1@d/r", "s1", "away");
+    u2 = _session_route("u2@d/r", "s2", "away");
+    u3 = _session_route("u3@d/r", "s3", "dnd");
+
+    fail_unless (stanza_multicast_match(mc, mc->ecur, u2));
+    fail_if (stanza_multicast_match(mc, mc->ecur, u3));
+
+    addrs = stanza_multicast_new(mc);
+    fail_unless (stanza_multicast_match(mc, addrs, u2));
+    stanza_multicast_add(mc, addrs, u2);
+    fail_if (stanza_multicast_match(mc, addrs, u3));
+
+    /* it has to survive the trip through the router */
+    nad_print(mc, 0, &buf, &addrs);
+    parsed = nad_parse(buf, addrs);
+    fail_if (stanza_multicast_addresses(parsed) < 0);
+
+    expanded = 0;
+    ck_assert_int_eq (2, stanza_multicast_expand(parsed, _check_unicast, NULL));
+    ck_assert_int_eq (2, expanded);
+
+    nad_free(mc);
+    nad_free(u2);
+    nad_free(u3);
+}
+END_TEST
+
+START_TEST (check_serialize)
+{
+    nad_t nad, copy;
+    const char *buf, *cbuf;
+    char *ser;
+    int len, clen, slen, i, elem;
+
+    nad = nad_parse(nadtxt[_i], 0);
+    NAD_DIRTY(nad);
+    nad_print(nad, 0, &buf, &len);
+
+    nad_serialize(nad, &ser, &slen);
+    copy = nad_deserialize(ser, slen);
+    fail_if(copy == NULL);
+    nad_print(copy, 0, &cbuf, &clen);
+    ck_assert_int_eq(len, clen);
+    fail_if(strncmp(buf, cbuf, len));
+
+    /* it can be added to like one that was parsed */
+    elem = nad_append_elem(copy, -1, "extra", 1);
+    nad_append_cdata(copy, "x", 1, 2);
+    ck_assert_int_eq(0, copy->elems[elem].parent);
+    nad_free(copy);
+
+    /* short, long, or with any one byte changed, it's either rejected or still sane */
+    ck_assert_ptr_eq(NULL, nad_deserialize(ser, slen - 1));
+    ck_assert_ptr_eq(NULL, nad_deserialize(ser, 10));
+    ser[3]++;
+    ck_assert_ptr_eq(NULL, nad_deserialize(ser, slen));
+    ser[3]--;
+
+    for(i = 0; i < slen; i++) {
+        ser[i] ^= 0x80;
+        if((copy = nad_deserialize(ser, slen)) != NULL) {
+            nad_print(copy, 0, &cbuf, &clen);
+            nad_free(copy);
+        }
+        ser[i] ^= 0x80;
+    }
+
+    free(ser);
+    nad_free(nad);
+}
+END_TEST
+
 Suite* s2s_wrapper_suite (void)
 {
     Suite *s = suite_create ("s2s incoming packet wrapper");
@@ -211,6 +443,26 @@ Suite* s2s_wrapper_suite (void)
     tcase_add_test (tc_nad_find_elem_path, check_leaf_path);
     suite_add_tcase (s, tc_nad_find_elem_path);
 
+    TCase *tc_nad_shared = tcase_create ("shared nads");
+    tcase_add_test (tc_nad_shared, check_shared);
+    suite_add_tcase (s, tc_nad_shared);
+
+    TCase *tc_nad_raw = tcase_create ("raw xml");
+    tcase_add_test (tc_nad_raw, check_raw);
+    suite_add_tcase (s, tc_nad_raw);
+
+    TCase *tc_multicast = tcase_create ("multicast routes");
+    tcase_add_test (tc_multicast, check_multicast);
+    suite_add_tcase (s, tc_multicast);
+
+    TCase *tc_nad_serialize = tcase_create ("serialized nads");
+    tcase_add_loop_test (tc_nad_serialize, check_serialize, 0, NADTXT_COUNT);
+    suite_add_tcase (s, tc_nad_serialize);
+
+    TCase *tc_nad_cache = tcase_create ("nad cache");
+    tcase_add_test (tc_nad_cache, check_cache_reuse);
+    suite_add_tcase (s, tc_nad_cache);
+
 
     return s;
 }
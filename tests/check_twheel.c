@@ -0,0 +1,118 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define TIMERS 64
+
+static struct twheel_timer_st timers[TIMERS];
+static uint64_t armed_at[TIMERS];
+static int armed_for[TIMERS];
+static int fired[TIMERS];
+
+static void _check_timer(twheel_t w, twheel_timer_t t, void *arg) {
+    int i = (int) (intptr_t) arg;
+
+    /* never early */
+    fail_unless (twheel_clock() >= armed_at[i] + armed_for[i]);
+    fired[i]++;
+}
+
+static void _run_until_idle(twheel_t w, int limit) {
+    uint64_t end = twheel_clock() + limit;
+
+    while(twheel_count(w) > 0 && twheel_clock() < end) {
+        usleep(twheel_timeout(w, 50) * 1000);
+        twheel_run(w);
+    }
+}
+
+START_TEST (check_twheel_fire)
+{
+    twheel_t w = twheel_new(5);
+    int i;
+
+    memset(fired, 0, sizeof(fired));
+
+    /* spread over several first level rotations so the cascade is used */
+    for(i = 0; i < TIMERS; i++) {
+        twheel_timer_init(&timers[i], _check_timer, (void *) (intptr_t) i);
+        armed_at[i] = twheel_clock();
+        armed_for[i] = i * 40;
+        twheel_add(w, &timers[i], armed_for[i]);
+    }
+
+    ck_assert_int_eq (TIMERS, twheel_count(w));
+
+    /* every other one is cancelled */
+    for(i = 1; i < TIMERS; i += 2)
+        twheel_del(w, &timers[i]);
+
+    ck_assert_int_eq (TIMERS / 2, twheel_count(w));
+
+    _run_until_idle(w, 5000);
+
+    ck_assert_int_eq (0, twheel_count(w));
+    for(i = 0; i < TIMERS; i++) {
+        ck_assert_int_eq (i % 2 == 0 ? 1 : 0, fired[i]);
+        fail_if (twheel_pending(&timers[i]));
+    }
+
+    twheel_free(w);
+}
+END_TEST
+
+START_TEST (check_twheel_rearm)
+{
+    twheel_t w = twheel_new(5);
+
+    memset(fired, 0, sizeof(fired));
+
+    twheel_timer_init(&timers[0], _check_timer, (void *) 0);
+    armed_at[0] = twheel_clock();
+    armed_for[0] = 1000;
+    twheel_add(w, &timers[0], 1000);
+
+    /* moving a pending timer doesn't count it twice */
+    armed_at[0] = twheel_clock();
+    armed_for[0] = 20;
+    twheel_add(w, &timers[0], 20);
+
+    ck_assert_int_eq (1, twheel_count(w));
+    fail_unless (twheel_timeout(w, 1000) <= 25);
+
+    _run_until_idle(w, 1000);
+
+    ck_assert_int_eq (1, fired[0]);
+
+    twheel_free(w);
+}
+END_TEST
+
+Suite* twheel_suite (void)
+{
+    Suite *s = suite_create ("twheel");
+
+    TCase *tc_twheel = tcase_create ("Timers");
+    tcase_add_test (tc_twheel, check_twheel_fire);
+    tcase_add_test (tc_twheel, check_twheel_rearm);
+    suite_add_tcase (s, tc_twheel);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = twheel_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,155 @@
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "util/util.h"
+
+#define KEYS 20000
+
+static char keys[KEYS][16];
+
+static void _make_keys(void)
+{
+    int i;
+
+    for(i = 0; i < KEYS; i++)
+        snprintf(keys[i], sizeof(keys[i]), "user%d@example.com", i);
+}
+
+START_TEST (check_xhash_grow_shrink)
+{
+    xht h = xhash_new(11);
+    int i;
+
+    _make_keys();
+
+    for(i = 0; i < KEYS; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    ck_assert_int_eq (KEYS, xhash_count(h));
+    fail_unless (h->tab[0].size >= KEYS / 2);
+
+    for(i = 0; i < KEYS; i++)
+        ck_assert_ptr_eq (keys[i], xhash_get(h, keys[i]));
+
+    for(i = 0; i < KEYS; i++)
+        xhash_zap(h, keys[i]);
+
+    ck_assert_int_eq (0, xhash_count(h));
+
+    /* let the shrink finish */
+    for(i = 0; i < KEYS; i++)
+        fail_unless (xhash_get(h, keys[i]) == NULL);
+
+    fail_unless (h->tab[0].size < 64);
+
+    xhash_free(h);
+}
+END_TEST
+
+START_TEST (check_xhash_iter_zap)
+{
+    xht h = xhash_new(11);
+    const char *key;
+    int i, keylen, seen = 0;
+    void *val;
+
+    _make_keys();
+
+    for(i = 0; i < 1000; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    /* zap every entry while walking, as the session cleanup loops do */
+    if(xhash_iter_first(h))
+        do {
+            xhash_iter_get(h, &key, &keylen, &val);
+            ck_assert_ptr_eq (val, xhash_getx(h, key, keylen));
+            xhash_iter_zap(h);
+            seen++;
+        } while(xhash_iter_next(h));
+
+    ck_assert_int_eq (1000, seen);
+    ck_assert_int_eq (0, xhash_count(h));
+    fail_unless (xhash_iter_first(h) == 0);
+
+    xhash_free(h);
+}
+END_TEST
+
+START_TEST (check_xhash_iter_done)
+{
+    xht h = xhash_new(11);
+    int i;
+
+    _make_keys();
+
+    for(i = 0; i < 10; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    /* stop at the first one, like a lookup loop does */
+    fail_unless (xhash_iter_first(h) == 1);
+    xhash_iter_zap(h);
+    xhash_iter_done(h);
+
+    ck_assert_int_eq (9, xhash_count(h));
+
+    /* nothing holds the layout any more */
+    for(i = 10; i < KEYS; i++)
+        xhash_put(h, keys[i], keys[i]);
+
+    for(i = 10; i < KEYS; i++)
+        ck_assert_ptr_eq (keys[i], xhash_get(h, keys[i]));
+
+    fail_unless (h->tab[0].size >= KEYS / 2);
+
+    xhash_free(h);
+}
+END_TEST
+
+START_TEST (check_xhash_replace)
+{
+    xht h = xhash_new(11);
+    char key[] = "replace";
+
+    xhash_put(h, "replace", "one");
+    xhash_put(h, key, "two");
+
+    ck_assert_int_eq (1, xhash_count(h));
+    ck_assert_str_eq ("two", (char *) xhash_get(h, "replace"));
+    ck_assert_str_eq ("two", (char *) xhash_getx(h, "replace me", 7));
+
+    xhash_free(h);
+}
+END_TEST
+
+Suite* xhash_suite (void)
+{
+    Suite *s = suite_create ("xhash");
+
+    TCase *tc_resize = tcase_create ("Resize");
+    tcase_add_test (tc_resize, check_xhash_grow_shrink);
+    suite_add_tcase (s, tc_resize);
+
+    TCase *tc_iter = tcase_create ("Iteration");
+    tcase_add_test (tc_iter, check_xhash_iter_zap);
+    tcase_add_test (tc_iter, check_xhash_iter_done);
+    tcase_add_test (tc_iter, check_xhash_replace);
+    suite_add_tcase (s, tc_iter);
+
+    return s;
+}
+
+int main (void)
+{
+    int number_failed;
+    Suite *s = xhash_suite ();
+    SRunner *sr = srunner_create (s);
+    srunner_run_all (sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed (sr);
+    srunner_free (sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
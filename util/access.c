@@ -33,8 +33,8 @@ access_t access_new(int order)
 
 void access_free(access_t access)
 {
-    if(access->allow != NULL) free(access->allow);
-    if(access->deny != NULL) free(access->deny);
+    if(access->allow != NULL) iptrie_free(access->allow, NULL);
+    if(access->deny != NULL) iptrie_free(access->deny, NULL);
     free(access);
 }
 
@@ -66,165 +66,93 @@ static int _access_calc_netsize(const char *mask, int defaultsize)
     return netsize;
 }
 
-/** convert a IPv6 mapped IPv4 address to a real IPv4 address */
-static void _access_unmap_v4(struct sockaddr_in6 *src, struct sockaddr_in *dst)
+/** add a rule to a list, the prefix is all that matters so anything will do for its value */
+static int _access_add(iptrie_t *list, int *count, const char *ip, const char *mask)
 {
-    memset(dst, 0, sizeof(struct sockaddr_in));
-    dst->sin_family = AF_INET;
-    dst->sin_addr.s_addr = htonl((((int)src->sin6_addr.s6_addr[12]*256+src->sin6_addr.s6_addr[13])*256+src->sin6_addr.s6_addr[14])*256+(int)src->sin6_addr.s6_addr[15]);
-}
-
-/** check if two ip addresses are within the same subnet */
-static int _access_check_match(struct sockaddr_storage *ip_1, struct sockaddr_storage *ip_2, int netsize)
-{
-    struct sockaddr_in *sin_1;
-    struct sockaddr_in *sin_2;
-    struct sockaddr_in6 *sin6_1;
-    struct sockaddr_in6 *sin6_2;
-    int i;
-
-    sin_1 = (struct sockaddr_in *)ip_1;
-    sin_2 = (struct sockaddr_in *)ip_2;
-    sin6_1 = (struct sockaddr_in6 *)ip_1;
-    sin6_2 = (struct sockaddr_in6 *)ip_2;
-
-    /* addresses of different families */
-    if(ip_1->ss_family != ip_2->ss_family)
-    {
-        /* maybe on of the addresses is just a IPv6 mapped IPv4 address */
-        if (ip_1->ss_family == AF_INET && ip_2->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6_2->sin6_addr))
-        {
-            struct sockaddr_storage t;
-            struct sockaddr_in *temp;
-
-            temp = (struct sockaddr_in *)&t;
-
-            _access_unmap_v4(sin6_2, temp);
-            if(netsize>96)
-                netsize -= 96;
-
-            return _access_check_match(ip_1, &t, netsize);
-        }
-
-        if (ip_1->ss_family == AF_INET6 && ip_2->ss_family == AF_INET && IN6_IS_ADDR_V4MAPPED(&sin6_1->sin6_addr))
-        {
-            struct sockaddr_storage t;
-            struct sockaddr_in *temp;
-
-            temp = (struct sockaddr_in *)&t;
-        
-            _access_unmap_v4(sin6_1, temp);
-            if(netsize>96)
-                netsize -= 96;
-
-            return _access_check_match(&t, ip_2, netsize);
-        }
-
-        return 0;
-    }
-
-    /* IPv4? */
-    if(ip_1->ss_family == AF_INET)
-    {
-        int netmask;
-
-        if(netsize > 32)
-            netsize = 32;
-
-        netmask = htonl(-1 << (32-netsize));
-
-        return ((sin_1->sin_addr.s_addr&netmask) == (sin_2->sin_addr.s_addr&netmask));
-    }
-
-    /* IPv6? */
-    if(ip_1->ss_family == AF_INET6)
-    {
-        unsigned char bytemask;
+    unsigned char key[IPTRIE_KEYLEN];
+    int base, netsize;
 
-        if(netsize > 128)
-            netsize = 128;
+    if((base = iptrie_key(ip, key)) < 0)
+        return 1;
 
-        for(i=0; i<netsize/8; i++)
-            if(sin6_1->sin6_addr.s6_addr[i] != sin6_2->sin6_addr.s6_addr[i])
-                return 0;
-    
-        if(netsize%8 == 0)
-            return 1;
+    netsize = (mask == NULL) ? -1 : _access_calc_netsize(mask, -1);
+    if(netsize < 0 || netsize > IPTRIE_KEYLEN * 8 - base)
+        netsize = IPTRIE_KEYLEN * 8 - base;
 
-        bytemask = 0xff << (8 - netsize%8);
+    if(*list == NULL)
+        *list = iptrie_new();
 
-        return ((sin6_1->sin6_addr.s6_addr[i]&bytemask) == (sin6_2->sin6_addr.s6_addr[i]&bytemask));
-    }
+    if(iptrie_put(*list, key, base + netsize, (void *) list) == NULL)
+        (*count)++;
 
-    /* unknown address family */
     return 0;
 }
 
 int access_allow(access_t access, const char *ip, const char *mask)
 {
-    struct sockaddr_storage ip_addr;
-    int netsize;
+    return _access_add(&access->allow, &access->nallow, ip, mask);
+}
 
-    if(j_inet_pton(ip, &ip_addr) <= 0)
-        return 1;
+int access_deny(access_t access, const char *ip, const char *mask)
+{
+    return _access_add(&access->deny, &access->ndeny, ip, mask);
+}
 
-    netsize = _access_calc_netsize(mask, ip_addr.ss_family==AF_INET ? 32 : 128);
+int access_load(access_t access, const char *file, int deny)
+{
+    FILE *f;
+    char buf[1024], *ip, *mask, *end;
+    int line = 0, count = 0;
 
-    access->allow = (access_rule_t) realloc(access->allow, sizeof(struct access_rule_st) * (access->nallow + 1));
+    f = fopen(file, "r");
+    if(f == NULL)
+        return -1;
 
-    memcpy(&access->allow[access->nallow].ip, &ip_addr, sizeof(ip_addr));
-    access->allow[access->nallow].mask = netsize;
+    while(fgets(buf, sizeof(buf), f) != NULL) {
+        line++;
 
-    access->nallow++;
+        /* comments and blank lines */
+        if((end = strchr(buf, '#')) != NULL)
+            *end = '\0';
 
-    return 0;
-}
+        ip = buf + strspn(buf, " \t\r\n");
+        if(*ip == '\0')
+            continue;
 
-int access_deny(access_t access, const char *ip, const char *mask)
-{
-    struct sockaddr_storage ip_addr;
-    int netsize;
-
-    if(j_inet_pton(ip, &ip_addr) <= 0)
-        return 1;
+        end = ip + strcspn(ip, " \t\r\n");
+        *end = '\0';
 
-    netsize = _access_calc_netsize(mask, ip_addr.ss_family==AF_INET ? 32 : 128);
+        if((mask = strchr(ip, '/')) != NULL)
+            *mask++ = '\0';
 
-    access->deny = (access_rule_t) realloc(access->deny, sizeof(struct access_rule_st) * (access->ndeny + 1));
+        if(deny ? access_deny(access, ip, mask) : access_allow(access, ip, mask)) {
+            log_debug(ZONE, "%s:%d: '%s' isn't an address, skipping", file, line, ip);
+            continue;
+        }
 
-    memcpy(&access->deny[access->ndeny].ip, &ip_addr, sizeof(ip_addr));
-    access->deny[access->ndeny].mask = netsize;
+        count++;
+    }
 
-    access->ndeny++;
+    fclose(f);
 
-    return 0;
+    return count;
 }
 
 int access_check(access_t access, const char *ip)
 {
-    struct sockaddr_storage addr;
-    access_rule_t rule;
-    int i, allow = 0, deny = 0;
+    unsigned char key[IPTRIE_KEYLEN];
+    int allow = 0, deny = 0;
 
-    if(j_inet_pton(ip, &addr) <= 0)
+    if(iptrie_key(ip, key) < 0)
         return 0;
 
     /* first, search the allow list */
-    for(i = 0; !allow && i < access->nallow; i++)
-    {
-        rule = &access->allow[i];
-        if(_access_check_match(&addr, &rule->ip, rule->mask))
-            allow = 1;
-    }
+    if(access->allow != NULL && iptrie_match(access->allow, key, NULL) != NULL)
+        allow = 1;
 
     /* now the deny list */
-    for(i = 0; !deny && i < access->ndeny; i++)
-    {
-        rule = &access->deny[i];
-        if(_access_check_match(&addr, &rule->ip, rule->mask))
-            deny = 1;
-    }
-
+    if(access->deny != NULL && iptrie_match(access->deny, key, NULL) != NULL)
+        deny = 1;
     /* allow then deny */
     if(access->order == 0)
     {
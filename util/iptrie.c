@@ -0,0 +1,302 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* ip prefix trie */
+
+#include "util.h"
+
+/*
+ * Every node is a prefix: its key, masked to its length. A node only
+ * exists if it holds a value or if both of its children do, so
+ * a chain of single children is never longer than one node and the
+ * trie has fewer than two nodes per prefix. A node's children carry
+ * on from its length, indexed by the next bit of their key.
+ */
+
+#define IPTRIE_BITS (IPTRIE_KEYLEN * 8)
+
+typedef struct _iptrie_node_st *_iptrie_node_t;
+struct _iptrie_node_st {
+    _iptrie_node_t      child[2];
+
+    unsigned char       key[IPTRIE_KEYLEN];
+    int                 bits;
+
+    int                 set;        /* 1 if a prefix ends here */
+    void                *val;
+};
+
+struct iptrie_st {
+    _iptrie_node_t      root;
+    int                 count;
+};
+
+/** bit n of a key, counting from the top */
+#define _iptrie_bit(key, n) (((key)[(n) >> 3] >> (7 - ((n) & 7))) & 1)
+
+/** how many of the first max bits two keys have in common */
+static int _iptrie_common(const unsigned char *a, const unsigned char *b, int max) {
+    int i, n;
+    unsigned char x;
+
+    for(i = 0, n = 0; n < max; i++, n += 8) {
+        if((x = a[i] ^ b[i]) == 0)
+            continue;
+
+        while(!(x & 0x80)) {
+            x <<= 1;
+            n++;
+        }
+
+        break;
+    }
+
+    return n < max ? n : max;
+}
+
+static _iptrie_node_t _iptrie_node_new(const unsigned char *key, int bits) {
+    _iptrie_node_t n;
+    int i;
+
+    n = (_iptrie_node_t) calloc(1, sizeof(struct _iptrie_node_st));
+
+    /* keep the key masked, the bits past the prefix don't mean anything */
+    memcpy(n->key, key, (bits + 7) / 8);
+    if(bits % 8 != 0)
+        n->key[bits / 8] &= 0xff << (8 - bits % 8);
+    for(i = (bits + 7) / 8; i < IPTRIE_KEYLEN; i++)
+        n->key[i] = 0;
+
+    n->bits = bits;
+
+    return n;
+}
+
+/** an empty node with less than two children can go */
+static _iptrie_node_t _iptrie_prune(_iptrie_node_t n) {
+    _iptrie_node_t c;
+
+    if(n->set || (n->child[0] != NULL && n->child[1] != NULL))
+        return n;
+
+    c = n->child[0] != NULL ? n->child[0] : n->child[1];
+    free(n);
+
+    return c;
+}
+
+iptrie_t iptrie_new(void) {
+    return (iptrie_t) calloc(1, sizeof(struct iptrie_st));
+}
+
+static void _iptrie_free(_iptrie_node_t n, void (*free_val)(void *val)) {
+    if(n == NULL)
+        return;
+
+    _iptrie_free(n->child[0], free_val);
+    _iptrie_free(n->child[1], free_val);
+
+    if(n->set && free_val != NULL)
+        (free_val)(n->val);
+
+    free(n);
+}
+
+void iptrie_free(iptrie_t t, void (*free_val)(void *val)) {
+    _iptrie_free(t->root, free_val);
+    free(t);
+}
+
+int iptrie_key(const char *ip, unsigned char key[IPTRIE_KEYLEN]) {
+    struct sockaddr_storage sa;
+
+    if(ip == NULL || j_inet_pton(ip, &sa) <= 0)
+        return -1;
+
+    if(sa.ss_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in *) &sa)->sin_addr.s_addr, 4);
+        return IPTRIE_V4;
+    }
+
+#ifdef AF_INET6
+    if(sa.ss_family == AF_INET6) {
+        memcpy(key, ((struct sockaddr_in6 *) &sa)->sin6_addr.s6_addr, IPTRIE_KEYLEN);
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+void *iptrie_put(iptrie_t t, const unsigned char *key, int bits, void *val) {
+    _iptrie_node_t n, m, *np;
+    void *old;
+    int common;
+
+    if(bits < 0) bits = 0;
+    if(bits > IPTRIE_BITS) bits = IPTRIE_BITS;
+
+    np = &t->root;
+    while((n = *np) != NULL) {
+        common = _iptrie_common(key, n->key, bits < n->bits ? bits : n->bits);
+
+        /* we're somewhere inside this one */
+        if(common == n->bits) {
+            if(n->bits == bits)
+                break;
+
+            np = &n->child[_iptrie_bit(key, n->bits)];
+            continue;
+        }
+
+        /* we're above it */
+        if(common == bits) {
+            m = _iptrie_node_new(key, bits);
+            m->child[_iptrie_bit(n->key, bits)] = n;
+            *np = m;
+            n = m;
+            break;
+        }
+
+        /* we part ways with it, and need somewhere to do that */
+        m = _iptrie_node_new(key, common);
+        m->child[_iptrie_bit(n->key, common)] = n;
+        *np = m;
+
+        np = &m->child[_iptrie_bit(key, common)];
+    }
+
+    if(n == NULL)
+        n = *np = _iptrie_node_new(key, bits);
+
+    old = n->set ? n->val : NULL;
+
+    if(!n->set)
+        t->count++;
+
+    n->set = 1;
+    n->val = val;
+
+    return old;
+}
+
+/** the node for exactly this prefix, set or not */
+static _iptrie_node_t _iptrie_find(iptrie_t t, const unsigned char *key, int bits) {
+    _iptrie_node_t n = t->root;
+
+    while(n != NULL && n->bits <= bits) {
+        if(_iptrie_common(key, n->key, n->bits) != n->bits)
+            return NULL;
+
+        if(n->bits == bits)
+            return n;
+
+        n = n->child[_iptrie_bit(key, n->bits)];
+    }
+
+    return NULL;
+}
+
+void *iptrie_get(iptrie_t t, const unsigned char *key, int bits) {
+    _iptrie_node_t n = _iptrie_find(t, key, bits);
+
+    return (n != NULL && n->set) ? n->val : NULL;
+}
+
+void *iptrie_match(iptrie_t t, const unsigned char *key, int *bits) {
+    _iptrie_node_t n = t->root, best = NULL;
+
+    while(n != NULL) {
+        if(_iptrie_common(key, n->key, n->bits) != n->bits)
+            break;
+
+        if(n->set)
+            best = n;
+
+        if(n->bits == IPTRIE_BITS)
+            break;
+
+        n = n->child[_iptrie_bit(key, n->bits)];
+    }
+
+    if(best == NULL)
+        return NULL;
+
+    if(bits != NULL)
+        *bits = best->bits;
+
+    return best->val;
+}
+
+/** take the prefix out of this subtree, @return what's left of it */
+static _iptrie_node_t _iptrie_zap(iptrie_t t, _iptrie_node_t n, const unsigned char *key, int bits, void **val) {
+    int b;
+
+    if(n == NULL || n->bits > bits || _iptrie_common(key, n->key, n->bits) != n->bits)
+        return n;
+
+    if(n->bits < bits) {
+        b = _iptrie_bit(key, n->bits);
+        n->child[b] = _iptrie_zap(t, n->child[b], key, bits, val);
+    }
+
+    else if(n->set) {
+        *val = n->val;
+        n->set = 0;
+        n->val = NULL;
+        t->count--;
+    }
+
+    return _iptrie_prune(n);
+}
+
+void *iptrie_zap(iptrie_t t, const unsigned char *key, int bits) {
+    void *val = NULL;
+
+    t->root = _iptrie_zap(t, t->root, key, bits, &val);
+
+    return val;
+}
+
+static _iptrie_node_t _iptrie_walk(iptrie_t t, _iptrie_node_t n, iptrie_walker_t w, void *arg) {
+    if(n == NULL)
+        return NULL;
+
+    if(n->set && (w)(n->key, n->bits, n->val, arg)) {
+        n->set = 0;
+        n->val = NULL;
+        t->count--;
+    }
+
+    n->child[0] = _iptrie_walk(t, n->child[0], w, arg);
+    n->child[1] = _iptrie_walk(t, n->child[1], w, arg);
+
+    return _iptrie_prune(n);
+}
+
+void iptrie_walk(iptrie_t t, iptrie_walker_t w, void *arg) {
+    t->root = _iptrie_walk(t, t->root, w, arg);
+}
+
+int iptrie_count(iptrie_t t) {
+    return t->count;
+}
@@ -0,0 +1,91 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file util/iptrie.h
+  * @brief IP prefix trie
+  *
+  * A path compressed binary (patricia) trie of address prefixes, each
+  * with a value. IPv4 addresses are kept as IPv4 mapped IPv6 ones, so a
+  * single trie holds both families, and an IPv4 rule also matches the
+  * mapped form of its addresses. Inserts and lookups walk at most one
+  * node per bit of the address.
+  */
+
+#ifndef INCL_UTIL_IPTRIE_H
+#define INCL_UTIL_IPTRIE_H 1
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+/* jabberd2 Windows DLL */
+#ifndef JABBERD2_API
+# ifdef _WIN32
+#  ifdef JABBERD2_EXPORTS
+#   define JABBERD2_API  __declspec(dllexport)
+#  else /* JABBERD2_EXPORTS */
+#   define JABBERD2_API  __declspec(dllimport)
+#  endif /* JABBERD2_EXPORTS */
+# else /* _WIN32 */
+#  define JABBERD2_API extern
+# endif /* _WIN32 */
+#endif /* JABBERD2_API */
+
+/** bytes in a key */
+#define IPTRIE_KEYLEN   (16)
+
+/** bits before the address in the key of an IPv4 address */
+#define IPTRIE_V4       (96)
+
+typedef struct iptrie_st        *iptrie_t;
+
+/** called for every prefix in the trie, return 1 to remove it (the value is yours to free) */
+typedef int (*iptrie_walker_t)(const unsigned char *key, int bits, void *val, void *arg);
+
+JABBERD2_API iptrie_t    iptrie_new(void);
+
+/** free the trie, and the values with free_val if it isn't NULL */
+JABBERD2_API void        iptrie_free(iptrie_t t, void (*free_val)(void *val));
+
+/**
+ * make a key from an address
+ * @return the bits that come before the address (IPTRIE_V4 or 0), or -1 if it isn't one
+ */
+JABBERD2_API int         iptrie_key(const char *ip, unsigned char key[IPTRIE_KEYLEN]);
+
+/** store a value for the first bits of key, @return the value it replaced */
+JABBERD2_API void        *iptrie_put(iptrie_t t, const unsigned char *key, int bits, void *val);
+
+/** @return the value stored for exactly this prefix */
+JABBERD2_API void        *iptrie_get(iptrie_t t, const unsigned char *key, int bits);
+
+/** @return the value of the longest prefix of key in the trie, its length in bits if that isn't NULL */
+JABBERD2_API void        *iptrie_match(iptrie_t t, const unsigned char *key, int *bits);
+
+/** take out a prefix, @return its value */
+JABBERD2_API void        *iptrie_zap(iptrie_t t, const unsigned char *key, int bits);
+
+/** visit every prefix, shortest first */
+JABBERD2_API void        iptrie_walk(iptrie_t t, iptrie_walker_t w, void *arg);
+
+/** @return the number of prefixes in the trie */
+JABBERD2_API int         iptrie_count(iptrie_t t);
+
+#endif
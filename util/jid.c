@@ -21,20 +21,265 @@
 #include "util.h"
 #include <stringprep.h>
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 /** Forward declaration **/
 static jid_t jid_reset_components_internal(jid_t jid, const char *node, const char *domain, const char *resource, int prepare);
 
+/* the prep cache is one slot per hash value, a part that lands on a
+ * taken slot pushes out what was there. slots are guarded by a few
+ * locks, so threads working on different parts rarely meet. */
+
+/** locks over the slots */
+#define JID_CACHE_LOCKS     (16)
+
+/** longer parts aren't worth keeping */
+#define JID_CACHE_KEEP      (256)
+
+typedef struct _jid_cache_slot_st {
+    jid_part_t      part;
+    unsigned int    hash;
+    int             ok;         /* 0 if stringprep refused it */
+    char            *raw;       /* followed by the prepped text */
+} *_jid_cache_slot_t;
+
+static _jid_cache_slot_t _jid_cache = NULL;
+static int _jid_cache_size = 0;
+static int _jid_cache_init = 0;
+
+static struct jid_cache_stats_st _jid_cache_stats;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t _jid_cache_mutex[JID_CACHE_LOCKS] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_once_t _jid_cache_once = PTHREAD_ONCE_INIT;
+
+# define _jid_cache_lock(i)     pthread_mutex_lock(&_jid_cache_mutex[(i) % JID_CACHE_LOCKS])
+# define _jid_cache_unlock(i)   pthread_mutex_unlock(&_jid_cache_mutex[(i) % JID_CACHE_LOCKS])
+#else
+# define _jid_cache_lock(i)
+# define _jid_cache_unlock(i)
+#endif
+
+#define _jid_cache_count(field, n) __atomic_add_fetch(&_jid_cache_stats.field, (n), __ATOMIC_RELAXED)
+
+/** take every lock, for when the table itself changes */
+static void _jid_cache_lock_all(void) {
+    int i;
+
+    for(i = 0; i < JID_CACHE_LOCKS; i++)
+        _jid_cache_lock(i);
+}
+
+static void _jid_cache_unlock_all(void) {
+    int i;
+
+    for(i = 0; i < JID_CACHE_LOCKS; i++)
+        _jid_cache_unlock(i);
+}
+
+static void _jid_cache_empty(void) {
+    int i;
+
+    for(i = 0; i < _jid_cache_size; i++)
+        if(_jid_cache[i].raw != NULL) {
+            free(_jid_cache[i].raw);
+            _jid_cache[i].raw = NULL;
+        }
+
+    _jid_cache_stats.cached = 0;
+}
+
+static void _jid_cache_resize(int max) {
+    _jid_cache_lock_all();
+
+    _jid_cache_empty();
+    free(_jid_cache);
+
+    _jid_cache = NULL;
+    _jid_cache_size = max > 0 ? max : 0;
+    if(_jid_cache_size > 0)
+        _jid_cache = (_jid_cache_slot_t) calloc(_jid_cache_size, sizeof(struct _jid_cache_slot_st));
+
+    _jid_cache_init = 1;
+
+    _jid_cache_unlock_all();
+}
+
+static void _jid_cache_default(void) {
+    if(!_jid_cache_init)
+        _jid_cache_resize(JID_CACHE_MAX);
+}
+
+void jid_cache_max(int max) {
+#ifdef HAVE_PTHREAD
+    pthread_once(&_jid_cache_once, _jid_cache_default);
+#endif
+
+    _jid_cache_resize(max);
+}
+
+void jid_cache_stats(jid_cache_stats_t stats) {
+    _jid_cache_lock_all();
+    memcpy(stats, &_jid_cache_stats, sizeof(struct jid_cache_stats_st));
+    _jid_cache_unlock_all();
+}
+
+void jid_cache_flush(void) {
+    _jid_cache_lock_all();
+    _jid_cache_empty();
+    _jid_cache_unlock_all();
+}
+
+void jid_cache_log(log_t log) {
+    struct jid_cache_stats_st stats;
+
+    jid_cache_stats(&stats);
+    log_write(log, LOG_INFO, "jid cache: %lu ascii, %lu hits, %lu misses, %lu evicted", stats.fast, stats.hits, stats.misses, stats.evicted);
+}
+
+/** fnv-1a over the part and its text */
+static unsigned int _jid_cache_hash(jid_part_t part, const char *str) {
+    unsigned int h = 2166136261u ^ (unsigned int) part;
+
+    for(; *str != '\0'; str++)
+        h = (h ^ (unsigned char) *str) * 16777619u;
+
+    return h;
+}
+
+/**
+ * ascii only needs lowercasing in nodeprep and nameprep, and nothing
+ * at all in resourceprep. anything the profiles prohibit (controls,
+ * spaces, and the characters nodeprep won't have) goes the long way.
+ * @return 1 if the part was prepped here
+ */
+static int _jid_prep_ascii(jid_part_t part, char *str) {
+    unsigned char *c;
+
+    for(c = (unsigned char *) str; *c != '\0'; c++) {
+        if(*c < 0x20 || *c >= 0x7f)
+            return 0;
+
+        if(part == jid_RESOURCE)
+            continue;
+
+        if(*c == ' ' || (part == jid_NODE && strchr("\"&'/:<>@", *c) != NULL))
+            return 0;
+    }
+
+    if(part != jid_RESOURCE)
+        for(c = (unsigned char *) str; *c != '\0'; c++)
+            if(*c >= 'A' && *c <= 'Z')
+                *c += 'a' - 'A';
+
+    return 1;
+}
+
+static int _jid_stringprep(jid_part_t part, char *str) {
+    switch(part) {
+        case jid_NODE:
+            return stringprep_xmpp_nodeprep(str, 1024);
+
+        case jid_DOMAIN:
+            return stringprep_nameprep(str, 1024);
+
+        case jid_RESOURCE:
+            return stringprep_xmpp_resourceprep(str, 1024);
+    }
+
+    return 1;
+}
+
+/** stringprep one part in place, through the cache */
+static int _jid_prep_part(jid_part_t part, char *str) {
+    _jid_cache_slot_t slot;
+    unsigned int hash;
+    int len, idx, ret;
+    char orig[JID_CACHE_KEEP + 1], *raw;
+
+    if(_jid_prep_ascii(part, str)) {
+        _jid_cache_count(fast, 1);
+        return 0;
+    }
+
+#ifdef HAVE_PTHREAD
+    pthread_once(&_jid_cache_once, _jid_cache_default);
+#else
+    _jid_cache_default();
+#endif
+
+    len = strlen(str);
+    if(_jid_cache_size == 0 || len > JID_CACHE_KEEP) {
+        _jid_cache_count(misses, 1);
+        return _jid_stringprep(part, str) != 0;
+    }
+
+    hash = _jid_cache_hash(part, str);
+    idx = hash % _jid_cache_size;
+    slot = &_jid_cache[idx];
+
+    _jid_cache_lock(idx);
+
+    if(slot->raw != NULL && slot->hash == hash && slot->part == part && strcmp(slot->raw, str) == 0) {
+        ret = slot->ok ? 0 : 1;
+        if(slot->ok)
+            strcpy(str, slot->raw + len + 1);
+
+        _jid_cache_unlock(idx);
+
+        _jid_cache_count(hits, 1);
+        return ret;
+    }
+
+    _jid_cache_unlock(idx);
+
+    /* stringprep without holding anyone up */
+    memcpy(orig, str, len + 1);
+
+    ret = _jid_stringprep(part, str);
+    _jid_cache_count(misses, 1);
+
+    raw = (char *) malloc(len + 1 + (ret == 0 ? strlen(str) + 1 : 0));
+    memcpy(raw, orig, len + 1);
+    if(ret == 0)
+        strcpy(raw + len + 1, str);
+
+    _jid_cache_lock(idx);
+
+    if(slot->raw != NULL) {
+        free(slot->raw);
+        _jid_cache_count(evicted, 1);
+    } else
+        _jid_cache_count(cached, 1);
+
+    slot->part = part;
+    slot->hash = hash;
+    slot->ok = (ret == 0);
+    slot->raw = raw;
+
+    _jid_cache_unlock(idx);
+
+    return ret != 0;
+}
+
 /** do stringprep on the pieces */
 static int jid_prep_pieces(char *node, char *domain, char *resource) {
     if(node[0] != '\0')
-        if(stringprep_xmpp_nodeprep(node, 1024) != 0)
+        if(_jid_prep_part(jid_NODE, node) != 0)
             return 1;
 
-    if(stringprep_nameprep(domain, 1024) != 0)
+    if(_jid_prep_part(jid_DOMAIN, domain) != 0)
         return 1;
 
     if(resource[0] != '\0')
-        if(stringprep_xmpp_resourceprep(resource, 1024) != 0)
+        if(_jid_prep_part(jid_RESOURCE, resource) != 0)
             return 1;
 
     return 0;
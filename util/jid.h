@@ -123,4 +123,26 @@ JABBERD2_API jid_t               jid_zap(jid_t list, jid_t jid);
 /** insert of a copy of jid into list, avoiding dups */
 JABBERD2_API jid_t               jid_append(jid_t list, jid_t jid);
 
+/** the results of stringprep are kept in a table shared by all threads,
+  * keyed by the part (node, domain or resource) and its raw text. max is
+  * the number of slots, each holding one part (0 turns the cache off).
+  * parts that are plain ascii skip both the cache and stringprep. */
+#define JID_CACHE_MAX       (4096)
+
+typedef struct jid_cache_stats_st {
+    unsigned long   fast;       /* parts that were ascii, and needed no stringprep */
+    unsigned long   hits;       /* parts found in the cache */
+    unsigned long   misses;     /* parts that went through stringprep */
+    unsigned long   evicted;    /* parts pushed out of the cache by others */
+    int             cached;     /* parts in the cache now */
+} *jid_cache_stats_t;
+
+/** resize the cache, dropping what's in it */
+JABBERD2_API void                jid_cache_max(int max);
+
+JABBERD2_API void                jid_cache_stats(jid_cache_stats_t stats);
+
+/** empty the cache */
+JABBERD2_API void                jid_cache_flush(void);
+
 #endif
@@ -0,0 +1,171 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* jid sets */
+
+#include "util.h"
+
+/*
+ * Members are kept on a doubly linked list in the order they were
+ * added, and the hash maps each one's full jid to its list node. The
+ * key is the member's own jid_full(), so it lives as long as the node.
+ */
+
+typedef struct _jidset_node_st *_jidset_node_t;
+struct _jidset_node_st {
+    jid_t               jid;
+
+    _jidset_node_t      prev;
+    _jidset_node_t      next;
+};
+
+struct jidset_st {
+    xht                 hash;
+
+    _jidset_node_t      first;
+    _jidset_node_t      last;
+    int                 count;
+
+    _jidset_node_t      iter;       /* the next one the walk will return */
+};
+
+jidset_t jidset_new(void) {
+    return (jidset_t) calloc(1, sizeof(struct jidset_st));
+}
+
+void jidset_free(jidset_t set) {
+    if(set == NULL)
+        return;
+
+    jidset_clear(set);
+
+    if(set->hash != NULL)
+        xhash_free(set->hash);
+
+    free(set);
+}
+
+static _jidset_node_t _jidset_find(jidset_t set, jid_t jid) {
+    const char *full;
+
+    if(set == NULL || set->count == 0 || jid == NULL || (full = jid_full(jid)) == NULL)
+        return NULL;
+
+    return (_jidset_node_t) xhash_get(set->hash, full);
+}
+
+int jidset_add(jidset_t set, jid_t jid) {
+    _jidset_node_t n;
+
+    if(jid == NULL || jid_full(jid) == NULL || _jidset_find(set, jid) != NULL)
+        return 0;
+
+    n = (_jidset_node_t) calloc(1, sizeof(struct _jidset_node_st));
+    n->jid = jid_dup(jid);
+
+    n->prev = set->last;
+    if(set->last != NULL)
+        set->last->next = n;
+    else
+        set->first = n;
+    set->last = n;
+
+    if(set->hash == NULL)
+        set->hash = xhash_new(11);
+
+    xhash_put(set->hash, jid_full(n->jid), (void *) n);
+    set->count++;
+
+    return 1;
+}
+
+int jidset_has(jidset_t set, jid_t jid) {
+    return _jidset_find(set, jid) != NULL;
+}
+
+int jidset_zap(jidset_t set, jid_t jid) {
+    _jidset_node_t n;
+
+    if((n = _jidset_find(set, jid)) == NULL)
+        return 0;
+
+    xhash_zap(set->hash, jid_full(n->jid));
+
+    if(n->prev != NULL)
+        n->prev->next = n->next;
+    else
+        set->first = n->next;
+
+    if(n->next != NULL)
+        n->next->prev = n->prev;
+    else
+        set->last = n->prev;
+
+    if(set->iter == n)
+        set->iter = n->next;
+
+    set->count--;
+
+    jid_free(n->jid);
+    free(n);
+
+    return 1;
+}
+
+void jidset_clear(jidset_t set) {
+    _jidset_node_t n, next;
+
+    if(set == NULL)
+        return;
+
+    for(n = set->first; n != NULL; n = next) {
+        next = n->next;
+        xhash_zap(set->hash, jid_full(n->jid));
+        jid_free(n->jid);
+        free(n);
+    }
+
+    set->first = set->last = set->iter = NULL;
+    set->count = 0;
+}
+
+int jidset_count(jidset_t set) {
+    return set != NULL ? set->count : 0;
+}
+
+jid_t jidset_iter_first(jidset_t set) {
+    if(set == NULL)
+        return NULL;
+
+    set->iter = set->first;
+
+    return jidset_iter_next(set);
+}
+
+jid_t jidset_iter_next(jidset_t set) {
+    _jidset_node_t n;
+
+    if(set == NULL || (n = set->iter) == NULL)
+        return NULL;
+
+    set->iter = n->next;
+
+    return n->jid;
+}
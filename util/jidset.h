@@ -0,0 +1,84 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+
+/** @file util/jidset.h
+  * @brief sets of jids
+  *
+  * A set of full jids that remembers the order they went in. Each
+  * member is a copy of the jid it was added with, hashed on its full
+  * form, so adding, removing and looking one up don't depend on how
+  * many others there are. Nothing is allocated for the hash until the
+  * first jid goes in, so an empty set costs next to nothing.
+  */
+
+#ifndef INCL_UTIL_JIDSET_H
+#define INCL_UTIL_JIDSET_H 1
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+/* jabberd2 Windows DLL */
+#ifndef JABBERD2_API
+# ifdef _WIN32
+#  ifdef JABBERD2_EXPORTS
+#   define JABBERD2_API  __declspec(dllexport)
+#  else /* JABBERD2_EXPORTS */
+#   define JABBERD2_API  __declspec(dllimport)
+#  endif /* JABBERD2_EXPORTS */
+# else /* _WIN32 */
+#  define JABBERD2_API extern
+# endif /* _WIN32 */
+#endif /* JABBERD2_API */
+
+typedef struct jidset_st        *jidset_t;
+
+JABBERD2_API jidset_t    jidset_new(void);
+
+/** free the set and its jids, set may be NULL */
+JABBERD2_API void        jidset_free(jidset_t set);
+
+/** add a copy of jid, @return 1 if it wasn't already there */
+JABBERD2_API int         jidset_add(jidset_t set, jid_t jid);
+
+/** @return 1 if jid is in the set, set may be NULL */
+JABBERD2_API int         jidset_has(jidset_t set, jid_t jid);
+
+/** take jid out, @return 1 if it was there */
+JABBERD2_API int         jidset_zap(jidset_t set, jid_t jid);
+
+/** take everything out */
+JABBERD2_API void        jidset_clear(jidset_t set);
+
+/** @return the number of jids in the set, 0 for NULL */
+JABBERD2_API int         jidset_count(jidset_t set);
+
+/**
+ * walk the set in the order the jids were added, eg
+ *
+ *   for(jid = jidset_iter_first(set); jid != NULL; jid = jidset_iter_next(set))
+ *
+ * any of them may be zapped during the walk
+ */
+JABBERD2_API jid_t       jidset_iter_first(jidset_t set);
+JABBERD2_API jid_t       jidset_iter_next(jidset_t set);
+
+#endif
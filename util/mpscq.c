@@ -0,0 +1,110 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* multi-producer single-consumer queue
+ *
+ * Producers swap themselves in as the new head with one atomic
+ * exchange, then link the previous head to themselves. Until that link
+ * is made the consumer sees the queue as empty at that point; the
+ * producer wakes it up afterwards, so nothing is left behind. */
+
+#include "util.h"
+
+mpscq_t mpscq_new(void) {
+    mpscq_t q;
+
+    q = (mpscq_t) calloc(1, sizeof(struct _mpscq_st));
+
+    q->head = q->tail = &q->stub;
+
+    return q;
+}
+
+void mpscq_free(mpscq_t q) {
+    assert((int) (q != NULL));
+
+    while(mpscq_pull(q) != NULL);
+
+    free(q);
+}
+
+static void _mpscq_link(mpscq_t q, _mpscq_node_t n) {
+    _mpscq_node_t prev;
+
+    n->next = NULL;
+    prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+int mpscq_push(mpscq_t q, void *data) {
+    _mpscq_node_t n;
+
+    assert((int) (q != NULL));
+
+    n = (_mpscq_node_t) malloc(sizeof(struct _mpscq_node_st));
+    n->data = data;
+
+    _mpscq_link(q, n);
+
+    return __atomic_exchange_n(&q->signalled, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void mpscq_woken(mpscq_t q) {
+    __atomic_store_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+void *mpscq_pull(mpscq_t q) {
+    _mpscq_node_t tail, next;
+    void *data;
+
+    assert((int) (q != NULL));
+
+    tail = q->tail;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    /* step over the stub */
+    if(tail == &q->stub) {
+        if(next == NULL)
+            return NULL;
+
+        q->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next == NULL) {
+        /* a push is half way through */
+        if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        /* last one, put the stub back behind it so we can let go of it */
+        _mpscq_link(q, &q->stub);
+
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if(next == NULL)
+            return NULL;
+    }
+
+    q->tail = next;
+
+    data = tail->data;
+    free(tail);
+
+    return data;
+}
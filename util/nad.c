@@ -35,6 +35,10 @@
 #include "nad.h"
 #include "util.h"
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 /* define NAD_DEBUG to get pointer tracking - great for weird bugs that you can't reproduce */
 #ifdef NAD_DEBUG
 
@@ -122,13 +126,258 @@ static int _nad_attr(nad_t nad, int elem, int ns, const char *name, const char *
     return attr;
 }
 
-nad_t nad_new(void)
+/*
+ * nad cache - nads that were freed, with their arrays, ready to be handed
+ * out again. One per thread so nobody has to take a lock; a nad freed by
+ * another thread than the one that made it simply joins the cache of the
+ * thread freeing it.
+ */
+#ifndef NAD_DEBUG
+
+/** upper bound of each size class, by the bytes a nad holds in its arrays */
+static const int _nad_cache_class_size[NAD_CACHE_CLASSES] = { 1024, 4096, 16384, 65536 };
+
+static int _nad_cache_limit = NAD_CACHE_MAX;
+
+typedef struct _nad_cache_st {
+    nad_t                       free[NAD_CACHE_CLASSES];
+    struct nad_cache_stats_st   stats;
+
+    struct _nad_cache_st        *prev, *next;
+} *_nad_cache_t;
+
+/** every live cache, for the stats, and the totals of caches that are gone */
+static _nad_cache_t _nad_cache_list = NULL;
+static struct nad_cache_stats_st _nad_cache_retired;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t _nad_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _nad_cache_key;
+static pthread_once_t _nad_cache_once = PTHREAD_ONCE_INIT;
+
+# define _nad_cache_lock()      pthread_mutex_lock(&_nad_cache_mutex)
+# define _nad_cache_unlock()    pthread_mutex_unlock(&_nad_cache_mutex)
+#else
+static struct _nad_cache_st _nad_cache_main;
+
+# define _nad_cache_lock()
+# define _nad_cache_unlock()
+#endif
+
+/** really free a nad */
+static void _nad_release(nad_t nad) {
+    free(nad->elems);
+    free(nad->attrs);
+    free(nad->cdata);
+    free(nad->nss);
+    free(nad->depths);
+    free(nad->raw);
+    free(nad);
+}
+
+/** the size class this nad belongs in, -1 if it's too big to keep */
+static int _nad_cache_class(nad_t nad) {
+    int size, cls;
+
+    size = nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen + nad->rlen;
+
+    for(cls = 0; cls < NAD_CACHE_CLASSES; cls++)
+        if(size <= _nad_cache_class_size[cls])
+            return cls;
+
+    return -1;
+}
+
+static void _nad_cache_empty(_nad_cache_t c) {
+    nad_t nad;
+    int cls;
+
+    for(cls = 0; cls < NAD_CACHE_CLASSES; cls++) {
+        while((nad = c->free[cls]) != NULL) {
+            c->free[cls] = nad->next;
+            _nad_release(nad);
+        }
+        c->stats.cached[cls] = 0;
+    }
+}
+
+static void _nad_cache_stats_add(nad_cache_stats_t to, nad_cache_stats_t from) {
+    int cls;
+
+    to->hits += from->hits;
+    to->misses += from->misses;
+    to->recycled += from->recycled;
+    to->dropped += from->dropped;
+
+    for(cls = 0; cls < NAD_CACHE_CLASSES; cls++)
+        to->cached[cls] += from->cached[cls];
+}
+
+#ifdef HAVE_PTHREAD
+/** thread is going away, so is its cache */
+static void _nad_cache_destroy(void *arg) {
+    _nad_cache_t c = (_nad_cache_t) arg;
+
+    _nad_cache_empty(c);
+
+    _nad_cache_lock();
+
+    if(c->prev != NULL) c->prev->next = c->next;
+    else _nad_cache_list = c->next;
+    if(c->next != NULL) c->next->prev = c->prev;
+
+    _nad_cache_stats_add(&_nad_cache_retired, &c->stats);
+
+    _nad_cache_unlock();
+
+    free(c);
+}
+
+static void _nad_cache_key_init(void) {
+    pthread_key_create(&_nad_cache_key, _nad_cache_destroy);
+}
+#endif
+
+/** the calling thread's cache, made on first use if create is set */
+static _nad_cache_t _nad_cache_get(int create) {
+    _nad_cache_t c;
+
+#ifdef HAVE_PTHREAD
+    pthread_once(&_nad_cache_once, _nad_cache_key_init);
+
+    c = (_nad_cache_t) pthread_getspecific(_nad_cache_key);
+    if(c != NULL || !create)
+        return c;
+
+    c = (_nad_cache_t) calloc(1, sizeof(struct _nad_cache_st));
+    pthread_setspecific(_nad_cache_key, (void *) c);
+#else
+    c = &_nad_cache_main;
+    if(c == _nad_cache_list || !create)
+        return c;
+#endif
+
+    _nad_cache_lock();
+
+    c->next = _nad_cache_list;
+    if(_nad_cache_list != NULL) _nad_cache_list->prev = c;
+    _nad_cache_list = c;
+
+    _nad_cache_unlock();
+
+    return c;
+}
+
+/** a cached nad of at least this class, if we have one */
+static nad_t _nad_cache_take(int cls) {
+    _nad_cache_t c;
+    nad_t nad;
+
+    if(_nad_cache_limit <= 0)
+        return NULL;
+
+    c = _nad_cache_get(1);
+
+    if(cls >= 0)
+        for(; cls < NAD_CACHE_CLASSES; cls++)
+            if((nad = c->free[cls]) != NULL) {
+                c->free[cls] = nad->next;
+                c->stats.cached[cls]--;
+                c->stats.hits++;
+
+                /* keep the arrays, lose the contents */
+                nad->ecur = nad->acur = nad->ncur = nad->ccur = nad->rcur = 0;
+                nad->pelem = -1;
+                nad->dirty = 0;
+                nad->next = NULL;
+
+                return nad;
+            }
+
+    c->stats.misses++;
+
+    return NULL;
+}
+
+/** keep a nad for later, returns 0 if it should be freed instead */
+static int _nad_cache_put(nad_t nad) {
+    _nad_cache_t c;
+    int cls;
+
+    if(_nad_cache_limit <= 0)
+        return 0;
+
+    c = _nad_cache_get(1);
+
+    cls = _nad_cache_class(nad);
+    if(cls < 0 || c->stats.cached[cls] >= _nad_cache_limit) {
+        c->stats.dropped++;
+        return 0;
+    }
+
+    nad->next = c->free[cls];
+    c->free[cls] = nad;
+    c->stats.cached[cls]++;
+    c->stats.recycled++;
+
+    return 1;
+}
+
+void nad_cache_max(int max) {
+    _nad_cache_limit = max;
+}
+
+void nad_cache_stats(nad_cache_stats_t stats) {
+    _nad_cache_t c;
+
+    memset(stats, 0, sizeof(struct nad_cache_stats_st));
+
+    /* other threads keep counting while we add up, near enough is good enough */
+    _nad_cache_lock();
+
+    _nad_cache_stats_add(stats, &_nad_cache_retired);
+    for(c = _nad_cache_list; c != NULL; c = c->next)
+        _nad_cache_stats_add(stats, &c->stats);
+
+    _nad_cache_unlock();
+}
+
+void nad_cache_flush(void) {
+    _nad_cache_t c;
+
+    if((c = _nad_cache_get(0)) != NULL)
+        _nad_cache_empty(c);
+}
+
+#else
+/* pointer tracking needs every nad to be new */
+#define _nad_cache_class(nad) (0)
+#define _nad_cache_take(cls) (NULL)
+
+void nad_cache_max(int max) { }
+void nad_cache_stats(nad_cache_stats_t stats) { memset(stats, 0, sizeof(struct nad_cache_stats_st)); }
+void nad_cache_flush(void) { }
+#endif
+
+void nad_cache_log(log_t log) {
+    struct nad_cache_stats_st stats;
+
+    nad_cache_stats(&stats);
+    log_write(log, LOG_INFO, "nad cache: %lu hits, %lu misses, %lu recycled, %lu dropped", stats.hits, stats.misses, stats.recycled, stats.dropped);
+}
+
+/** new nad, from the cache if there's one of at least this size class */
+static nad_t _nad_new(int cls)
 {
     nad_t nad;
 
-    nad = calloc(1, sizeof(struct nad_st));
+    nad = _nad_cache_take(cls);
+    if(nad == NULL)
+        nad = calloc(1, sizeof(struct nad_st));
 
     nad->scope = -1;
+    nad->refs = 1;
+    nad->pelem = -1;
 
 #ifdef NAD_DEBUG
     {
@@ -142,6 +391,11 @@ nad_t nad_new(void)
     return nad;
 }
 
+nad_t nad_new(void)
+{
+    return _nad_new(0);
+}
+
 nad_t nad_copy(nad_t nad)
 {
     nad_t copy;
@@ -150,7 +404,7 @@ nad_t nad_copy(nad_t nad)
 
     if(nad == NULL) return NULL;
 
-    copy = nad_new();
+    copy = _nad_new(_nad_cache_class(nad));
 
     /* if it's not large enough, make bigger */
     NAD_SAFE(copy->elems, nad->elen, copy->elen);
@@ -172,6 +426,9 @@ nad_t nad_copy(nad_t nad)
 
     copy->scope = nad->scope;
 
+    if(!nad->dirty && nad->rcur > 0)
+        nad_set_raw(copy, nad->raw, nad->rcur);
+
     return copy;
 }
 
@@ -179,6 +436,17 @@ void nad_free(nad_t nad)
 {
     if(nad == NULL) return;
 
+    /* someone else still has it */
+    if(nad->refs > 1) {
+        _nad_ptr_check(__func__, nad);
+
+        /* theirs alone now, they may change it */
+        if(--nad->refs == 1)
+            nad->pelem = -1;
+
+        return;
+    }
+
 #ifdef NAD_DEBUG
     _nad_ptr_check(__func__, nad);
     {
@@ -189,17 +457,46 @@ void nad_free(nad_t nad)
     }
 #endif
 
-    /* Free nad */
+#ifndef NAD_DEBUG
+    if(_nad_cache_put(nad))
+        return;
+
+    _nad_release(nad);
+#else
+    /* Free nad, but keep the pointer for tracking */
     free(nad->elems);
     free(nad->attrs);
     free(nad->cdata);
     free(nad->nss);
     free(nad->depths);
-#ifndef NAD_DEBUG
-    free(nad);
+    free(nad->raw);
 #endif
 }
 
+nad_t nad_ref(nad_t nad)
+{
+    _nad_ptr_check(__func__, nad);
+
+    nad->refs++;
+
+    return nad;
+}
+
+nad_t nad_unshare(nad_t nad)
+{
+    nad_t copy;
+
+    _nad_ptr_check(__func__, nad);
+
+    if(nad->refs <= 1)
+        return nad;
+
+    copy = nad_copy(nad);
+    nad_free(nad);
+
+    return copy;
+}
+
 /** locate the next elem at a given depth with an optional matching name */
 int nad_find_elem(nad_t nad, int elem, int ns, const char *name, int depth)
 {
@@ -405,6 +702,7 @@ void nad_set_attr(nad_t nad, int elem, int ns, const char *name, const char *val
     int attr;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     /* find one to replace first */
     if((attr = nad_find_attr(nad, elem, ns, name, NULL)) < 0)
@@ -444,6 +742,7 @@ int nad_insert_elem(nad_t nad, int parent, int ns, const char *name, const char
     elem = parent + 1;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     NAD_SAFE(nad->elems, (nad->ecur + 1) * sizeof(struct nad_elem_st), nad->elen);
 
@@ -481,6 +780,7 @@ void nad_drop_elem(nad_t nad, int elem) {
     int next, cur;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     if(elem >= nad->ecur) return;
 
@@ -505,6 +805,7 @@ void nad_wrap_elem(nad_t nad, int elem, int ns, const char *name)
     int cur;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     if(elem >= nad->ecur) return;
 
@@ -543,6 +844,7 @@ int nad_insert_nad(nad_t dest, int delem, nad_t src, int selem) {
 
     _nad_ptr_check(__func__, dest);
     _nad_ptr_check(__func__, src);
+    NAD_DIRTY(dest);
 
     /* can't do anything if these aren't real elems */
     if(src->ecur <= selem || dest->ecur <= delem)
@@ -697,6 +999,7 @@ int nad_append_elem(nad_t nad, int ns, const char *name, int depth)
     int elem;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     /* make sure there's mem for us */
     NAD_SAFE(nad->elems, (nad->ecur + 1) * sizeof(struct nad_elem_st), nad->elen);
@@ -729,6 +1032,7 @@ int nad_append_elem(nad_t nad, int ns, const char *name, int depth)
 int nad_append_attr(nad_t nad, int ns, const char *name, const char *val)
 {
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     return _nad_attr(nad, nad->ecur - 1, ns, name, val, 0);
 }
@@ -739,6 +1043,7 @@ void nad_append_cdata(nad_t nad, const char *cdata, int len, int depth)
     int elem = nad->ecur - 1;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     /* make sure this cdata is the child of the last elem to append */
     if(nad->elems[elem].depth == depth - 1)
@@ -764,6 +1069,7 @@ int nad_add_namespace(nad_t nad, const char *uri, const char *prefix)
     int ns;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     /* only add it if its not already in scope */
     ns = nad_find_scoped_namespace(nad, uri, NULL);
@@ -799,6 +1105,7 @@ int nad_append_namespace(nad_t nad, int elem, const char *uri, const char *prefi
     int ns;
 
     _nad_ptr_check(__func__, nad);
+    NAD_DIRTY(nad);
 
     /* see if its already scoped on this element */
     ns = nad_find_namespace(nad, elem, uri, NULL);
@@ -1195,97 +1502,263 @@ void nad_print(nad_t nad, int elem, const char **xml, int *len)
 
     _nad_ptr_check(__func__, nad);
 
+    /* not changed since it was parsed, out it goes as it came in */
+    if(elem == 0 && !nad->dirty && nad->rcur > 0) {
+        *len = nad->rcur;
+        *xml = nad->raw;
+        return;
+    }
+
+    /* shared nads can't change, so the last printout is still good */
+    if(nad->refs > 1 && nad->pelem == elem) {
+        *len = nad->lxml;
+        *xml = nad->cdata + nad->ixml;
+        return;
+    }
+
     _nad_lp0(nad, elem);
     *len = nad->ccur - ixml;
     *xml = nad->cdata + ixml;
+
+    if(nad->refs > 1) {
+        nad->pelem = elem;
+        nad->ixml = ixml;
+        nad->lxml = *len;
+    }
+}
+
+void nad_set_raw(nad_t nad, const char *raw, int len)
+{
+    _nad_ptr_check(__func__, nad);
+
+    NAD_SAFE(nad->raw, len, nad->rlen);
+    memcpy(nad->raw, raw, len);
+    nad->rcur = len;
+
+    nad->dirty = 0;
 }
 
 /**
  * nads serialize to a buffer of this form:
  *
- * [buflen][ecur][acur][ncur][ccur][elems][attrs][nss][cdata]
- *
- * nothing is done with endianness or word length, so the nad must be
- * serialized and deserialized on the same platform
+ * "NAD" [version] [buflen][ecur][acur][ncur][ccur] [elems][attrs][nss][cdata]
  *
- * buflen is not actually used by deserialize(), but is provided as a
- * convenience to the application so it knows how many bytes to read before
+ * every number is a 32 bit integer in network byte order, and the elems,
+ * attrs and nss are written field by field in the order they're declared
+ * in, so a nad can go between platforms. buflen is the length of the
+ * whole buffer, so the application knows how many bytes to read before
  * passing them in to deserialize()
  *
- * the depths array is not stored, so after deserialization
- * nad_append_elem() and nad_append_cdata() will not work. this is rarely
- * a problem
+ * deserialize() checks everything before it trusts it - the header, the
+ * lengths, and that every index points inside the nad - and returns NULL
+ * if anything is off. it also rebuilds the depths array, so the result can
+ * be added to like any other nad
  */
 
+#define NAD_SERIAL_VERSION  (1)
+#define NAD_SERIAL_HEADER   (4 + sizeof(uint32_t) * 5)
+#define NAD_SERIAL_ELEM     (sizeof(uint32_t) * 11)
+#define NAD_SERIAL_ATTR     (sizeof(uint32_t) * 6)
+#define NAD_SERIAL_NS       (sizeof(uint32_t) * 5)
+
+static char *_nad_put(char *pos, int val) {
+    uint32_t n = htonl((uint32_t) val);
+
+    memcpy(pos, &n, sizeof(uint32_t));
+    return pos + sizeof(uint32_t);
+}
+
+static const char *_nad_get(const char *pos, int *val) {
+    uint32_t n;
+
+    memcpy(&n, pos, sizeof(uint32_t));
+    *val = (int) ntohl(n);
+    return pos + sizeof(uint32_t);
+}
+
 void nad_serialize(nad_t nad, char **buf, int *len) {
     char *pos;
+    int i;
 
     _nad_ptr_check(__func__, nad);
 
-    *len = sizeof(int) * 5 + /* 4 ints in nad_t, plus one for len */
-           sizeof(struct nad_elem_st) * nad->ecur +
-           sizeof(struct nad_attr_st) * nad->acur +
-           sizeof(struct nad_ns_st) * nad->ncur +
+    *len = NAD_SERIAL_HEADER +
+           NAD_SERIAL_ELEM * nad->ecur +
+           NAD_SERIAL_ATTR * nad->acur +
+           NAD_SERIAL_NS * nad->ncur +
            sizeof(char) * nad->ccur;
 
     *buf = (char *) malloc(*len);
     pos = *buf;
 
-    * (int *) pos = *len;       pos += sizeof(int);
-    * (int *) pos = nad->ecur;  pos += sizeof(int);
-    * (int *) pos = nad->acur;  pos += sizeof(int);
-    * (int *) pos = nad->ncur;  pos += sizeof(int);
-    * (int *) pos = nad->ccur;  pos += sizeof(int);
+    memcpy(pos, "NAD", 3);
+    pos[3] = NAD_SERIAL_VERSION;
+    pos += 4;
+
+    pos = _nad_put(pos, *len);
+    pos = _nad_put(pos, nad->ecur);
+    pos = _nad_put(pos, nad->acur);
+    pos = _nad_put(pos, nad->ncur);
+    pos = _nad_put(pos, nad->ccur);
+
+    for(i = 0; i < nad->ecur; i++) {
+        pos = _nad_put(pos, nad->elems[i].parent);
+        pos = _nad_put(pos, nad->elems[i].iname);
+        pos = _nad_put(pos, nad->elems[i].lname);
+        pos = _nad_put(pos, nad->elems[i].icdata);
+        pos = _nad_put(pos, nad->elems[i].lcdata);
+        pos = _nad_put(pos, nad->elems[i].itail);
+        pos = _nad_put(pos, nad->elems[i].ltail);
+        pos = _nad_put(pos, nad->elems[i].attr);
+        pos = _nad_put(pos, nad->elems[i].ns);
+        pos = _nad_put(pos, nad->elems[i].my_ns);
+        pos = _nad_put(pos, nad->elems[i].depth);
+    }
+
+    for(i = 0; i < nad->acur; i++) {
+        pos = _nad_put(pos, nad->attrs[i].iname);
+        pos = _nad_put(pos, nad->attrs[i].lname);
+        pos = _nad_put(pos, nad->attrs[i].ival);
+        pos = _nad_put(pos, nad->attrs[i].lval);
+        pos = _nad_put(pos, nad->attrs[i].my_ns);
+        pos = _nad_put(pos, nad->attrs[i].next);
+    }
+
+    for(i = 0; i < nad->ncur; i++) {
+        pos = _nad_put(pos, nad->nss[i].iuri);
+        pos = _nad_put(pos, nad->nss[i].luri);
+        pos = _nad_put(pos, nad->nss[i].iprefix);
+        pos = _nad_put(pos, nad->nss[i].lprefix);
+        pos = _nad_put(pos, nad->nss[i].next);
+    }
 
-    memcpy(pos, nad->elems, sizeof(struct nad_elem_st) * nad->ecur);    pos += sizeof(struct nad_elem_st) * nad->ecur;
-    memcpy(pos, nad->attrs, sizeof(struct nad_attr_st) * nad->acur);    pos += sizeof(struct nad_attr_st) * nad->acur;
-    memcpy(pos, nad->nss, sizeof(struct nad_ns_st) * nad->ncur);        pos += sizeof(struct nad_ns_st) * nad->ncur;
     memcpy(pos, nad->cdata, sizeof(char) * nad->ccur);
 }
 
-nad_t nad_deserialize(const char *buf) {
-    nad_t nad = nad_new();
-    const char *pos = buf + sizeof(int);  /* skip len */
+/** a string has to be inside the cdata, an empty one may start just past it (or at -1, for no prefix) */
+#define _nad_serial_str(nad, i, l) ((l) >= 0 && ((l) == 0 ? (i) >= -1 && (i) <= (nad)->ccur : (i) >= 0 && (i) <= (nad)->ccur - (l)))
 
-    _nad_ptr_check(__func__, nad);
+/** an index has to be in range or -1 */
+#define _nad_serial_idx(i, max) ((i) >= -1 && (i) < (max))
 
-    nad->ecur = * (int *) pos; pos += sizeof(int);
-    nad->acur = * (int *) pos; pos += sizeof(int);
-    nad->ncur = * (int *) pos; pos += sizeof(int);
-    nad->ccur = * (int *) pos; pos += sizeof(int);
-    nad->elen = nad->ecur;
-    nad->alen = nad->acur;
-    nad->nlen = nad->ncur;
-    nad->clen = nad->ccur;
+nad_t nad_deserialize(const char *buf, int len) {
+    nad_t nad;
+    const char *pos = buf;
+    int blen, ecur, acur, ncur, ccur, left, i;
+    struct nad_elem_st *e;
+    struct nad_attr_st *a;
+    struct nad_ns_st *n;
 
-    if(nad->ecur > 0)
-    {
-        nad->elems = (struct nad_elem_st *) malloc(sizeof(struct nad_elem_st) * nad->ecur);
-        memcpy(nad->elems, pos, sizeof(struct nad_elem_st) * nad->ecur);
-        pos += sizeof(struct nad_elem_st) * nad->ecur;
-    }
+    if(buf == NULL || len < (int) NAD_SERIAL_HEADER || memcmp(pos, "NAD", 3) != 0 || pos[3] != NAD_SERIAL_VERSION)
+        return NULL;
+    pos += 4;
 
-    if(nad->acur > 0)
-    {
-        nad->attrs = (struct nad_attr_st *) malloc(sizeof(struct nad_attr_st) * nad->acur);
-        memcpy(nad->attrs, pos, sizeof(struct nad_attr_st) * nad->acur);
-        pos += sizeof(struct nad_attr_st) * nad->acur;
+    pos = _nad_get(pos, &blen);
+    pos = _nad_get(pos, &ecur);
+    pos = _nad_get(pos, &acur);
+    pos = _nad_get(pos, &ncur);
+    pos = _nad_get(pos, &ccur);
+
+    /* the counts have to add up to exactly what we were given */
+    if(blen != len || ecur < 0 || acur < 0 || ncur < 0 || ccur < 0)
+        return NULL;
+
+    left = len - NAD_SERIAL_HEADER;
+
+    if(ecur > left / (int) NAD_SERIAL_ELEM)
+        return NULL;
+    left -= ecur * NAD_SERIAL_ELEM;
+
+    if(acur > left / (int) NAD_SERIAL_ATTR)
+        return NULL;
+    left -= acur * NAD_SERIAL_ATTR;
+
+    if(ncur > left / (int) NAD_SERIAL_NS)
+        return NULL;
+    left -= ncur * NAD_SERIAL_NS;
+
+    if(ccur != left)
+        return NULL;
+
+    nad = nad_new();
+
+    _nad_ptr_check(__func__, nad);
+
+    /* it may already have arrays, from the cache */
+    NAD_SAFE(nad->elems, sizeof(struct nad_elem_st) * ecur, nad->elen);
+    NAD_SAFE(nad->attrs, sizeof(struct nad_attr_st) * acur, nad->alen);
+    NAD_SAFE(nad->nss, sizeof(struct nad_ns_st) * ncur, nad->nlen);
+    NAD_SAFE(nad->cdata, sizeof(char) * ccur, nad->clen);
+
+    nad->ecur = ecur;
+    nad->acur = acur;
+    nad->ncur = ncur;
+    nad->ccur = ccur;
+
+    /* the cdata first, so the strings can be checked against it */
+    memcpy(nad->cdata, buf + len - ccur, ccur);
+
+    /* chains only ever point back, so walking them always ends */
+    for(i = 0; i < ecur; i++) {
+        e = &nad->elems[i];
+
+        pos = _nad_get(pos, &e->parent);
+        pos = _nad_get(pos, &e->iname);
+        pos = _nad_get(pos, &e->lname);
+        pos = _nad_get(pos, &e->icdata);
+        pos = _nad_get(pos, &e->lcdata);
+        pos = _nad_get(pos, &e->itail);
+        pos = _nad_get(pos, &e->ltail);
+        pos = _nad_get(pos, &e->attr);
+        pos = _nad_get(pos, &e->ns);
+        pos = _nad_get(pos, &e->my_ns);
+        pos = _nad_get(pos, &e->depth);
+
+        if(!_nad_serial_idx(e->parent, i) || !_nad_serial_str(nad, e->iname, e->lname) ||
+           !_nad_serial_str(nad, e->icdata, e->lcdata) || !_nad_serial_str(nad, e->itail, e->ltail) ||
+           !_nad_serial_idx(e->attr, acur) || !_nad_serial_idx(e->ns, ncur) || !_nad_serial_idx(e->my_ns, ncur) ||
+           e->depth < 0 || e->depth > ecur)
+            goto bad;
+
+        /* last elem at each depth, as if we'd appended them */
+        NAD_SAFE(nad->depths, (e->depth + 1) * sizeof(int), nad->dlen);
+        nad->depths[e->depth] = i;
     }
 
-    if(nad->ncur > 0)
-    {
-        nad->nss = (struct nad_ns_st *) malloc(sizeof(struct nad_ns_st) * nad->ncur);
-        memcpy(nad->nss, pos, sizeof(struct nad_ns_st) * nad->ncur);
-        pos += sizeof(struct nad_ns_st) * nad->ncur;
+    for(i = 0; i < acur; i++) {
+        a = &nad->attrs[i];
+
+        pos = _nad_get(pos, &a->iname);
+        pos = _nad_get(pos, &a->lname);
+        pos = _nad_get(pos, &a->ival);
+        pos = _nad_get(pos, &a->lval);
+        pos = _nad_get(pos, &a->my_ns);
+        pos = _nad_get(pos, &a->next);
+
+        if(!_nad_serial_str(nad, a->iname, a->lname) || !_nad_serial_str(nad, a->ival, a->lval) ||
+           !_nad_serial_idx(a->my_ns, ncur) || !_nad_serial_idx(a->next, i))
+            goto bad;
     }
 
-    if(nad->ccur > 0)
-    {
-        nad->cdata = (char *) malloc(sizeof(char) * nad->ccur);
-        memcpy(nad->cdata, pos, sizeof(char) * nad->ccur);
+    for(i = 0; i < ncur; i++) {
+        n = &nad->nss[i];
+
+        pos = _nad_get(pos, &n->iuri);
+        pos = _nad_get(pos, &n->luri);
+        pos = _nad_get(pos, &n->iprefix);
+        pos = _nad_get(pos, &n->lprefix);
+        pos = _nad_get(pos, &n->next);
+
+        if(!_nad_serial_str(nad, n->iuri, n->luri) || !_nad_serial_str(nad, n->iprefix, n->lprefix) ||
+           !_nad_serial_idx(n->next, i))
+            goto bad;
     }
 
     return nad;
+
+bad:
+    nad_free(nad);
+    return NULL;
 }
 
 
@@ -1295,6 +1768,7 @@ struct build_data {
     nad_t               nad;
     int                 depth;
     XML_Parser          p;
+    XML_Index           iraw, lraw;     /* where the top element is in the buffer */
 };
 
 static void _nad_parse_element_start(void *arg, const char *name, const char **atts) {
@@ -1337,6 +1811,9 @@ static void _nad_parse_element_start(void *arg, const char *name, const char **a
     /* add it */
     el = nad_append_elem(bd->nad, ns, elem, bd->depth);
 
+    if(bd->depth == 0)
+        bd->iraw = XML_GetCurrentByteIndex(bd->p);
+
     /* now the attributes, one at a time */
     attr = atts;
     while(attr[0] != NULL) {
@@ -1378,6 +1855,9 @@ static void _nad_parse_element_end(void *arg, const char *name) {
     struct build_data *bd = (struct build_data *) arg;
 
     bd->depth--;
+
+    if(bd->depth == 0)
+        bd->lraw = XML_GetCurrentByteIndex(bd->p) + XML_GetCurrentByteCount(bd->p) - bd->iraw;
 }
 
 static void _nad_parse_cdata(void *arg, const char *str, int len) {
@@ -1437,6 +1917,7 @@ nad_t nad_parse(const char *buf, int len) {
 
     bd.nad = nad_new();
     bd.depth = 0;
+    bd.iraw = bd.lraw = 0;
 
     XML_SetUserData(p, (void *) &bd);
     XML_SetElementHandler(p, _nad_parse_element_start, _nad_parse_element_end);
@@ -1454,5 +1935,8 @@ nad_t nad_parse(const char *buf, int len) {
     if(bd.depth != 0)
         return NULL;
 
+    if(bd.lraw > 0 && bd.iraw + bd.lraw <= len)
+        nad_set_raw(bd.nad, buf + bd.iraw, (int) bd.lraw);
+
     return bd.nad;
 }
@@ -53,6 +53,8 @@
 # include <sys/types.h>
 #endif
 
+#include <assert.h>
+
 /* jabberd2 Windows DLL */
 #ifndef JABBERD2_API
 # ifdef _WIN32
@@ -106,6 +108,13 @@ typedef struct nad_st
 
     int scope; /* currently scoped namespaces, get attached to the next element */
     struct nad_st *next; /* for keeping a list of nads */
+
+    int refs; /* references held, see nad_ref() */
+    int pelem, ixml, lxml; /* last printout of a shared nad, and what elem it was of */
+
+    char *raw; /* the xml this nad was parsed from, see nad_set_raw() */
+    int rlen, rcur; /* size of the raw buffer, and bytes in it */
+    int dirty; /* changed since it was parsed, the raw xml doesn't match anymore */
 } *nad_t;
 
 /** create a new nad */
@@ -114,9 +123,18 @@ JABBERD2_API nad_t nad_new(void);
 /** copy a nad */
 JABBERD2_API nad_t nad_copy(nad_t nad);
 
-/** free that nad */
+/** free that nad (drop a reference, the last one really frees it) */
 JABBERD2_API void nad_free(nad_t nad);
 
+/** take another reference to a nad, to hand the same packet to several
+  * places at once. nobody may change a nad while it's shared, and it's
+  * printed only once for all of them. shared nads stay in one thread. */
+JABBERD2_API nad_t nad_ref(nad_t nad);
+
+/** get a nad we may change: this one if nobody else has it, otherwise a
+  * copy (and our reference to the shared one is dropped) */
+JABBERD2_API nad_t nad_unshare(nad_t nad);
+
 /** find the next element with this name/depth */
 /** 0 for siblings, 1 for children and so on */
 JABBERD2_API int nad_find_elem(nad_t nad, int elem, int ns, const char *name, int depth);
@@ -172,13 +190,41 @@ JABBERD2_API int nad_append_namespace(nad_t nad, int elem, const char *uri, cons
 /** create a string representation of the given element (and children), point references to it */
 JABBERD2_API void nad_print(nad_t nad, int elem, const char **xml, int *len);
 
-/** serialize and deserialize a nad */
+/** serialize and deserialize a nad, deserialize returns NULL if the buffer isn't a valid one */
 JABBERD2_API void nad_serialize(nad_t nad, char **buf, int *len);
-JABBERD2_API nad_t nad_deserialize(const char *buf);
+JABBERD2_API nad_t nad_deserialize(const char *buf, int len);
 
 /** create a nad from raw xml */
 JABBERD2_API nad_t nad_parse(const char *buf, int len);
 
+/** keep the xml this nad was just parsed from. until the nad is changed,
+  * nad_print() of the whole nad hands that out instead of building it again */
+JABBERD2_API void nad_set_raw(nad_t nad, const char *raw, int len);
+
+/** freed nads are kept for reuse, along with their arrays, in one cache per
+  * thread. nads are sorted into size classes by the memory they hold, and
+  * each class keeps at most max of them (0 turns the cache off). nads bigger
+  * than the largest class are always freed. */
+#define NAD_CACHE_CLASSES   (4)
+#define NAD_CACHE_MAX       (64)
+
+typedef struct nad_cache_stats_st {
+    unsigned long   hits;       /* nads handed out from the cache */
+    unsigned long   misses;     /* nads that had to be allocated */
+    unsigned long   recycled;   /* nads put back in the cache */
+    unsigned long   dropped;    /* nads freed, the cache was full or they were too big */
+    int             cached[NAD_CACHE_CLASSES];  /* nads in the cache now, by class */
+} *nad_cache_stats_t;
+
+/** set how many nads each size class keeps, applies to every thread */
+JABBERD2_API void nad_cache_max(int max);
+
+/** totals for all threads, including ones that have exited */
+JABBERD2_API void nad_cache_stats(nad_cache_stats_t stats);
+
+/** free the nads cached by the calling thread */
+JABBERD2_API void nad_cache_flush(void);
+
 /* these are some helpful macros */
 #define NAD_ENAME(N,E) (N->cdata + N->elems[E].iname)
 #define NAD_ENAME_L(N,E) (N->elems[E].lname)
@@ -196,4 +242,8 @@ JABBERD2_API nad_t nad_parse(const char *buf, int len);
 #define NAD_ENS(N,E) (N->elems[E].my_ns)
 #define NAD_ANS(N,A) (N->attrs[A].my_ns)
 
+/** the nad functions do this themselves, call it after changing a nad by hand.
+  * a shared nad can't be changed, nad_unshare() it first */
+#define NAD_DIRTY(N) (assert((int) ((N)->refs <= 1)), (N)->dirty = 1)
+
 #endif
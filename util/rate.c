@@ -22,14 +22,44 @@
 
 #include "util.h"
 
+#include <limits.h>
+
+/** bucket units an event costs, the bucket fills by total units a millisecond */
+#define _rate_period(rt) ((int64_t) (rt)->seconds * 1000)
+
+/** top up the bucket for the time since we last did */
+static uint64_t _rate_fill(rate_t rt)
+{
+    uint64_t now = twheel_clock();
+    int64_t full = (int64_t) rt->total * _rate_period(rt);
+
+    if(now > rt->time && rt->total > 0) {
+        /* only multiply out times short enough to leave it less than full */
+        if(now - rt->time >= (uint64_t) ((full - rt->level) / rt->total) + 1)
+            rt->level = full;
+        else
+            rt->level += (int64_t) (now - rt->time) * rt->total;
+
+        rt->time = now;
+    }
+
+    /* done being bad */
+    if(rt->bad != 0 && now >= rt->bad)
+        rt->bad = 0;
+
+    return now;
+}
+
 rate_t rate_new(int total, int seconds, int wait)
 {
     rate_t rt = (rate_t) calloc(1, sizeof(struct rate_st));
 
     rt->total = total;
-    rt->seconds = seconds;
+    rt->seconds = seconds > 0 ? seconds : 1;
     rt->wait = wait;
 
+    rate_reset(rt);
+
     return rt;
 }
 
@@ -40,65 +70,144 @@ void rate_free(rate_t rt)
 
 void rate_reset(rate_t rt)
 {
-    rt->time = 0;
-    rt->count = 0;
+    rt->time = twheel_clock();
+    rt->level = (int64_t) rt->total * _rate_period(rt);
     rt->bad = 0;
 }
 
 void rate_add(rate_t rt, int count)
 {
-    time_t now;
+    uint64_t now;
 
-    now = time(NULL);
+    now = _rate_fill(rt);
 
-    /* rate expired */
-    if(now - rt->time >= rt->seconds)
-        rate_reset(rt);
-
-    rt->count += count;
-
-    /* first event, so set the time */
-    if(rt->time == 0)
-        rt->time = now;
+    rt->level -= (int64_t) count * _rate_period(rt);
 
     /* uhoh, they stuffed up */
-    if(rt->count >= rt->total)
-        rt->bad = now;
+    if(rt->level < _rate_period(rt) && rt->wait > 0 && rt->bad == 0)
+        rt->bad = now + (uint64_t) rt->wait * 1000;
 }
 
 int rate_left(rate_t rt)
 {
+    _rate_fill(rt);
+
     /* if we're bad, then there's none left */
-    if(rt->bad != 0)
+    if(rt->bad != 0 || rt->level <= 0)
         return 0;
 
-    return rt->total - rt->count;
+    return (int) (rt->level / _rate_period(rt));
 }
 
 int rate_check(rate_t rt)
 {
-    /* not tracking */
-    if(rt->time == 0)
-        return 1;
-
-    /* under the limit */
-    if(rt->count < rt->total)
-        return 1;
+    _rate_fill(rt);
 
-    /* currently bad */
+    /* keep them waiting */
     if(rt->bad != 0)
-    {
-        /* wait over, they're good again */
-        if(time(NULL) - rt->bad >= rt->wait)
-        {
-            rate_reset(rt);
-            return 1;
-        }
+        return 0;
+
+    return rt->level >= _rate_period(rt);
+}
+
+int rate_wait(rate_t rt)
+{
+    uint64_t now;
+    int64_t ms = 0;
+
+    now = _rate_fill(rt);
+
+    /* time for the bucket to get back to one event */
+    if(rt->level < _rate_period(rt) && rt->total > 0)
+        ms = (_rate_period(rt) - rt->level + rt->total - 1) / rt->total;
+
+    if(rt->bad != 0 && (int64_t) (rt->bad - now) > ms)
+        ms = rt->bad - now;
+
+    return ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+/* rates by address prefix */
+
+struct rate_table_st
+{
+    int             total;
+    int             seconds;
+    int             wait;
+
+    int             v4bits;     /* prefix lengths we count by */
+    int             v6bits;
+
+    iptrie_t        rates;
+    int             sweep;      /* look for idle rates when we have this many */
+};
+
+rate_table_t rate_table_new(int total, int seconds, int wait, int v4bits, int v6bits)
+{
+    rate_table_t rtt = (rate_table_t) calloc(1, sizeof(struct rate_table_st));
+
+    rtt->total = total;
+    rtt->seconds = seconds;
+    rtt->wait = wait;
+
+    rtt->v4bits = (v4bits < 0 || v4bits > 32) ? 32 : v4bits;
+    rtt->v6bits = (v6bits < 0 || v6bits > 128) ? 128 : v6bits;
+
+    rtt->rates = iptrie_new();
+    rtt->sweep = 1024;
 
-        /* keep them waiting */
+    return rtt;
+}
+
+void rate_table_free(rate_table_t rtt)
+{
+    iptrie_free(rtt->rates, (void (*)(void *)) rate_free);
+    free(rtt);
+}
+
+/** a rate with a full bucket has nothing left to remember, so it can go */
+static int _rate_table_idle(const unsigned char *key, int bits, void *val, void *arg)
+{
+    rate_t rt = (rate_t) val;
+
+    if(rate_left(rt) < rt->total)
         return 0;
+
+    rate_free(rt);
+
+    return 1;
+}
+
+int rate_table_check(rate_table_t rtt, const char *ip)
+{
+    unsigned char key[IPTRIE_KEYLEN];
+    rate_t rt;
+    int base;
+
+    if((base = iptrie_key(ip, key)) < 0)
+        return 0;
+
+    base += (base == IPTRIE_V4) ? rtt->v4bits : rtt->v6bits;
+
+    rt = (rate_t) iptrie_get(rtt->rates, key, base);
+    if(rt == NULL) {
+        /* keep the table from growing with every address that's ever been by */
+        if(iptrie_count(rtt->rates) >= rtt->sweep) {
+            iptrie_walk(rtt->rates, _rate_table_idle, NULL);
+
+            rtt->sweep = iptrie_count(rtt->rates) * 2;
+            if(rtt->sweep < 1024)
+                rtt->sweep = 1024;
+        }
+
+        rt = rate_new(rtt->total, rtt->seconds, rtt->wait);
+        iptrie_put(rtt->rates, key, base, (void *) rt);
     }
 
-    /* they're inside the time, and not bad yet */
+    if(rate_check(rt) == 0)
+        return 0;
+
+    rate_add(rt, 1);
+
     return 1;
 }
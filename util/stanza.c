@@ -97,3 +97,236 @@ nad_t stanza_tofrom(nad_t nad, int elem) {
 
     return nad;
 }
+
+/*
+ * multicast routes - a stanza going to many jids on the same component
+ * travels as one route, the stanza without its addressing followed by
+ * a list of who it's for, much like XEP-0033:
+ *
+ *   <route type='multicast' to='c2s' from='sm'>
+ *     <presence from='...'/>
+ *     <addresses xmlns='http://jabber.org/protocol/address' xmlns:sm='...'>
+ *       <address type='to' jid='...' sm:c2s='...' sm:sm='...'/>
+ *     </addresses>
+ *   </route>
+ *
+ * The addressing of a stanza is its 'to', and the session attributes
+ * sm puts on it for c2s.
+ */
+
+/** true if this attr on a stanza is part of its addressing */
+static int _stanza_multicast_addressing(nad_t nad, int attr) {
+    int ns = NAD_ANS(nad, attr);
+
+    if(ns < 0)
+        return NAD_ANAME_L(nad, attr) == 2 && strncmp("to", NAD_ANAME(nad, attr), 2) == 0;
+
+    return NAD_NURI_L(nad, ns) == strlen(uri_SESSION) && strncmp(uri_SESSION, NAD_NURI(nad, ns), NAD_NURI_L(nad, ns)) == 0;
+}
+
+/** the first attr from this one on that counts when comparing stanzas */
+static int _stanza_multicast_attr(nad_t nad, int elem, int attr) {
+    while(attr >= 0 && (NAD_ANAME_L(nad, attr) == 0 || (elem == 1 && _stanza_multicast_addressing(nad, attr))))
+        attr = nad->attrs[attr].next;
+
+    return attr;
+}
+
+static int _stanza_multicast_same(const char *a, int alen, const char *b, int blen) {
+    return alen == blen && (alen == 0 || memcmp(a, b, alen) == 0);
+}
+
+static int _stanza_multicast_same_ns(nad_t a, int ans, nad_t b, int bns) {
+    if(ans < 0 || bns < 0)
+        return ans == bns;
+
+    return _stanza_multicast_same(NAD_NURI(a, ans), NAD_NURI_L(a, ans), NAD_NURI(b, bns), NAD_NURI_L(b, bns));
+}
+
+/** make a unicast route into a multicast one, with its own addressing as the first address, @return its addresses element */
+int stanza_multicast_new(nad_t nad) {
+    nad_t first;
+    int attr, addrs;
+
+    assert((int) (nad != NULL && nad->ecur > 1));
+
+    first = nad_copy(nad);
+
+    nad_set_attr(nad, 0, -1, "type", "multicast", 9);
+
+    /* the addressing is all in the addresses from now on */
+    for(attr = nad->elems[1].attr; attr >= 0; attr = nad->attrs[attr].next)
+        if(NAD_ANAME_L(nad, attr) > 0 && _stanza_multicast_addressing(nad, attr))
+            nad->attrs[attr].lname = nad->attrs[attr].lval = 0;
+
+    /* appending doesn't know who the parent is in a copied nad */
+    addrs = nad_append_elem(nad, -1, "addresses", 1);
+    nad->elems[addrs].parent = 0;
+    nad->elems[addrs].my_ns = nad_append_namespace(nad, addrs, uri_ADDRESS, NULL);
+
+    stanza_multicast_add(nad, addrs, first);
+
+    nad_free(first);
+
+    return addrs;
+}
+
+/** add the addressing of a unicast route's stanza to a multicast */
+void stanza_multicast_add(nad_t nad, int addrs, nad_t unicast) {
+    int elem, attr, ns;
+    char name[64];
+
+    elem = nad_append_elem(nad, NAD_ENS(nad, addrs), "address", 2);
+    nad->elems[elem].parent = addrs;
+
+    nad_append_attr(nad, -1, "type", "to");
+
+    for(attr = unicast->elems[1].attr; attr >= 0; attr = unicast->attrs[attr].next) {
+        if(NAD_ANAME_L(unicast, attr) == 0 || NAD_AVAL_L(unicast, attr) == 0 || !_stanza_multicast_addressing(unicast, attr))
+            continue;
+
+        if(NAD_ANS(unicast, attr) < 0) {
+            nad_set_attr(nad, elem, -1, "jid", NAD_AVAL(unicast, attr), NAD_AVAL_L(unicast, attr));
+            continue;
+        }
+
+        if(NAD_ANAME_L(unicast, attr) >= sizeof(name))
+            continue;
+        snprintf(name, sizeof(name), "%.*s", NAD_ANAME_L(unicast, attr), NAD_ANAME(unicast, attr));
+
+        ns = nad_append_namespace(nad, addrs, uri_SESSION, "sm");
+        nad_set_attr(nad, elem, ns, name, NAD_AVAL(unicast, attr), NAD_AVAL_L(unicast, attr));
+    }
+}
+
+/**
+ * true if a unicast route could join a multicast, that is if their
+ * stanzas are the same but for their addressing. addrs is the addresses
+ * element of the multicast, or if it's still a unicast itself, ecur.
+ * The routes themselves aren't compared.
+ */
+int stanza_multicast_match(nad_t nad, int addrs, nad_t unicast) {
+    int elem, a, b;
+
+    if(addrs != unicast->ecur)
+        return 0;
+
+    for(elem = 1; elem < addrs; elem++) {
+        if(nad->elems[elem].depth != unicast->elems[elem].depth ||
+           !_stanza_multicast_same(NAD_ENAME(nad, elem), NAD_ENAME_L(nad, elem), NAD_ENAME(unicast, elem), NAD_ENAME_L(unicast, elem)) ||
+           !_stanza_multicast_same_ns(nad, NAD_ENS(nad, elem), unicast, NAD_ENS(unicast, elem)) ||
+           !_stanza_multicast_same(NAD_CDATA(nad, elem), NAD_CDATA_L(nad, elem), NAD_CDATA(unicast, elem), NAD_CDATA_L(unicast, elem)) ||
+           !_stanza_multicast_same(nad->cdata + nad->elems[elem].itail, nad->elems[elem].ltail, unicast->cdata + unicast->elems[elem].itail, unicast->elems[elem].ltail))
+            return 0;
+
+        a = _stanza_multicast_attr(nad, elem, nad->elems[elem].attr);
+        b = _stanza_multicast_attr(unicast, elem, unicast->elems[elem].attr);
+        while(a >= 0 && b >= 0) {
+            if(!_stanza_multicast_same(NAD_ANAME(nad, a), NAD_ANAME_L(nad, a), NAD_ANAME(unicast, b), NAD_ANAME_L(unicast, b)) ||
+               !_stanza_multicast_same(NAD_AVAL(nad, a), NAD_AVAL_L(nad, a), NAD_AVAL(unicast, b), NAD_AVAL_L(unicast, b)) ||
+               !_stanza_multicast_same_ns(nad, NAD_ANS(nad, a), unicast, NAD_ANS(unicast, b)))
+                return 0;
+
+            a = _stanza_multicast_attr(nad, elem, nad->attrs[a].next);
+            b = _stanza_multicast_attr(unicast, elem, unicast->attrs[b].next);
+        }
+
+        if(a >= 0 || b >= 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/** @return the addresses element of a multicast route, or -1 if it doesn't have one */
+int stanza_multicast_addresses(nad_t nad) {
+    int ns, addrs;
+
+    if((ns = nad_find_scoped_namespace(nad, uri_ADDRESS, NULL)) < 0)
+        return -1;
+
+    /* the stanza comes first */
+    addrs = nad_find_elem(nad, 0, ns, "addresses", 1);
+
+    return addrs > 1 ? addrs : -1;
+}
+
+/** the multicast without its addresses, ready to be addressed */
+static nad_t _stanza_multicast_template(nad_t nad, int addrs) {
+    nad_t tmpl;
+
+    tmpl = nad_copy(nad);
+    nad_drop_elem(tmpl, addrs);
+    nad_set_attr(tmpl, 0, -1, "type", NULL, 0);
+
+    return tmpl;
+}
+
+static nad_t _stanza_multicast_unicast(nad_t tmpl, nad_t nad, int addr) {
+    nad_t unicast;
+    int attr, ns;
+    char name[64];
+
+    unicast = nad_copy(tmpl);
+
+    for(attr = nad->elems[addr].attr; attr >= 0; attr = nad->attrs[attr].next) {
+        if(NAD_ANAME_L(nad, attr) == 0 || NAD_AVAL_L(nad, attr) == 0)
+            continue;
+
+        if(NAD_ANS(nad, attr) < 0) {
+            if(NAD_ANAME_L(nad, attr) == 3 && strncmp("jid", NAD_ANAME(nad, attr), 3) == 0)
+                nad_set_attr(unicast, 1, -1, "to", NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+            continue;
+        }
+
+        if(!_stanza_multicast_addressing(nad, attr) || NAD_ANAME_L(nad, attr) >= sizeof(name))
+            continue;
+        snprintf(name, sizeof(name), "%.*s", NAD_ANAME_L(nad, attr), NAD_ANAME(nad, attr));
+
+        ns = nad_append_namespace(unicast, 1, uri_SESSION, "sm");
+        nad_set_attr(unicast, 1, ns, name, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+    }
+
+    return unicast;
+}
+
+/** make the unicast route for one address of a multicast */
+nad_t stanza_multicast_unicast(nad_t nad, int addr) {
+    nad_t tmpl, unicast;
+
+    tmpl = _stanza_multicast_template(nad, nad->elems[addr].parent);
+    unicast = _stanza_multicast_unicast(tmpl, nad, addr);
+    nad_free(tmpl);
+
+    return unicast;
+}
+
+/**
+ * split a multicast route into a unicast route for every address, and
+ * hand each to cb. The multicast is freed.
+ * @return the number of routes, or -1 if it had no addresses
+ */
+int stanza_multicast_expand(nad_t nad, stanza_multicast_cb cb, void *arg) {
+    nad_t tmpl;
+    int addrs, addr, n = 0;
+
+    if((addrs = stanza_multicast_addresses(nad)) < 0) {
+        nad_free(nad);
+        return -1;
+    }
+
+    tmpl = _stanza_multicast_template(nad, addrs);
+
+    for(addr = nad_find_elem(nad, addrs, NAD_ENS(nad, addrs), "address", 1); addr >= 0; addr = nad_find_elem(nad, addr, NAD_ENS(nad, addrs), "address", 0)) {
+        if(nad_find_attr(nad, addr, -1, "jid", NULL) < 0)
+            continue;
+
+        (cb)(_stanza_multicast_unicast(tmpl, nad, addr), arg);
+        n++;
+    }
+
+    nad_free(tmpl);
+    nad_free(nad);
+
+    return n;
+}
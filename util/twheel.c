@@ -0,0 +1,262 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* hierarchical timer wheel */
+
+#include "util.h"
+
+/*
+ * Classic five level wheel. The first level has a slot per tick, each
+ * further level covers 64 slots of the level below. Timers far in the
+ * future sit in a coarse slot and are cascaded down as the wheel turns,
+ * so arming, disarming and expiring are all O(1).
+ */
+
+#define TV1_BITS    (8)
+#define TVN_BITS    (6)
+#define TV1_SIZE    (1 << TV1_BITS)
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TV1_MASK    (TV1_SIZE - 1)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TVN_LEVELS  (4)
+
+/** furthest we can schedule, in ticks */
+#define TWHEEL_MAX  ((((uint64_t) 1) << (TV1_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+struct twheel_st {
+    int                 resolution;     /* ms per tick */
+
+    uint64_t            base;           /* clock at tick 0 */
+    uint64_t            now;            /* next tick to be processed */
+
+    int                 count;
+
+    twheel_timer_t      tv1[TV1_SIZE];
+    twheel_timer_t      tvn[TVN_LEVELS][TVN_SIZE];
+};
+
+uint64_t twheel_clock(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+#else
+    return (uint64_t) time(NULL) * 1000;
+#endif
+}
+
+/** current time in ticks */
+static uint64_t _twheel_ticks(twheel_t w) {
+    uint64_t clock = twheel_clock();
+
+    if(clock < w->base)
+        return 0;
+
+    return (clock - w->base) / w->resolution;
+}
+
+twheel_t twheel_new(int resolution) {
+    twheel_t w;
+
+    w = (twheel_t) calloc(1, sizeof(struct twheel_st));
+
+    w->resolution = resolution > 0 ? resolution : 1;
+    w->base = twheel_clock();
+
+    return w;
+}
+
+void twheel_free(twheel_t w) {
+    free(w);
+}
+
+void twheel_timer_init(twheel_timer_t t, twheel_callback_t cb, void *arg) {
+    memset(t, 0, sizeof(struct twheel_timer_st));
+
+    t->cb = cb;
+    t->arg = arg;
+}
+
+/** put a timer on the slot matching its expiry */
+static void _twheel_link(twheel_t w, twheel_timer_t t) {
+    uint64_t expires = t->expires, idx;
+    twheel_timer_t *slot;
+    int level;
+
+    if(expires < w->now)
+        expires = w->now;
+
+    idx = expires - w->now;
+
+    if(idx < TV1_SIZE)
+        slot = &w->tv1[expires & TV1_MASK];
+    else {
+        if(idx > TWHEEL_MAX) {
+            expires = w->now + TWHEEL_MAX;
+            t->expires = expires;
+            idx = TWHEEL_MAX;
+        }
+
+        for(level = 0; level < TVN_LEVELS - 1; level++)
+            if(idx < ((uint64_t) 1) << (TV1_BITS + (level + 1) * TVN_BITS))
+                break;
+
+        slot = &w->tvn[level][(expires >> (TV1_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if(t->next != NULL) t->next->prev = t;
+    *slot = t;
+}
+
+static void _twheel_unlink(twheel_timer_t t) {
+    if(t->prev != NULL) t->prev->next = t->next;
+    else *t->slot = t->next;
+    if(t->next != NULL) t->next->prev = t->prev;
+
+    t->next = t->prev = NULL;
+    t->slot = NULL;
+}
+
+void twheel_add(twheel_t w, twheel_timer_t t, int ms) {
+    assert((w != NULL && t != NULL));
+
+    if(t->slot != NULL)
+        _twheel_unlink(t);
+    else
+        w->count++;
+
+    if(ms < 0) ms = 0;
+
+    /* round up, a timer never fires early */
+    t->expires = (twheel_clock() - w->base + ms + w->resolution - 1) / w->resolution;
+
+    _twheel_link(w, t);
+}
+
+void twheel_del(twheel_t w, twheel_timer_t t) {
+    if(w == NULL || t == NULL || t->slot == NULL)
+        return;
+
+    _twheel_unlink(t);
+    w->count--;
+}
+
+int twheel_pending(twheel_timer_t t) {
+    return t != NULL && t->slot != NULL;
+}
+
+/** move every timer in a coarse slot down to where it now belongs, @return the slot index */
+static int _twheel_cascade(twheel_t w, int level) {
+    int index = (w->now >> (TV1_BITS + level * TVN_BITS)) & TVN_MASK;
+    twheel_timer_t t, next;
+
+    t = w->tvn[level][index];
+    w->tvn[level][index] = NULL;
+
+    for(; t != NULL; t = next) {
+        next = t->next;
+        _twheel_link(w, t);
+    }
+
+    return index;
+}
+
+int twheel_run(twheel_t w) {
+    uint64_t target;
+    twheel_timer_t due, t;
+    int index, level, fired = 0;
+
+    target = _twheel_ticks(w);
+
+    /* nothing armed, just catch up */
+    if(w->count == 0) {
+        if(target >= w->now)
+            w->now = target + 1;
+        return 0;
+    }
+
+    while(w->now <= target) {
+        index = w->now & TV1_MASK;
+
+        /* wrapped the first level, pull the next batch down */
+        if(index == 0)
+            for(level = 0; level < TVN_LEVELS && _twheel_cascade(w, level) == 0; level++);
+
+        /* detach the due list first, callbacks may re-arm into this very
+         * slot or disarm timers that are still waiting on the list */
+        due = w->tv1[index];
+        w->tv1[index] = NULL;
+        for(t = due; t != NULL; t = t->next)
+            t->slot = &due;
+
+        w->now++;
+
+        while(due != NULL) {
+            t = due;
+            _twheel_unlink(t);
+            w->count--;
+
+            (t->cb)(w, t, t->arg);
+            fired++;
+        }
+    }
+
+    return fired;
+}
+
+int twheel_timeout(twheel_t w, int max) {
+    uint64_t clock, next;
+    int i, ms;
+
+    if(w == NULL || w->count == 0)
+        return max;
+
+    /* look for the nearest armed slot in the first level */
+    next = w->now + TV1_SIZE - (w->now & TV1_MASK);
+    for(i = 0; i < TV1_SIZE; i++)
+        if(w->tv1[(w->now + i) & TV1_MASK] != NULL) {
+            if(w->now + i < next)
+                next = w->now + i;
+            break;
+        }
+
+    clock = twheel_clock();
+    if(w->base + next * w->resolution <= clock)
+        return 0;
+
+    ms = (int) ((w->base + next * w->resolution) - clock);
+    return ms < max ? ms : max;
+}
+
+int twheel_count(twheel_t w) {
+    return w->count;
+}
@@ -0,0 +1,97 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002-2004 Jeremie Miller, Thomas Muldowney,
+ *                         Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file util/twheel.h
+  * @brief hierarchical timer wheel
+  *
+  * Timers are embedded in the structure they belong to (a session, a
+  * connection) and armed or re-armed in O(1). The main loop asks the
+  * wheel how long it may sleep with twheel_timeout(), and calls
+  * twheel_run() after each mio_run() to fire the timers that are due.
+  */
+
+#ifndef INCL_UTIL_TWHEEL_H
+#define INCL_UTIL_TWHEEL_H 1
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "ac-stdint.h"
+
+/* jabberd2 Windows DLL */
+#ifndef JABBERD2_API
+# ifdef _WIN32
+#  ifdef JABBERD2_EXPORTS
+#   define JABBERD2_API  __declspec(dllexport)
+#  else /* JABBERD2_EXPORTS */
+#   define JABBERD2_API  __declspec(dllimport)
+#  endif /* JABBERD2_EXPORTS */
+# else /* _WIN32 */
+#  define JABBERD2_API extern
+# endif /* _WIN32 */
+#endif /* JABBERD2_API */
+
+typedef struct twheel_st        *twheel_t;
+typedef struct twheel_timer_st  *twheel_timer_t;
+
+/** called when a timer expires, the timer is disarmed by then and may be re-armed */
+typedef void (*twheel_callback_t)(twheel_t w, twheel_timer_t t, void *arg);
+
+struct twheel_timer_st {
+    twheel_timer_t      next;
+    twheel_timer_t      prev;
+    twheel_timer_t      *slot;      /* list head we are on, NULL when not armed */
+
+    uint64_t            expires;    /* in wheel ticks */
+
+    twheel_callback_t   cb;
+    void                *arg;
+};
+
+/** milliseconds from an arbitrary point, never goes backwards */
+JABBERD2_API uint64_t    twheel_clock(void);
+
+/** new wheel, resolution is the tick length in milliseconds */
+JABBERD2_API twheel_t    twheel_new(int resolution);
+JABBERD2_API void        twheel_free(twheel_t w);
+
+/** prepare an embedded timer, must be called once before it is armed */
+JABBERD2_API void        twheel_timer_init(twheel_timer_t t, twheel_callback_t cb, void *arg);
+
+/** arm a timer to fire in ms milliseconds, re-arming a pending timer moves it */
+JABBERD2_API void        twheel_add(twheel_t w, twheel_timer_t t, int ms);
+
+/** disarm a timer, harmless if it isn't pending */
+JABBERD2_API void        twheel_del(twheel_t w, twheel_timer_t t);
+
+/** @return 1 if the timer is armed */
+JABBERD2_API int         twheel_pending(twheel_timer_t t);
+
+/** fire every timer that is due, @return the number of timers fired */
+JABBERD2_API int         twheel_run(twheel_t w);
+
+/** @return milliseconds until the next timer may fire, no more than max */
+JABBERD2_API int         twheel_timeout(twheel_t w, int max);
+
+/** @return number of armed timers */
+JABBERD2_API int         twheel_count(twheel_t w);
+
+#endif
@@ -52,9 +52,12 @@
 #define uri_COMPONENT   "http://jabberd.jabberstudio.org/ns/component/1.0"
 #define uri_SESSION     "http://jabberd.jabberstudio.org/ns/session/1.0"
 #define uri_RESOLVER    "http://jabberd.jabberstudio.org/ns/resolver/1.0"
+#define uri_USERCACHE   "http://jabberd.jabberstudio.org/ns/usercache/1.0"
+#define uri_BINARY      "http://jabberd.jabberstudio.org/ns/binary/1.0"
 #define uri_XDATA       "jabber:x:data"
 #define uri_OOB         "jabber:x:oob"
 #define uri_ADDRESS_FEATURE "http://affinix.com/jabber/address"
+#define uri_ADDRESS     "http://jabber.org/protocol/address"
 #define uri_ROSTERVER   "urn:xmpp:features:rosterver"
 
 /* these are used by SM mainly */
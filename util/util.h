@@ -167,6 +167,7 @@ JABBERD2_API const char *spools(pool_t p, ...); /* wrap all the spooler stuff in
 
 /* JID manipulation */
 #include "util/jid.h"
+#include "util/jidset.h"
 
 /* logging */
 
@@ -192,6 +193,10 @@ JABBERD2_API log_t    log_new(log_type_t type, const char *ident, const char *fa
 JABBERD2_API void     log_write(log_t log, int level, const char *msgfmt, ...);
 JABBERD2_API void     log_free(log_t log);
 
+/** log the cache totals, for the daemons to call on the way out */
+JABBERD2_API void     nad_cache_log(log_t log);
+JABBERD2_API void     jid_cache_log(log_t log);
+
 /* config files */
 typedef struct config_elem_st   *config_elem_t;
 typedef struct config_st        *config_t;
@@ -227,20 +232,16 @@ JABBERD2_API void             config_free(config_t);
  * IP-based access controls
  */
 
-typedef struct access_rule_st
-{
-    struct sockaddr_storage ip;
-    int            mask;
-} *access_rule_t;
+#include "iptrie.h"
 
 typedef struct access_st
 {
     int             order;      /* 0 = allow,deny  1 = deny,allow */
 
-    access_rule_t   allow;
+    iptrie_t        allow;
     int             nallow;
 
-    access_rule_t   deny;
+    iptrie_t        deny;
     int             ndeny;
 } *access_t;
 
@@ -250,21 +251,33 @@ JABBERD2_API int         access_allow(access_t access, const char *ip, const cha
 JABBERD2_API int         access_deny(access_t access, const char *ip, const char *mask);
 JABBERD2_API int         access_check(access_t access, const char *ip);
 
+/**
+ * Add the rules in a file to the allow (deny = 0) or deny list. Each
+ * line is an address with an optional /mask, # starts a comment.
+ * @return the number of rules added, or -1 if the file can't be read
+ */
+JABBERD2_API int         access_load(access_t access, const char *file, int deny);
+
 
 /*
  * rate limiting
  */
 
+/**
+ * A token bucket that holds total events and fills up over seconds,
+ * timed by a monotonic millisecond clock. Running it dry makes the
+ * rate go bad for wait seconds (0 to just wait for the next token).
+ */
 typedef struct rate_st
 {
     int             total;      /* if we exceed this many events */
     int             seconds;    /* in this many seconds */
     int             wait;       /* then go bad for this many seconds */
 
-    time_t          time;       /* time we started counting events */
-    int             count;      /* event count */
+    uint64_t        time;       /* clock when the bucket was last topped up */
+    int64_t         level;      /* events in the bucket, in units of 1/(seconds * 1000) */
 
-    time_t          bad;        /* time we went bad, or 0 if we're not */
+    uint64_t        bad;        /* clock when we stop being bad, or 0 if we're not */
 } *rate_t;
 
 JABBERD2_API rate_t      rate_new(int total, int seconds, int wait);
@@ -272,8 +285,8 @@ JABBERD2_API void        rate_free(rate_t rt);
 JABBERD2_API void        rate_reset(rate_t rt);
 
 /**
- * Add a number of events to the counter.  This takes care of moving
- * the sliding window, if we've moved outside the previous window.
+ * Take a number of events out of the bucket. It may go into debt if
+ * there weren't that many, which is paid back before it has any more.
  */
 JABBERD2_API void        rate_add(rate_t rt, int count);
 
@@ -291,6 +304,37 @@ JABBERD2_API int         rate_left(rate_t rt);
  */
 JABBERD2_API int         rate_check(rate_t rt);
 
+/**
+ * @return milliseconds until rate_check() will let the next event
+ *         through, 0 if it already does
+ */
+JABBERD2_API int         rate_wait(rate_t rt);
+
+/**
+ * A rate per address prefix (say per /24 or /64), for limiting
+ * connections from busy networks rather than single hosts. Rates
+ * that have gone idle are dropped as the table grows.
+ */
+typedef struct rate_table_st *rate_table_t;
+
+/** prefixes are v4bits of an IPv4 address and v6bits of an IPv6 one */
+JABBERD2_API rate_table_t rate_table_new(int total, int seconds, int wait, int v4bits, int v6bits);
+JABBERD2_API void        rate_table_free(rate_table_t rtt);
+
+/**
+ * Count an event from this address.
+ * @return 1 if its prefix is under the limit, 0 if it should be
+ *         throttled (or the address is no good), in which case the
+ *         event isn't counted
+ */
+JABBERD2_API int         rate_table_check(rate_table_t rtt, const char *ip);
+
+/*
+ * timers
+ */
+
+#include "twheel.h"
+
 /*
  * helpers for ip addresses
  */
@@ -339,6 +383,35 @@ JABBERD2_API void        *jqueue_pull(jqueue_t q);
 JABBERD2_API int         jqueue_size(jqueue_t q);
 JABBERD2_API time_t      jqueue_age(jqueue_t q);
 
+/* lock-free queue, any thread can push, only one thread may pull */
+typedef struct _mpscq_node_st   *_mpscq_node_t;
+struct _mpscq_node_st {
+    void            *data;
+
+    _mpscq_node_t   next;
+};
+
+typedef struct _mpscq_st {
+    /** last pushed node, swapped in by the producers */
+    _mpscq_node_t   head;
+
+    /** next node to pull, only touched by the consumer */
+    _mpscq_node_t   tail;
+
+    struct _mpscq_node_st   stub;
+
+    /** set when the consumer has been asked to wake up */
+    int             signalled;
+} *mpscq_t;
+
+JABBERD2_API mpscq_t     mpscq_new(void);
+JABBERD2_API void        mpscq_free(mpscq_t q);
+/** returns 1 if the consumer needs to be woken up */
+JABBERD2_API int         mpscq_push(mpscq_t q, void *data);
+JABBERD2_API void        *mpscq_pull(mpscq_t q);
+/** consumer is awake, call before pulling */
+JABBERD2_API void        mpscq_woken(mpscq_t q);
+
 
 /* ISO 8601 / JEP-0082 date/time manipulation */
 typedef enum {
@@ -392,6 +465,16 @@ JABBERD2_API char *b64_decode(char *buf);
 JABBERD2_API nad_t stanza_error(nad_t nad, int elem, int err);
 JABBERD2_API nad_t stanza_tofrom(nad_t nad, int elem);
 
+/* multicast routes, one stanza for many addresses (see stanza.c) */
+typedef void (*stanza_multicast_cb)(nad_t nad, void *arg);
+
+JABBERD2_API int stanza_multicast_new(nad_t nad);
+JABBERD2_API void stanza_multicast_add(nad_t nad, int addrs, nad_t unicast);
+JABBERD2_API int stanza_multicast_match(nad_t nad, int addrs, nad_t unicast);
+JABBERD2_API int stanza_multicast_addresses(nad_t nad);
+JABBERD2_API nad_t stanza_multicast_unicast(nad_t nad, int addr);
+JABBERD2_API int stanza_multicast_expand(nad_t nad, stanza_multicast_cb cb, void *arg);
+
 typedef struct _stanza_error_st {
     const char  *name;
     const char  *type;
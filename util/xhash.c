@@ -21,74 +21,267 @@
 #include "xhash.h"
 #include "util.h"
 
+/*
+ * Tables are power-of-two sized and grow or shrink themselves as entries
+ * come and go. Resizing is incremental: a second bucket array is allocated
+ * and every subsequent operation migrates a few buckets into it, so no
+ * single call has to rehash the whole table.
+ *
+ * Bucket arrays live outside the pool (they have to be released when a
+ * resize completes), nodes are still allocated from the pool and recycled
+ * through the free list.
+ */
+
+/** smallest bucket array we will ever use */
+#define XHASH_MIN_SIZE      8
+
+/** grow when there is more than one entry per bucket */
+#define XHASH_GROW_LOAD     1
+
+/** shrink when less than one in this many buckets is used */
+#define XHASH_SHRINK_LOAD   8
+
+/** buckets migrated per operation while rehashing */
+#define XHASH_REHASH_STEP   1
+
+/** empty buckets skipped per migrated bucket before giving up for this step */
+#define XHASH_REHASH_EMPTY  10
+
+static unsigned int _xhash_seed = 0;
+
+/** pick a per-process seed so bucket placement is not predictable from outside */
+static unsigned int _xhash_seed_get(void)
+{
+    struct timeval tv;
+    unsigned int seed;
+
+    if(_xhash_seed != 0)
+        return _xhash_seed;
+
+    gettimeofday(&tv, NULL);
+    seed = (unsigned int) tv.tv_sec ^ ((unsigned int) tv.tv_usec << 12) ^ ((unsigned int) getpid() << 16) ^ (unsigned int) (uintptr_t) &tv;
+    if(seed == 0)
+        seed = 0x9747b28c;
+
+    _xhash_seed = seed;
+    return seed;
+}
+
+#define _xhash_rotl(x,r) (((x) << (r)) | ((x) >> (32 - (r))))
 
 /* Generates a hash code for a string.
- * This function uses the ELF hashing algorithm as reprinted in 
- * Andrew Binstock, "Hashing Rehashed," Dr. Dobb's Journal, April 1996.
+ * This is the 32 bit variant of Austin Appleby's MurmurHash3, keyed with
+ * the table seed.
  */
-static int _xhasher(const char *s, int len)
+static unsigned int _xhasher(const char *s, int len, unsigned int seed)
 {
-    /* ELF hash uses unsigned chars and unsigned arithmetic for portability */
-    const unsigned char *name = (const unsigned char *)s;
-    unsigned long h = 0, g;
+    const unsigned char *data = (const unsigned char *) s;
+    int nblocks = len / 4;
+    uint32_t h = seed, k;
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
     int i;
 
-    for(i=0;i<len;i++)
-    { /* do some fancy bitwanking on the string */
-        h = (h << 4) + (unsigned long)(name[i]);
-        if ((g = (h & 0xF0000000UL))!=0)
-            h ^= (g >> 24);
-        h &= ~g;
+    for(i = 0; i < nblocks; i++) {
+        memcpy(&k, data + i * 4, 4);
+
+        k *= c1;
+        k = _xhash_rotl(k, 15);
+        k *= c2;
 
+        h ^= k;
+        h = _xhash_rotl(h, 13);
+        h = h * 5 + 0xe6546b64;
     }
 
-    return (int)h;
+    data += nblocks * 4;
+    k = 0;
+    switch(len & 3) {
+        case 3: k ^= data[2] << 16;
+        case 2: k ^= data[1] << 8;
+        case 1: k ^= data[0];
+                k *= c1;
+                k = _xhash_rotl(k, 15);
+                k *= c2;
+                h ^= k;
+    }
+
+    h ^= (uint32_t) len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static unsigned int _xhash_size_for(int count)
+{
+    unsigned int size = XHASH_MIN_SIZE;
+
+    while(size < (unsigned int) count && size < 0x40000000)
+        size <<= 1;
+
+    return size;
 }
 
+static void _xhash_tab_new(_xhb *tab, unsigned int size)
+{
+    while((tab->zen = calloc(size, sizeof(xhn))) == NULL) sleep(1);
+    tab->size = size;
+    tab->mask = size - 1;
+}
+
+/** pool cleanup, releases the bucket arrays */
+static void _xhash_tab_free(void *arg)
+{
+    xht h = (xht) arg;
 
-static xhn _xhash_node_new(xht h, int index)
+    free(h->tab[0].zen);
+    free(h->tab[1].zen);
+    h->tab[0].zen = h->tab[1].zen = NULL;
+}
+
+/** link a node at the head of its bucket */
+static void _xhash_node_link(xht h, int t, xhn n)
+{
+    xhn *head = &h->tab[t].zen[n->hash & h->tab[t].mask];
+
+    n->prev = NULL;
+    n->next = *head;
+    if(n->next) n->next->prev = n;
+    *head = n;
+}
+
+static void _xhash_node_unlink(xht h, int t, xhn n)
+{
+    if(n->prev) n->prev->next = n->next;
+    else h->tab[t].zen[n->hash & h->tab[t].mask] = n->next;
+    if(n->next) n->next->prev = n->prev;
+}
+
+/** put an unlinked node on the free list */
+static void _xhash_node_release(xht h, xhn n)
+{
+    n->key = NULL;
+    n->val = NULL;
+    n->prev = NULL;
+    n->next = h->free_list;
+    h->free_list = n;
+}
+
+/** an iteration pins the bucket layout, no migration may happen under it */
+#define _xhash_busy(h) ((h)->iter_node != NULL)
+
+/** migrate a few buckets into the new table, finish the rehash when all are done */
+static void _xhash_resize_check(xht h);
+
+static void _xhash_rehash_step(xht h, int steps)
+{
+    int empty = steps * XHASH_REHASH_EMPTY;
+    xhn n, next;
+
+    if(h->rehash < 0 || _xhash_busy(h))
+        return;
+
+    while(steps > 0 && (unsigned int) h->rehash < h->tab[0].size) {
+        n = h->tab[0].zen[h->rehash];
+        if(n == NULL) {
+            h->rehash++;
+            if(--empty == 0)
+                return;
+            continue;
+        }
+
+        for(; n != NULL; n = next) {
+            next = n->next;
+            _xhash_node_link(h, 1, n);
+        }
+        h->tab[0].zen[h->rehash] = NULL;
+
+        h->rehash++;
+        steps--;
+    }
+
+    if((unsigned int) h->rehash < h->tab[0].size)
+        return;
+
+    /* all moved over, the new table becomes the only one */
+    free(h->tab[0].zen);
+    h->tab[0] = h->tab[1];
+    h->tab[1].zen = NULL;
+    h->tab[1].size = h->tab[1].mask = 0;
+    h->rehash = -1;
+
+    /* the load may have moved on while we were migrating */
+    _xhash_resize_check(h);
+}
+
+/** start a rehash if the table is over- or underloaded */
+static void _xhash_resize_check(xht h)
+{
+    unsigned int size;
+
+    if(h->rehash >= 0 || _xhash_busy(h))
+        return;
+
+    if((unsigned int) h->count > h->tab[0].size * XHASH_GROW_LOAD)
+        size = h->tab[0].size << 1;
+    else if(h->tab[0].size > (unsigned int) h->prime && (unsigned int) h->count < h->tab[0].size / XHASH_SHRINK_LOAD) {
+        size = _xhash_size_for(h->count * 2);
+        if(size < (unsigned int) h->prime)
+            size = _xhash_size_for(h->prime);
+        if(size >= h->tab[0].size)
+            return;
+    }
+    else
+        return;
+
+    _xhash_tab_new(&h->tab[1], size);
+    h->rehash = 0;
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+}
+
+static xhn _xhash_node_new(xht h, unsigned int hash)
 {
     xhn n;
-    int i = index % h->prime;
 
     /* track total */
     h->count++;
 
-#ifdef XHASH_DEBUG
-    h->stat[i]++;
-#endif
- 
-    // if the zen[i] is empty, reuse it, else get a new one.
-    n = &h->zen[i];
-    
-    if( n->key != NULL ) 
+    if(h->free_list)
     {
-        if( h->free_list )
-        {
-            n = h->free_list;
-            h->free_list = h->free_list->next;        
-        }else
-            n = pmalloco(h->p, sizeof(_xhn));
-
-        //add it to the bucket list head.
-        n->prev = &h->zen[i];
-        n->next = h->zen[i].next;
-
-        if( n->next ) n->next->prev = n;
-        h->zen[i].next = n;
-    }
+        n = h->free_list;
+        h->free_list = h->free_list->next;
+    }else
+        n = pmalloco(h->p, sizeof(_xhn));
+
+    n->hash = hash;
+
+    /* new entries always go to the table being rehashed into */
+    _xhash_node_link(h, h->rehash >= 0 ? 1 : 0, n);
 
     return n;
 }
 
 
-static xhn _xhash_node_get(xht h, const char *key, int len, int index)
+static xhn _xhash_node_get(xht h, const char *key, int len, unsigned int hash, int *table)
 {
     xhn n;
-    int i = index % h->prime;
-    for(n = &h->zen[i]; n != NULL; n = n->next)
-        if(n->key != NULL && (n->keylen==len) && (strncmp(key, n->key, len) == 0))
-            return n;
+    int t;
+
+    for(t = 0; t < 2; t++) {
+        if(t == 1 && h->rehash < 0)
+            break;
+
+        for(n = h->tab[t].zen[hash & h->tab[t].mask]; n != NULL; n = n->next)
+            if(n->key != NULL && n->hash == hash && n->keylen == len && memcmp(key, n->key, len) == 0) {
+                if(table != NULL) *table = t;
+                return n;
+            }
+    }
+
     return NULL;
 }
 
@@ -102,46 +295,48 @@ xht xhash_new(int prime)
 
     /**
      * NOTE:
-     * all xhash's memory should be allocated from the pool by using pmalloco()/pmallocx(),
-     * so that the xhash_free() can just call pool_free() simply.
+     * all xhash's node memory should be allocated from the pool by using pmalloco()/pmallocx(),
+     * so that the xhash_free() can just call pool_free() simply. The bucket arrays are
+     * released by a pool cleanup.
      */
-    
+
     p = pool_heap(sizeof(_xhn)*prime + sizeof(_xht));
     xnew = pmalloco(p, sizeof(_xht));
     xnew->prime = prime;
     xnew->p = p;
-    xnew->zen = pmalloco(p, sizeof(_xhn)*prime); /* array of xhn size of prime */
+    xnew->seed = _xhash_seed_get();
+
+    _xhash_tab_new(&xnew->tab[0], _xhash_size_for(prime));
+    xnew->rehash = -1;
+    pool_cleanup(p, _xhash_tab_free, (void *) xnew);
 
     xnew->free_list = NULL;
-    
+
+    xnew->iter_table = 0;
     xnew->iter_bucket = -1;
     xnew->iter_node = NULL;
 
-#ifdef XHASH_DEBUG
-    xnew->stat = pmalloco(p, sizeof(int)*prime );
-#else
-    xnew->stat = NULL;
-#endif
-
     return xnew;
 }
 
 
 void xhash_putx(xht h, const char *key, int len, void *val)
 {
-    int index;
+    unsigned int hash;
     xhn n;
 
     if(h == NULL || key == NULL)
         return;
 
-    index = _xhasher(key,len);
+    hash = _xhasher(key,len,h->seed);
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
 
     /* dirty the xht */
     h->dirty++;
 
     /* if existing key, replace it */
-    if((n = _xhash_node_get(h, key, len, index)) != NULL)
+    if((n = _xhash_node_get(h, key, len, hash, NULL)) != NULL)
     {
 /*        log_debug(ZONE,"replacing %s with new val %X",key,val); */
 
@@ -154,10 +349,12 @@ void xhash_putx(xht h, const char *key, int len, void *val)
 /*    log_debug(ZONE,"saving %s val %X",key,val); */
 
     /* new node */
-    n = _xhash_node_new(h, index);
+    n = _xhash_node_new(h, hash);
     n->key = key;
     n->keylen = len;
     n->val = val;
+
+    _xhash_resize_check(h);
 }
 
 void xhash_put(xht h, const char *key, void *val)
@@ -171,7 +368,12 @@ void *xhash_getx(xht h, const char *key, int len)
 {
     xhn n;
 
-    if(h == NULL || key == NULL || len <= 0 || (n = _xhash_node_get(h, key, len, _xhasher(key,len))) == NULL)
+    if(h == NULL || key == NULL || len <= 0)
+        return NULL;
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+
+    if((n = _xhash_node_get(h, key, len, _xhasher(key,len,h->seed), NULL)) == NULL)
     {
 /*        log_debug(ZONE,"failed lookup of %s",key); */
         return NULL;
@@ -187,49 +389,43 @@ void *xhash_get(xht h, const char *key)
     return xhash_getx(h,key,strlen(key));
 }
 
-void xhash_zap_inner( xht h, xhn n, int index)
+static void _xhash_zap_inner(xht h, xhn n, int table)
 {
-    int i = index % h->prime;
-
-    // if element:n is in bucket list and it's not the current iter
-    if( &h->zen[i] != n && h->iter_node != n )
+    // the current iter node stays linked, xhash_iter_next() releases it
+    if(h->iter_node != n)
     {
-        if(n->prev) n->prev->next = n->next;
-        if(n->next) n->next->prev = n->prev;
-
-        // add it to the free_list head.
-        n->prev = NULL;
-        n->next = h->free_list;
-        h->free_list = n;
+        _xhash_node_unlink(h, table, n);
+        _xhash_node_release(h, n);
+    }
+    else
+    {
+        //empty the value.
+        n->key = NULL;
+        n->val = NULL;
     }
-
-    //empty the value.
-    n->key = NULL;
-    n->val = NULL;
 
     /* dirty the xht and track the total */
     h->dirty++;
     h->count--;
-
-#ifdef XHASH_DEBUG
-    h->stat[i]--;
-#endif
 }
 
 void xhash_zapx(xht h, const char *key, int len)
 {
     xhn n;
-    int index;
+    int table;
 
     if( !h || !key ) return;
-    
-    index = _xhasher(key,len);
-    n = _xhash_node_get(h, key, len, index);
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+
+    n = _xhash_node_get(h, key, len, _xhasher(key,len,h->seed), &table);
     if( !n ) return;
 
 /*    log_debug(ZONE,"zapping %s",key); */
 
-    xhash_zap_inner(h ,n, index );
+    _xhash_zap_inner(h, n, table);
+
+    _xhash_resize_check(h);
 }
 
 void xhash_zap(xht h, const char *key)
@@ -249,25 +445,36 @@ void xhash_free(xht h)
 
 void xhash_stat( xht h )
 {
-#ifdef XHASH_DEBUG
+    unsigned int i, len, used, longest;
+    xhn n;
+    int t;
+
     if( !h ) return;
-    
-    fprintf(stderr, "XHASH: table prime: %d , number of elements: %d\n", h->prime, h->count );
 
-    int i;
-    for( i = 0; i< h->prime ; ++i )
-    {
-        if( h->stat[i] > 1 )
-            fprintf(stderr, "%d: %d\t", i, h->stat[i]);
+    fprintf(stderr, "XHASH: table size: %u (requested %d), number of elements: %d%s\n",
+            h->tab[0].size, h->prime, h->count, h->rehash >= 0 ? ", rehashing" : "");
+
+    for(t = 0; t < 2; t++) {
+        if(t == 1 && h->rehash < 0)
+            break;
+
+        used = longest = 0;
+        for(i = 0; i < h->tab[t].size; i++) {
+            len = 0;
+            for(n = h->tab[t].zen[i]; n != NULL; n = n->next)
+                len++;
+            if(len > 0) used++;
+            if(len > longest) longest = len;
+        }
+
+        fprintf(stderr, "XHASH: table %d: %u buckets, %u used, longest chain %u\n", t, h->tab[t].size, used, longest);
     }
-    fprintf(stderr, "\n");
-    
-#endif
 }
 
 void xhash_walk(xht h, xhash_walker w, void *arg)
 {
-    int i;
+    unsigned int i;
+    int t;
     xhn n;
 
     if(h == NULL || w == NULL)
@@ -275,10 +482,15 @@ void xhash_walk(xht h, xhash_walker w, void *arg)
 
 /*    log_debug(ZONE,"walking %X",h); */
 
-    for(i = 0; i < h->prime; i++)
-        for(n = &h->zen[i]; n != NULL; n = n->next)
-            if(n->key != NULL && n->val != NULL)
-                (*w)(n->key, n->keylen, n->val, arg);
+    for(t = 0; t < 2; t++) {
+        if(t == 1 && h->rehash < 0)
+            break;
+
+        for(i = 0; i < h->tab[t].size; i++)
+            for(n = h->tab[t].zen[i]; n != NULL; n = n->next)
+                if(n->key != NULL && n->val != NULL)
+                    (*w)(n->key, n->keylen, n->val, arg);
+    }
 }
 
 /** return the dirty flag (and reset) */
@@ -307,10 +519,29 @@ pool_t xhash_pool(xht h)
     return h->p;
 }
 
+/** drop the current iter node, releasing it if it was zapped under us */
+static void _xhash_iter_leave(xht h)
+{
+    xhn n = h->iter_node;
+
+    if(n == NULL) return;
+
+    h->iter_node = n->next;
+
+    if(n->key == NULL) {
+        _xhash_node_unlink(h, h->iter_table, n);
+        _xhash_node_release(h, n);
+    }
+}
+
 /** iteration */
 int xhash_iter_first(xht h) {
     if(h == NULL) return 0;
 
+    /* an earlier iteration may have been abandoned */
+    _xhash_iter_leave(h);
+
+    h->iter_table = 0;
     h->iter_bucket = -1;
     h->iter_node = NULL;
 
@@ -321,29 +552,25 @@ int xhash_iter_next(xht h) {
     if(h == NULL) return 0;
 
     /* next in this bucket */
-    h->iter_node = h->iter_node ? h->iter_node->next : NULL;
+    _xhash_iter_leave(h);
     while(h->iter_node != NULL) {
-        xhn n = h->iter_node;
-
-        if(n->key != NULL && n->val != NULL)
+        if(h->iter_node->key != NULL && h->iter_node->val != NULL)
             return 1;
 
-        h->iter_node = n->next;
-
-        if (n != &h->zen[h->iter_bucket]) {
-            if(n->prev) n->prev->next = n->next;
-            if(n->next) n->next->prev = n->prev;
+        h->iter_node = h->iter_node->next;
+    }
 
-            // add it to the free_list head.
-            n->prev = NULL;
-            n->next = h->free_list;
-            h->free_list = n;
+    /* next bucket, running into the second table while rehashing */
+    for(;;) {
+        h->iter_bucket++;
+        if((unsigned int) h->iter_bucket >= h->tab[h->iter_table].size) {
+            if(h->iter_table == 1 || h->rehash < 0)
+                break;
+            h->iter_table = 1;
+            h->iter_bucket = 0;
         }
-    }
 
-    /* next bucket */
-    for(h->iter_bucket++; h->iter_bucket < h->prime; h->iter_bucket++) {
-        h->iter_node = &h->zen[h->iter_bucket];
+        h->iter_node = h->tab[h->iter_table].zen[h->iter_bucket];
 
         while(h->iter_node != NULL) {
             if(h->iter_node->key != NULL && h->iter_node->val != NULL)
@@ -354,27 +581,36 @@ int xhash_iter_next(xht h) {
     }
 
     /* there is no next */
+    xhash_iter_done(h);
+
+    return 0;
+}
+
+/** end an iteration that stopped before xhash_iter_next() ran out */
+void xhash_iter_done(xht h) {
+    if(h == NULL) return;
+
+    _xhash_iter_leave(h);
+
+    h->iter_table = 0;
     h->iter_bucket = -1;
     h->iter_node = NULL;
 
-    return 0;
+    /* catch up on any resize we held back while iterating */
+    _xhash_resize_check(h);
 }
 
 void xhash_iter_zap(xht h)
 {
-    int index;
-
-    if( !h || !h->iter_node ) return;
-
-    index = _xhasher( h->iter_node->key, h->iter_node->keylen );
+    if( !h || !h->iter_node || !h->iter_node->key ) return;
 
-    xhash_zap_inner( h ,h->iter_node, index);
+    _xhash_zap_inner(h, h->iter_node, h->iter_table);
 }
 
 int xhash_iter_get(xht h, const char **key, int *keylen, void **val) {
     if(h == NULL || (key == NULL && val == NULL) || (key != NULL && keylen == NULL)) return 0;
 
-    if(h->iter_node == NULL) {
+    if(h->iter_node == NULL || h->iter_node->key == NULL) {
         if(key != NULL) *key = NULL;
         if(val != NULL) *val = NULL;
         return 0;
@@ -39,20 +39,31 @@ typedef struct xhn_struct
     struct xhn_struct *prev;
     const char *key;
     int keylen;
+    unsigned int hash;
     void *val;
 } *xhn, _xhn;
 
+/** one bucket array, the table keeps two of them while rehashing */
+typedef struct xhb_struct
+{
+    xhn *zen;
+    unsigned int size;
+    unsigned int mask;
+} _xhb;
+
 typedef struct xht_struct
 {
     pool_t p;
-    int prime;
+    int prime;              /* requested size, the table never shrinks below it */
     int dirty;
     int count;
-    struct xhn_struct *zen;
+    unsigned int seed;
+    _xhb tab[2];            /* tab[1] is only in use while rehashing */
+    int rehash;             /* next tab[0] bucket to migrate, -1 when not rehashing */
     struct xhn_struct *free_list; // list of zaped elements to be reused.
+    int iter_table;
     int iter_bucket;
     xhn iter_node;
-    int *stat;
 } *xht, _xht;
 
 JABBERD2_API xht xhash_new(int prime);
@@ -70,9 +81,11 @@ JABBERD2_API int xhash_dirty(xht h);
 JABBERD2_API int xhash_count(xht h);
 JABBERD2_API pool_t xhash_pool(xht h);
 
-/* iteration functions */
+/* iteration functions. the table won't resize while an iteration is going,
+ * so one that stops before xhash_iter_next() returns 0 must call xhash_iter_done() */
 JABBERD2_API int xhash_iter_first(xht h);
 JABBERD2_API int xhash_iter_next(xht h);
+JABBERD2_API void xhash_iter_done(xht h);
 JABBERD2_API void xhash_iter_zap(xht h);
 JABBERD2_API int xhash_iter_get(xht h, const char **key, int *keylen, void **val);
 